@@ -0,0 +1,147 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Arena.h"
+#include "TaskGraph.h"
+#include "DirectIO.h"
+#include "Util.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Regions start on page boundaries, so that they can be used as buffers for direct I/O
+#define ARENA_ALIGNMENT DIRECT_IO_ALIGNMENT
+
+// Pages are prefaulted in blocks of this size, in parallel
+#define PREFAULT_BLOCK_SIZE (hsize_t)(64 << 20)
+
+Arena::~Arena() {
+    free();
+}
+
+void Arena::add(std::string name, hsize_t size, int firstPhase, int lastPhase) {
+    if (size) {
+        regions.push_back(ArenaRegion(name, (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT, firstPhase, lastPhase));
+    }
+}
+
+void Arena::plan() {
+    // Place the largest regions first, each at the lowest offset where it doesn't collide with any region
+    // which has already been placed and which is used in the same phase
+    std::vector<ArenaRegion*> order;
+    for (auto& region : regions) {
+        order.push_back(&region);
+    }
+    
+    std::stable_sort(order.begin(), order.end(), [] (const ArenaRegion* a, const ArenaRegion* b) {
+        return a->size > b->size;
+    });
+    
+    std::vector<ArenaRegion*> placed;
+    totalSize = 0;
+    
+    for (auto& region : order) {
+        hsize_t offset = 0;
+        bool moved = true;
+        
+        while (moved) {
+            moved = false;
+            for (auto& other : placed) {
+                if (region->overlaps(*other) && offset < other->offset + other->size && other->offset < offset + region->size) {
+                    offset = other->offset + other->size;
+                    moved = true;
+                }
+            }
+        }
+        
+        region->offset = offset;
+        placed.push_back(region);
+        totalSize = std::max(totalSize, offset + region->size);
+    }
+}
+
+void Arena::allocate(const std::string& scratchDirectory) {
+    free();
+    
+    if (!totalSize) {
+        return;
+    }
+    
+    // With overcommit, an allocation which doesn't fit usually succeeds, and the process is killed later
+    if (!scratchDirectory.empty() && totalSize > availableMemory()) {
+        mapScratchFile(scratchDirectory);
+        return;
+    }
+    
+    memory = (char*)std::aligned_alloc(ARENA_ALIGNMENT, totalSize);
+    
+    if (!memory) {
+        if (scratchDirectory.empty()) {
+            throw "Could not allocate memory";
+        }
+        
+        mapScratchFile(scratchDirectory);
+        return;
+    }
+    
+    // Writing to each page once makes the kernel back it now, in parallel, instead of page by page on the
+    // critical path of the first read
+    TaskGraph graph;
+    for (hsize_t offset = 0; offset < totalSize; offset += PREFAULT_BLOCK_SIZE) {
+        hsize_t size = std::min(PREFAULT_BLOCK_SIZE, totalSize - offset);
+        graph.add([this, offset, size] {
+            memset(memory + offset, 0, size);
+        });
+    }
+    graph.run();
+}
+
+void Arena::mapScratchFile(const std::string& scratchDirectory) {
+    // The file is removed straight away, so that it disappears when it is unmapped, even if the process is killed.
+    // It is sparse, so the blocks are only allocated as the pages are written back.
+    std::string fileName = scratchDirectory + "/.fits2idia-scratch-XXXXXX";
+    int fd = mkstemp(&fileName[0]);
+    
+    if (fd < 0) {
+        throw "Could not create a scratch file";
+    }
+    
+    unlink(fileName.c_str());
+    
+    if (ftruncate(fd, totalSize) != 0) {
+        ::close(fd);
+        throw "Could not resize the scratch file";
+    }
+    
+    void* mapped = mmap(nullptr, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    
+    if (mapped == MAP_FAILED) {
+        throw "Could not map the scratch file";
+    }
+    
+    memory = (char*)mapped;
+    mappedSize = totalSize;
+    spilled = true;
+}
+
+void Arena::adviseRandom(const std::string& name) {
+    const ArenaRegion* region = find(name);
+    
+    if (spilled && region) {
+        madvise(memory + region->offset, region->size, MADV_RANDOM);
+    }
+}
+
+void Arena::free() {
+    if (spilled) {
+        munmap(memory, mappedSize);
+        spilled = false;
+    } else {
+        std::free(memory);
+    }
+    memory = nullptr;
+}
@@ -0,0 +1,100 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include "common.h"
+
+// A buffer which is used during a range of phases of the conversion
+struct ArenaRegion {
+    ArenaRegion(std::string name, hsize_t size, int firstPhase, int lastPhase) : name(name), size(size), firstPhase(firstPhase), lastPhase(lastPhase), offset(0) {}
+    
+    bool overlaps(const ArenaRegion& other) const {
+        return firstPhase <= other.lastPhase && other.firstPhase <= lastPhase;
+    }
+    
+    std::string name;
+    hsize_t size;
+    int firstPhase;
+    int lastPhase;
+    hsize_t offset;
+};
+
+// A single allocation which holds all the large buffers of a conversion.
+// The converter first plans the arena by adding a region for each buffer, with the phases in which it is used.
+// Regions which are not used in the same phase share memory, so the size of the arena is the peak usage of any
+// phase rather than the sum of all the buffers. The memory is allocated and prefaulted once, and the regions stay
+// resident until the arena is freed, so buffers which are needed again for every Stokes are not faulted in again.
+// If the arena doesn't fit in the available memory, it is backed by a sparse scratch file instead, which the kernel
+// pages in and out as it is used. This is much slower, but the conversion doesn't fail.
+class Arena {
+public:
+    Arena() : memory(nullptr), totalSize(0), spilled(false), mappedSize(0) {}
+    ~Arena();
+    
+    // The arena owns its memory, so only its plan can be copied
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    
+    // Replace the regions with the planned regions of another arena, without its memory, so that variations of a
+    // plan can be tried
+    void copyPlan(const Arena& other) {
+        free();
+        regions = other.regions;
+        totalSize = other.totalSize;
+    }
+    
+    // Regions of size zero are ignored
+    void add(std::string name, hsize_t size, int firstPhase = 0, int lastPhase = 0);
+    
+    // Assign the offsets of the regions. This has to be called after all the regions have been added.
+    void plan();
+    
+    // Allocate the planned memory and touch every page in parallel. If a scratch directory is given, the arena is
+    // backed by a file in it if it doesn't fit in memory, or if the allocation fails.
+    void allocate(const std::string& scratchDirectory = "");
+    void free();
+    
+    // Hint that a region is accessed in a random order, so that the pages around each page fault are not read in
+    // from the scratch file too
+    void adviseRandom(const std::string& name);
+    
+    bool isSpilled() const {
+        return spilled;
+    }
+    
+    // These return null if there is no such region
+    const ArenaRegion* find(const std::string& name) const {
+        for (auto& region : regions) {
+            if (region.name == name) {
+                return &region;
+            }
+        }
+        return nullptr;
+    }
+    
+    template <typename T>
+    T* get(const std::string& name) {
+        const ArenaRegion* region = find(name);
+        return region ? (T*)(memory + region->offset) : nullptr;
+    }
+    
+    hsize_t size() const {
+        return totalSize;
+    }
+    
+    std::vector<ArenaRegion> regions;
+
+private:
+    void mapScratchFile(const std::string& scratchDirectory);
+    
+    char* memory;
+    hsize_t totalSize;
+    bool spilled;
+    hsize_t mappedSize;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "ChannelBroadcast.h"
+#include "Util.h"
+
+ChannelBroadcast::ChannelBroadcast(std::string inputFileName, hsize_t numSlots) : numSlots(std::max(numSlots, (hsize_t)1)), nextIndex(0), reading(false), error(nullptr) {
+    if (inputFileName == "-") {
+        inputStream = &FitsStream::standardInput();
+        inputStream->open(&inputFilePtr);
+    } else {
+        inputStream = nullptr;
+        openFitsFile(&inputFilePtr, inputFileName);
+    }
+    
+    int N;
+    long dims[4];
+    getFitsDims(inputFilePtr, N, dims);
+    
+    depth = N >= 3 ? dims[2] : 1;
+    height = dims[1];
+    width = dims[0];
+}
+
+ChannelBroadcast::~ChannelBroadcast() {
+    closeFitsFile(inputFilePtr);
+}
+
+int ChannelBroadcast::addConsumer(hsize_t firstChannel, hsize_t numChannels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    consumers.push_back({firstChannel, numChannels, 0, false});
+    return consumers.size() - 1;
+}
+
+bool ChannelBroadcast::isNeeded(hsize_t index) const {
+    hsize_t channel = index % depth;
+    
+    for (auto& consumer : consumers) {
+        if (!consumer.finished && index >= consumer.position && channel >= consumer.firstChannel && channel < consumer.firstChannel + consumer.numChannels) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void ChannelBroadcast::read(int consumer, hsize_t channel, unsigned int stokes, float* destination) {
+    hsize_t index = (hsize_t)stokes * depth + channel;
+    hsize_t channelSize = height * width;
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    if (index < consumers[consumer].position) {
+        throw "The channels of a shared input can only be read in order";
+    }
+    
+    // The converter has skipped any channels before this one
+    consumers[consumer].position = index;
+    
+    auto findSlot = [&]() -> Slot* {
+        for (auto& slot : slots) {
+            if (slot.index == index) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    };
+    
+    Slot* slot;
+    
+    while (!(slot = findSlot())) {
+        if (error) {
+            throw error;
+        }
+        
+        if (index < nextIndex) {
+            throw "A channel of the shared input has been released before it was read";
+        }
+        
+        if (!reading) {
+            // Release the oldest channels once every converter which needs them is past them
+            while (!slots.empty() && !slots.front().readers && !isNeeded(slots.front().index)) {
+                spareBuffers.push_back(std::move(slots.front().data));
+                slots.pop_front();
+            }
+            
+            if (slots.size() < numSlots) {
+                // Read the next channel which any converter needs. Only one channel is read at a time, and the input
+                // is read outside the lock, so that the other converters can copy the channels which are ready.
+                while (nextIndex < index && !isNeeded(nextIndex)) {
+                    nextIndex++;
+                }
+                
+                hsize_t readIndex = nextIndex;
+                std::vector<float> buffer;
+                
+                if (spareBuffers.empty()) {
+                    buffer.resize(channelSize);
+                } else {
+                    buffer = std::move(spareBuffers.back());
+                    spareBuffers.pop_back();
+                }
+                
+                reading = true;
+                lock.unlock();
+                
+                try {
+                    if (inputStream) {
+                        inputStream->read(readIndex * channelSize, channelSize, buffer.data());
+                    } else {
+                        readFitsData(inputFilePtr, readIndex % depth, readIndex / depth, channelSize, buffer.data());
+                    }
+                } catch (const char* msg) {
+                    lock.lock();
+                    error = msg;
+                    reading = false;
+                    changed.notify_all();
+                    throw;
+                }
+                
+                lock.lock();
+                slots.push_back({readIndex, std::move(buffer), 0});
+                nextIndex = readIndex + 1;
+                reading = false;
+                changed.notify_all();
+                continue;
+            }
+        }
+        
+        changed.wait(lock);
+    }
+    
+    // The slot stays in place while it is copied, because only the oldest slots are released, and only if nobody is
+    // copying them
+    slot->readers++;
+    lock.unlock();
+    
+    std::copy(slot->data.begin(), slot->data.end(), destination);
+    
+    lock.lock();
+    slot->readers--;
+    consumers[consumer].position = index + 1;
+    changed.notify_all();
+}
+
+void ChannelBroadcast::finish(int consumer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    consumers[consumer].finished = true;
+    changed.notify_all();
+}
@@ -0,0 +1,84 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __CHANNELBROADCAST_H
+#define __CHANNELBROADCAST_H
+
+#include "common.h"
+#include "FitsStream.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Reads each channel of a FITS file once, and hands it to every converter which needs it. The converters run on their
+// own threads, and each of them reads its own range of channels of each Stokes, in order. The channels which have
+// been read are kept in a small ring of buffers, until every converter which needs them has copied them, so the
+// converters can only drift apart by the size of the ring.
+class ChannelBroadcast {
+public:
+    ChannelBroadcast(std::string inputFileName, hsize_t numSlots);
+    ~ChannelBroadcast();
+    
+    // Register a converter which reads numChannels channels of each Stokes, starting at firstChannel. Returns the id
+    // which the converter reads with.
+    int addConsumer(hsize_t firstChannel, hsize_t numChannels);
+    
+    // Copy a channel of the input, waiting for it to be read if necessary. The channel index is in the whole input.
+    void read(int consumer, hsize_t channel, unsigned int stokes, float* destination);
+    
+    // The converter doesn't read any more channels, because it is done, or because it has failed
+    void finish(int consumer);
+    
+    // The memory used by the ring of buffers
+    static hsize_t size(hsize_t numSlots, hsize_t height, hsize_t width) {
+        return numSlots * height * width * sizeof(float);
+    }
+    
+    hsize_t depth, height, width;
+
+private:
+    struct Consumer {
+        hsize_t firstChannel;
+        hsize_t numChannels;
+        // The index of the next channel, across all the Stokes, which the converter may read
+        hsize_t position;
+        bool finished;
+    };
+    
+    struct Slot {
+        hsize_t index;
+        std::vector<float> data;
+        // Converters which are copying the channel out
+        int readers;
+    };
+    
+    // Whether any converter still has to read the channel with this index
+    bool isNeeded(hsize_t index) const;
+    
+    fitsfile* inputFilePtr;
+    // The stream which the FITS file is read from, or null if it is read from a file
+    FitsStream* inputStream;
+    
+    std::vector<Consumer> consumers;
+    
+    // Ordered by channel index
+    std::deque<Slot> slots;
+    hsize_t numSlots;
+    // Buffers of released slots, which are reused
+    std::vector<std::vector<float>> spareBuffers;
+    
+    // The index of the next channel which has to be read from the input
+    hsize_t nextIndex;
+    // A channel is being read from the input
+    bool reading;
+    // The reason the input can't be read any more, if it has failed
+    const char* error;
+    
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+#endif
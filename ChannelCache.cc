@@ -0,0 +1,38 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "ChannelCache.h"
+
+static const hsize_t EMPTY_SLOT = std::numeric_limits<hsize_t>::max();
+
+void ChannelCache::createBuffers(float* memory) {
+    buffer = memory;
+    clear();
+}
+
+void ChannelCache::clear() {
+    slots.assign(capacity, EMPTY_SLOT);
+}
+
+void ChannelCache::store(hsize_t channel, const float* data) {
+    if (!enabled()) {
+        return;
+    }
+    
+    // Each channel replaces the one which was stored capacity channels ago
+    hsize_t slot = channel % capacity;
+    std::copy(data, data + channelSize, buffer + slot * channelSize);
+    slots[slot] = channel;
+}
+
+const float* ChannelCache::load(hsize_t channel) {
+    if (!enabled() || slots[channel % capacity] != channel) {
+        misses++;
+        return nullptr;
+    }
+    
+    hits++;
+    return buffer + (channel % capacity) * channelSize;
+}
@@ -0,0 +1,51 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __CHANNELCACHE_H
+#define __CHANNELCACHE_H
+
+#include "common.h"
+
+// A bounded in-memory cache of the original channel data, so that a second pass over the channels doesn't have to
+// read all of them from the FITS file again. Channels are stored in increasing order, and the most recent ones are
+// kept, so a second pass which runs backwards finds the cached channels first.
+struct ChannelCache {
+    ChannelCache() : channelSize(0), capacity(0), buffer(nullptr), hits(0), misses(0) {}
+    ChannelCache(hsize_t channelSize, hsize_t capacity) : channelSize(channelSize), capacity(capacity), buffer(nullptr), hits(0), misses(0) {}
+    
+    // The number of channels which fit in the memory budget
+    static hsize_t capacityFor(hsize_t channelSize, hsize_t depth, hsize_t budget) {
+        return std::min(depth, budget / (channelSize * sizeof(float)));
+    }
+    
+    bool enabled() const {
+        return capacity > 0;
+    }
+    
+    // The memory is owned by the caller, and has to hold capacity channels
+    void createBuffers(float* memory);
+    void clear();
+    
+    void store(hsize_t channel, const float* data);
+    
+    // Returns the cached channel, or null if the channel is not cached
+    const float* load(hsize_t channel);
+    
+    hsize_t bytesSaved() const {
+        return hits * channelSize * sizeof(float);
+    }
+    
+    hsize_t channelSize;
+    hsize_t capacity;
+    
+    float* buffer;
+    // The channel held by each slot
+    std::vector<hsize_t> slots;
+    
+    hsize_t hits;
+    hsize_t misses;
+};
+
+#endif
@@ -0,0 +1,394 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Checksum.h"
+#include "Util.h"
+#include "TaskGraph.h"
+#include "IoStats.h"
+
+#include <filesystem>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+// CRC32C
+
+// Tables for the software implementation, which processes 8 bytes at a time
+struct Crc32cTables {
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82f63b78u & (0 - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int t = 1; t < 8; t++) {
+                table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+            }
+        }
+    }
+    
+    uint32_t table[8][256];
+};
+
+static uint32_t crc32cSoftware(const uint8_t* data, size_t size, uint32_t crc) {
+    static const Crc32cTables tables;
+    auto& t = tables.table;
+    
+    for (; size >= 8; size -= 8, data += 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+            t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    }
+    
+    for (; size; size--, data++) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+    }
+    
+    return crc;
+}
+
+#ifdef __x86_64__
+// We don't require SSE 4.2 at compile time, so the instruction is only used if the CPU supports it
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const uint8_t* data, size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    
+    crc = crc64;
+    
+    for (; size; size--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc) {
+    const uint8_t* bytes = (const uint8_t*)data;
+
+#ifdef __x86_64__
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32cHardware(bytes, size, ~crc);
+    }
+#endif
+
+    return ~crc32cSoftware(bytes, size, ~crc);
+}
+
+// Rows of elements in the dataset's type
+
+// The checksums are of the little-endian values, so on a big-endian host the values are swapped into a buffer first
+template <typename T>
+static uint32_t checksumValues(const T* values, hsize_t size, uint32_t crc, std::vector<uint8_t>& swapped) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    swapped.resize(size * sizeof(T));
+    auto bytes = (const uint8_t*)values;
+    for (hsize_t i = 0; i < size * sizeof(T); i += sizeof(T)) {
+        std::reverse_copy(bytes + i, bytes + i + sizeof(T), swapped.data() + i);
+    }
+    return crc32c(swapped.data(), swapped.size(), crc);
+#else
+    UNUSED(swapped);
+    return crc32c(values, size * sizeof(T), crc);
+#endif
+}
+
+static uint32_t checksumRow(const float* row, hsize_t size, uint32_t crc, std::vector<float>& buffer, std::vector<uint8_t>& swapped) {
+    UNUSED(buffer);
+    return checksumValues(row, size, crc, swapped);
+}
+
+static uint32_t checksumRow(const uint16_t* row, hsize_t size, uint32_t crc, std::vector<float>& buffer, std::vector<uint8_t>& swapped) {
+    UNUSED(buffer);
+    return checksumValues(row, size, crc, swapped);
+}
+
+static uint32_t checksumRow(const double* row, hsize_t size, uint32_t crc, std::vector<float>& buffer, std::vector<uint8_t>& swapped) {
+    buffer.assign(row, row + size);
+    return checksumValues(buffer.data(), size, crc, swapped);
+}
+
+// ChunkChecksums
+
+ChunkChecksums::ChunkChecksums(const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims) : dims(dims), chunkDims(chunkDims) {
+    for (size_t i = 0; i < dims.size(); i++) {
+        gridDims.push_back((dims[i] + chunkDims[i] - 1) / chunkDims[i]);
+    }
+    
+    checksums.resize(product(gridDims), 0);
+    progress.resize(product(gridDims), 0);
+}
+
+void ChunkChecksums::createDataset(OutputGroup group, const std::string& name) {
+    dataset = group.createDataset("Checksums/" + name, DataType::UINT32, gridDims);
+}
+
+void ChunkChecksums::calculate(const float* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    calculateRows(data, count, start);
+}
+
+void ChunkChecksums::calculate(const uint16_t* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    calculateRows(data, count, start);
+}
+
+void ChunkChecksums::calculate(const double* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    calculateRows(data, count, start);
+}
+
+template <typename T>
+void ChunkChecksums::calculateRows(const T* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    int N = dims.size();
+    
+    std::vector<hsize_t> memStrides(N, 1);
+    for (int i = N - 2; i >= 0; i--) {
+        memStrides[i] = memStrides[i + 1] * count[i + 1];
+    }
+    
+    // The range of chunks which the hyperslab overlaps
+    std::vector<hsize_t> firstChunk(N);
+    std::vector<hsize_t> lastChunk(N);
+    for (int i = 0; i < N; i++) {
+        firstChunk[i] = start[i] / chunkDims[i];
+        lastChunk[i] = (start[i] + count[i] - 1) / chunkDims[i];
+    }
+    
+    std::vector<hsize_t> chunk = firstChunk;
+    std::vector<float> buffer;
+    std::vector<uint8_t> swapped;
+    
+    while (true) {
+        // The part of the chunk which is covered by the hyperslab, and where it starts in the chunk
+        std::vector<hsize_t> partStart(N);
+        std::vector<hsize_t> partCount(N);
+        std::vector<hsize_t> chunkCount(N);
+        hsize_t gridIndex(0);
+        hsize_t offset(0);
+        
+        for (int i = 0; i < N; i++) {
+            hsize_t chunkStart = chunk[i] * chunkDims[i];
+            chunkCount[i] = std::min(chunkDims[i], dims[i] - chunkStart);
+            partStart[i] = std::max(start[i], chunkStart);
+            partCount[i] = std::min(start[i] + count[i], chunkStart + chunkCount[i]) - partStart[i];
+            
+            gridIndex = gridIndex * gridDims[i] + chunk[i];
+            offset = offset * chunkCount[i] + partStart[i] - chunkStart;
+        }
+        
+        // The part must be contiguous in the chunk, and continue where the previous part ended
+        int partialAxis = N - 1;
+        while (partialAxis >= 0 && partCount[partialAxis] == chunkCount[partialAxis]) {
+            partialAxis--;
+        }
+        
+        for (int i = 0; i < partialAxis; i++) {
+            if (partCount[i] != 1) {
+                throw "Chunk checksums can only be calculated from contiguous parts of each chunk";
+            }
+        }
+        
+        if (offset != progress[gridIndex]) {
+            throw "The parts of each chunk have to be checksummed in order";
+        }
+        
+        uint32_t crc = checksums[gridIndex];
+        hsize_t numRows = product(partCount) / partCount[N - 1];
+        std::vector<hsize_t> row(N, 0);
+        
+        for (hsize_t r = 0; r < numRows; r++) {
+            hsize_t memOffset(0);
+            for (int i = 0; i < N; i++) {
+                memOffset += (partStart[i] - start[i] + row[i]) * memStrides[i];
+            }
+            
+            crc = checksumRow(data + memOffset, partCount[N - 1], crc, buffer, swapped);
+            
+            for (int i = N - 2; i >= 0; i--) {
+                if (++row[i] < partCount[i]) {
+                    break;
+                }
+                row[i] = 0;
+            }
+        }
+        
+        checksums[gridIndex] = crc;
+        progress[gridIndex] += product(partCount);
+        
+        // Next chunk
+        int axis = N - 1;
+        for (; axis >= 0; axis--) {
+            if (++chunk[axis] <= lastChunk[axis]) {
+                break;
+            }
+            chunk[axis] = firstChunk[axis];
+        }
+        
+        if (axis < 0) {
+            break;
+        }
+    }
+}
+
+void ChunkChecksums::write() {
+    if (std::accumulate(progress.begin(), progress.end(), (hsize_t)0) != product(dims)) {
+        throw "Some chunks were not checksummed";
+    }
+    
+    dataset->write(checksums.data(), gridDims);
+}
+
+// Verification
+
+static void findDatasets(H5::Group group, const std::string& path, std::vector<std::string>& paths) {
+    for (hsize_t i = 0; i < group.getNumObjs(); i++) {
+        std::string name = group.getObjnameByIdx(i);
+        std::string childPath = path.empty() ? name : path + "/" + name;
+        
+        if (group.getObjTypeByIdx(i) == H5G_GROUP) {
+            findDatasets(group.openGroup(name), childPath, paths);
+        } else {
+            paths.push_back(childPath);
+        }
+    }
+}
+
+hsize_t verifyChecksums(const std::string& fileName, bool progress) {
+    if (!std::filesystem::exists(fileName) || !H5::H5File::isHdf5(fileName)) {
+        throw "Could not open the HDF5 file to verify";
+    }
+    
+    H5::H5File file(fileName, H5F_ACC_RDONLY);
+    if (!hdf5Exists(file, "0")) {
+        throw "The file has no image group";
+    }
+    H5::Group group = file.openGroup("0");
+    
+    if (!hdf5Exists(group, "Checksums")) {
+        throw "The file has no chunk checksums";
+    }
+    
+    std::vector<std::string> paths;
+    findDatasets(group.openGroup("Checksums"), "", paths);
+    
+    hsize_t numChunks(0);
+    hsize_t numMismatches(0);
+    
+    for (auto& path : paths) {
+        PROGRESS(path << "\t");
+        
+        H5::DataSet dataset = group.openDataSet(path);
+        auto dataSpace = dataset.getSpace();
+        int N = dataSpace.getSimpleExtentNdims();
+        std::vector<hsize_t> dims(N);
+        std::vector<hsize_t> chunkDims(N);
+        dataSpace.getSimpleExtentDims(dims.data());
+        
+        auto propList = dataset.getCreatePlist();
+        if (propList.getLayout() != H5D_CHUNKED) {
+            throw "A dataset with chunk checksums is not chunked";
+        }
+        propList.getChunk(N, chunkDims.data());
+        
+        ChunkChecksums expected(dims, chunkDims);
+        H5::DataSet checksumDataSet = group.openDataSet("Checksums/" + path);
+        if (checksumDataSet.getSpace().getSimpleExtentNpoints() != (hssize_t)expected.checksums.size()) {
+            throw "The chunk checksums don't match the shape of the dataset";
+        }
+        checksumDataSet.read(expected.checksums.data(), H5::PredType::NATIVE_UINT32);
+        
+        // Reading the chunks in the dataset's own type gives us the bytes which were checksummed
+        H5::DataType fileType = dataset.getDataType();
+        hsize_t elementSize = fileType.getSize();
+        
+        hsize_t numDatasetChunks = expected.checksums.size();
+        std::vector<uint32_t> actual(numDatasetChunks);
+        // A chunk which is too damaged to be decompressed counts as a mismatch
+        std::vector<char> unreadable(numDatasetChunks, false);
+        
+        auto chunkIndex = [&] (hsize_t gridIndex) {
+            std::vector<hsize_t> index(N);
+            for (int i = N - 1; i >= 0; i--) {
+                index[i] = gridIndex % expected.gridDims[i];
+                gridIndex /= expected.gridDims[i];
+            }
+            return index;
+        };
+        
+        // The chunks are processed in rounds, so that only a few of them are in memory at once
+        hsize_t chunksPerRound = TaskGraph::numThreads() * 4;
+        std::vector<std::vector<uint8_t>> buffers(chunksPerRound);
+        
+        for (hsize_t roundStart = 0; roundStart < numDatasetChunks; roundStart += chunksPerRound) {
+            TaskGraph graph;
+            Task* lastRead(nullptr);
+            
+            for (hsize_t g = roundStart; g < std::min(numDatasetChunks, roundStart + chunksPerRound); g++) {
+                hsize_t b = g - roundStart;
+                
+                Task* read = graph.add([&, g, b] {
+                    auto index = chunkIndex(g);
+                    std::vector<hsize_t> start(N);
+                    std::vector<hsize_t> count(N);
+                    for (int i = 0; i < N; i++) {
+                        start[i] = index[i] * chunkDims[i];
+                        count[i] = std::min(chunkDims[i], dims[i] - start[i]);
+                    }
+                    
+                    buffers[b].resize(product(count) * elementSize);
+                    H5::DataSpace memSpace(N, count.data());
+                    auto fileSpace = dataset.getSpace();
+                    fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+                    IoCall call(IoSite::HDF5_READ, buffers[b].size());
+                    try {
+                        dataset.read(buffers[b].data(), fileType, memSpace, fileSpace);
+                    } catch (const H5::Exception&) {
+                        unreadable[g] = true;
+                    }
+                }, {lastRead});
+                lastRead = read;
+                
+                graph.add([&, g, b] {
+                    actual[g] = crc32c(buffers[b].data(), buffers[b].size());
+                }, {read});
+            }
+            
+            graph.run();
+        }
+        
+        for (hsize_t g = 0; g < numDatasetChunks; g++) {
+            if (unreadable[g] || actual[g] != expected.checksums[g]) {
+                auto index = chunkIndex(g);
+                std::cerr << (unreadable[g] ? "Unreadable chunk in " : "Checksum mismatch in ") << path << " at chunk";
+                for (auto& i : index) {
+                    std::cerr << " " << i;
+                }
+                std::cerr << std::endl;
+                numMismatches++;
+            }
+        }
+        
+        numChunks += numDatasetChunks;
+        PROGRESS(numDatasetChunks << " chunks" << std::endl);
+    }
+    
+    PROGRESS("Verified " << numChunks << " chunks in " << paths.size() << " datasets; " << numMismatches << " mismatches" << std::endl);
+    
+    return numMismatches;
+}
@@ -0,0 +1,62 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include "common.h"
+#include "Output.h"
+
+// CRC32C (Castagnoli polynomial), using the SSE 4.2 instruction if the CPU has it. A checksum can be continued
+// over more data by passing in the previous result.
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// Checksums of the chunks of a dataset, stored in a dataset with one element per chunk in Checksums/<dataset name>.
+// The checksum of a chunk is the CRC32C of the elements of the chunk which are inside the dataset, in row-major
+// order, as little-endian values of the dataset's type. This is what a reader gets if it reads the chunk as a
+// hyperslab in the dataset's own type.
+// The checksums are calculated from the data as it is written. A write may cover only part of a chunk, as long as
+// the parts of each chunk are written in order. Different chunks can be checksummed from multiple threads at once.
+struct ChunkChecksums {
+    ChunkChecksums() {}
+    ChunkChecksums(const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims);
+    
+    bool enabled() const {
+        return !dims.empty();
+    }
+    
+    void createDataset(OutputGroup group, const std::string& name);
+    
+    // The data is a contiguous block with the dimensions of the hyperslab given by count and start
+    void calculate(const float* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+    // 16-bit float data which has already been converted to the dataset's own type
+    void calculate(const uint16_t* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+    // Double precision data which is stored in a single precision dataset
+    void calculate(const double* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+    
+    // All the chunks must have been checksummed
+    void write();
+    
+    std::vector<hsize_t> dims;
+    std::vector<hsize_t> chunkDims;
+    // Number of chunks along each axis
+    std::vector<hsize_t> gridDims;
+    
+    std::vector<uint32_t> checksums;
+    // Number of elements of each chunk which have been checksummed so far
+    std::vector<hsize_t> progress;
+    
+    std::shared_ptr<OutputDataset> dataset;
+
+private:
+    template <typename T>
+    void calculateRows(const T* data, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+};
+
+// Verify the chunk checksums of an IDIA file, reading the chunks on one thread and checksumming them on all the
+// others. Each mismatch is reported, and the number of mismatched chunks is returned.
+hsize_t verifyChecksums(const std::string& fileName, bool progress);
+
+#endif
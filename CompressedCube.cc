@@ -0,0 +1,111 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "CompressedCube.h"
+
+#include <zlib.h>
+
+CompressedCube::CompressedCube(hsize_t depth, hsize_t height, hsize_t width, hsize_t rowsPerBlock) : depth(depth), height(height), width(width), rowsPerBlock(rowsPerBlock) {
+    numBlocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+    blocks.resize(depth * numBlocks);
+}
+
+void CompressedCube::store(hsize_t channel, const float* data) {
+    for (hsize_t b = 0; b < numBlocks; b++) {
+        encode(data + b * rowsPerBlock * width, blockRows(b) * width, blocks[channel * numBlocks + b]);
+    }
+}
+
+void CompressedCube::load(hsize_t channel, hsize_t block, float* destination) const {
+    decode(blocks[channel * numBlocks + block], blockRows(block) * width, destination);
+}
+
+hsize_t CompressedCube::size() const {
+    hsize_t total(0);
+    for (auto& block : blocks) {
+        total += block.data.size();
+    }
+    return total;
+}
+
+hsize_t CompressedCube::compressedSize(const float* channel, hsize_t height, hsize_t width, hsize_t rowsPerBlock) {
+    CompressedCube sample(1, height, width, rowsPerBlock);
+    sample.store(0, channel);
+    return sample.size();
+}
+
+void CompressedCube::encode(const float* data, hsize_t size, Block& block) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    std::vector<uint8_t> shuffled(size * sizeof(float));
+    for (hsize_t i = 0; i < size; i++) {
+        for (hsize_t b = 0; b < sizeof(float); b++) {
+            shuffled[b * size + i] = bytes[i * sizeof(float) + b];
+        }
+    }
+    
+    // A raw deflate stream, without the header and the checksum, because the block never leaves the process
+    z_stream stream = {};
+    if (deflateInit2(&stream, 1, Z_DEFLATED, -15, 8, Z_RLE) != Z_OK) {
+        throw "Could not compress channel block";
+    }
+    
+    std::vector<uint8_t> encoded(deflateBound(&stream, shuffled.size()));
+    stream.next_in = shuffled.data();
+    stream.avail_in = shuffled.size();
+    stream.next_out = encoded.data();
+    stream.avail_out = encoded.size();
+    
+    int result = deflate(&stream, Z_FINISH);
+    hsize_t encodedSize = stream.total_out;
+    deflateEnd(&stream);
+    
+    if (result != Z_STREAM_END) {
+        throw "Could not compress channel block";
+    }
+    
+    block.raw = encodedSize >= shuffled.size();
+    
+    // The memory of the previous Stokes is reused if it is large enough
+    if (block.raw) {
+        block.data.assign(bytes, bytes + size * sizeof(float));
+    } else {
+        block.data.assign(encoded.begin(), encoded.begin() + encodedSize);
+    }
+}
+
+void CompressedCube::decode(const Block& block, hsize_t size, float* destination) {
+    uint8_t* bytes = (uint8_t*)destination;
+    
+    if (block.raw) {
+        std::copy(block.data.begin(), block.data.end(), bytes);
+        return;
+    }
+    
+    std::vector<uint8_t> shuffled(size * sizeof(float));
+    
+    z_stream stream = {};
+    if (inflateInit2(&stream, -15) != Z_OK) {
+        throw "Could not decompress channel block";
+    }
+    
+    stream.next_in = (Bytef*)block.data.data();
+    stream.avail_in = block.data.size();
+    stream.next_out = shuffled.data();
+    stream.avail_out = shuffled.size();
+    
+    int result = inflate(&stream, Z_FINISH);
+    hsize_t decodedSize = stream.total_out;
+    inflateEnd(&stream);
+    
+    if (result != Z_STREAM_END || decodedSize != shuffled.size()) {
+        throw "Could not decompress channel block";
+    }
+    
+    for (hsize_t i = 0; i < size; i++) {
+        for (hsize_t b = 0; b < sizeof(float); b++) {
+            bytes[i * sizeof(float) + b] = shuffled[b * size + i];
+        }
+    }
+}
@@ -0,0 +1,63 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __COMPRESSEDCUBE_H
+#define __COMPRESSEDCUBE_H
+
+#include "common.h"
+
+// The channels of one Stokes, held in memory as losslessly compressed blocks of rows, so that the fast converter
+// can keep a cube which is larger than the memory. Each block is shuffled into byte planes, which puts the sign and
+// exponent bytes of neighbouring pixels, and the runs of identical bytes in blanked borders, next to each other. The
+// planes are then run-length and Huffman coded with deflate's fastest strategy. A block which doesn't get any
+// smaller is kept as it is.
+// Different blocks can be stored and loaded from multiple threads at once.
+class CompressedCube {
+public:
+    CompressedCube() : depth(0), height(0), width(0), rowsPerBlock(0), numBlocks(0) {}
+    CompressedCube(hsize_t depth, hsize_t height, hsize_t width, hsize_t rowsPerBlock);
+    
+    bool enabled() const {
+        return depth > 0;
+    }
+    
+    // Compress all the blocks of a channel, replacing the channel from the previous Stokes
+    void store(hsize_t channel, const float* data);
+    // Decompress one block of rows of a channel
+    void load(hsize_t channel, hsize_t block, float* destination) const;
+    
+    hsize_t blockRows(hsize_t block) const {
+        return std::min(rowsPerBlock, height - block * rowsPerBlock);
+    }
+    
+    // The total size of the compressed blocks. This is not thread-safe.
+    hsize_t size() const;
+    
+    // The compressed size of a whole channel, for estimating the size of a cube from sample channels
+    static hsize_t compressedSize(const float* channel, hsize_t height, hsize_t width, hsize_t rowsPerBlock);
+    
+    hsize_t depth;
+    hsize_t height;
+    hsize_t width;
+    hsize_t rowsPerBlock;
+    hsize_t numBlocks;
+
+private:
+    struct Block {
+        Block() : raw(false) {}
+        
+        std::vector<uint8_t> data;
+        // The block is stored uncompressed
+        bool raw;
+    };
+    
+    static void encode(const float* data, hsize_t size, Block& block);
+    static void decode(const Block& block, hsize_t size, float* destination);
+    
+    // Ordered by channel, then by block
+    std::vector<Block> blocks;
+};
+
+#endif
@@ -5,26 +5,93 @@
 
 #include "Converter.h"
 
-Converter::Converter(std::string inputFileName, std::string outputFileName, bool progress) : timer(), progress(progress) {
+#include <filesystem>
+
+Converter::Converter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options) : timer(), options(options), progress(options.progress) {
     TIMER(timer.start("Setup"););
     
-    openFitsFile(&inputFilePtr, inputFileName);
+    // A FITS file on standard input is read as it streams in, and never written to disk
+    if (inputFileName == "-") {
+        inputStream = &FitsStream::standardInput();
+        inputStream->open(&inputFilePtr);
+    } else {
+        inputStream = nullptr;
+        openFitsFile(&inputFilePtr, inputFileName);
+    }
+    
+    broadcast = nullptr;
+    broadcastConsumer = -1;
     
     long dims[4];
     
     getFitsDims(inputFilePtr, N, dims);
         
     stokes = N == 4 ? dims[3] : 1;
-    depth = N >= 3 ? dims[2] : 1;
+    inputDepth = N >= 3 ? dims[2] : 1;
     height = dims[1];
     width = dims[0];
     
+    // The output may only cover a range of the channels
+    if (options.channelOffset || options.channelCount) {
+        if (N < 3) {
+            throw "Only the channels of a cube can be cropped";
+        }
+        
+        if (options.channelOffset >= inputDepth || options.channelCount > inputDepth - options.channelOffset) {
+            throw "The channel range is outside the image";
+        }
+        
+        // The sum covers all the channels
+        if (options.dataSumCheck == DataSumCheck::FAIL) {
+            throw "The FITS DATASUM can't be verified for a range of channels";
+        }
+        
+        if (options.dataSumCheck != DataSumCheck::NONE) {
+            std::cout << "Warning: the FITS DATASUM can't be verified for a range of channels, so it is not checked for " << outputFileName << "." << std::endl;
+            this->options.dataSumCheck = DataSumCheck::NONE;
+        }
+    }
+    
+    depth = options.channelCount ? options.channelCount : inputDepth - options.channelOffset;
+    
     swizzledName = N == 3 ? "ZYX" : "ZYXW";
     
     standardDims = trimAxes({stokes, depth, height, width}, N);
     tileDims = trimAxes({1, 1, TILE_SIZE, TILE_SIZE}, N);
     
-    numBins = int(std::max(std::sqrt(width * height), 2.0));
+    // Custom chunk dimensions are aligned to the last (X) axis. They are limited to the dataset dimensions; small images
+    // are still chunked if the chunk dimensions are given explicitly.
+    if (!options.chunkDims.empty()) {
+        int numCustom = std::min((int)options.chunkDims.size(), N);
+        for (int i = 1; i <= numCustom; i++) {
+            tileDims[N - i] = std::min(options.chunkDims[options.chunkDims.size() - i], standardDims[N - i]);
+        }
+    }
+    
+    // The Stokes and channel chunk dimensions can't exceed the dataset dimensions
+    for (int i = 0; i < N - 2; i++) {
+        tileDims[i] = std::min(tileDims[i], standardDims[i]);
+    }
+    
+    if (useChunks(standardDims, tileDims)) {
+        standardChunkDims = tileDims;
+    } else if (options.checksums) {
+        // Chunk checksums need a chunked dataset, so a small image gets a single chunk per channel
+        for (int i = 0; i < N; i++) {
+            standardChunkDims.push_back(std::min(tileDims[i], standardDims[i]));
+        }
+    }
+    
+    // OUTPUT PRODUCTS
+    // The histograms need the XY and XYZ min and max, so they imply the statistics
+    writeHistograms = options.products & PRODUCT_HISTOGRAMS;
+    writeStats = writeHistograms || (options.products & PRODUCT_STATS);
+    writeZStats = depth > 1 && (options.products & PRODUCT_Z_STATS);
+    writeSwizzled = depth > 1 && (options.products & PRODUCT_SWIZZLED);
+    writeMipMaps = options.products & PRODUCT_MIPMAPS;
+    
+    // Stats objects without bins have no histograms
+    numBins = writeHistograms ? int(std::max(std::sqrt(width * height), 2.0)) : 0;
     
     // STATS OBJECTS
 
@@ -33,31 +100,81 @@ Converter::Converter(std::string inputFileName, std::string outputFileName, bool
     
     if (depth > 1) {
         swizzledDims = trimAxes({stokes, width, height, depth}, N);
+        
+        // The rotated dataset is only chunked if it is compressed or checksummed. Each chunk holds whole spectra where
+        // possible, and is limited to about 1MB so that reading a single spectrum stays cheap.
+        if (options.compression || options.checksums) {
+            hsize_t chunkDepth = std::min(depth, (hsize_t)(1 << 18));
+            hsize_t chunkHeight = std::min(height, std::max((hsize_t)1, (hsize_t)(1 << 18) / chunkDepth));
+            swizzledChunkDims = trimAxes({1, 1, chunkHeight, chunkDepth}, N);
+        }
+        
         statsZ = Stats(trimAxes({stokes, height, width}, N - 1));
         auto statsXYZDims = trimAxes({stokes}, N - 3);
         statsXYZ = Stats(statsXYZDims, numBins);
     }
     
     // MIPMAPS
-    mipMaps = MipMaps(standardDims, tileDims);
+    // An empty set of mipmaps does nothing. The display tile cache then only has the full resolution layer.
+    if (writeMipMaps) {
+        mipMaps = MipMaps(standardDims, tileDims, options.mipMapType);
+    }
+    
+    // QUANTIZATION
+    quantizer = Quantizer(options.keepBits, options.noiseFraction, stokes * depth);
+    
+    // DISPLAY TILES
+    tileCache = TileCache(standardDims, mipMaps, options.tileKeepBits);
     
     // Prepare output file
     this->outputFileName = outputFileName;
+    storeName = outputFileName + ".tmp.zarr";
     tempOutputFileName = outputFileName + ".tmp";        
 }
 
 Converter::~Converter() {
     // TODO this is probably unnecessary; the file object destructor should close the file properly.
-    outputFile.close();
+    if (output) {
+        output->close();
+    }
     closeFitsFile(inputFilePtr);
 }
 
-std::unique_ptr<Converter> Converter::getConverter(std::string inputFileName, std::string outputFileName, bool slow, bool progress) {
-    if (slow) {
-        return std::unique_ptr<Converter>(new SlowConverter(inputFileName, outputFileName, progress));
-    } else {
-        return std::unique_ptr<Converter>(new FastConverter(inputFileName, outputFileName, progress));
+std::unique_ptr<Converter> Converter::getConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options) {
+    if (options.slow) {
+        return std::unique_ptr<Converter>(new SlowConverter(inputFileName, outputFileName, options));
+    }
+    
+    std::unique_ptr<Converter> converter(new FastConverter(inputFileName, outputFileName, options));
+    
+    // If the fast method doesn't fit in the available memory or under the memory limit, but the slow method does,
+    // the slow method is used instead. Otherwise the buffers of the fast method are backed by a scratch file.
+    hsize_t available = availableMemory();
+    if (options.memoryLimit) {
+        available = std::min(available, options.memoryLimit);
+    }
+    // The slow method can't read a stream again for the original values of rounded data
+    bool canUseSlow = inputFileName != "-" || (!options.keepBits && options.noiseFraction <= 0);
+    
+    if (canUseSlow && converter->calculateMemoryUsage().total > available) {
+        // The slow method sizes its buffers to fit
+        ConverterOptions slowOptions = options;
+        slowOptions.slow = true;
+        slowOptions.memoryLimit = available;
+        std::unique_ptr<Converter> slowConverter(new SlowConverter(inputFileName, outputFileName, slowOptions));
+        
+        if (slowConverter->calculateMemoryUsage().total <= available) {
+            std::cout << "Warning: the fast method doesn't fit in the " << available * 1e-9 << " GB of available memory, so the slow method is used instead." << std::endl;
+            return slowConverter;
+        }
     }
+    
+    return converter;
+}
+
+void Converter::shareInput(ChannelBroadcast* broadcast, int consumer) {
+    this->broadcast = broadcast;
+    broadcastConsumer = consumer;
 }
 
 void Converter::copyAndCalculate() {
@@ -68,6 +185,119 @@ MemoryUsage Converter::calculateMemoryUsage() {
     // implemented in subclasses
 }
 
+void Converter::planArena(Arena& arena) {
+    // implemented in subclasses
+    UNUSED(arena);
+}
+
+void Converter::allocateArena() {
+    planArena(arena);
+    
+    // Scratch files are kept next to the output, where there has to be enough space for the output anyway
+    std::string scratchDirectory = options.scratchDirectory;
+    if (scratchDirectory.empty()) {
+        scratchDirectory = std::filesystem::path(outputFileName).parent_path().string();
+        if (scratchDirectory.empty()) {
+            scratchDirectory = ".";
+        }
+    }
+    
+    arena.allocate(scratchDirectory);
+    
+    // The rotation is written (or read, in the slow converter) with a large stride
+    arena.adviseRandom("Rotation");
+    
+    if (arena.isSpilled()) {
+        std::cout << "Warning: the " << arena.size() * 1e-9 << " GB of conversion buffers don't fit in memory, so they are backed by a scratch file in " << scratchDirectory << ". The conversion will be slower." << std::endl;
+    }
+    
+    openDirectReader();
+}
+
+void Converter::openDirectReader() {
+    char* buffer = arena.get<char>("Direct I/O");
+    
+    // A stream doesn't pass through the page cache anyway, and a shared input is read by the broadcast
+    if (buffer && !singlePass() && !directReader.open(inputFilePtr, buffer, arena.find("Direct I/O")->size)) {
+        std::cout << "Warning: the FITS data can't be read with direct I/O, and will be read through the page cache." << std::endl;
+    }
+}
+
+void Converter::readChannel(hsize_t channel, unsigned int stokes, float* destination) {
+    hsize_t channelSize = height * width;
+    // The channel in the input
+    channel += options.channelOffset;
+    
+    if (broadcast) {
+        broadcast->read(broadcastConsumer, channel, stokes, destination);
+    } else if (inputStream) {
+        inputStream->read(((hsize_t)stokes * inputDepth + channel) * channelSize, channelSize, destination);
+    } else if (directReader.enabled()) {
+        directReader.read(((hsize_t)stokes * inputDepth + channel) * channelSize, channelSize, destination);
+    } else {
+        readFitsData(inputFilePtr, channel, stokes, channelSize, destination);
+    }
+}
+
+void Converter::readSubset(unsigned int stokes, hsize_t xOffset, hsize_t yOffset, hsize_t zOffset, hsize_t xSize, hsize_t ySize, hsize_t zSize, float* destination) {
+    if (singlePass()) {
+        throw "A subset of a streamed or shared input can't be read";
+    }
+    
+    zOffset += options.channelOffset;
+    
+    if (directReader.enabled()) {
+        for (hsize_t c = 0; c < zSize; c++) {
+            hsize_t offset = (((hsize_t)stokes * inputDepth + zOffset + c) * height + yOffset) * width + xOffset;
+            directReader.readRows(offset, xSize, width, ySize, destination + c * ySize * xSize);
+        }
+    } else {
+        readFitsSubset(inputFilePtr, stokes, xOffset, yOffset, zOffset, xSize, ySize, zSize, destination);
+    }
+}
+
+MemoryUsage Converter::arenaMemoryUsage(const Arena& arena, hsize_t mipMapBufferDepth) {
+    MemoryUsage m;
+    
+    hsize_t sumOfRegions(0);
+    for (auto& region : arena.regions) {
+        m.sizes[region.name] = region.size;
+        sumOfRegions += region.size;
+    }
+    m.total = arena.size();
+    
+    if (sumOfRegions > arena.size()) {
+        m.note = " (Buffers which are not used at the same time share memory.)";
+    }
+    
+    // These are small, and allocated separately
+    m.sizes["XY stats"] = Stats::size({depth}, numBins);
+    m.total += m.sizes["XY stats"];
+    
+    if (writeStats && depth > 1) {
+        m.sizes["XYZ stats"] = Stats::size({}, numBins, depth);
+        m.total += m.sizes["XYZ stats"];
+    }
+    
+    // A small output is built in memory. It holds at most the main dataset, the rotated dataset and the mipmaps,
+    // which are at most a third as large as the main dataset.
+    if (isSmallFile()) {
+        hsize_t dataSize = product(standardDims) * sizeof(float);
+        m.sizes["In-memory output"] = dataSize * (writeSwizzled ? 2 : 1) + (writeMipMaps ? dataSize / 3 : 0);
+        m.total += m.sizes["In-memory output"];
+    }
+    
+    // The buffer for converting mipmaps to half precision
+    if (writeMipMaps) {
+        std::vector<hsize_t> bufferDims = {mipMapBufferDepth, height, width};
+        hsize_t conversionSize = MipMaps::size(standardDims, bufferDims, options.mipMapType) - MipMaps::bufferSize(standardDims, bufferDims);
+        m.sizes["Mipmaps"] += conversionSize;
+        m.total += conversionSize;
+    }
+    
+    return m;
+}
+
 void Converter::reportMemoryUsage() {
     MemoryUsage m = calculateMemoryUsage();
 
@@ -78,6 +308,15 @@ void Converter::reportMemoryUsage() {
     }
 
     std::cout << "TOTAL:\t" << m.total * 1e-9 << "GB" << m.note << std::endl;
+    
+    hsize_t available = availableMemory();
+    if (m.total > available) {
+        std::cout << "This exceeds the " << available * 1e-9 << " GB of available memory, so the buffers will be backed by a scratch file." << std::endl;
+    }
+    
+    for (auto& line : m.details) {
+        std::cout << line << std::endl;
+    }
 }
 
 void Converter::convert() {
@@ -85,39 +324,75 @@ void Converter::convert() {
     
     // TODO dataset variables should be local and passed into the copy function?
     
-    outputFile = H5::H5File(tempOutputFileName, H5F_ACC_TRUNC);
-    outputGroup = outputFile.createGroup("0");
+    // With the directory backend, the output is first written to a directory store, and packed into the HDF5 file
+    // at the end
+    if (options.backend == OutputBackendType::DIRECTORY) {
+        output = OutputBackend::create(options.backend, storeName);
+    } else {
+        output = OutputBackend::create(options.backend, tempOutputFileName, isSmallFile());
+    }
     
-    std::vector<hsize_t> chunkDims;
-    if (useChunks(standardDims)) {
-        chunkDims = tileDims;
+    if (options.directIO) {
+        output->bypassPageCache();
     }
     
-    H5::FloatType floatType(H5::PredType::NATIVE_FLOAT);
-    floatType.setOrder(H5T_ORDER_LE);
-    createHdf5Dataset(standardDataSet, outputGroup, "DATA", floatType, standardDims, chunkDims);
+    outputGroup = output->root().createGroup("0");
     
-    statsXY.createDatasets(outputGroup, "XY");
-
-    if (depth > 1) {
-        statsXYZ.createDatasets(outputGroup, "XYZ");
-        statsZ.createDatasets(outputGroup, "Z");
+    if (options.checksums) {
+        auto checksumGroup = outputGroup.createGroup("Checksums");
+        checksumGroup.writeAttribute("ALGORITHM", std::string("CRC32C"));
+    }
+    
+    standardDataSet = outputGroup.createDataset("DATA", DataType::FLOAT, standardDims, standardChunkDims, options.compression);
+    
+    if (options.checksums) {
+        standardChecksums = ChunkChecksums(standardDims, standardChunkDims);
+        standardChecksums.createDataset(outputGroup, "DATA");
+    }
+    
+    if (writeStats) {
+        statsXY.createDatasets(outputGroup, "XY");
         
+        if (depth > 1) {
+            statsXYZ.createDatasets(outputGroup, "XYZ");
+        }
+    }
+    
+    if (writeZStats) {
+        statsZ.createDatasets(outputGroup, "Z");
+    }
+    
+    if (writeSwizzled) {
         auto swizzledGroup = outputGroup.createGroup("SwizzledData");
         // We use this name in papers because it sounds more serious. :)
-        outputGroup.link(H5L_TYPE_HARD, "SwizzledData", "PermutedData");
-        createHdf5Dataset(swizzledDataSet, swizzledGroup, swizzledName, floatType, swizzledDims);
+        outputGroup.link("SwizzledData", "PermutedData");
+        
+        swizzledDataSet = swizzledGroup.createDataset(swizzledName, DataType::FLOAT, swizzledDims, swizzledChunkDims, options.compression);
+        
+        if (options.checksums) {
+            swizzledChecksums = ChunkChecksums(swizzledDims, swizzledChunkDims);
+            swizzledChecksums.createDataset(outputGroup, "SwizzledData/" + swizzledName);
+        }
     }
     
-    mipMaps.createDatasets(outputGroup);
+    mipMaps.createDatasets(outputGroup, options.compression, options.checksums);
+    
+    if (options.channelHashes) {
+        channelHashDataSet = outputGroup.createDataset("ChannelHashes", DataType::UINT32, statsXY.basicDatasetDims);
+    }
+    
+    if (tileCache.enabled()) {
+        tileCache.createDatasets(outputGroup);
+    }
     
     // COPY HEADERS
     
     TIMER(timer.start("Headers"););
     
-    writeHdf5Attribute(outputGroup, "SCHEMA_VERSION", std::string(SCHEMA_VERSION));
-    writeHdf5Attribute(outputGroup, "HDF5_CONVERTER", std::string(HDF5_CONVERTER));
-    writeHdf5Attribute(outputGroup, "HDF5_CONVERTER_VERSION", std::string(HDF5_CONVERTER_VERSION));
+    outputGroup.writeAttribute("SCHEMA_VERSION", std::string(SCHEMA_VERSION));
+    outputGroup.writeAttribute("HDF5_CONVERTER", std::string(HDF5_CONVERTER));
+    outputGroup.writeAttribute("HDF5_CONVERTER_VERSION", std::string(HDF5_CONVERTER_VERSION));
+    quantizer.writeAttributes(outputGroup);
 
     int numAttributes;
     readFitsHeader(inputFilePtr, numAttributes);
@@ -128,10 +403,24 @@ void Converter::convert() {
         std::string attributeValue;
         readFitsAttribute(inputFilePtr, i, attributeName, attributeValue);
         
+        // The spectral axis of a cropped cube starts at the first channel of the range
+        if (depth != inputDepth && attributeName == "NAXIS3") {
+            attributeValue = std::to_string(depth);
+        } else if (depth != inputDepth && attributeName == "CRPIX3") {
+            try {
+                std::ostringstream ostream;
+                ostream.precision(17);
+                ostream << std::showpoint << std::stod(attributeValue) - options.channelOffset;
+                attributeValue = ostream.str();
+            } catch (const std::exception& e) {
+                std::cout << "Warning: could not parse attribute 'CRPIX3', so it is not adjusted for the channel range." << std::endl;
+            }
+        }
+        
         if (attributeName.empty() || attributeName.find("COMMENT") == 0 || attributeName.find("HISTORY") == 0) {
             // TODO we should actually do something about these
         } else {
-            if (outputGroup.attrExists(attributeName)) {
+            if (outputGroup.attributeExists(attributeName)) {
                 std::cout << "Warning: Skipping duplicate attribute '" << attributeName << "'" << std::endl;
             } else {
                 bool parsingFailure(false);
@@ -141,16 +430,16 @@ void Converter::convert() {
                     // STRING
                     std::string attributeValueStr;
                     readFitsStringAttribute(inputFilePtr, attributeName, attributeValueStr);
-                    writeHdf5Attribute(outputGroup, attributeName, attributeValueStr);
+                    outputGroup.writeAttribute(attributeName, attributeValueStr);
                 } else if (attributeValue == "T" || attributeValue == "F") {
                     // BOOLEAN
                     bool attributeValueBool = (attributeValue == "T");
-                    writeHdf5Attribute(outputGroup, attributeName, attributeValueBool);
+                    outputGroup.writeAttribute(attributeName, attributeValueBool);
                 } else if (attributeValue.find('.') != std::string::npos) {
                     // TRY TO PARSE AS DOUBLE
                     try {
                         double attributeValueDouble = std::stod(attributeValue);
-                        writeHdf5Attribute(outputGroup, attributeName, attributeValueDouble);
+                        outputGroup.writeAttribute(attributeName, attributeValueDouble);
                     } catch (const std::invalid_argument& ia) {
                         std::cout << "Warning: could not parse attribute '" << attributeName << "' as a float." << std::endl;
                         parsingFailure = true;
@@ -158,7 +447,7 @@ void Converter::convert() {
                         // Special handling for subnormal numbers
                         long double attributeValueLongDouble = std::stold(attributeValue);
                         double attributeValueDouble = (double) attributeValueLongDouble;
-                        writeHdf5Attribute(outputGroup, attributeName, attributeValueDouble);
+                        outputGroup.writeAttribute(attributeName, attributeValueDouble);
                         
                         std::ostringstream ostream;
                         ostream.precision(13);
@@ -176,7 +465,7 @@ void Converter::convert() {
                     // TRY TO PARSE AS INTEGER
                     try {
                         int64_t attributeValueInt = std::stoi(attributeValue);
-                        writeHdf5Attribute(outputGroup, attributeName, attributeValueInt);
+                        outputGroup.writeAttribute(attributeName, attributeValueInt);
                     } catch (const std::invalid_argument& ia) {
                         std::cout << "Warning: could not parse attribute '" << attributeName << "' as an integer." << std::endl;
                         parsingFailure = true;
@@ -185,7 +474,7 @@ void Converter::convert() {
                 
                 if (parsingFailure) {
                     // FALL BACK TO STRING
-                    writeHdf5Attribute(outputGroup, attributeName, attributeValue);
+                    outputGroup.writeAttribute(attributeName, attributeValue);
                 }
             }
         }
@@ -193,10 +482,116 @@ void Converter::convert() {
     
     // MAIN CONVERSION AND CALCULATION FUNCTION
 
+    if (options.dataSumCheck != DataSumCheck::NONE) {
+        dataSums.assign(stokes * depth, 0);
+    }
+    
+    if (options.channelHashes) {
+        channelHashes.assign(stokes * depth, 0);
+    }
+    
     copyAndCalculate();
+    
+    if (options.dataSumCheck != DataSumCheck::NONE) {
+        checkDataSum();
+    }
+    
+    if (options.channelHashes) {
+        channelHashDataSet->write(channelHashes.data(), {stokes * depth});
+    }
             
+    if (options.checksums) {
+        TIMER(timer.start("Checksums"););
+        standardChecksums.write();
+        
+        if (writeSwizzled) {
+            swizzledChecksums.write();
+        }
+        
+        mipMaps.writeChecksums();
+    }
+    
+    if (options.backend == OutputBackendType::DIRECTORY) {
+        TIMER(timer.start("Pack"););
+        output->close();
+        packDirectoryStore(storeName, tempOutputFileName, options.directIO);
+        
+        if (!options.keepStore) {
+            std::filesystem::remove_all(storeName);
+        }
+    }
+    
+    // A file which is built in memory only exists once it has been closed
+    if (isSmallFile()) {
+        TIMER(timer.start("Write"););
+        output->close();
+    }
+    
     TIMER(timer.print(product(standardDims)););
     
     // Rename from temp file
     rename(tempOutputFileName.c_str(), outputFileName.c_str());
+    renameHdf5FileStats(tempOutputFileName, outputFileName);
+}
+
+void Converter::checkDataSum() {
+    uint32_t dataSum(0);
+    
+    for (auto& channelSum : dataSums) {
+        dataSum = addFitsDataSums(dataSum, channelSum);
+    }
+    
+    std::string result;
+    uint32_t headerDataSum;
+    
+    if (fitsDataIsScaled(inputFilePtr)) {
+        // The data we read is not the data which was summed
+        result = "UNVERIFIABLE";
+    } else if (!readFitsDataSum(inputFilePtr, headerDataSum)) {
+        result = "MISSING";
+    } else if (headerDataSum == dataSum) {
+        result = "MATCH";
+    } else {
+        result = "MISMATCH";
+    }
+    
+    // The CHECKSUM covers the raw header blocks as well as the data
+    std::string checksumResult("UNVERIFIABLE");
+    
+    if (result != "UNVERIFIABLE" && !fitsHasChecksum(inputFilePtr)) {
+        checksumResult = "MISSING";
+    } else if (result != "UNVERIFIABLE") {
+        // A stream keeps its raw header blocks; otherwise they are read again from the file
+        uint32_t headerSum(0);
+        bool haveHeaderSum(true);
+        
+        if (inputStream) {
+            headerSum = inputStream->headerSum();
+        } else {
+            haveHeaderSum = readFitsHeaderSum(inputFilePtr, headerSum);
+        }
+        
+        if (haveHeaderSum) {
+            checksumResult = addFitsDataSums(headerSum, dataSum) == 0xFFFFFFFF ? "MATCH" : "MISMATCH";
+        }
+    }
+    
+    DEBUG(std::cout << "FITS DATASUM check: " << result << " (" << dataSum << "); CHECKSUM check: " << checksumResult << std::endl;);
+    
+    if (options.dataSumCheck == DataSumCheck::FAIL) {
+        if (result == "MISMATCH") {
+            throw "The data does not match the FITS DATASUM";
+        }
+        if (result != "MATCH") {
+            throw "The FITS DATASUM can't be verified";
+        }
+        // The CHECKSUM is optional, but if it is there, it has to match
+        if (checksumResult == "MISMATCH") {
+            throw "The FITS file does not match its CHECKSUM";
+        }
+    }
+    
+    outputGroup.writeAttribute("FITS_DATASUM_CHECK", result);
+    outputGroup.writeAttribute("FITS_DATASUM_COMPUTED", std::to_string(dataSum));
+    outputGroup.writeAttribute("FITS_CHECKSUM_CHECK", checksumResult);
 }
@@ -10,6 +10,17 @@
 #include "Stats.h"
 #include "MipMap.h"
 #include "Timer.h"
+#include "TaskGraph.h"
+#include "Quantizer.h"
+#include "TileCache.h"
+#include "ChannelCache.h"
+#include "CompressedCube.h"
+#include "FitsStream.h"
+#include "ChannelBroadcast.h"
+#include "Arena.h"
+#include "Output.h"
+#include "DirectoryStore.h"
+#include "Checksum.h"
 #include "Util.h"
 
 struct MemoryUsage {
@@ -18,34 +29,186 @@ struct MemoryUsage {
     std::unordered_map<std::string, hsize_t> sizes;
     hsize_t total;
     std::string note;
+    // Lines which describe how the buffers are used
+    std::vector<std::string> details;
+};
+
+// Optional output products. The main dataset is always written.
+enum Product : unsigned int {
+    PRODUCT_STATS = 1 << 0,
+    PRODUCT_HISTOGRAMS = 1 << 1,
+    PRODUCT_Z_STATS = 1 << 2,
+    PRODUCT_SWIZZLED = 1 << 3,
+    PRODUCT_MIPMAPS = 1 << 4,
+    ALL_PRODUCTS = (1 << 5) - 1
+};
+
+// What to do with the DATASUM keyword of the FITS file
+enum class DataSumCheck {
+    NONE,
+    // Record the result of the check in the output attributes
+    RECORD,
+    // Also fail the conversion if the data does not match the DATASUM, or if there is no DATASUM
+    FAIL
+};
+
+// Settings which are passed in from the commandline
+struct ConverterOptions {
+    ConverterOptions() : slow(false), progress(false), keepBits(0), noiseFraction(0), compression(0), mipMapType(MipMapType::FLOAT), tileKeepBits(0), products(ALL_PRODUCTS), memoryLimit(0), channelCacheSize(-1), backend(OutputBackendType::HDF5), keepStore(false), checksums(false), dataSumCheck(DataSumCheck::NONE), channelHashes(false), update(false), directIO(false), tileMajor(false), compressCube(false), channelOffset(0), channelCount(0), smallFileSize(256 << 10), hdf5Stats(false) {}
+    
+    bool slow;
+    bool progress;
+    
+    // Lossy quantization (disabled if both are zero)
+    int keepBits;
+    double noiseFraction;
+    
+    // Deflate level for chunked datasets (0 means no compression)
+    int compression;
+    
+    MipMapType mipMapType;
+    
+    // Mantissa bits of the precomputed display tiles (0 means no tile cache)
+    int tileKeepBits;
+    
+    // Chunk dimensions of the main dataset and mipmaps, aligned to the X axis (empty for the default)
+    std::vector<hsize_t> chunkDims;
+    
+    // Bitmask of output products
+    unsigned int products;
+    
+    // Configured memory limit (0 means no limit)
+    hsize_t memoryLimit;
+    
+    // Memory for the slow converter's channel cache (-1 means whatever is left under the memory limit)
+    hsize_t channelCacheSize;
+    
+    // Where the datasets are written before they end up in the HDF5 file
+    OutputBackendType backend;
+    // Keep the directory store after it has been packed
+    bool keepStore;
+    
+    // Store a checksum of each chunk of the main dataset, the rotated dataset and the mipmaps
+    bool checksums;
+    
+    // Check the data against the DATASUM keyword of the FITS file, from the channels as they are read
+    DataSumCheck dataSumCheck;
+    
+    // Store a hash of each input channel, so that the changed channels can be found when the file is updated
+    bool channelHashes;
+    
+    // Update an existing output file from a FITS file in which only some channels have changed
+    bool update;
+    // The changed channels (empty to find them with the stored channel hashes)
+    std::vector<hsize_t> updateChannels;
+    
+    // Read the FITS data with direct I/O, and keep the output file out of the page cache
+    bool directIO;
+    
+    // Write the main dataset of the fast converter in whole chunks, which are laid out and encoded in parallel
+    bool tileMajor;
+    
+    // Hold the channels of the fast converter in memory as losslessly compressed blocks, instead of as a raw cube
+    bool compressCube;
+    
+    // Where the conversion buffers are backed by a file if they don't fit in memory (empty for the directory of the
+    // output file)
+    std::string scratchDirectory;
+    
+    // Only convert this range of the channels of each Stokes (a count of 0 means up to the last channel)
+    hsize_t channelOffset;
+    hsize_t channelCount;
+    
+    // Images with up to this many bytes of data are converted on a single thread into an output which is built in
+    // memory (0 to disable)
+    hsize_t smallFileSize;
+    
+    // Collect the statistics of the HDF5 library; the files are then never built in memory, so that their I/O is counted
+    bool hdf5Stats;
 };
 
 class Converter {
 public:
     Converter() {}
-    Converter(std::string inputFileName, std::string outputFileName, bool progress);
+    Converter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options);
     ~Converter();
     
-    static std::unique_ptr<Converter> getConverter(std::string inputFileName, std::string outputFileName, bool slow, bool progress);
+    static std::unique_ptr<Converter> getConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options);
     void convert();
     void reportMemoryUsage();
     virtual MemoryUsage calculateMemoryUsage();
     
+    // Read the channels from a broadcast which is shared with other converters, instead of from the input file. This
+    // has to be set up before the conversion, and after the memory usage has been calculated.
+    virtual void shareInput(ChannelBroadcast* broadcast, int consumer);
+    
 protected:
     virtual void copyAndCalculate();
     
+    // Compare the sum of the data with the FITS DATASUM, and record the result
+    void checkDataSum();
+    
+    // Plan and allocate the arena, falling back to a scratch file if it doesn't fit in memory, and open the direct
+    // reader with its buffer
+    void allocateArena();
+    // Read the FITS data directly if possible, with a buffer from the arena
+    void openDirectReader();
+    // Read a channel, or a subset of a range of channels of a Stokes, directly or with CFITSIO
+    void readChannel(hsize_t channel, unsigned int stokes, float* destination);
+    void readSubset(unsigned int stokes, hsize_t xOffset, hsize_t yOffset, hsize_t zOffset, hsize_t xSize, hsize_t ySize, hsize_t zSize, float* destination);
+    
+    // Whether the image is so small that the conversion time is dominated by fixed costs. The output is then built
+    // in memory and written in one go, and the calculations are not spread over threads.
+    bool isSmallFile() const {
+        return options.smallFileSize && !options.hdf5Stats && options.backend == OutputBackendType::HDF5 && !options.directIO && product(standardDims) * sizeof(float) <= options.smallFileSize;
+    }
+    
+    // Whether each channel can only be read once, in order. The later passes then read the output instead.
+    bool singlePass() const {
+        return inputStream || broadcast;
+    }
+    
+    // Add the large buffers of the conversion to the arena, and plan it
+    virtual void planArena(Arena& arena);
+    // Memory usage of a planned arena and of the small buffers which are allocated separately
+    MemoryUsage arenaMemoryUsage(const Arena& arena, hsize_t mipMapBufferDepth);
+    
     Timer timer;
+    ConverterOptions options;
     bool progress;
     
     std::string tempOutputFileName;
     std::string outputFileName;
+    // The directory store of the directory backend
+    std::string storeName;
     fitsfile* inputFilePtr;
+    // The stream which the FITS file is read from in a single pass, or null if it is read from a file
+    FitsStream* inputStream;
+    // The broadcast which the channels are read from, if the input is shared with other converters
+    ChannelBroadcast* broadcast;
+    int broadcastConsumer;
+    // Optional direct reader of the FITS data
+    DirectFitsReader directReader;
+    
+    // Main output objects
+    std::unique_ptr<OutputBackend> output;
+    OutputGroup outputGroup;
+    std::shared_ptr<OutputDataset> standardDataSet;
+    std::shared_ptr<OutputDataset> swizzledDataSet;
+    
+    // Optional chunk checksums
+    ChunkChecksums standardChecksums;
+    ChunkChecksums swizzledChecksums;
+    
+    // Optional FITS DATASUM of each channel of each Stokes, in the order of the main dataset
+    std::vector<uint32_t> dataSums;
     
-    // Main HDF5 objects
-    H5::H5File outputFile;
-    H5::Group outputGroup;
-    H5::DataSet standardDataSet;
-    H5::DataSet swizzledDataSet;
+    // Optional CRC32C of each channel of each Stokes, in the order of the main dataset
+    std::vector<uint32_t> channelHashes;
+    std::shared_ptr<OutputDataset> channelHashDataSet;
+    
+    // Single allocation for the large buffers, which is reused for all Stokes
+    Arena arena;
     
     float* standardCube;
     float* rotatedCube;
@@ -58,15 +221,34 @@ protected:
     // MipMaps
     MipMaps mipMaps;
     
+    // Optional lossy rounding of the output data
+    Quantizer quantizer;
+    
+    // Optional precomputed display tiles
+    TileCache tileCache;
+    
     int N;
     hsize_t stokes, depth, height, width;
+    // The depth of the input, which is larger than the depth of the output if the channels are cropped
+    hsize_t inputDepth;
     hsize_t numBins;
     
+    // Selected output products which apply to this image. Work for products which are not written is skipped.
+    bool writeStats;
+    bool writeHistograms;
+    bool writeZStats;
+    bool writeSwizzled;
+    bool writeMipMaps;
+    
     // Dataset dimensions
     
     std::vector<hsize_t> standardDims;
     std::vector<hsize_t> swizzledDims;
+    // Empty if the rotated dataset is not chunked
+    std::vector<hsize_t> swizzledChunkDims;
     std::vector<hsize_t> tileDims;
+    // Empty if the main dataset is not chunked
+    std::vector<hsize_t> standardChunkDims;
     
     std::string swizzledName;
 };
@@ -74,21 +256,56 @@ protected:
 
 class FastConverter : public Converter {
 public:
-    FastConverter(std::string inputFileName, std::string outputFileName, bool progress);
+    FastConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options);
     MemoryUsage calculateMemoryUsage() override;
     
 protected:
     void copyAndCalculate() override;
+    void planArena(Arena& arena) override;
+    
+    // Whether the main dataset is written in whole chunks, which only the HDF5 backend takes
+    bool writesWholeChunks() const {
+        return options.tileMajor && options.backend == OutputBackendType::HDF5 && !standardChunkDims.empty();
+    }
+    
+    // Whether the channels are held compressed. A single channel is always held as it is.
+    bool compressesCube() const {
+        return options.compressCube && depth > 1;
+    }
+    
+    // Estimate the size of the compressed cube of a Stokes from a few sample channels
+    hsize_t estimateCompressedCubeSize();
+    
+    // The Z stats are calculated in blocks of this many rows. With a compressed cube, these are also the blocks in
+    // which the channels are compressed, and in which the rotated dataset is written.
+    hsize_t zRowsPerBlock;
+    
+    CompressedCube compressedCube;
+    // Zero until it has been estimated
+    hsize_t compressedCubeEstimate;
 };
 
 
 class SlowConverter : public Converter {
 public:
-    SlowConverter(std::string inputFileName, std::string outputFileName, bool progress);
+    SlowConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options);
     MemoryUsage calculateMemoryUsage() override;
+    void shareInput(ChannelBroadcast* broadcast, int consumer) override;
     
 protected:
     void copyAndCalculate() override;
+    void planArena(Arena& arena) override;
+    
+    // Choose the largest rotation tile and depth range whose buffers fit in the memory budget, and add them
+    void planRotation(Arena& arena);
+    void addRotationRegions(Arena& arena, hsize_t tileSize, hsize_t rangeDepth);
+    
+    // Channels from the first pass which the histogram pass doesn't have to read again
+    ChannelCache channelCache;
+    
+    // The rotation pass reads slices of rotationTileSize x rotationTileSize pixels and rotationDepth channels at a time
+    hsize_t rotationTileSize;
+    hsize_t rotationDepth;
 };
 
 #endif
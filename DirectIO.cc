@@ -0,0 +1,200 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "DirectIO.h"
+#include "Util.h"
+#include "Throttle.h"
+#include "IoStats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Rows which are closer together than this are read together, including the gap between them
+#define DIRECT_IO_MAX_GAP (hsize_t)(256 << 10)
+
+// Convert big-endian single precision values, which don't have to be aligned, to native ones
+static void convertFromBigEndian(const char* source, float* destination, hsize_t size) {
+    for (hsize_t i = 0; i < size; i++) {
+        uint32_t word;
+        memcpy(&word, source + i * sizeof(word), sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        memcpy(destination + i, &word, sizeof(word));
+    }
+}
+
+// DirectFitsReader
+
+DirectFitsReader::~DirectFitsReader() {
+    close();
+}
+
+bool DirectFitsReader::open(fitsfile* filePtr, char* buffer, hsize_t bufferSize) {
+    close();
+
+#ifdef O_DIRECT
+    int status(0);
+    char fileName[FLEN_FILENAME];
+    LONGLONG headerStart, fitsDataStart, dataEnd;
+    
+    fits_file_name(filePtr, fileName, &status);
+    fits_get_hduaddrll(filePtr, &headerStart, &fitsDataStart, &dataEnd, &status);
+    
+    if (status != 0 || fitsDataIsScaled(filePtr)) {
+        return false;
+    }
+    
+    fd = ::open(fileName, O_RDONLY | O_DIRECT);
+    
+    if (fd < 0) {
+        return false;
+    }
+    
+    this->buffer = buffer;
+    this->bufferSize = bufferSize;
+    
+    // If the file is compressed, or the image is tile-compressed, the bytes on disk are not the ones which CFITSIO
+    // reads. The header of the HDU has to be where CFITSIO says it is, and it has to be an image header.
+    dataStart = headerStart;
+    bool isImage(false);
+    
+    try {
+        std::string card(readSpan(0, 80), 80);
+        isImage = card.compare(0, 9, "SIMPLE  =") == 0 || card.compare(0, 20, "XTENSION= 'IMAGE   '") == 0;
+    } catch (const char* msg) {
+        UNUSED(msg);
+    }
+    
+    if (!isImage) {
+        close();
+        return false;
+    }
+    
+    dataStart = fitsDataStart;
+    return true;
+#else
+    UNUSED(filePtr);
+    UNUSED(buffer);
+    UNUSED(bufferSize);
+    return false;
+#endif
+}
+
+void DirectFitsReader::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+const char* DirectFitsReader::readSpan(hsize_t start, hsize_t size) {
+    hsize_t alignedStart = (dataStart + start) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    hsize_t alignedEnd = (dataStart + start + size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    hsize_t needed = dataStart + start + size - alignedStart;
+    
+    if (alignedEnd - alignedStart > bufferSize) {
+        throw "Direct read is larger than its buffer";
+    }
+    
+    // The last read may stop short at the end of the file. A throttled read is split into aligned blocks, which are
+    // paced evenly.
+    hsize_t done(0);
+    hsize_t blockSize = throttleReadBlock() / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    
+    while (done < needed) {
+        hsize_t count = alignedEnd - alignedStart - done;
+        if (blockSize) {
+            count = std::min(count, blockSize);
+        }
+        
+        throttleRead(count);
+        IoCall call(IoSite::DIRECT_READ, count);
+        ssize_t result = pread(fd, buffer + done, count, alignedStart + done);
+        
+        if (result <= 0) {
+            throw "Could not read image data";
+        }
+        
+        done += result;
+    }
+    
+    return buffer + (dataStart + start - alignedStart);
+}
+
+void DirectFitsReader::read(hsize_t offset, hsize_t size, float* destination) {
+    // There has to be room for the alignment at both ends
+    const hsize_t maxPixels = (bufferSize - 2 * DIRECT_IO_ALIGNMENT) / sizeof(float);
+    
+    for (hsize_t done = 0; done < size;) {
+        hsize_t count = std::min(maxPixels, size - done);
+        convertFromBigEndian(readSpan((offset + done) * sizeof(float), count * sizeof(float)), destination + done, count);
+        done += count;
+    }
+}
+
+void DirectFitsReader::readRows(hsize_t offset, hsize_t rowSize, hsize_t stride, hsize_t numRows, float* destination) {
+    const hsize_t maxPixels = (bufferSize - 2 * DIRECT_IO_ALIGNMENT) / sizeof(float);
+    const bool smallGaps = (stride - rowSize) * sizeof(float) <= DIRECT_IO_MAX_GAP;
+    
+    for (hsize_t row = 0; row < numRows;) {
+        if (rowSize > maxPixels) {
+            read(offset + row * stride, rowSize, destination + row * rowSize);
+            row++;
+            continue;
+        }
+        
+        // Read as many rows as possible at once
+        hsize_t lastRow = row;
+        
+        while (smallGaps && lastRow + 1 < numRows && (lastRow + 1 - row) * stride + rowSize <= maxPixels) {
+            lastRow++;
+        }
+        
+        const char* span = readSpan((offset + row * stride) * sizeof(float), ((lastRow - row) * stride + rowSize) * sizeof(float));
+        
+        for (hsize_t r = row; r <= lastRow; r++) {
+            convertFromBigEndian(span + (r - row) * stride * sizeof(float), destination + r * rowSize, rowSize);
+        }
+        
+        row = lastRow + 1;
+    }
+}
+
+// WriteBehind
+
+WriteBehind::~WriteBehind() {
+    close();
+}
+
+void WriteBehind::open(const std::string& fileName) {
+    close();
+    
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    
+    if (fd < 0) {
+        throw "Could not open the output file to release its pages";
+    }
+}
+
+void WriteBehind::release() {
+    if (fd < 0) {
+        return;
+    }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
+#endif
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+void WriteBehind::close() {
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,71 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __DIRECTIO_H
+#define __DIRECTIO_H
+
+#include "common.h"
+
+// Direct I/O needs buffers, file offsets and sizes which are aligned to the logical block size of the device.
+// A page is enough for all common devices.
+#define DIRECT_IO_ALIGNMENT (hsize_t)4096
+
+// The size of the buffer which the FITS data is read into before it is converted
+#define DIRECT_IO_BUFFER_SIZE (hsize_t)(16 << 20)
+
+// Reads the data unit of a FITS file with O_DIRECT, so that the data doesn't pass through the page cache.
+// The reads are aligned supersets of the data which is needed, and they go into a separate aligned buffer, because
+// the data has to be converted from big-endian anyway. This only works for uncompressed files with unscaled single
+// precision data; for any other file the reader stays disabled, and the data has to be read with CFITSIO.
+// The reader is not thread-safe, but all the reads of the converters are made one at a time.
+class DirectFitsReader {
+public:
+    DirectFitsReader() : fd(-1) {}
+    ~DirectFitsReader();
+    
+    // The buffer must be aligned to DIRECT_IO_ALIGNMENT, and its size must be a multiple of it.
+    // Returns false if the file can't be read directly.
+    bool open(fitsfile* filePtr, char* buffer, hsize_t bufferSize);
+    void close();
+    
+    bool enabled() const {
+        return fd >= 0;
+    }
+    
+    // Read size consecutive pixels, starting at a pixel index in the data unit
+    void read(hsize_t offset, hsize_t size, float* destination);
+    // Read numRows rows of rowSize pixels, which start stride pixels apart
+    void readRows(hsize_t offset, hsize_t rowSize, hsize_t stride, hsize_t numRows, float* destination);
+
+private:
+    // Read an aligned superset of a byte range of the data unit into the buffer, and return where the range starts
+    const char* readSpan(hsize_t start, hsize_t size);
+    
+    int fd;
+    hsize_t dataStart;
+    char* buffer;
+    hsize_t bufferSize;
+};
+
+// Keeps a file which is written through the page cache from filling it. After each write, writeback of the new
+// dirty pages is started, after waiting for the writeback which was started the previous time, and the pages which
+// are clean are dropped from the cache. Only about one write's worth of the file is cached at any time, and the
+// writeback is spread evenly over the conversion instead of happening in bursts.
+class WriteBehind {
+public:
+    WriteBehind() : fd(-1) {}
+    ~WriteBehind();
+    
+    void open(const std::string& fileName);
+    // Call after each write
+    void release();
+    // Call after the file has been closed
+    void close();
+
+private:
+    int fd;
+};
+
+#endif
@@ -0,0 +1,876 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "DirectoryStore.h"
+#include "Util.h"
+#include "Throttle.h"
+#include "IoStats.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Types
+
+// The Zarr type, and our own name which distinguishes the two 16-bit float types
+static std::string zarrTypeName(DataType type) {
+    switch (type) {
+        case DataType::FLOAT:
+            return "<f4";
+        case DataType::DOUBLE:
+            return "<f8";
+        case DataType::INT64:
+            return "<i8";
+        case DataType::UINT32:
+            return "<u4";
+        case DataType::UINT8:
+            return "|u1";
+        case DataType::HALF:
+            return "<f2";
+        default:
+            // Zarr has no bfloat16 type
+            return "<u2";
+    }
+}
+
+static const std::vector<std::pair<DataType, std::string>> TYPE_NAMES = {
+    {DataType::FLOAT, "float"},
+    {DataType::DOUBLE, "double"},
+    {DataType::INT64, "int64"},
+    {DataType::UINT32, "uint32"},
+    {DataType::UINT8, "uint8"},
+    {DataType::HALF, "half"},
+    {DataType::BFLOAT16, "bfloat16"}
+};
+
+static std::string typeName(DataType type) {
+    for (auto& kv : TYPE_NAMES) {
+        if (kv.first == type) {
+            return kv.second;
+        }
+    }
+    return "";
+}
+
+static DataType parseTypeName(const std::string& name) {
+    for (auto& kv : TYPE_NAMES) {
+        if (kv.second == name) {
+            return kv.first;
+        }
+    }
+    throw "Unknown data type in directory store";
+}
+
+// Convert elements while copying them between memory and a chunk
+static void convert(const uint8_t* source, DataType sourceType, uint8_t* destination, DataType destinationType, hsize_t size) {
+    if (sourceType == destinationType) {
+        memcpy(destination, source, size * dataTypeSize(sourceType));
+    } else if (sourceType == DataType::DOUBLE && destinationType == DataType::FLOAT) {
+        const double* from = (const double*)source;
+        float* to = (float*)destination;
+        for (hsize_t i = 0; i < size; i++) {
+            to[i] = from[i];
+        }
+    } else {
+        throw "Unsupported type conversion in directory store";
+    }
+}
+
+// Files
+
+static bool readFile(const fs::path& path, std::vector<uint8_t>& contents) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    
+    contents.resize(file.tellg());
+    file.seekg(0);
+    throttleRead(contents.size());
+    IoCall call(IoSite::STORE_READ, contents.size());
+    if (!file.read((char*)contents.data(), contents.size())) {
+        throw "Could not read file in directory store";
+    }
+    return true;
+}
+
+static std::string readTextFile(const fs::path& path) {
+    std::vector<uint8_t> contents;
+    if (!readFile(path, contents)) {
+        throw "Could not read metadata file in directory store";
+    }
+    return std::string(contents.begin(), contents.end());
+}
+
+static void writeFile(const fs::path& path, const void* data, size_t size) {
+    throttleWrite(size);
+    IoCall call(IoSite::STORE_WRITE, size);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.write((const char*)data, size)) {
+        throw "Could not write file in directory store";
+    }
+}
+
+static void writeTextFile(const fs::path& path, const std::string& text) {
+    writeFile(path, text.data(), text.size());
+}
+
+// JSON
+
+static std::string jsonString(const std::string& value) {
+    std::ostringstream json;
+    json << '"';
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            json << '\\' << c;
+        } else if (c < 0x20) {
+            json << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+        } else {
+            json << c;
+        }
+    }
+    json << '"';
+    return json.str();
+}
+
+// Doubles always have a decimal point or an exponent, so that they are read back as doubles
+static std::string jsonDouble(double value) {
+    if (std::isnan(value)) {
+        return "NaN";
+    } else if (std::isinf(value)) {
+        return value > 0 ? "Infinity" : "-Infinity";
+    }
+    
+    std::ostringstream json;
+    json << std::setprecision(17) << value;
+    std::string result = json.str();
+    if (result.find_first_of(".e") == std::string::npos) {
+        result += ".0";
+    }
+    return result;
+}
+
+static std::string jsonArray(const std::vector<hsize_t>& values) {
+    std::ostringstream json;
+    json << '[';
+    for (size_t i = 0; i < values.size(); i++) {
+        json << (i ? ", " : "") << values[i];
+    }
+    json << ']';
+    return json.str();
+}
+
+// Just enough of a parser to read back the metadata which we have written
+struct JsonValue {
+    enum Kind {NUL, BOOL, INT, DOUBLE, STRING, ARRAY, OBJECT};
+    
+    JsonValue() : kind(NUL), boolean(false), integer(0), number(0) {}
+    
+    const JsonValue& operator[](const std::string& key) const {
+        static const JsonValue null;
+        for (auto& member : members) {
+            if (member.first == key) {
+                return member.second;
+            }
+        }
+        return null;
+    }
+    
+    std::vector<hsize_t> dims() const {
+        std::vector<hsize_t> result;
+        for (auto& item : items) {
+            result.push_back(item.integer);
+        }
+        return result;
+    }
+    
+    Kind kind;
+    bool boolean;
+    int64_t integer;
+    double number;
+    std::string string;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+};
+
+static void skipSpace(const std::string& text, size_t& pos) {
+    while (pos < text.size() && std::isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+}
+
+static bool consume(const std::string& text, size_t& pos, const std::string& token) {
+    if (text.compare(pos, token.size(), token) == 0) {
+        pos += token.size();
+        return true;
+    }
+    return false;
+}
+
+static std::string parseJsonString(const std::string& text, size_t& pos) {
+    std::string result;
+    pos++;
+    while (pos < text.size() && text[pos] != '"') {
+        char c = text[pos++];
+        if (c == '\\' && pos < text.size()) {
+            c = text[pos++];
+            if (c == 'u') {
+                result += (char)std::stoi(text.substr(pos, 4), nullptr, 16);
+                pos += 4;
+                continue;
+            }
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+            }
+        }
+        result += c;
+    }
+    if (pos >= text.size()) {
+        throw "Unterminated string in directory store metadata";
+    }
+    pos++;
+    return result;
+}
+
+static JsonValue parseJson(const std::string& text, size_t& pos) {
+    JsonValue value;
+    skipSpace(text, pos);
+    
+    if (pos >= text.size()) {
+        throw "Unexpected end of directory store metadata";
+    }
+    
+    if (text[pos] == '{') {
+        value.kind = JsonValue::OBJECT;
+        pos++;
+        skipSpace(text, pos);
+        while (!consume(text, pos, "}")) {
+            skipSpace(text, pos);
+            std::string key = parseJsonString(text, pos);
+            skipSpace(text, pos);
+            if (!consume(text, pos, ":")) {
+                throw "Invalid object in directory store metadata";
+            }
+            value.members.push_back({key, parseJson(text, pos)});
+            skipSpace(text, pos);
+            consume(text, pos, ",");
+            skipSpace(text, pos);
+        }
+    } else if (text[pos] == '[') {
+        value.kind = JsonValue::ARRAY;
+        pos++;
+        skipSpace(text, pos);
+        while (!consume(text, pos, "]")) {
+            value.items.push_back(parseJson(text, pos));
+            skipSpace(text, pos);
+            consume(text, pos, ",");
+            skipSpace(text, pos);
+        }
+    } else if (text[pos] == '"') {
+        value.kind = JsonValue::STRING;
+        value.string = parseJsonString(text, pos);
+    } else if (consume(text, pos, "null")) {
+        value.kind = JsonValue::NUL;
+    } else if (consume(text, pos, "true")) {
+        value.kind = JsonValue::BOOL;
+        value.boolean = true;
+    } else if (consume(text, pos, "false")) {
+        value.kind = JsonValue::BOOL;
+        value.boolean = false;
+    } else if (consume(text, pos, "NaN")) {
+        value.kind = JsonValue::DOUBLE;
+        value.number = std::numeric_limits<double>::quiet_NaN();
+    } else if (consume(text, pos, "Infinity")) {
+        value.kind = JsonValue::DOUBLE;
+        value.number = std::numeric_limits<double>::infinity();
+    } else if (consume(text, pos, "-Infinity")) {
+        value.kind = JsonValue::DOUBLE;
+        value.number = -std::numeric_limits<double>::infinity();
+    } else {
+        size_t end = text.find_first_of(",]} \t\r\n", pos);
+        std::string number = text.substr(pos, end - pos);
+        pos = end;
+        if (number.find_first_of(".eE") == std::string::npos) {
+            value.kind = JsonValue::INT;
+            value.integer = std::strtoll(number.c_str(), nullptr, 10);
+        } else {
+            // Unlike stod, this accepts subnormal numbers
+            value.kind = JsonValue::DOUBLE;
+            value.number = std::strtod(number.c_str(), nullptr);
+        }
+    }
+    
+    return value;
+}
+
+static JsonValue parseJson(const std::string& text) {
+    size_t pos = 0;
+    return parseJson(text, pos);
+}
+
+// Chunk encoding, which matches HDF5's shuffle and deflate filters
+
+void encodeChunk(const uint8_t* chunk, hsize_t size, hsize_t elementSize, int compression, std::vector<uint8_t>& encoded) {
+    if (!compression) {
+        encoded.assign(chunk, chunk + size);
+        return;
+    }
+    
+    // Group the bytes of all the elements into planes, which compress better
+    hsize_t numVals = size / elementSize;
+    std::vector<uint8_t> shuffled(size);
+    for (hsize_t i = 0; i < numVals; i++) {
+        for (hsize_t b = 0; b < elementSize; b++) {
+            shuffled[b * numVals + i] = chunk[i * elementSize + b];
+        }
+    }
+    
+    uLongf compressedSize = compressBound(shuffled.size());
+    encoded.resize(compressedSize);
+    
+    if (compress2(encoded.data(), &compressedSize, shuffled.data(), shuffled.size(), compression) != Z_OK) {
+        throw "Could not compress chunk";
+    }
+    
+    encoded.resize(compressedSize);
+}
+
+static void decodeChunk(const std::vector<uint8_t>& encoded, hsize_t elementSize, int compression, std::vector<uint8_t>& chunk) {
+    if (!compression) {
+        if (encoded.size() != chunk.size()) {
+            throw "Chunk in directory store has the wrong size";
+        }
+        chunk = encoded;
+        return;
+    }
+    
+    std::vector<uint8_t> shuffled(chunk.size());
+    uLongf size = shuffled.size();
+    
+    if (uncompress(shuffled.data(), &size, encoded.data(), encoded.size()) != Z_OK || size != shuffled.size()) {
+        throw "Could not decompress chunk";
+    }
+    
+    hsize_t numVals = chunk.size() / elementSize;
+    for (hsize_t i = 0; i < numVals; i++) {
+        for (hsize_t b = 0; b < elementSize; b++) {
+            chunk[i * elementSize + b] = shuffled[b * numVals + i];
+        }
+    }
+}
+
+// Advance a position in the box [first, end) over the first n axes, with the last of them changing fastest.
+// Returns false once every position has been visited.
+static bool nextPosition(std::vector<hsize_t>& position, const std::vector<hsize_t>& first, const std::vector<hsize_t>& end, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        if (++position[i] < end[i]) {
+            return true;
+        }
+        position[i] = first[i];
+    }
+    return false;
+}
+
+// DirectoryDataset
+
+DirectoryDataset::DirectoryDataset(const std::string& directory, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression, ChunkLayout layout) : OutputDataset(type, dims), directory(directory), chunkDims(chunkDims), compression(compression), layout(layout) {
+    // An extendible dataset only grows along its first axis, which doesn't affect the linear index of a chunk
+    for (size_t i = 0; i < dims.size(); i++) {
+        chunkGrid.push_back(chunkDims[i] ? (dims[i] + chunkDims[i] - 1) / chunkDims[i] : 0);
+    }
+}
+
+void DirectoryDataset::writeMetadata() {
+    hsize_t elementSize = dataTypeSize(type);
+    
+    std::ostringstream json;
+    json << "{" << std::endl;
+    json << "    \"zarr_format\": 2," << std::endl;
+    json << "    \"shape\": " << jsonArray(dims) << "," << std::endl;
+    json << "    \"chunks\": " << jsonArray(chunkDims) << "," << std::endl;
+    json << "    \"dtype\": " << jsonString(zarrTypeName(type)) << "," << std::endl;
+    
+    if (compression) {
+        json << "    \"compressor\": {\"id\": \"zlib\", \"level\": " << compression << "}," << std::endl;
+        json << "    \"filters\": [{\"id\": \"shuffle\", \"elementsize\": " << elementSize << "}]," << std::endl;
+    } else {
+        json << "    \"compressor\": null," << std::endl;
+        json << "    \"filters\": null," << std::endl;
+    }
+    
+    json << "    \"fill_value\": 0," << std::endl;
+    json << "    \"order\": \"C\"," << std::endl;
+    json << "    \"dimension_separator\": \".\"," << std::endl;
+    // Not part of Zarr, but needed to recreate the HDF5 dataset
+    json << "    \"hdf5_type\": " << jsonString(typeName(type)) << "," << std::endl;
+    json << "    \"hdf5_layout\": " << jsonString(layout == ChunkLayout::CHUNKED ? "chunked" : layout == ChunkLayout::CONTIGUOUS ? "contiguous" : "extendible") << std::endl;
+    json << "}" << std::endl;
+    
+    writeTextFile(fs::path(directory) / ".zarray", json.str());
+}
+
+std::string DirectoryDataset::chunkFileName(const std::vector<hsize_t>& chunkIndex) const {
+    std::ostringstream name;
+    name << directory << "/";
+    
+    if (chunkIndex.empty()) {
+        name << 0;
+    }
+    
+    for (size_t i = 0; i < chunkIndex.size(); i++) {
+        name << (i ? "." : "") << chunkIndex[i];
+    }
+    
+    return name.str();
+}
+
+bool DirectoryDataset::readChunk(const std::vector<hsize_t>& chunkIndex, std::vector<uint8_t>& chunk) const {
+    std::vector<uint8_t> encoded;
+    if (!readFile(chunkFileName(chunkIndex), encoded)) {
+        return false;
+    }
+    
+    decodeChunk(encoded, dataTypeSize(type), compression, chunk);
+    return true;
+}
+
+void DirectoryDataset::writeChunk(const std::vector<hsize_t>& chunkIndex, const std::vector<uint8_t>& chunk) const {
+    std::vector<uint8_t> encoded;
+    ::encodeChunk(chunk.data(), chunk.size(), dataTypeSize(type), compression, encoded);
+    writeFile(chunkFileName(chunkIndex), encoded.data(), encoded.size());
+}
+
+void DirectoryDataset::transfer(void* data, DataType memType, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing) {
+    std::vector<hsize_t> datasetDims;
+    {
+        std::lock_guard<std::mutex> lock(extentMutex);
+        datasetDims = dims;
+    }
+    
+    int N = datasetDims.size();
+    
+    std::vector<hsize_t> regionCount = count;
+    std::vector<hsize_t> regionStart = start;
+    if (count.empty() || start.empty()) {
+        regionCount = datasetDims;
+        regionStart.assign(N, 0);
+    }
+    
+    hsize_t elementSize = dataTypeSize(type);
+    hsize_t memElementSize = dataTypeSize(memType);
+    
+    if (layout == ChunkLayout::CONTIGUOUS) {
+        transferContiguous(data, memType, regionCount, regionStart, writing);
+        return;
+    }
+    
+    // The range of chunks which the region overlaps
+    std::vector<hsize_t> firstChunk(N);
+    std::vector<hsize_t> endChunk(N);
+    for (int i = 0; i < N; i++) {
+        if (!regionCount[i]) {
+            return;
+        }
+        firstChunk[i] = regionStart[i] / chunkDims[i];
+        endChunk[i] = (regionStart[i] + regionCount[i] - 1) / chunkDims[i] + 1;
+    }
+    
+    std::vector<uint8_t> chunk(product(chunkDims) * elementSize);
+    std::vector<hsize_t> chunkIndex = firstChunk;
+    
+    do {
+        // The part of the region which is in this chunk, and whether it covers all of the chunk within the dataset
+        std::vector<hsize_t> first(N);
+        std::vector<hsize_t> end(N);
+        bool wholeChunk(true);
+        hsize_t linearIndex(0);
+        
+        for (int i = 0; i < N; i++) {
+            hsize_t chunkStart = chunkIndex[i] * chunkDims[i];
+            first[i] = std::max(chunkStart, regionStart[i]);
+            end[i] = std::min(chunkStart + chunkDims[i], regionStart[i] + regionCount[i]);
+            wholeChunk = wholeChunk && first[i] == chunkStart && end[i] >= std::min(chunkStart + chunkDims[i], datasetDims[i]);
+            linearIndex = linearIndex * chunkGrid[i] + chunkIndex[i];
+        }
+        
+        std::lock_guard<std::mutex> lock(chunkLocks[linearIndex % chunkLocks.size()]);
+        
+        // The padding of edge chunks is zero, like the fill value of the HDF5 dataset
+        if ((writing && wholeChunk) || !readChunk(chunkIndex, chunk)) {
+            std::fill(chunk.begin(), chunk.end(), 0);
+        }
+        
+        // Copy one row along the last axis at a time
+        hsize_t rowLength = N ? end[N - 1] - first[N - 1] : 1;
+        std::vector<hsize_t> position = first;
+        
+        do {
+            hsize_t memOffset(0);
+            hsize_t chunkOffset(0);
+            for (int i = 0; i < N; i++) {
+                memOffset = memOffset * regionCount[i] + position[i] - regionStart[i];
+                chunkOffset = chunkOffset * chunkDims[i] + position[i] - chunkIndex[i] * chunkDims[i];
+            }
+            
+            uint8_t* memPointer = (uint8_t*)data + memOffset * memElementSize;
+            uint8_t* chunkPointer = chunk.data() + chunkOffset * elementSize;
+            
+            if (writing) {
+                convert(memPointer, memType, chunkPointer, type, rowLength);
+            } else {
+                convert(chunkPointer, type, memPointer, memType, rowLength);
+            }
+        } while (nextPosition(position, first, end, N - 1));
+        
+        if (writing) {
+            writeChunk(chunkIndex, chunk);
+        }
+    } while (nextPosition(chunkIndex, firstChunk, endChunk, N));
+}
+
+void DirectoryDataset::transferContiguous(void* data, DataType memType, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing) {
+    int N = dims.size();
+    hsize_t elementSize = dataTypeSize(type);
+    hsize_t memElementSize = dataTypeSize(memType);
+    
+    // The rows of a contiguous dataset are small and mostly adjacent, so they are throttled as one operation
+    hsize_t size = product(count) * elementSize;
+    if (writing) {
+        throttleWrite(size);
+    } else {
+        throttleRead(size);
+    }
+    
+    IoCall call(writing ? IoSite::STORE_WRITE : IoSite::STORE_READ, size);
+    int file = open(chunkFileName(std::vector<hsize_t>(N, 0)).c_str(), writing ? O_WRONLY : O_RDONLY);
+    if (file < 0) {
+        throw "Could not open file in directory store";
+    }
+    
+    // Copy one row along the last axis at a time
+    hsize_t rowLength = N ? count[N - 1] : 1;
+    std::vector<uint8_t> row(rowLength * elementSize);
+    std::vector<hsize_t> end(N);
+    for (int i = 0; i < N; i++) {
+        end[i] = start[i] + count[i];
+    }
+    std::vector<hsize_t> position = start;
+    uint8_t* memPointer = (uint8_t*)data;
+    bool success(true);
+    
+    do {
+        hsize_t fileOffset(0);
+        for (int i = 0; i < N; i++) {
+            fileOffset = fileOffset * dims[i] + position[i];
+        }
+        fileOffset *= elementSize;
+        
+        if (writing) {
+            convert(memPointer, memType, row.data(), type, rowLength);
+            success = pwrite(file, row.data(), row.size(), fileOffset) == (ssize_t)row.size();
+        } else {
+            success = pread(file, row.data(), row.size(), fileOffset) == (ssize_t)row.size();
+            convert(row.data(), type, memPointer, memType, rowLength);
+        }
+        
+        memPointer += rowLength * memElementSize;
+    } while (success && nextPosition(position, start, end, N - 1));
+    
+    ::close(file);
+    
+    if (!success) {
+        throw "Could not access file in directory store";
+    }
+}
+
+void DirectoryDataset::write(const void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    UNUSED(memDims);
+    transfer((void*)data, memType, count, start, true);
+}
+
+void DirectoryDataset::read(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    UNUSED(memDims);
+    transfer(data, memType, count, start, false);
+}
+
+void DirectoryDataset::append(const uint8_t* data, hsize_t size, hsize_t offset) {
+    if (!size) {
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(extentMutex);
+        dims[0] = std::max(dims[0], offset + size);
+    }
+    
+    transfer((void*)data, DataType::UINT8, {size}, {offset}, true);
+}
+
+// DirectoryStore
+
+// Marks a store as one which the converter created, so that it can be replaced by the next conversion
+static const std::string STORE_MARKER = ".fits2idia_store";
+
+DirectoryStore::DirectoryStore(const std::string& directory) : directory(directory), closed(false) {
+    // Only a store which was left behind by an earlier conversion is replaced; anything else is the user's
+    if (fs::exists(directory) || fs::is_symlink(directory)) {
+        if (!fs::is_directory(fs::symlink_status(directory)) || !fs::exists(fs::path(directory) / STORE_MARKER)) {
+            throw "The path of the directory store already exists, and is not a store which was written by the converter";
+        }
+        fs::remove_all(directory);
+    }
+    
+    fs::create_directories(directory);
+    writeTextFile(fs::path(directory) / STORE_MARKER, "");
+    writeTextFile(fs::path(directory) / ".zgroup", "{\"zarr_format\": 2}\n");
+}
+
+void DirectoryStore::createGroups(const std::string& path) {
+    fs::path groupPath(directory);
+    
+    for (auto& name : split(path, '/')) {
+        groupPath /= name;
+        if (!fs::exists(groupPath)) {
+            fs::create_directory(groupPath);
+            writeTextFile(groupPath / ".zgroup", "{\"zarr_format\": 2}\n");
+        }
+    }
+}
+
+std::shared_ptr<OutputDataset> DirectoryStore::createDataset(const std::string& path, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) {
+    createGroups(fs::path(path).parent_path().generic_string());
+    fs::create_directory(fs::path(directory) / path);
+    
+    // Filters can only be applied to chunked datasets
+    auto layout = chunkDims.empty() ? ChunkLayout::CONTIGUOUS : ChunkLayout::CHUNKED;
+    auto dataset = std::make_shared<DirectoryDataset>((fs::path(directory) / path).string(), type, dims, chunkDims.empty() ? dims : chunkDims, chunkDims.empty() ? 0 : compression, layout);
+    dataset->writeMetadata();
+    
+    // Contiguous datasets are written in place, so their single chunk has to exist
+    if (layout == ChunkLayout::CONTIGUOUS) {
+        std::string fileName = dataset->chunkFileName(std::vector<hsize_t>(dims.size(), 0));
+        std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+        file.close();
+        fs::resize_file(fileName, product(dims) * dataTypeSize(type));
+    }
+    
+    return dataset;
+}
+
+std::shared_ptr<OutputDataset> DirectoryStore::createExtendibleDataset(const std::string& path, DataType type, hsize_t chunkSize) {
+    createGroups(fs::path(path).parent_path().generic_string());
+    fs::create_directory(fs::path(directory) / path);
+    
+    auto dataset = std::make_shared<DirectoryDataset>((fs::path(directory) / path).string(), type, std::vector<hsize_t>{0}, std::vector<hsize_t>{chunkSize}, 0, ChunkLayout::EXTENDIBLE);
+    dataset->writeMetadata();
+    extendibleDatasets.push_back(dataset);
+    return dataset;
+}
+
+void DirectoryStore::createGroup(const std::string& path) {
+    createGroups(path);
+}
+
+void DirectoryStore::link(const std::string& target, const std::string& path) {
+    fs::path linkPath = fs::path(directory) / path;
+    fs::create_directory_symlink(fs::path(target).lexically_relative(fs::path(path).parent_path()), linkPath);
+}
+
+void DirectoryStore::addAttribute(const std::string& path, const std::string& name, const std::string& json) {
+    for (auto& group : attributes) {
+        if (group.first == path) {
+            group.second.push_back({name, json});
+            return;
+        }
+    }
+    attributes.push_back({path, {{name, json}}});
+}
+
+bool DirectoryStore::attributeExists(const std::string& path, const std::string& name) {
+    for (auto& group : attributes) {
+        if (group.first == path) {
+            for (auto& attribute : group.second) {
+                if (attribute.first == name) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void DirectoryStore::writeAttribute(const std::string& path, const std::string& name, const std::string& value) {
+    addAttribute(path, name, jsonString(value));
+}
+
+void DirectoryStore::writeAttribute(const std::string& path, const std::string& name, int64_t value) {
+    addAttribute(path, name, std::to_string(value));
+}
+
+void DirectoryStore::writeAttribute(const std::string& path, const std::string& name, double value) {
+    addAttribute(path, name, jsonDouble(value));
+}
+
+void DirectoryStore::writeAttribute(const std::string& path, const std::string& name, bool value) {
+    addAttribute(path, name, value ? "true" : "false");
+}
+
+void DirectoryStore::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    
+    for (auto& group : attributes) {
+        std::ostringstream json;
+        json << "{" << std::endl;
+        for (size_t i = 0; i < group.second.size(); i++) {
+            json << "    " << jsonString(group.second[i].first) << ": " << group.second[i].second << (i + 1 < group.second.size() ? "," : "") << std::endl;
+        }
+        json << "}" << std::endl;
+        writeTextFile(fs::path(directory) / group.first / ".zattrs", json.str());
+    }
+    
+    for (auto& dataset : extendibleDatasets) {
+        dataset->writeMetadata();
+    }
+}
+
+// Packing
+
+static void packDataset(const fs::path& arrayPath, const std::string& path, Hdf5Output& output) {
+    JsonValue metadata = parseJson(readTextFile(arrayPath / ".zarray"));
+    
+    DataType type = parseTypeName(metadata["hdf5_type"].string);
+    std::string layout = metadata["hdf5_layout"].string;
+    std::vector<hsize_t> dims = metadata["shape"].dims();
+    std::vector<hsize_t> chunkDims = metadata["chunks"].dims();
+    int compression = metadata["compressor"].kind == JsonValue::OBJECT ? metadata["compressor"]["level"].integer : 0;
+    
+    // The chunk files, with their chunk indices
+    std::vector<std::pair<std::vector<hsize_t>, fs::path>> chunks;
+    for (auto& entry : fs::directory_iterator(arrayPath)) {
+        std::string name = entry.path().filename().string();
+        if (name[0] == '.') {
+            continue;
+        }
+        
+        std::vector<hsize_t> chunkIndex;
+        for (auto& index : split(name, '.')) {
+            chunkIndex.push_back(std::stoull(index));
+        }
+        chunks.push_back({chunkIndex, entry.path()});
+    }
+    std::sort(chunks.begin(), chunks.end());
+    
+    std::vector<uint8_t> contents;
+    
+    if (layout == "extendible") {
+        auto dataset = output.createExtendibleDataset(path, type, chunkDims[0]);
+        for (auto& chunk : chunks) {
+            hsize_t offset = chunk.first[0] * chunkDims[0];
+            readFile(chunk.second, contents);
+            dataset->append(contents.data(), std::min(chunkDims[0], dims[0] - offset), offset);
+        }
+    } else if (layout == "contiguous") {
+        auto dataset = output.createDataset(path, type, dims, EMPTY_DIMS, 0);
+        if (!chunks.empty()) {
+            readFile(chunks[0].second, contents);
+            dataset->write(contents.data(), type, dims, EMPTY_DIMS, EMPTY_DIMS);
+        }
+    } else {
+        auto dataset = std::static_pointer_cast<Hdf5Dataset>(output.createDataset(path, type, dims, chunkDims, compression));
+        for (auto& chunk : chunks) {
+            std::vector<hsize_t> offset(dims.size());
+            for (size_t i = 0; i < dims.size(); i++) {
+                offset[i] = chunk.first[i] * chunkDims[i];
+            }
+            readFile(chunk.second, contents);
+            dataset->writeChunk(offset, contents);
+        }
+    }
+}
+
+static void packAttributes(const fs::path& groupPath, const std::string& path, Hdf5Output& output) {
+    if (!fs::exists(groupPath / ".zattrs")) {
+        return;
+    }
+    
+    JsonValue attributes = parseJson(readTextFile(groupPath / ".zattrs"));
+    
+    for (auto& attribute : attributes.members) {
+        auto& value = attribute.second;
+        switch (value.kind) {
+            case JsonValue::STRING:
+                output.writeAttribute(path, attribute.first, value.string);
+                break;
+            case JsonValue::INT:
+                output.writeAttribute(path, attribute.first, value.integer);
+                break;
+            case JsonValue::DOUBLE:
+                output.writeAttribute(path, attribute.first, value.number);
+                break;
+            case JsonValue::BOOL:
+                output.writeAttribute(path, attribute.first, value.boolean);
+                break;
+            default:
+                throw "Unsupported attribute type in directory store";
+        }
+    }
+}
+
+void packDirectoryStore(const std::string& directory, const std::string& fileName, bool bypassPageCache) {
+    Hdf5Output output(fileName);
+    
+    if (bypassPageCache) {
+        output.bypassPageCache();
+    }
+    
+    // Parents come before their children in sorted order, and links are made once everything else exists
+    std::vector<std::string> nodes = {""};
+    std::vector<std::pair<std::string, std::string>> links;
+    
+    for (auto& entry : fs::recursive_directory_iterator(directory)) {
+        // fs::relative would resolve the links themselves
+        std::string path = entry.path().lexically_relative(directory).generic_string();
+        
+        if (entry.is_symlink()) {
+            fs::path target = entry.path().parent_path() / fs::read_symlink(entry.path());
+            links.push_back({target.lexically_normal().lexically_relative(fs::path(directory).lexically_normal()).generic_string(), path});
+        } else if (entry.is_directory()) {
+            nodes.push_back(path);
+        }
+    }
+    
+    std::sort(nodes.begin(), nodes.end());
+    
+    for (auto& path : nodes) {
+        fs::path nodePath = fs::path(directory) / path;
+        
+        if (fs::exists(nodePath / ".zarray")) {
+            packDataset(nodePath, path, output);
+        } else if (fs::exists(nodePath / ".zgroup")) {
+            if (!path.empty()) {
+                output.createGroup(path);
+            }
+            packAttributes(nodePath, path, output);
+        }
+    }
+    
+    for (auto& link : links) {
+        output.link(link.first, link.second);
+    }
+    
+    output.close();
+}
@@ -0,0 +1,104 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __DIRECTORYSTORE_H
+#define __DIRECTORYSTORE_H
+
+#include "common.h"
+#include "Output.h"
+#include <array>
+#include <mutex>
+
+enum class ChunkLayout {
+    CHUNKED,
+    // A dataset which isn't chunked in the HDF5 file is stored as a single uncompressed chunk
+    CONTIGUOUS,
+    EXTENDIBLE
+};
+
+class DirectoryDataset : public OutputDataset {
+public:
+    DirectoryDataset(const std::string& directory, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression, ChunkLayout layout);
+    
+    using OutputDataset::write;
+    using OutputDataset::read;
+    
+    void write(const void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) override;
+    void read(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) override;
+    void append(const uint8_t* data, hsize_t size, hsize_t offset) override;
+    
+    void writeMetadata();
+    std::string chunkFileName(const std::vector<hsize_t>& chunkIndex) const;
+    
+    std::string directory;
+    std::vector<hsize_t> chunkDims;
+    int compression;
+    ChunkLayout layout;
+
+private:
+    // Copy between a block of memory and the chunks which it overlaps
+    void transfer(void* data, DataType memType, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing);
+    // Contiguous datasets are a single uncompressed chunk, so each row is accessed in place, without locking
+    void transferContiguous(void* data, DataType memType, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing);
+    
+    bool readChunk(const std::vector<hsize_t>& chunkIndex, std::vector<uint8_t>& chunk) const;
+    void writeChunk(const std::vector<hsize_t>& chunkIndex, const std::vector<uint8_t>& chunk) const;
+    
+    // The number of chunks along each axis, which gives each chunk of the dataset its own lock stripe
+    std::vector<hsize_t> chunkGrid;
+    std::array<std::mutex, 64> chunkLocks;
+    std::mutex extentMutex;
+};
+
+// Writes the IDIA layout as a directory of independent chunk files, in the Zarr v2 format: each group is a
+// directory with a .zgroup file and its attributes in .zattrs, each dataset is a directory with its metadata in
+// .zarray, and each chunk is a separate file. A chunk is encoded with the same shuffle and deflate filters as the
+// HDF5 dataset, so the chunks can later be copied into an HDF5 file as they are.
+// Every write only touches the chunks it covers, so threads can write different chunks (and different datasets)
+// at the same time. Writes which cover part of a chunk read, modify and rewrite it under the lock which its
+// position in the dataset selects from a fixed set, so that every write to the chunk takes the same lock.
+class DirectoryStore : public OutputBackend {
+public:
+    DirectoryStore(const std::string& directory);
+    
+    bool concurrentWrites() const override {
+        return true;
+    }
+    
+    std::shared_ptr<OutputDataset> createDataset(const std::string& path, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) override;
+    std::shared_ptr<OutputDataset> createExtendibleDataset(const std::string& path, DataType type, hsize_t chunkSize) override;
+    void createGroup(const std::string& path) override;
+    // Links are stored as symbolic links to the target directory
+    void link(const std::string& target, const std::string& path) override;
+    
+    bool attributeExists(const std::string& path, const std::string& name) override;
+    void writeAttribute(const std::string& path, const std::string& name, const std::string& value) override;
+    void writeAttribute(const std::string& path, const std::string& name, int64_t value) override;
+    void writeAttribute(const std::string& path, const std::string& name, double value) override;
+    void writeAttribute(const std::string& path, const std::string& name, bool value) override;
+    
+    void close() override;
+
+private:
+    void createGroups(const std::string& path);
+    void addAttribute(const std::string& path, const std::string& name, const std::string& json);
+    
+    std::string directory;
+    bool closed;
+    
+    // Attributes of each group, encoded as JSON, in the order in which they were written
+    std::vector<std::pair<std::string, std::vector<std::pair<std::string, std::string>>>> attributes;
+    // Extendible datasets only know their final size when the store is closed
+    std::vector<std::shared_ptr<DirectoryDataset>> extendibleDatasets;
+};
+
+// Encode a chunk with the equivalent of HDF5's shuffle and deflate filters (no filters if compression is 0)
+void encodeChunk(const uint8_t* chunk, hsize_t size, hsize_t elementSize, int compression, std::vector<uint8_t>& encoded);
+
+// Copy a directory store into an HDF5 file. The encoded chunks are written to the file directly, without being
+// decoded and filtered again. The written pages can be kept out of the page cache.
+void packDirectoryStore(const std::string& directory, const std::string& fileName, bool bypassPageCache = false);
+
+#endif
@@ -5,319 +5,815 @@
 
 #include "Converter.h"
 
-// TODO do we need these?
-FastConverter::FastConverter(std::string inputFileName, std::string outputFileName, bool progress) : Converter(inputFileName, outputFileName, progress) {}
+// The target size of each slab of rows which is decompressed from all the channels of a compressed cube
+#define COMPRESSED_SLAB_SIZE (hsize_t)(64 << 20)
+// The number of channels which are compressed to estimate the size of a compressed cube
+#define COMPRESSION_SAMPLE_CHANNELS (hsize_t)3
 
-MemoryUsage FastConverter::calculateMemoryUsage() {
-    MemoryUsage m;
+// Z statistics are calculated and written in blocks of rows, so that they can be scheduled as independent tasks.
+// Each block is about the size of a tile, and the blocks share a bounded number of buffer slots, so that the size of
+// the Z statistics buffers doesn't depend on the image size.
+static hsize_t zStatsSlots(hsize_t height, hsize_t rowsPerBlock) {
+    hsize_t numBlocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+    return std::min(numBlocks, (hsize_t)TaskGraph::numThreads());
+}
+
+// Mipmaps are calculated and written in blocks of channels which match the chunk depth. The blocks share a bounded
+// number of buffer slots, so that the size of the mipmap buffers doesn't depend on the image depth, and there are
+// at least two slots, so that a block can be written while the next one is calculated.
+static hsize_t mipMapSlots(hsize_t depth, hsize_t channelsPerBlock) {
+    hsize_t numBlocks = (depth + channelsPerBlock - 1) / channelsPerBlock;
+    return std::min(numBlocks, (hsize_t)std::max(2, TaskGraph::numThreads()));
+}
+
+FastConverter::FastConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options) : Converter(inputFileName, outputFileName, options), compressedCubeEstimate(0) {
+    zRowsPerBlock = std::max((hsize_t)1, TILE_SIZE * TILE_SIZE / width);
     
-    m.sizes["Main dataset"] = depth * height * width * sizeof(float);
-    m.sizes["Mipmaps"] = MipMaps::size(standardDims, {depth, height, width});
-    m.sizes["XY stats"] = Stats::size({depth}, numBins);
+    // With a compressed cube, each block of rows is decompressed from all the channels into a slab, which is used
+    // for the Z stats and written to the rotated dataset. The blocks are made small enough that the slabs stay
+    // small, and the chunks of the rotated dataset are made to match them, so that every chunk is written whole.
+    if (compressesCube()) {
+        zRowsPerBlock = std::min(zRowsPerBlock, std::max((hsize_t)1, COMPRESSED_SLAB_SIZE / (depth * width * sizeof(float))));
+        
+        if (!swizzledChunkDims.empty()) {
+            zRowsPerBlock = std::min(zRowsPerBlock, swizzledChunkDims[N - 2]);
+            swizzledChunkDims[N - 2] = zRowsPerBlock;
+        }
+        
+        compressedCube = CompressedCube(depth, height, width, zRowsPerBlock);
+    }
+}
+
+void FastConverter::planArena(Arena& arena) {
+    // All the buffers are used throughout the task graph of each Stokes, so they can't share memory, but the arena
+    // is allocated once and stays resident for all the Stokes
+    hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
+    hsize_t cubeSize = depth * height * width * sizeof(float);
     
-    if (depth > 1) {
-        m.sizes["Rotation"] = m.sizes["Main dataset"];
-        m.sizes["XYZ stats"] = Stats::size({}, numBins, depth);
-        m.sizes["Z stats"] = Stats::size({height, width});
+    if (compressesCube()) {
+        // The raw channels are only kept until they have been compressed, written and used for the per-channel
+        // products, in slots which match the mipmap slots
+        arena.add("Channels", mipMapSlots(depth, channelsPerWrite) * channelsPerWrite * height * width * sizeof(float));
+        
+        if (writeZStats || writeSwizzled) {
+            arena.add("Slabs", zStatsSlots(height, zRowsPerBlock) * zRowsPerBlock * width * depth * sizeof(float));
+        }
+    } else {
+        arena.add("Main dataset", cubeSize);
+    
+        if (writeSwizzled) {
+            arena.add("Rotation", cubeSize);
+        }
     }
     
-    for (auto& kv : m.sizes) {
-        m.total += kv.second;
+    if (writesWholeChunks()) {
+        arena.add("Chunks", channelsPerWrite * height * width * sizeof(float));
+    } else if (quantizer.enabled()) {
+        arena.add("Quantization", channelsPerWrite * height * width * sizeof(float));
     }
     
-    if (depth > 1) {
-        m.total -= std::min(m.sizes["Mipmaps"], m.sizes["Rotation"]);
-        m.note = " (Rotated dataset and mipmaps are not allocated at the same time.)";
+    if (writeMipMaps) {
+        hsize_t bufferDepth = mipMapSlots(depth, channelsPerWrite) * channelsPerWrite;
+        arena.add("Mipmaps", MipMaps::bufferSize(standardDims, {bufferDepth, height, width}));
+    }
+    
+    if (writeZStats) {
+        arena.add("Z stats", Stats::size({zStatsSlots(height, zRowsPerBlock) * zRowsPerBlock, width}));
+    }
+    
+    if (options.directIO) {
+        arena.add("Direct I/O", DIRECT_IO_BUFFER_SIZE);
+    }
+    
+    arena.plan();
+}
+
+MemoryUsage FastConverter::calculateMemoryUsage() {
+    Arena arena;
+    planArena(arena);
+    
+    hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
+    MemoryUsage m = arenaMemoryUsage(arena, mipMapSlots(depth, channelsPerWrite) * channelsPerWrite);
+    
+    // The compressed cube grows as the channels are read, outside the arena
+    if (compressesCube()) {
+        m.sizes["Compressed cube"] = estimateCompressedCubeSize();
+        m.total += m.sizes["Compressed cube"];
+        
+        std::ostringstream detail;
+        if (inputStream) {
+            detail << "The compressed cube of a streamed input is assumed to be as large as the raw cube, because the stream can't be sampled.";
+        } else {
+            detail << "The size of the compressed cube is estimated from " << std::min(depth, COMPRESSION_SAMPLE_CHANNELS) << " sample channels, and depends on the data (raw size: " << depth * height * width * sizeof(float) * 1e-9 << " GB).";
+        }
+        m.details.push_back(detail.str());
     }
     
     return m;
 }
 
+hsize_t FastConverter::estimateCompressedCubeSize() {
+    // A stream can't be sampled before it is converted, so the worst case is assumed. A converter which shares its input
+    // with others has to be sampled before the broadcast starts.
+    if (inputStream) {
+        return depth * height * width * sizeof(float);
+    }
+    
+    if (!compressedCubeEstimate) {
+        // Evenly spaced channels of the first Stokes, including the first and the last, which are often blanked
+        hsize_t numSamples = std::min(depth, COMPRESSION_SAMPLE_CHANNELS);
+        std::vector<float> channel(height * width);
+        hsize_t sampleSize(0);
+        
+        for (hsize_t s = 0; s < numSamples; s++) {
+            hsize_t c = numSamples > 1 ? s * (depth - 1) / (numSamples - 1) : 0;
+            readChannel(c, 0, channel.data());
+            sampleSize += CompressedCube::compressedSize(channel.data(), height, width, zRowsPerBlock);
+        }
+        
+        compressedCubeEstimate = std::max((hsize_t)1, sampleSize * depth / numSamples);
+    }
+    
+    return compressedCubeEstimate;
+}
+
 void FastConverter::copyAndCalculate() {
-    const hsize_t pixelProgressStride = std::max((hsize_t)1, (hsize_t)(width * height / 100));
     const hsize_t channelProgressStride = std::max((hsize_t)1, (hsize_t)(depth / 100));
     
+    const hsize_t zSlots = zStatsSlots(height, zRowsPerBlock);
+    
     TIMER(timer.start("Allocate"););
     
-    // Process one stokes at a time
-    hsize_t cubeSize = depth * height * width;
-    standardCube = new float[cubeSize];
+    // Process one stokes at a time, reusing the same buffers
+    hsize_t channelSize = height * width;
+    allocateArena();
+    standardCube = arena.get<float>("Main dataset");
+    rotatedCube = arena.get<float>("Rotation");
+    
+    // With a compressed cube, the raw channels of the latest batches share the mipmap slots, and each block of rows
+    // is decompressed into a slab, which is already rotated
+    const bool compressed = compressesCube();
+    float* channelSlots = arena.get<float>("Channels");
+    float* slabs = arena.get<float>("Slabs");
     
     statsXY.createBuffers({depth});
     
-    if (depth > 1) {
+    if (writeStats && depth > 1) {
         statsXYZ.createBuffers({}, depth);
-        statsZ.createBuffers({height, width});
     }
     
-    mipMaps.createBuffers({depth, height, width});
+    if (writeZStats) {
+        statsZ.createBuffers(arena.get<char>("Z stats"), {zSlots * zRowsPerBlock, width});
+    }
+    
+    // The main dataset and the mipmaps are written in batches of channels which match the chunk depth
+    const hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
+    const hsize_t mipMapBufferSlots = mipMapSlots(depth, channelsPerWrite);
+    
+    mipMaps.createBuffers({mipMapBufferSlots * channelsPerWrite, height, width}, arena.get<char>("Mipmaps"));
+    
+    // Rounded copy of each batch of channels of the main dataset
+    float* quantizedChannels = arena.get<float>("Quantization");
+    
+    // Each batch of channels of the main dataset laid out in whole chunks, one row of chunks after the other
+    const bool wholeChunks = writesWholeChunks();
+    float* chunkBuffer = arena.get<float>("Chunks");
+    const hsize_t chunkWidth = wholeChunks ? standardChunkDims[N - 1] : 0;
+    const hsize_t chunkHeight = wholeChunks ? standardChunkDims[N - 2] : 0;
+    const hsize_t chunkRows = wholeChunks ? (height + chunkHeight - 1) / chunkHeight : 0;
+    const hsize_t chunksPerRow = wholeChunks ? (width + chunkWidth - 1) / chunkWidth : 0;
+    const hsize_t fullChunkSize = wholeChunks ? channelsPerWrite * chunkHeight * chunkWidth : 0;
+    
+    // The encoded chunks of each row, until they are written (empty if a chunk is written from the chunk buffer)
+    std::vector<std::vector<std::vector<uint8_t>>> encodedChunks(chunkRows, std::vector<std::vector<uint8_t>>(chunksPerRow));
     
-    std::string timerLabelXYRotation = depth > 1 ? "XY statistics and rotation" : "XY statistics";
-
     for (unsigned int currentStokes = 0; currentStokes < stokes; currentStokes++) {
         DEBUG(std::cout << "Processing Stokes " << currentStokes << "..." << std::endl;);
         PROGRESS("Stokes " << currentStokes << ":" << std::endl);
-
-        // Read data into memory space
-        TIMER(timer.start("Read"););
-        DEBUG(std::cout << "+ Reading main dataset..." << std::flush;);
-        readFitsData(inputFilePtr, 0, currentStokes, cubeSize, standardCube);
         
-        // We have to allocate the swizzled cube for each stokes because we free it to make room for mipmaps
-        if (depth > 1) {
-            TIMER(timer.start("Allocate"););
-            rotatedCube = new float[cubeSize];
-        }
+        statsXY.clearHistogramBuffers();
+        statsXYZ.clearHistogramBuffers();
         
-        DEBUG(std::cout << " " << timerLabelXYRotation <<  "..." << std::flush;);
-        PROGRESS("\tMain loop\t");
-        TIMER(timer.start(timerLabelXYRotation););
-
-        // First loop calculates stats for each XY slice and rotates the dataset
+        double cubeMin;
+        double cubeMax;
+        double cubeRange;
+        bool cubeHist(false);
+        
+        // Instead of running each phase over the whole cube with a barrier in between, we express the work for
+        // this Stokes as a graph of per-channel and per-row-block tasks. Each task only waits for the data it needs,
+        // so that reading, writing and the independent calculations overlap.
+        // Neither CFITSIO nor HDF5 can be used from multiple threads at once, so all reads are chained together,
+        // and so are all writes. Reads and writes can overlap with each other and with the calculations.
+        // If the output backend supports concurrent writes, writes are only chained where they share a buffer or
+        // have to happen in order.
         
-#pragma omp parallel for
-        for (hsize_t i = 0; i < depth; i++) {
-            PROGRESS_DECIMATED(i, channelProgressStride, "|");
-            StatsCounter counterXY;
+        // Threads cost more than they save on a small image
+        TaskGraph graph(isSmallFile() ? 1 : 0);
+        
+        const bool concurrentWrites = output->concurrentWrites();
+        
+        Task* lastRead(nullptr);
+        Task* lastWrite(nullptr);
+        Task* lastDataWrite(nullptr);
+        Task* lastTileWrite(nullptr);
+        std::vector<Task*> chunkRowWrites(chunkRows, nullptr);
+        
+        std::vector<Task*> readTasks(depth);
+        std::vector<Task*> xyTasks(depth);
+        std::vector<Task*> mipMapTasks(depth);
+        std::vector<Task*> histogramTasks(depth);
+        std::vector<Task*> encodeTasks(depth);
+        std::vector<Task*> compressTasks(depth);
+        std::vector<Task*> mipMapWrites;
+        
+        // The tasks which use the raw channels of the current batch, and the tasks after which each slot of raw
+        // channels is free again
+        std::vector<Task*> channelUsers;
+        std::vector<Task*> channelsFree;
+        
+        std::vector<std::vector<EncodedTiles>> encodedTiles(tileCache.enabled() ? depth : 0);
+        
+        for (hsize_t c = 0; c < depth; c++) {
+            // The mipmaps and the raw channels of a compressed cube use the buffer slot of the block of this channel
+            hsize_t block = c / channelsPerWrite;
+            hsize_t slotStart = (block % mipMapBufferSlots) * channelsPerWrite;
+            hsize_t bufferChannel = slotStart + c % channelsPerWrite;
             
-            auto& indexXY = i;
-            std::function<void(float)> accumulate;
+            float* channel = compressed ? channelSlots + bufferChannel * channelSize : standardCube + c * channelSize;
             
-            auto lazy_accumulate = [&] (float val) {
-                counterXY.accumulateFiniteLazy(val);
-            };
+            // Read one channel
+            Task* read = graph.add([&, c, channel] {
+                readChannel(c, currentStokes, channel);
+            }, {lastRead, compressed && block >= mipMapBufferSlots ? channelsFree[block - mipMapBufferSlots] : nullptr});
+            lastRead = read;
+            readTasks[c] = read;
             
-            auto first_accumulate = [&] (float val) {
-                counterXY.accumulateFiniteLazyFirst(val);
-                accumulate = lazy_accumulate;
-            };
+            // Compress the channel, so that the passes which need all the channels can decompress it later
+            if (compressed) {
+                compressTasks[c] = graph.add([&, c, channel] {
+                    compressedCube.store(c, channel);
+                }, {read});
+                channelUsers.push_back(compressTasks[c]);
+            }
+            
+            // Sum and hash the channel for the FITS DATASUM check and the channel hashes, while it is still in the cache
+            if (!dataSums.empty() || !channelHashes.empty()) {
+                channelUsers.push_back(graph.add([&, c, channel] {
+                    hsize_t index = currentStokes * depth + c;
+                    
+                    if (!dataSums.empty()) {
+                        dataSums[index] = fitsDataSum(channel, channelSize);
+                    }
+                    
+                    if (!channelHashes.empty()) {
+                        channelHashes[index] = crc32c(channel, channelSize * sizeof(float));
+                    }
+                }, {read}));
+            }
             
-            accumulate = first_accumulate;
+            // Calculate XY stats and rotate the channel
+            xyTasks[c] = graph.add([&, c, channel] {
+                PROGRESS_DECIMATED(c, channelProgressStride, "|");
+                StatsCounter counterXY;
+                
+                auto& indexXY = c;
+                std::function<void(float)> accumulate;
+                
+                auto lazy_accumulate = [&] (float val) {
+                    counterXY.accumulateFiniteLazy(val);
+                };
+                
+                auto first_accumulate = [&] (float val) {
+                    counterXY.accumulateFiniteLazyFirst(val);
+                    accumulate = lazy_accumulate;
+                };
+                
+                accumulate = first_accumulate;
+                
+                for (hsize_t j = 0; j < height; j++) {
+                    for (hsize_t k = 0; k < width; k++) {
+                        auto sourceIndex = k + width * j;
+                        auto destIndex = c + depth * j + (height * depth) * k;
+                        auto& val = channel[sourceIndex];
+                        
+                        if (rotatedCube) {
+                            rotatedCube[destIndex] = val;
+                        }
+                        
+                        // Accumulate XY stats
+                        if (std::isfinite(val)) {
+                            accumulate(val);
+                        } else {
+                            counterXY.accumulateNonFinite();
+                        }
+                    }
+                }
+                
+                // Final correction of XY min and max
+                statsXY.copyStatsFromCounter(indexXY, height * width, counterXY);
+                quantizer.setChannelNoise(currentStokes * depth + c, counterXY, height * width);
+            }, {read});
+            channelUsers.push_back(xyTasks[c]);
             
-            for (hsize_t j = 0; j < height; j++) {
-                for (hsize_t k = 0; k < width; k++) {
-                    auto sourceIndex = k + width * j + (height * width) * i;
-                    auto destIndex = i + depth * j + (height * depth) * k;
-                    auto& val = standardCube[sourceIndex];
+            // Write each batch of channels to the main dataset as soon as it has been read. The batches match the
+            // chunk depth, so that every write covers whole chunks.
+            // If we are rounding the output, we have to wait for the channel noise, and we round a copy,
+            // because all the statistics are calculated from the original values. All the rounded batches share
+            // one buffer.
+            // The chunk checksums are calculated by a separate task, while the batch is still in the cache.
+            if (c % channelsPerWrite == channelsPerWrite - 1 || c == depth - 1) {
+                hsize_t batchStart = c - c % channelsPerWrite;
+                hsize_t batchSize = c - batchStart + 1;
+                
+                std::vector<Task*> batchTasks;
+                for (hsize_t b = batchStart; b <= c; b++) {
+                    batchTasks.push_back(quantizer.enabled() ? xyTasks[b] : readTasks[b]);
+                }
+                
+                float* batchChannels = channel - (c - batchStart) * channelSize;
+                float* data = quantizer.enabled() ? quantizedChannels : batchChannels;
+                std::vector<hsize_t> count = trimAxes({1, batchSize, height, width}, N);
+                std::vector<hsize_t> start = trimAxes({currentStokes, batchStart, 0, 0}, N);
                     
-                    if (depth > 1) {
-                        rotatedCube[destIndex] = val;
+                // Alternatively, each row of chunks is copied into its own part of the chunk buffer, chunk by chunk,
+                // rounded, checksummed and encoded by a separate task, and each chunk is handed to the output as it
+                // is. HDF5 then doesn't have to gather the chunks from strided rows itself. A row can only reuse its
+                // part of the buffer once the same row of the previous batch has been written.
+                if (wholeChunks) {
+                    for (hsize_t row = 0; row < chunkRows; row++) {
+                        hsize_t yStart = row * chunkHeight;
+                        hsize_t rowHeight = std::min(chunkHeight, height - yStart);
+                        float* rowData = chunkBuffer + channelsPerWrite * yStart * width;
+                        
+                        Task* layout = graph.add([&, batchStart, batchSize, batchChannels, row, yStart, rowHeight, rowData] {
+                            std::vector<float> padded;
+                            
+                            for (hsize_t xStart = 0; xStart < width; xStart += chunkWidth) {
+                                hsize_t columns = std::min(chunkWidth, width - xStart);
+                                float* chunk = rowData + batchSize * rowHeight * xStart;
+                                
+                                for (hsize_t b = 0; b < batchSize; b++) {
+                                    for (hsize_t y = 0; y < rowHeight; y++) {
+                                        const float* source = batchChannels + b * channelSize + (yStart + y) * width + xStart;
+                                        std::copy(source, source + columns, chunk + (b * rowHeight + y) * columns);
+                                    }
+                                    
+                                    if (quantizer.enabled()) {
+                                        quantizer.round(chunk + b * rowHeight * columns, rowHeight * columns, currentStokes * depth + batchStart + b);
+                                    }
+                                }
+                                
+                                if (standardChecksums.enabled()) {
+                                    standardChecksums.calculate(chunk, trimAxes({1, batchSize, rowHeight, columns}, N), trimAxes({currentStokes, batchStart, yStart, xStart}, N));
+                                }
+                                
+                                // Chunks at the edges of the dataset are padded to the full chunk size
+                                auto& encoded = encodedChunks[row][xStart / chunkWidth];
+                                
+                                if (batchSize < channelsPerWrite || rowHeight < chunkHeight || columns < chunkWidth) {
+                                    padded.assign(fullChunkSize, 0);
+                                    for (hsize_t b = 0; b < batchSize; b++) {
+                                        for (hsize_t y = 0; y < rowHeight; y++) {
+                                            const float* source = chunk + (b * rowHeight + y) * columns;
+                                            std::copy(source, source + columns, padded.data() + (b * chunkHeight + y) * chunkWidth);
+                                        }
+                                    }
+                                    
+                                    if (!standardDataSet->encodeChunk(padded.data(), fullChunkSize, encoded)) {
+                                        encoded.assign((uint8_t*)padded.data(), (uint8_t*)(padded.data() + fullChunkSize));
+                                    }
+                                } else if (!standardDataSet->encodeChunk(chunk, fullChunkSize, encoded)) {
+                                    encoded.clear();
+                                }
+                            }
+                        }, extend(batchTasks, {chunkRowWrites[row]}));
+                        channelUsers.push_back(layout);
+                        
+                        lastWrite = graph.add([&, batchStart, batchSize, row, yStart, rowHeight, rowData] {
+                            for (hsize_t xStart = 0; xStart < width; xStart += chunkWidth) {
+                                auto& encoded = encodedChunks[row][xStart / chunkWidth];
+                                std::vector<hsize_t> chunkStart = trimAxes({currentStokes, batchStart, yStart, xStart}, N);
+                                
+                                if (encoded.empty()) {
+                                    standardDataSet->writeWholeChunk(chunkStart, rowData + batchSize * rowHeight * xStart, fullChunkSize * sizeof(float));
+                                } else {
+                                    standardDataSet->writeWholeChunk(chunkStart, encoded.data(), encoded.size());
+                                }
+                            }
+                        }, {layout, concurrentWrites ? nullptr : lastWrite});
+                        chunkRowWrites[row] = lastWrite;
                     }
+                } else {
+                    if (quantizer.enabled()) {
+                        Task* rounding = graph.add([&, batchStart, batchSize, batchChannels, data, count, start] {
+                            float* original = batchChannels;
+                            std::copy(original, original + batchSize * channelSize, data);
+                            for (hsize_t b = 0; b < batchSize; b++) {
+                                quantizer.round(data + b * channelSize, channelSize, currentStokes * depth + batchStart + b);
+                            }
+                    
+                            if (standardChecksums.enabled()) {
+                                standardChecksums.calculate(data, count, start);
+                            }
+                        }, extend(batchTasks, {lastDataWrite}));
+                        channelUsers.push_back(rounding);
                     
-                    // Accumulate XY stats
-                    if (std::isfinite(val)) {
-                        accumulate(val);
+                        batchTasks = {rounding};
+                    } else if (standardChecksums.enabled()) {
+                        channelUsers.push_back(graph.add([&, data, count, start] {
+                            standardChecksums.calculate(data, count, start);
+                        }, batchTasks));
+                    }
+                
+                    batchTasks.push_back(concurrentWrites ? nullptr : lastWrite);
+                
+                    lastWrite = graph.add([&, batchSize, data, count, start] {
+                        std::vector<hsize_t> memDims = {batchSize, height, width};
+                        standardDataSet->write(data, memDims, count, start);
+                    }, batchTasks);
+                
+                    if (quantizer.enabled()) {
+                        lastDataWrite = lastWrite;
                     } else {
-                        counterXY.accumulateNonFinite();
+                        channelUsers.push_back(lastWrite);
+                    }
+                }
+            }
+            
+            // Mipmaps only depend on this channel, and on the buffer slot of its block being free
+            if (writeMipMaps) {
+                Task* previous = block >= mipMapBufferSlots ? mipMapWrites[block - mipMapBufferSlots] : nullptr;
+                
+                mipMapTasks[c] = graph.add([&, channel, bufferChannel] {
+                    for (hsize_t y = 0; y < height; y++) {
+                        for (hsize_t x = 0; x < width; x++) {
+                            auto& val = channel[x + width * y];
+                            if (std::isfinite(val)) {
+                                mipMaps.accumulate(val, x, y, bufferChannel);
+                            }
+                        }
                     }
+                    
+                    // Final mipmap calculation for this channel
+                    mipMaps.calculate(bufferChannel);
+                }, {read, previous});
+                channelUsers.push_back(mipMapTasks[c]);
+            }
+            
+            // Encode the display tiles of this channel as soon as its mipmaps are ready, and append them to the cache
+            if (tileCache.enabled()) {
+                encodeTasks[c] = graph.add([&, c, channel, bufferChannel] {
+                    tileCache.encode(channel, mipMaps, bufferChannel, encodedTiles[c]);
+                }, {read, mipMapTasks[c]});
+                channelUsers.push_back(encodeTasks[c]);
+                
+                // The tiles are appended in order
+                lastWrite = graph.add([&, c] {
+                    tileCache.write(currentStokes, c, encodedTiles[c]);
+                }, {encodeTasks[c], concurrentWrites ? lastTileWrite : lastWrite});
+                lastTileWrite = lastWrite;
+            }
+            
+            // Write each block of mipmaps once all its channels are done, and free its slot for a later block.
+            // The mipmaps need the channel noise if we are rounding them. If we are rounding them, this happens in
+            // place, so the display tiles have to be encoded first.
+            if (writeMipMaps && (c % channelsPerWrite == channelsPerWrite - 1 || c == depth - 1)) {
+                hsize_t blockStart = block * channelsPerWrite;
+                hsize_t blockSize = c - blockStart + 1;
+                
+                std::vector<Task*> blockTasks;
+                for (hsize_t b = blockStart; b <= c; b++) {
+                    blockTasks.insert(blockTasks.end(), {mipMapTasks[b], xyTasks[b], encodeTasks[b]});
                 }
+                if (!concurrentWrites) {
+                    blockTasks.push_back(lastWrite);
+                }
+                
+                lastWrite = graph.add([&, blockStart, blockSize, slotStart] {
+                    mipMaps.write(currentStokes, blockStart, quantizer, blockSize, slotStart);
+                    mipMaps.resetBuffers(slotStart, blockSize);
+                }, blockTasks);
+                mipMapWrites.push_back(lastWrite);
             }
             
-            // Final correction of XY min and max
-            statsXY.copyStatsFromCounter(indexXY, height * width, counterXY);
+            // A slot of raw channels can be reused once everything which uses the raw channels of its batch is done
+            if (compressed && (c % channelsPerWrite == channelsPerWrite - 1 || c == depth - 1)) {
+                channelsFree.push_back(graph.add([] {}, channelUsers));
+                channelUsers.clear();
+            }
         }
         
-        PROGRESS(std::endl);
-
-        if (depth > 1) {
+        Task* xyzTask(nullptr);
+        
+        if (writeStats && depth > 1) {
             // Consolidate XY stats into XYZ stats
-            DEBUG(std::cout << " XYZ statistics..." << std::flush;);
-            PROGRESS("\tXYZ stats" << std::endl);
-            TIMER(timer.start("XYZ statistics"););
-            
-            StatsCounter counterXYZ;
-
-            for (hsize_t i = 0; i < depth; i++) {
-                auto& indexXY = i;
-                statsXY.accumulateStatsToCounter(counterXYZ, indexXY);
+            xyzTask = graph.add([&] {
+                StatsCounter counterXYZ;
+                
+                for (hsize_t i = 0; i < depth; i++) {
+                    auto& indexXY = i;
+                    statsXY.accumulateStatsToCounter(counterXYZ, indexXY);
+                }
+                
+                statsXYZ.copyStatsFromCounter(0, depth * height * width, counterXYZ);
+                
+                cubeMin = statsXYZ.minVals[0];
+                cubeMax = statsXYZ.maxVals[0];
+                cubeRange = cubeMax - cubeMin;
+                cubeHist = std::isfinite(cubeMin) && std::isfinite(cubeMax) && cubeRange > 0;
+            }, xyTasks);
+        }
+        
+        if (compressed && (writeZStats || writeSwizzled)) {
+            // With a compressed cube, each block of rows is decompressed from all the channels into a slab, which
+            // is laid out like the rotated dataset. The Z stats of the block are calculated from the slab, and the
+            // slab is written to the rotated dataset as it is, one whole row of its chunks at a time.
+            // The rotated data has to wait for the channel noise if we are rounding it.
+            // A block can only reuse a slab and a buffer slot once the previous block in that slot has been written.
+            std::vector<Task*> slabTasks = compressTasks;
+            if (writeSwizzled && quantizer.enabled()) {
+                slabTasks = extend(slabTasks, xyTasks);
             }
-
-            statsXYZ.copyStatsFromCounter(0, depth * height * width, counterXYZ);
-
-            // Second loop calculates stats for each Z profile (i.e. average/min/max XY slices)
             
-            DEBUG(std::cout << " Z statistics... " << std::flush;);
-            PROGRESS("\tZ stats\t\t");
-            TIMER(timer.start("Z statistics"););
-
-#pragma omp parallel for
-            for (hsize_t j = 0; j < height; j++) {
-                for (hsize_t k = 0; k < width; k++) {
-                    StatsCounter counterZ;
-                    
-                    auto indexZ = k + j * width;
-                    PROGRESS_DECIMATED(indexZ, pixelProgressStride, ".");
+            std::vector<Task*> zWrites;
+            std::vector<Task*> swizzledWrites;
+            
+            for (hsize_t block = 0; block < compressedCube.numBlocks; block++) {
+                hsize_t rowStart = block * zRowsPerBlock;
+                hsize_t numRows = compressedCube.blockRows(block);
+                hsize_t slotOffset = (block % zSlots) * zRowsPerBlock * width;
+                float* slab = slabs + slotOffset * depth;
+                
+                std::vector<Task*> previous;
+                if (block >= zSlots) {
+                    previous = {zWrites[block - zSlots], swizzledWrites[block - zSlots]};
+                }
+                
+                Task* slabTask = graph.add([&, block, rowStart, numRows, slotOffset, slab] {
+                    std::vector<float> rows(numRows * width);
                     
                     for (hsize_t i = 0; i < depth; i++) {
-                        auto sourceIndex = k + width * j + (height * width) * i;
-                        auto& val = standardCube[sourceIndex];
-
-                        if (std::isfinite(val)) {
-                            // Not lazy; too much risk of encountering an ascending / descending sequence.
-                            counterZ.accumulateFinite(val);
-                        } else {
-                            counterZ.accumulateNonFinite();
+                        compressedCube.load(i, block, rows.data());
+                        
+                        for (hsize_t j = 0; j < numRows; j++) {
+                            for (hsize_t k = 0; k < width; k++) {
+                                slab[i + depth * j + (numRows * depth) * k] = rows[k + width * j];
+                            }
+                        }
+                    }
+                    
+                    for (hsize_t j = 0; writeZStats && j < numRows; j++) {
+                        for (hsize_t k = 0; k < width; k++) {
+                            StatsCounter counterZ;
+                            
+                            auto indexZ = slotOffset + k + j * width;
+                            const float* spectrum = slab + depth * j + (numRows * depth) * k;
+                            
+                            for (hsize_t i = 0; i < depth; i++) {
+                                auto& val = spectrum[i];
+                                
+                                if (std::isfinite(val)) {
+                                    counterZ.accumulateFinite(val);
+                                } else {
+                                    counterZ.accumulateNonFinite();
+                                }
+                            }
+                            
+                            statsZ.copyStatsFromCounter(indexZ, depth, counterZ);
+                        }
+                    }
+                    
+                    if (!writeSwizzled) {
+                        return;
+                    }
+                    
+                    // The rotated data is not used for anything else, so it can be rounded in place
+                    if (quantizer.enabled()) {
+                        for (hsize_t p = 0; p < width * numRows; p++) {
+                            for (hsize_t i = 0; i < depth; i++) {
+                                auto& val = slab[i + depth * p];
+                                val = quantizer.round(val, currentStokes * depth + i);
+                            }
                         }
                     }
                     
-                    statsZ.copyStatsFromCounter(indexZ, depth, counterZ);
+                    // The slab covers whole chunks, so it can be checksummed independently of the other slabs
+                    if (swizzledChecksums.enabled()) {
+                        swizzledChecksums.calculate(slab, trimAxes({1, width, numRows, depth}, N), trimAxes({currentStokes, 0, rowStart, 0}, N));
+                    }
+                }, extend(slabTasks, previous));
+                
+                zWrites.push_back(nullptr);
+                swizzledWrites.push_back(nullptr);
+                
+                if (writeZStats) {
+                    lastWrite = graph.add([&, rowStart, numRows, slotOffset] {
+                        statsZ.write({numRows, width}, {1, numRows, width}, {currentStokes, rowStart, 0}, slotOffset);
+                    }, {slabTask, concurrentWrites ? nullptr : lastWrite});
+                    zWrites.back() = lastWrite;
+                }
+                
+                if (writeSwizzled) {
+                    lastWrite = graph.add([&, rowStart, numRows, slab] {
+                        std::vector<hsize_t> swizzledCount = trimAxes({1, width, numRows, depth}, N);
+                        std::vector<hsize_t> swizzledMemDims = {width, numRows, depth};
+                        std::vector<hsize_t> start = trimAxes({currentStokes, 0, rowStart, 0}, N);
+                        swizzledDataSet->write(slab, swizzledMemDims, swizzledCount, start);
+                    }, {slabTask, concurrentWrites ? nullptr : lastWrite});
+                    swizzledWrites.back() = lastWrite;
                 }
             }
-
-            PROGRESS(std::endl);
+        } else if (writeZStats) {
+            // Calculate stats for each Z profile (i.e. average/min/max XY slices) in blocks of rows, and write each
+            // block as soon as it is done. These need all the channels, but not the XY stats.
+            // A block can only reuse a buffer slot once the previous block in that slot has been written.
+            std::vector<Task*> zWrites;
+                
+            for (hsize_t rowStart = 0; rowStart < height; rowStart += zRowsPerBlock) {
+                hsize_t rowEnd = std::min(height, rowStart + zRowsPerBlock);
+                hsize_t block = zWrites.size();
+                hsize_t slotOffset = (block % zSlots) * zRowsPerBlock * width;
+                Task* previous = block >= zSlots ? zWrites[block - zSlots] : nullptr;
+                
+                Task* zTask = graph.add([&, rowStart, rowEnd, slotOffset] {
+                    for (hsize_t j = rowStart; j < rowEnd; j++) {
+                        for (hsize_t k = 0; k < width; k++) {
+                            StatsCounter counterZ;
+                            
+                            auto indexZ = slotOffset + k + (j - rowStart) * width;
+                            
+                            for (hsize_t i = 0; i < depth; i++) {
+                                auto sourceIndex = k + width * j + channelSize * i;
+                                auto& val = standardCube[sourceIndex];
+                                
+                                if (std::isfinite(val)) {
+                                    // Not lazy; too much risk of encountering an ascending / descending sequence.
+                                    counterZ.accumulateFinite(val);
+                                } else {
+                                    counterZ.accumulateNonFinite();
+                                }
+                            }
+                            
+                            statsZ.copyStatsFromCounter(indexZ, depth, counterZ);
+                        }
+                    }
+                }, {lastRead, previous});
+                
+                lastWrite = graph.add([&, rowStart, rowEnd, slotOffset] {
+                    hsize_t numRows = rowEnd - rowStart;
+                    statsZ.write({numRows, width}, {1, numRows, width}, {currentStokes, rowStart, 0}, slotOffset);
+                }, {zTask, concurrentWrites ? nullptr : lastWrite});
+                zWrites.push_back(lastWrite);
+            }
         }
-
-        // Third loop handles histograms
         
-        DEBUG(std::cout << " Histograms..." << std::flush;);
-        PROGRESS("\tHistograms\t");
-        TIMER(timer.start("Histograms"););
-        
-        double cubeMin;
-        double cubeMax;
-        double cubeRange;
-        bool cubeHist(false);
+        // Histograms need the channel min and max, and the cube min and max if there is more than one channel
+        // With a compressed cube, each channel is decompressed one block of rows at a time
+        for (hsize_t c = 0; writeHistograms && c < depth; c++) {
+            float* channel = compressed ? nullptr : standardCube + c * channelSize;
+            
+            histogramTasks[c] = graph.add([&, c, channel] {
+                auto& indexXY = c;
+                double chanMin = statsXY.minVals[indexXY];
+                double chanMax = statsXY.maxVals[indexXY];
+                double chanRange = chanMax - chanMin;
+                
+                bool chanHist(std::isfinite(chanMin) && std::isfinite(chanMax) && chanRange > 0);
+                
+                if (!chanHist && !cubeHist) {
+                    return; // skip the loop entirely
+                }
+                
+                auto doChannelHistogram = [&] (float val) {
+                    // XY histogram
+                    statsXY.accumulateHistogram(val, chanMin, chanRange, c);
+                };
+                
+                auto doCubeHistogram = [&] (float val) {
+                    // Partial XYZ histogram
+                    statsXYZ.accumulatePartialHistogram(val, cubeMin, cubeRange, c);
+                };
+                
+                auto doNothing = [&] (float val) {
+                    UNUSED(val);
+                };
+                
+                std::function<void(float)> channelHistogramFunc = doChannelHistogram;
+                std::function<void(float)> cubeHistogramFunc = doCubeHistogram;
+                
+                if (!chanHist) {
+                    channelHistogramFunc = doNothing;
+                }
+                
+                if (!cubeHist) {
+                    cubeHistogramFunc = doNothing;
+                }
+                
+                auto accumulateHistograms = [&] (const float* data, hsize_t size) {
+                    for (hsize_t j = 0; j < size; j++) {
+                        auto& val = data[j];
+                    
+                        if (std::isfinite(val)) {
+                            channelHistogramFunc(val);
+                            cubeHistogramFunc(val);
+                        }
+                    } // end of XY loop
+                };
+                
+                if (compressed) {
+                    std::vector<float> rows(zRowsPerBlock * width);
                     
-        if (depth > 1) {
-            cubeMin = statsXYZ.minVals[0];
-            cubeMax = statsXYZ.maxVals[0];
-            cubeRange = cubeMax - cubeMin;
-            cubeHist = std::isfinite(cubeMin) && std::isfinite(cubeMax) && cubeRange > 0;
+                    for (hsize_t b = 0; b < compressedCube.numBlocks; b++) {
+                        compressedCube.load(c, b, rows.data());
+                        accumulateHistograms(rows.data(), compressedCube.blockRows(b) * width);
+                    }
+                } else {
+                    accumulateHistograms(channel, channelSize);
+                }
+            }, {xyzTask ? xyzTask : xyTasks[c], compressTasks[c]});
         }
         
-        statsXY.clearHistogramBuffers();
-        statsXYZ.clearHistogramBuffers();
-
-#pragma omp parallel for
-        for (hsize_t i = 0; i < depth; i++) {
-            PROGRESS_DECIMATED(i, channelProgressStride, "|");
-            
-            auto& indexXY = i;
-            double chanMin = statsXY.minVals[indexXY];
-            double chanMax = statsXY.maxVals[indexXY];
-            double chanRange = chanMax - chanMin;
-            
-            bool chanHist(std::isfinite(chanMin) && std::isfinite(chanMax) && chanRange > 0);
+        Task* histogramsDone(nullptr);
+        
+        if (writeHistograms) {
+            histogramsDone = graph.add([&] {
+                if (depth > 1) {
+                    // Consolidate partial XYZ histograms into final histogram
+                    statsXYZ.consolidatePartialHistogram();
+                }
+            }, histogramTasks);
+        }
+        
+        if (writeSwizzled && !compressed) {
+            std::vector<Task*> rotationTasks = xyTasks;
             
-            if (!chanHist && !cubeHist) {
-                continue; // skip the loop entirely
+            // The rotated dataset is not used for any calculations, so it can be rounded in place, in blocks of columns
+            if (quantizer.enabled()) {
+                rotationTasks.clear();
+                
+                for (hsize_t xStart = 0; xStart < width; xStart += TILE_SIZE) {
+                    hsize_t xEnd = std::min(width, xStart + TILE_SIZE);
+                    
+                    rotationTasks.push_back(graph.add([&, xStart, xEnd] {
+                        for (hsize_t k = xStart; k < xEnd; k++) {
+                            for (hsize_t j = 0; j < height; j++) {
+                                for (hsize_t i = 0; i < depth; i++) {
+                                    auto& val = rotatedCube[i + depth * j + (height * depth) * k];
+                                    val = quantizer.round(val, currentStokes * depth + i);
+                                }
+                            }
+                        }
+                    }, xyTasks));
+                }
             }
             
-            auto doChannelHistogram = [&] (float val) {
-                // XY histogram
-                statsXY.accumulateHistogram(val, chanMin, chanRange, i);
-            };
-            
-            auto doCubeHistogram = [&] (float val) {
-                // Partial XYZ histogram
-                statsXYZ.accumulatePartialHistogram(val, cubeMin, cubeRange, i);
-            };
-            
-            auto doNothing = [&] (float val) {
-                UNUSED(val);
-            };
-            
-            std::function<void(float)> channelHistogramFunc = doChannelHistogram;
-            std::function<void(float)> cubeHistogramFunc = doCubeHistogram;
-                        
-            if (!chanHist) {
-                channelHistogramFunc = doNothing;
+            // The chunks of the rotated dataset hold single columns, so they can be checksummed in blocks of columns
+            for (hsize_t xStart = 0; swizzledChecksums.enabled() && xStart < width; xStart += TILE_SIZE) {
+                hsize_t xEnd = std::min(width, xStart + TILE_SIZE);
+                
+                graph.add([&, xStart, xEnd] {
+                    std::vector<hsize_t> count = trimAxes({1, xEnd - xStart, height, depth}, N);
+                    std::vector<hsize_t> start = trimAxes({currentStokes, xStart, 0, 0}, N);
+                    swizzledChecksums.calculate(rotatedCube + xStart * height * depth, count, start);
+                }, rotationTasks);
             }
             
-            if (!cubeHist) {
-                cubeHistogramFunc = doNothing;
-            }
-
-            for (hsize_t j = 0; j < width * height; j++) {
-                auto& val = standardCube[i * width * height + j];
-
-                if (std::isfinite(val)) {
-                    channelHistogramFunc(val);
-                    cubeHistogramFunc(val);
-                }
-            } // end of XY loop
-        } // end of parallel Z loop
-        
-        if (depth > 1) {
-            // Consolidate partial XYZ histograms into final histogram
-            statsXYZ.consolidatePartialHistogram();
-        }
-        
-        PROGRESS(std::endl);
-
-        DEBUG(std::cout << " Writing main and rotated datasets... " << std::flush;);
-        PROGRESS("\tWrite data" << std::endl);
-        TIMER(timer.start("Write"););
-                    
-        std::vector<hsize_t> memDims = {depth, height, width};
-        std::vector<hsize_t> count = trimAxes({1, depth, height, width}, N);
-        std::vector<hsize_t> start = trimAxes({currentStokes, 0, 0, 0}, N);
-        writeHdf5Data(standardDataSet, standardCube, memDims, count, start);
-        
-        if (depth > 1) {
+            // Write the rotated dataset as soon as all the channels have been rotated
             // This all technically worked if we reused the standard filespace and memspace
             // But it's probably not a good idea to rely on two incorrect values cancelling each other out
-            std::vector<hsize_t> swizzledCount = trimAxes({1, width, height, depth}, N);
-            std::vector<hsize_t> swizzledMemDims = {width, height, depth};
-            writeHdf5Data(swizzledDataSet, rotatedCube, swizzledMemDims, swizzledCount, start);
-        }
-
-        // After writing and before mipmaps, we free the swizzled memory. We allocate it again next Stokes.
-        if (depth > 1) {
-            DEBUG(std::cout << " Freeing memory from rotated dataset..." << std::flush;);
-            TIMER(timer.start("Free"););
-            
-            delete[] rotatedCube;
+            lastWrite = graph.add([&] {
+                std::vector<hsize_t> swizzledCount = trimAxes({1, width, height, depth}, N);
+                std::vector<hsize_t> swizzledMemDims = {width, height, depth};
+                std::vector<hsize_t> start = trimAxes({currentStokes, 0, 0, 0}, N);
+                swizzledDataSet->write(rotatedCube, swizzledMemDims, swizzledCount, start);
+            }, extend(rotationTasks, {concurrentWrites ? nullptr : lastWrite}));
         }
         
-        // Fourth loop handles mipmaps
-        
-        // In the fast algorithm, we keep one Stokes of mipmaps in memory at once and parallelise by channel
-        DEBUG(std::cout << " Mipmaps..." << std::endl;);
-        PROGRESS("\tMipmaps\t\t");
-        TIMER(timer.start("Mipmaps"););
-        
-#pragma omp parallel for
-        for (hsize_t c = 0; c < depth; c++) {
-            PROGRESS_DECIMATED(c, channelProgressStride, "|");
-            for (hsize_t y = 0; y < height; y++) {
-                for (hsize_t x = 0; x < width; x++) {
-                    auto sourceIndex = x + width * y + (height * width) * c;
-                    auto& val = standardCube[sourceIndex];
-                    if (std::isfinite(val)) {
-                        mipMaps.accumulate(val, x, y, c);
-                    }
+        // Write the statistics
+        if (writeStats) {
+            lastWrite = graph.add([&] {
+                statsXY.write({1, depth}, {currentStokes, 0});
+                
+                if (depth > 1) {
+                    statsXYZ.write({1}, {currentStokes});
                 }
-            }
-        } // end of mipmap loop
-        PROGRESS(std::endl);
-        
-        // Final mipmap calculation
-        mipMaps.calculate();
-        
-        TIMER(timer.start("Write"););
-        PROGRESS("\tWrite stats & mipmaps" << std::endl);
+            }, extend(xyTasks, {xyzTask, histogramsDone, concurrentWrites ? nullptr : lastWrite}));
+        }
         
-        // Write the mipmaps
-        mipMaps.write(currentStokes, 0);
+        DEBUG(std::cout << "+ Running task graph..." << std::flush;);
+        PROGRESS("\tMain loop\t");
+        TIMER(timer.start("Read, calculate and write"););
         
-        // Write the statistics                
-        statsXY.write({1, depth}, {currentStokes, 0});
+        graph.run();
         
-        if (depth > 1) {
-            statsXYZ.write({1}, {currentStokes});
-            statsZ.write({1, height, width}, {currentStokes, 0, 0});
-        }
+        PROGRESS(std::endl);
+        DEBUG(std::cout << " Done." << std::endl;);
                 
-        // Clear the mipmaps before the next Stokes
-        TIMER(timer.start("Mipmaps"););
-        mipMaps.resetBuffers();
-        
     } // end of Stokes loop
     
     // Free memory
-    DEBUG(std::cout << "Freeing memory from main dataset... " << std::endl;);
+    DEBUG(std::cout << "Freeing memory... " << std::endl;);
     TIMER(timer.start("Free"););
     
-    delete[] standardCube;
+    arena.free();
 }
@@ -0,0 +1,125 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "FitsStream.h"
+#include "Util.h"
+#include "Throttle.h"
+#include "IoStats.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+// The size of the header and data blocks of a FITS file, and of a header card
+#define FITS_BLOCK_SIZE (hsize_t)2880
+#define FITS_CARD_SIZE (hsize_t)80
+
+// Skipped data is read into a buffer of this size
+#define SKIP_BUFFER_SIZE (hsize_t)(1 << 20)
+
+FitsStream& FitsStream::standardInput() {
+    static FitsStream stream(STDIN_FILENO, "stdin");
+    return stream;
+}
+
+void FitsStream::open(fitsfile** filePtr) {
+    if (header.empty()) {
+        // Read whole blocks until one of them contains the END card
+        bool end(false);
+        
+        while (!end) {
+            hsize_t blockStart = header.size();
+            header.resize(blockStart + FITS_BLOCK_SIZE);
+            readBytes(header.data() + blockStart, FITS_BLOCK_SIZE);
+            
+            for (hsize_t card = blockStart; card < header.size(); card += FITS_CARD_SIZE) {
+                if (std::string(header.data() + card, 8) == "END     ") {
+                    end = true;
+                    break;
+                }
+            }
+        }
+        
+        if (std::string(header.data(), 9) != "SIMPLE  =") {
+            throw "The input stream is not a FITS file";
+        }
+        
+        headerAddress = header.data();
+        headerSize = header.size();
+    }
+    
+    if (position > 0) {
+        throw "The input stream has already been read";
+    }
+    
+    openFitsMemFile(filePtr, name, &headerAddress, &headerSize);
+    
+    if (fitsDataIsScaled(*filePtr)) {
+        throw "A scaled image can't be read from a stream";
+    }
+}
+
+uint32_t FitsStream::headerSum() const {
+    return fitsHeaderSum(header.data(), header.size());
+}
+
+void FitsStream::read(hsize_t offset, hsize_t size, float* destination) {
+    hsize_t start = offset * sizeof(float);
+    
+    if (start < position) {
+        throw "The input stream can only be read in order";
+    }
+    
+    if (start > position) {
+        std::vector<char> skipped(std::min(SKIP_BUFFER_SIZE, start - position));
+        
+        while (position < start) {
+            hsize_t count = std::min((hsize_t)skipped.size(), start - position);
+            readBytes(skipped.data(), count);
+            position += count;
+        }
+    }
+    
+    readBytes((char*)destination, size * sizeof(float));
+    position += size * sizeof(float);
+    
+    // The values are big-endian
+    for (hsize_t i = 0; i < size; i++) {
+        uint32_t word;
+        memcpy(&word, destination + i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        memcpy(destination + i, &word, sizeof(word));
+    }
+}
+
+void FitsStream::readBytes(char* destination, hsize_t size) {
+    hsize_t done(0);
+    
+    // A throttled read is split into blocks, which are paced evenly. A pipe often returns less than was asked for, so
+    // each read is counted after it returns, and the next one waits for it.
+    hsize_t blockSize = throttleReadBlock();
+    
+    while (done < size) {
+        hsize_t count = blockSize ? std::min(blockSize, size - done) : size - done;
+        ssize_t result;
+        {
+            IoCall call(IoSite::STREAM_READ, count);
+            result = ::read(fd, destination + done, count);
+            call.setBytes(std::max(result, (ssize_t)0));
+        }
+        
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if (result <= 0) {
+            throw "The input stream ended early";
+        }
+        
+        throttleRead(result);
+        done += result;
+    }
+}
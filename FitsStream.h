@@ -0,0 +1,50 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __FITSSTREAM_H
+#define __FITSSTREAM_H
+
+#include "common.h"
+
+// Reads a FITS file from a pipe in a single pass, without it ever landing on disk. The primary header is read first,
+// and opened with CFITSIO as a file in memory, so that the dimensions and keywords are read as usual. The data unit
+// is then read as it is needed. A read may skip ahead, but it can't go back, so the converters have to read the
+// channels in order, and read everything else again from the output.
+// The image has to be in the primary HDU, and it can't be scaled.
+class FitsStream {
+public:
+    // Standard input can only be read once, so every converter which is created for it shares this stream
+    static FitsStream& standardInput();
+    
+    // Read the header, unless it has already been read, and open it with CFITSIO. This can be called more than once
+    // before the data is read.
+    void open(fitsfile** filePtr);
+    
+    // Read size consecutive pixels, starting at a pixel index in the data unit, which can't be before the end of the
+    // previous read
+    void read(hsize_t offset, hsize_t size, float* destination);
+    
+    // The sum of the raw header blocks, for the FITS CHECKSUM
+    uint32_t headerSum() const;
+
+private:
+    FitsStream(int fd, std::string name) : fd(fd), name(name), headerAddress(nullptr), headerSize(0), position(0) {}
+    
+    // Read exactly size bytes, or fail
+    void readBytes(char* destination, hsize_t size);
+    
+    int fd;
+    std::string name;
+    
+    // CFITSIO keeps pointers to the address and size of the header, so these have to stay in place
+    std::vector<char> header;
+    void* headerAddress;
+    size_t headerSize;
+    
+    // Bytes of the data unit which have been read or skipped
+    hsize_t position;
+};
+
+#endif
@@ -0,0 +1,282 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Hdf5Stats.h"
+
+#include <iomanip>
+#include <map>
+
+static bool enabled(false);
+
+static std::vector<std::unique_ptr<FileStats>> files;
+
+// What the library is doing at the moment
+static DatasetStats* currentDataset(nullptr);
+static Hdf5StatsScope::Operation currentOperation(Hdf5StatsScope::OTHER);
+
+// The time of the library is only measured by the outermost scope, in case one is nested in another
+static int scopeDepth(0);
+
+// Counting file driver
+
+// The default driver, which does the actual I/O, and a copy of it which counts the reads and writes of each file
+static const H5FD_class_t* sec2Class(nullptr);
+static H5FD_class_t countingClass;
+static hid_t countingDriver(-1);
+static std::map<const H5FD_t*, FileStats*> openFiles;
+
+static void countIo(const H5FD_t* file, H5FD_mem_t type, size_t size, bool writing, double seconds) {
+    auto found = openFiles.find(file);
+    FileStats* fileStats = found == openFiles.end() ? nullptr : found->second;
+    
+    if (type != H5FD_MEM_DRAW) {
+        if (fileStats) {
+            if (writing) {
+                fileStats->metadataWrites++;
+            } else {
+                fileStats->metadataReads++;
+            }
+            fileStats->metadataBytes += size;
+        }
+    } else if (currentDataset) {
+        currentDataset->ioSeconds += seconds;
+        if (writing) {
+            currentDataset->rawWrites++;
+            currentDataset->bytesWritten += size;
+        } else {
+            if (currentOperation == Hdf5StatsScope::WRITE) {
+                currentDataset->writeMisses++;
+            } else {
+                currentDataset->readMisses++;
+            }
+            currentDataset->bytesRead += size;
+        }
+    } else if (fileStats) {
+        if (writing) {
+            fileStats->otherRawWrites++;
+        } else {
+            fileStats->otherRawReads++;
+        }
+    }
+}
+
+static H5FD_t* countingOpen(const char* name, unsigned flags, hid_t fapl, haddr_t maxaddr) {
+    H5FD_t* file = sec2Class->open(name, flags, fapl, maxaddr);
+    if (file) {
+        openFiles[file] = hdf5FileStats(name);
+    }
+    return file;
+}
+
+static herr_t countingClose(H5FD_t* file) {
+    openFiles.erase(file);
+    return sec2Class->close(file);
+}
+
+static herr_t countingRead(H5FD_t* file, H5FD_mem_t type, hid_t dxpl, haddr_t addr, size_t size, void* buffer) {
+    auto start = std::chrono::steady_clock::now();
+    herr_t result = sec2Class->read(file, type, dxpl, addr, size, buffer);
+    countIo(file, type, size, false, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return result;
+}
+
+static herr_t countingWrite(H5FD_t* file, H5FD_mem_t type, hid_t dxpl, haddr_t addr, size_t size, const void* buffer) {
+    auto start = std::chrono::steady_clock::now();
+    herr_t result = sec2Class->write(file, type, dxpl, addr, size, buffer);
+    countIo(file, type, size, true, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return result;
+}
+
+// Statistics
+
+void enableHdf5Stats() {
+    if (enabled) {
+        return;
+    }
+    
+    // The library has no public way to get the class of a driver, but a file which is opened with the driver points
+    // to it, and the class outlives the file
+    H5::FileAccPropList sec2AccessList;
+    H5Pset_fapl_sec2(sec2AccessList.getId());
+    H5FD_t* nullFile = H5FDopen("/dev/null", H5F_ACC_RDONLY, sec2AccessList.getId(), 1);
+    if (!nullFile) {
+        throw "Could not find the default HDF5 file driver";
+    }
+    sec2Class = nullFile->cls;
+    H5FDclose(nullFile);
+    
+    countingClass = *sec2Class;
+    countingClass.name = "fits2idia_counting_sec2";
+    // The copy must not reset the default driver when the library shuts down
+    countingClass.terminate = nullptr;
+    countingClass.open = countingOpen;
+    countingClass.close = countingClose;
+    countingClass.read = countingRead;
+    countingClass.write = countingWrite;
+    
+    countingDriver = H5FDregister(&countingClass);
+    if (countingDriver < 0) {
+        throw "Could not register the counting HDF5 file driver";
+    }
+    
+    enabled = true;
+}
+
+bool hdf5StatsEnabled() {
+    return enabled;
+}
+
+void setHdf5StatsDriver(H5::FileAccPropList& accessList) {
+    if (enabled) {
+        accessList.setDriver(countingDriver, nullptr);
+    }
+}
+
+FileStats* hdf5FileStats(const std::string& fileName) {
+    for (auto& file : files) {
+        if (file->fileName == fileName) {
+            return file.get();
+        }
+    }
+    
+    files.emplace_back(new FileStats());
+    files.back()->fileName = fileName;
+    return files.back().get();
+}
+
+void renameHdf5FileStats(const std::string& fileName, const std::string& newName) {
+    for (auto& file : files) {
+        if (file->fileName == fileName) {
+            file->fileName = newName;
+        }
+    }
+}
+
+DatasetStats* hdf5DatasetStats(FileStats* file, const std::string& path, const H5::DataSet& dataset) {
+    for (auto& datasetStats : file->datasets) {
+        if (datasetStats->path == path) {
+            return datasetStats.get();
+        }
+    }
+    
+    file->datasets.emplace_back(new DatasetStats());
+    DatasetStats* datasetStats = file->datasets.back().get();
+    datasetStats->path = path;
+    
+    auto propList = dataset.getCreatePlist();
+    datasetStats->numFilters = propList.getNfilters();
+    if (propList.getLayout() == H5D_CHUNKED) {
+        int N = dataset.getSpace().getSimpleExtentNdims();
+        datasetStats->chunkDims.resize(N);
+        propList.getChunk(N, datasetStats->chunkDims.data());
+    }
+    
+    return datasetStats;
+}
+
+void recordMetadataCache(FileStats* file, hid_t fileId) {
+    size_t minCleanSize;
+    if (H5Fget_mdc_hit_rate(fileId, &file->cacheHitRate) < 0 || H5Fget_mdc_size(fileId, &file->cacheMaxSize, &minCleanSize, &file->cacheSize, &file->cacheEntries) < 0) {
+        file->cacheHitRate = -1;
+    }
+}
+
+// Hdf5StatsScope
+
+Hdf5StatsScope::Hdf5StatsScope(DatasetStats* dataset, Operation operation) : previousDataset(currentDataset), previousOperation(currentOperation), startTime(std::chrono::steady_clock::now()) {
+    currentDataset = dataset;
+    currentOperation = operation;
+    scopeDepth++;
+}
+
+Hdf5StatsScope::~Hdf5StatsScope() {
+    scopeDepth--;
+    if (currentDataset && !scopeDepth) {
+        currentDataset->librarySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    
+    currentDataset = previousDataset;
+    currentOperation = previousOperation;
+}
+
+void Hdf5StatsScope::addLookups(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    if (!currentDataset || currentDataset->chunkDims.empty() || currentDataset->chunkDims.size() != count.size()) {
+        return;
+    }
+    
+    hsize_t numChunks(1);
+    hsize_t wholeChunks(1);
+    for (size_t i = 0; i < count.size(); i++) {
+        if (!count[i]) {
+            return;
+        }
+        hsize_t chunkDim = currentDataset->chunkDims[i];
+        hsize_t end = start[i] + count[i];
+        numChunks *= (end - 1) / chunkDim - start[i] / chunkDim + 1;
+        
+        // The chunks which lie entirely inside the selection along this axis
+        hsize_t firstWhole = (start[i] + chunkDim - 1) / chunkDim;
+        wholeChunks *= end / chunkDim > firstWhole ? end / chunkDim - firstWhole : 0;
+    }
+    
+    if (currentOperation == WRITE) {
+        // The library overwrites a whole chunk without reading it, or writes it directly if it doesn't fit in the
+        // cache, so neither is a hit
+        currentDataset->writeLookups += numChunks - wholeChunks;
+    } else {
+        currentDataset->readLookups += numChunks;
+    }
+}
+
+// Report
+
+static std::string chunkShape(const std::vector<hsize_t>& chunkDims) {
+    if (chunkDims.empty()) {
+        return "contiguous";
+    }
+    
+    std::ostringstream shape;
+    for (size_t i = 0; i < chunkDims.size(); i++) {
+        shape << (i ? "x" : "") << chunkDims[i];
+    }
+    return shape.str();
+}
+
+void printHdf5Stats() {
+    if (!enabled) {
+        return;
+    }
+    
+    for (auto& file : files) {
+        std::cout << std::endl << "HDF5 file " << file->fileName << ":" << std::endl;
+        
+        if (file->cacheHitRate >= 0) {
+            std::cout << std::fixed << std::setprecision(1) << "Metadata cache: " << file->cacheHitRate * 100 << "% hit rate, " << std::setprecision(2) << file->cacheSize * 1e-6 << " MB of " << file->cacheMaxSize * 1e-6 << " MB in " << file->cacheEntries << " entries" << std::defaultfloat << std::setprecision(6) << std::endl;
+        }
+        std::cout << "Metadata I/O: " << file->metadataReads << " reads and " << file->metadataWrites << " writes (" << std::fixed << std::setprecision(2) << file->metadataBytes * 1e-6 << " MB)" << std::defaultfloat << std::setprecision(6) << std::endl;
+        if (file->otherRawReads || file->otherRawWrites) {
+            std::cout << "Raw data I/O outside of any dataset: " << file->otherRawReads << " reads and " << file->otherRawWrites << " writes" << std::endl;
+        }
+        
+        // The hits and misses are estimates, and only chunked datasets have a chunk cache
+        std::cout << std::left << std::setw(32) << "Dataset" << std::setw(14) << "Chunks" << std::right << std::setw(11) << "Read hits*" << std::setw(13) << "Read misses*" << std::setw(12) << "Write hits*" << std::setw(14) << "Write misses*" << std::setw(12) << "Raw writes" << std::setw(10) << "MB read" << std::setw(12) << "MB written" << std::setw(10) << "Filters" << std::setw(11) << "CPU (ms)" << std::setw(11) << "I/O (ms)" << std::endl;
+        
+        for (auto& dataset : file->datasets) {
+            // Chunks which had to be read again after they were evicted count as misses without a hit
+            hsize_t readHits = dataset->readLookups > dataset->readMisses ? dataset->readLookups - dataset->readMisses : 0;
+            hsize_t writeHits = dataset->writeLookups > dataset->writeMisses ? dataset->writeLookups - dataset->writeMisses : 0;
+            
+            std::cout << std::left << std::setw(32) << dataset->path << std::setw(14) << chunkShape(dataset->chunkDims) << std::right;
+            if (dataset->chunkDims.empty()) {
+                std::cout << std::setw(11) << "-" << std::setw(13) << "-" << std::setw(12) << "-" << std::setw(14) << "-";
+            } else {
+                std::cout << std::setw(11) << readHits << std::setw(13) << dataset->readMisses << std::setw(12) << writeHits << std::setw(14) << dataset->writeMisses;
+            }
+            std::cout << std::setw(12) << dataset->rawWrites << std::fixed << std::setprecision(1) << std::setw(10) << dataset->bytesRead * 1e-6 << std::setw(12) << dataset->bytesWritten * 1e-6 << std::setw(10) << dataset->numFilters << std::setw(11) << std::max(0.0, dataset->librarySeconds - dataset->ioSeconds) * 1e3 << std::setw(11) << dataset->ioSeconds * 1e3 << std::defaultfloat << std::setprecision(6) << std::endl;
+        }
+        
+        std::cout << "* Estimated from the chunks touched by each read and write of a chunked dataset" << std::endl;
+    }
+}
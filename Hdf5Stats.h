@@ -0,0 +1,97 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __HDF5STATS_H
+#define __HDF5STATS_H
+
+#include "common.h"
+
+// What the HDF5 library did for one dataset. The chunk lookups are the chunks which were touched by the reads and
+// writes of the dataset; the chunk cache serves them, unless it has to read the chunk from the file (a miss). HDF5
+// doesn't count its chunk cache hits, so they are estimated as the lookups which didn't need a read. A write which
+// covers a whole chunk never reads it, so it is not a lookup.
+struct DatasetStats {
+    DatasetStats() : numFilters(0), readLookups(0), writeLookups(0), readMisses(0), writeMisses(0), rawWrites(0), bytesRead(0), bytesWritten(0), librarySeconds(0), ioSeconds(0) {}
+    
+    std::string path;
+    std::vector<hsize_t> chunkDims;
+    int numFilters;
+    
+    hsize_t readLookups;
+    hsize_t writeLookups;
+    // Raw data reads from the file during reads, and during writes to chunks which were not cached
+    hsize_t readMisses;
+    hsize_t writeMisses;
+    // Raw data writes to the file, of chunks which were evicted or flushed, or written directly
+    hsize_t rawWrites;
+    hsize_t bytesRead;
+    hsize_t bytesWritten;
+    
+    // The time spent in the library for this dataset, and the part of it which was spent in the file driver. The rest
+    // is the CPU time of the library, which is mostly spent in the filters if the dataset is compressed.
+    double librarySeconds;
+    double ioSeconds;
+};
+
+// The metadata of one file, and the I/O which can't be attributed to a dataset
+struct FileStats {
+    FileStats() : metadataReads(0), metadataWrites(0), metadataBytes(0), otherRawReads(0), otherRawWrites(0), cacheHitRate(-1), cacheMaxSize(0), cacheSize(0), cacheEntries(0) {}
+    
+    std::string fileName;
+    hsize_t metadataReads;
+    hsize_t metadataWrites;
+    hsize_t metadataBytes;
+    hsize_t otherRawReads;
+    hsize_t otherRawWrites;
+    
+    // The metadata cache, when the file was closed (a hit rate of -1 if it wasn't recorded)
+    double cacheHitRate;
+    size_t cacheMaxSize;
+    size_t cacheSize;
+    int cacheEntries;
+    
+    std::vector<std::unique_ptr<DatasetStats>> datasets;
+};
+
+// Collect the statistics of the HDF5 files which are created or updated from now on. The files are opened with a
+// copy of the default file driver which counts and times the reads and writes. Everything is counted from inside
+// the HDF5 library, so it has to be used by one thread at a time.
+void enableHdf5Stats();
+bool hdf5StatsEnabled();
+
+// Set the counting driver, and get the statistics of a file
+void setHdf5StatsDriver(H5::FileAccPropList& accessList);
+FileStats* hdf5FileStats(const std::string& fileName);
+// Report a file under its final name, once it has been renamed
+void renameHdf5FileStats(const std::string& fileName, const std::string& newName);
+DatasetStats* hdf5DatasetStats(FileStats* file, const std::string& path, const H5::DataSet& dataset);
+// Call before the file is closed
+void recordMetadataCache(FileStats* file, hid_t fileId);
+
+// Attributes the I/O and the time of the HDF5 library to a dataset while it exists, and counts the chunks which are
+// touched by a read or a write of a hyperslab
+class Hdf5StatsScope {
+public:
+    enum Operation {
+        OTHER,
+        READ,
+        WRITE
+    };
+    
+    Hdf5StatsScope(DatasetStats* dataset, Operation operation = OTHER);
+    ~Hdf5StatsScope();
+    
+    void addLookups(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+
+private:
+    DatasetStats* previousDataset;
+    Operation previousOperation;
+    std::chrono::time_point<std::chrono::steady_clock> startTime;
+};
+
+// Call once the files have been closed, so that their metadata has been written
+void printHdf5Stats();
+
+#endif
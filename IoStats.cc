@@ -0,0 +1,116 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "IoStats.h"
+
+#include <array>
+#include <iomanip>
+#include <mutex>
+
+// The histograms have this many buckets per doubling of the latency, so a percentile is known to within about 9%,
+// from 1 microsecond up to about 18 minutes
+#define LATENCY_BUCKETS_PER_DOUBLING 8
+#define NUM_LATENCY_BUCKETS (30 * LATENCY_BUCKETS_PER_DOUBLING)
+#define MIN_LATENCY 1e-6
+
+static const char* siteName(IoSite site) {
+    switch (site) {
+        case IoSite::FITS_READ:
+            return "FITS read";
+        case IoSite::FITS_SUBSET_READ:
+            return "FITS subset read";
+        case IoSite::DIRECT_READ:
+            return "Direct read";
+        case IoSite::STREAM_READ:
+            return "Stream read";
+        case IoSite::HDF5_READ:
+            return "HDF5 read";
+        case IoSite::HDF5_WRITE:
+            return "HDF5 write";
+        case IoSite::HDF5_CHUNK_WRITE:
+            return "HDF5 chunk write";
+        case IoSite::HDF5_APPEND:
+            return "HDF5 append";
+        case IoSite::HDF5_IMAGE_WRITE:
+            return "HDF5 file image write";
+        case IoSite::STORE_READ:
+            return "Store read";
+        case IoSite::STORE_WRITE:
+            return "Store write";
+        default:
+            return "";
+    }
+}
+
+struct LatencyHistogram {
+    LatencyHistogram() : calls(0), bytes(0), maxSeconds(0) {
+        buckets.fill(0);
+    }
+    
+    static int bucket(double seconds) {
+        if (seconds <= MIN_LATENCY) {
+            return 0;
+        }
+        int index = std::log2(seconds / MIN_LATENCY) * LATENCY_BUCKETS_PER_DOUBLING + 1;
+        return std::min(index, NUM_LATENCY_BUCKETS - 1);
+    }
+    
+    // The upper bound of a bucket
+    static double bucketLatency(int index) {
+        return MIN_LATENCY * std::exp2((double)index / LATENCY_BUCKETS_PER_DOUBLING);
+    }
+    
+    void add(double seconds, hsize_t size) {
+        buckets[bucket(seconds)]++;
+        calls++;
+        bytes += size;
+        maxSeconds = std::max(maxSeconds, seconds);
+    }
+    
+    // The latency below which this fraction of the calls finished, to within a bucket, but never above the maximum
+    double percentile(double fraction) const {
+        hsize_t rank = std::ceil(fraction * calls);
+        hsize_t count(0);
+        
+        for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+            count += buckets[i];
+            if (count >= rank) {
+                return std::min(bucketLatency(i), maxSeconds);
+            }
+        }
+        
+        return maxSeconds;
+    }
+    
+    std::array<hsize_t, NUM_LATENCY_BUCKETS> buckets;
+    hsize_t calls;
+    hsize_t bytes;
+    double maxSeconds;
+};
+
+static std::mutex latencyMutex;
+static std::array<LatencyHistogram, (int)IoSite::NUM_SITES> histograms;
+
+IoCall::~IoCall() {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    histograms[(int)site].add(seconds, bytes);
+}
+
+void printIoLatencies() {
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    
+    std::cout << std::endl << std::left << std::setw(24) << "I/O latency" << std::right << std::setw(10) << "calls" << std::setw(12) << "MB" << std::setw(12) << "p50 (ms)" << std::setw(12) << "p99 (ms)" << std::setw(12) << "max (ms)" << std::endl;
+    
+    for (int i = 0; i < (int)IoSite::NUM_SITES; i++) {
+        auto& histogram = histograms[i];
+        if (!histogram.calls) {
+            continue;
+        }
+        
+        std::cout << std::left << std::setw(24) << siteName((IoSite)i) << std::right << std::setw(10) << histogram.calls << std::fixed << std::setprecision(1) << std::setw(12) << histogram.bytes * 1e-6 << std::setprecision(3) << std::setw(12) << histogram.percentile(0.5) * 1e3 << std::setw(12) << histogram.percentile(0.99) * 1e3 << std::setw(12) << histogram.maxSeconds * 1e3 << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+}
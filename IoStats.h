@@ -0,0 +1,49 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __IOSTATS_H
+#define __IOSTATS_H
+
+#include "common.h"
+
+// The places where the converter reads or writes a file. Each of them gets its own latency histogram.
+enum class IoSite {
+    FITS_READ,
+    FITS_SUBSET_READ,
+    DIRECT_READ,
+    STREAM_READ,
+    HDF5_READ,
+    HDF5_WRITE,
+    HDF5_CHUNK_WRITE,
+    HDF5_APPEND,
+    HDF5_IMAGE_WRITE,
+    STORE_READ,
+    STORE_WRITE,
+    NUM_SITES
+};
+
+// Measures the latency of one read or write, from its construction to its destruction, and adds it to the histogram
+// of its site. Construct it after any throttling and locking, so that only the time in the library or the system call
+// is measured. It can be used from any thread.
+class IoCall {
+public:
+    IoCall(IoSite site, hsize_t bytes) : site(site), bytes(bytes), startTime(std::chrono::steady_clock::now()) {}
+    ~IoCall();
+    
+    // For a call which turns out to transfer a different number of bytes, like a short read
+    void setBytes(hsize_t bytes) {
+        this->bytes = bytes;
+    }
+
+private:
+    IoSite site;
+    hsize_t bytes;
+    std::chrono::time_point<std::chrono::steady_clock> startTime;
+};
+
+// The number of calls, the bytes and the p50, p99 and maximum latency of each site which was used
+void printIoLatencies();
+
+#endif
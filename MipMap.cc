@@ -5,36 +5,135 @@
 
 #include "MipMap.h"
 
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// Half precision conversion
+
+// Round to nearest even. Based on the branch-light conversion by Fabian Giesen; this loop is vectorised by the compiler
+// if we can't use the F16C instructions.
+static void convertToHalf(const double* source, uint16_t* destination, hsize_t size) {
+    hsize_t i = 0;
+    
+#ifdef __F16C__
+    for (; i + 8 <= size; i += 8) {
+        __m256 vals = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(source + i + 4)), _mm256_cvtpd_ps(_mm256_loadu_pd(source + i)));
+        _mm_storeu_si128((__m128i*)(destination + i), _mm256_cvtps_ph(vals, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    
+    const uint32_t denormMagicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+    float denormMagic;
+    memcpy(&denormMagic, &denormMagicBits, sizeof(float));
+    
+    for (; i < size; i++) {
+        float val = source[i];
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(float));
+        
+        uint32_t sign = bits & 0x80000000u;
+        bits ^= sign;
+        uint16_t result;
+        
+        if (bits >= 0x47800000u) {
+            // Infinity or NaN (all NaNs become quiet NaNs)
+            result = bits > 0x7f800000u ? 0x7e00 : 0x7c00;
+        } else if (bits < 0x38800000u) {
+            // Subnormal or zero: use the FPU to align the mantissa at the bottom of the float
+            float f;
+            memcpy(&f, &bits, sizeof(float));
+            f += denormMagic;
+            uint32_t fBits;
+            memcpy(&fBits, &f, sizeof(float));
+            result = fBits - denormMagicBits;
+        } else {
+            uint32_t mantissaOdd = (bits >> 13) & 1;
+            bits += ((uint32_t)(15 - 127) << 23) + 0xfff + mantissaOdd;
+            result = bits >> 13;
+        }
+        
+        destination[i] = result | (sign >> 16);
+    }
+}
+
+static void convertToBFloat16(const double* source, uint16_t* destination, hsize_t size) {
+    for (hsize_t i = 0; i < size; i++) {
+        float val = source[i];
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(float));
+        
+        if ((bits & 0x7fffffffu) > 0x7f800000u) {
+            // Keep NaNs quiet, so that they don't turn into infinity
+            destination[i] = (bits >> 16) | 0x40;
+        } else {
+            destination[i] = (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+        }
+    }
+}
+
 // MipMap
 
-MipMap::MipMap(const std::vector<hsize_t>& datasetDims, int mip) : datasetDims(datasetDims), mip(mip) {}
+MipMap::MipMap(const std::vector<hsize_t>& datasetDims, int mip, MipMapType type) : datasetDims(datasetDims), mip(mip), type(type), ownsBuffers(false) {}
 
 MipMap::~MipMap() {
-    if (!bufferDims.empty()) {
-        delete[] vals;
-        delete[] count;
+    if (ownsBuffers) {
+        delete[] memory;
     }
 }
 
-void MipMap::createDataset(H5::Group group, const std::vector<hsize_t>& chunkDims) {
-    H5::FloatType floatType(H5::PredType::NATIVE_FLOAT);
-    floatType.setOrder(H5T_ORDER_LE);
+hsize_t MipMap::size(const std::vector<hsize_t>& bufferDims) {
+    // Rounded up, so that consecutive mipmaps in the same memory stay aligned
+    hsize_t size = (sizeof(double) + sizeof(int)) * product(bufferDims);
+    return (size + 63) / 64 * 64;
+}
+
+void MipMap::createDataset(OutputGroup group, const std::vector<hsize_t>& chunkDims, int compression, bool checksums) {
+    DataType dataType = type == MipMapType::HALF ? DataType::HALF : type == MipMapType::BFLOAT16 ? DataType::BFLOAT16 : DataType::FLOAT;
     
     std::ostringstream mipMapName;
     mipMapName << "MipMaps/DATA/DATA_XY_" << mip;
     
-    if (useChunks(datasetDims)) {
-        createHdf5Dataset(dataset, group, mipMapName.str(), floatType, datasetDims, chunkDims);
+    std::vector<hsize_t> datasetChunkDims;
+    
+    if (useChunks(datasetDims, chunkDims)) {
+        datasetChunkDims = chunkDims;
+        dataset = group.createDataset(mipMapName.str(), dataType, datasetDims, chunkDims, compression);
+    } else if (checksums) {
+        // Chunk checksums need a chunked dataset, so a mipmap which is smaller than a chunk gets a smaller chunk
+        for (size_t i = 0; i < chunkDims.size(); i++) {
+            datasetChunkDims.push_back(std::min(chunkDims[i], datasetDims[i]));
+        }
+        dataset = group.createDataset(mipMapName.str(), dataType, datasetDims, datasetChunkDims, compression);
     } else {
-        createHdf5Dataset(dataset, group, mipMapName.str(), floatType, datasetDims);
+        dataset = group.createDataset(mipMapName.str(), dataType, datasetDims);
     }
+    
+    if (checksums) {
+        this->checksums = ChunkChecksums(datasetDims, datasetChunkDims);
+        this->checksums.createDataset(group, mipMapName.str());
+    }
+}
+
+void MipMap::openDataset(OutputGroup group) {
+    std::ostringstream mipMapName;
+    mipMapName << "MipMaps/DATA/DATA_XY_" << mip;
+    
+    dataset = group.openDataset(mipMapName.str());
+    type = dataset->type == DataType::HALF ? MipMapType::HALF : dataset->type == DataType::BFLOAT16 ? MipMapType::BFLOAT16 : MipMapType::FLOAT;
 }
 
-void MipMap::createBuffers(std::vector<hsize_t>& bufferDims) {
+void MipMap::createBuffers(std::vector<hsize_t>& bufferDims, char* memory) {
     bufferSize = product(bufferDims);
     
-    vals = new double[bufferSize];
-    count = new int[bufferSize];
+    ownsBuffers = !memory;
+    if (ownsBuffers) {
+        memory = new char[size(bufferDims)];
+    }
+    
+    this->memory = memory;
+    vals = (double*)memory;
+    count = (int*)(vals + bufferSize);
     
     resetBuffers();
     
@@ -48,12 +147,57 @@ void MipMap::createBuffers(std::vector<hsize_t>& bufferDims) {
     stokes = N > 3 ? bufferDims[N - 4] : 1;        
 }
 
-void MipMap::write(hsize_t stokesOffset, hsize_t channelOffset) {
+void MipMap::write(hsize_t stokesOffset, hsize_t channelOffset, const Quantizer& quantizer, hsize_t numChannels, hsize_t bufferChannelOffset) {
     int N = datasetDims.size();
-    std::vector<hsize_t> count = trimAxes({1, depth, height, width}, N);
+    
+    if (!numChannels) {
+        numChannels = depth;
+    }
+    
+    hsize_t channelSize = width * height;
+    hsize_t writeSize = numChannels * channelSize;
+    double* source = vals + bufferChannelOffset * channelSize;
+    
+    // The buffers are reset after they are written, so we can round them in place.
+    // The rounded values are exactly representable in the single precision dataset.
+    if (quantizer.enabled()) {
+        hsize_t datasetDepth = N > 2 ? datasetDims[N - 3] : 1;
+        for (hsize_t mipIndex = 0; mipIndex < writeSize; mipIndex++) {
+            hsize_t channelIndex = stokesOffset * datasetDepth + channelOffset + mipIndex / channelSize;
+            source[mipIndex] = quantizer.round(source[mipIndex], channelIndex, mip);
+        }
+    }
+    
+    std::vector<hsize_t> memDims = bufferDims;
+    if (memDims.size() > 2) {
+        memDims[memDims.size() - 3] = numChannels;
+    }
+    
+    std::vector<hsize_t> count = trimAxes({1, numChannels, height, width}, N);
     std::vector<hsize_t> start = trimAxes({stokesOffset, channelOffset, 0, 0}, N);
     
-    writeHdf5Data(dataset, vals, bufferDims, count, start);
+    if (type == MipMapType::FLOAT) {
+        if (checksums.enabled()) {
+            checksums.calculate(source, count, start);
+        }
+        
+        dataset->write(source, memDims, count, start);
+    } else {
+        // We do the conversion ourselves, because HDF5's conversion to custom float types is very slow
+        std::vector<uint16_t> converted(writeSize);
+        
+        if (type == MipMapType::HALF) {
+            convertToHalf(source, converted.data(), writeSize);
+        } else {
+            convertToBFloat16(source, converted.data(), writeSize);
+        }
+        
+        if (checksums.enabled()) {
+            checksums.calculate(converted.data(), count, start);
+        }
+        
+        dataset->write(converted.data(), memDims, count, start);
+    }
 }
 
 void MipMap::resetBuffers() {
@@ -61,9 +205,15 @@ void MipMap::resetBuffers() {
     memset(count, 0, sizeof(int) * bufferSize);
 }
 
+void MipMap::resetBuffers(hsize_t bufferChannelOffset, hsize_t numChannels) {
+    hsize_t channelSize = width * height;
+    memset(vals + bufferChannelOffset * channelSize, 0, sizeof(double) * numChannels * channelSize);
+    memset(count + bufferChannelOffset * channelSize, 0, sizeof(int) * numChannels * channelSize);
+}
+
 // MipMaps
 
-MipMaps::MipMaps(std::vector<hsize_t> standardDims, const std::vector<hsize_t>& chunkDims) : standardDims(standardDims), chunkDims(chunkDims) {
+MipMaps::MipMaps(std::vector<hsize_t> standardDims, const std::vector<hsize_t>& chunkDims, MipMapType type) : standardDims(standardDims), chunkDims(chunkDims), type(type) {
     auto dims = standardDims;
     int N = dims.size();
     int mip = 1;
@@ -72,11 +222,22 @@ MipMaps::MipMaps(std::vector<hsize_t> standardDims, const std::vector<hsize_t>&
     while (dims[N - 1] > MIN_MIPMAP_SIZE || dims[N - 2] > MIN_MIPMAP_SIZE) {
         mip *= 2;
         dims = mipDims(dims, 2);
-        mipMaps.push_back(MipMap(dims, mip));
+        mipMaps.push_back(MipMap(dims, mip, type));
     }
 }
 
-hsize_t MipMaps::size(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims) {
+hsize_t MipMaps::size(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims, MipMapType type) {
+    hsize_t size = 0;
+    
+    // The mipmaps are written one at a time, so we need one conversion buffer for the largest one
+    if (type != MipMapType::FLOAT) {
+        size += sizeof(uint16_t) * product(mipDims(standardBufferDims, 2));
+    }
+    
+    return size + bufferSize(standardDims, standardBufferDims);
+}
+
+hsize_t MipMaps::bufferSize(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims) {
     hsize_t size = 0;
     int mip = 1;
     auto datasetDims = standardDims;
@@ -87,29 +248,54 @@ hsize_t MipMaps::size(const std::vector<hsize_t>& standardDims, const std::vecto
         mip *= 2;
         datasetDims = mipDims(datasetDims, 2);
         bufferDims = mipDims(bufferDims, 2);
-        size += (sizeof(double) + sizeof(int)) * product(bufferDims);
+        size += MipMap::size(bufferDims);
     }
 
     return size;
 }
 
-void MipMaps::createDatasets(H5::Group group) {
+void MipMaps::createDatasets(OutputGroup group, int compression, bool checksums) {
+    for (auto& mipMap : mipMaps) {
+        mipMap.createDataset(group, chunkDims, compression, checksums);
+    }
+    
+}
+
+bool MipMaps::openDatasets(OutputGroup group) {
+    if (mipMaps.empty() || !group.exists("MipMaps/DATA")) {
+        return false;
+    }
+    
     for (auto& mipMap : mipMaps) {
-        mipMap.createDataset(group, chunkDims);
+        mipMap.openDataset(group);
+        type = mipMap.type;
     }
     
+    return true;
 }
 
-void MipMaps::createBuffers(const std::vector<hsize_t>& standardBufferDims) {
+void MipMaps::createBuffers(const std::vector<hsize_t>& standardBufferDims, char* memory) {
     for (auto& mipMap : mipMaps) {
         auto dims = mipDims(standardBufferDims, mipMap.mip);
-        mipMap.createBuffers(dims);
+        mipMap.createBuffers(dims, memory);
+        
+        if (memory) {
+            memory += MipMap::size(dims);
+        }
+    }
+}
+
+void MipMaps::write(hsize_t stokesOffset, hsize_t channelOffset, const Quantizer& quantizer, hsize_t numChannels, hsize_t bufferChannelOffset) {
+    for (auto& mipMap : mipMaps) {
+        mipMap.write(stokesOffset, channelOffset, quantizer, numChannels, bufferChannelOffset);
     }
 }
 
-void MipMaps::write(hsize_t stokesOffset, hsize_t channelOffset) {
+void MipMaps::writeChecksums() {
     for (auto& mipMap : mipMaps) {
-        mipMap.write(stokesOffset, channelOffset);
+        if (mipMap.checksums.enabled()) {
+            mipMap.checksums.write();
+        }
     }
 }
 
@@ -118,3 +304,9 @@ void MipMaps::resetBuffers() {
         mipMap.resetBuffers();
     }
 }
+
+void MipMaps::resetBuffers(hsize_t bufferChannelOffset, hsize_t numChannels) {
+    for (auto& mipMap : mipMaps) {
+        mipMap.resetBuffers(bufferChannelOffset, numChannels);
+    }
+}
@@ -8,15 +8,30 @@
 
 #include "common.h"
 #include "Util.h"
+#include "Quantizer.h"
+#include "Output.h"
+#include "Checksum.h"
+
+// Storage type of the mipmap datasets. The mipmaps are only used for display, so they can optionally be stored
+// at half precision (IEEE binary16, or bfloat16 which has the same range as single precision).
+enum class MipMapType {
+    FLOAT,
+    HALF,
+    BFLOAT16
+};
 
 // A single mipmap
 struct MipMap {
-    MipMap() {};
-    MipMap(const std::vector<hsize_t>& datasetDims, int mip);
+    MipMap() : ownsBuffers(false) {};
+    MipMap(const std::vector<hsize_t>& datasetDims, int mip, MipMapType type = MipMapType::FLOAT);
     ~MipMap();
     
-    void createDataset(H5::Group group, const std::vector<hsize_t>& chunkDims);
-    void createBuffers(std::vector<hsize_t>& bufferDims);
+    void createDataset(OutputGroup group, const std::vector<hsize_t>& chunkDims, int compression = 0, bool checksums = false);
+    // Open the dataset of an existing file, and take the storage type from it
+    void openDataset(OutputGroup group);
+    static hsize_t size(const std::vector<hsize_t>& bufferDims);
+    // The buffers are allocated unless memory which is owned by someone else is passed in
+    void createBuffers(std::vector<hsize_t>& bufferDims, char* memory = nullptr);
     
     void accumulate(double val, hsize_t x, hsize_t y, hsize_t totalChannelOffset) {
         hsize_t mipIndex = totalChannelOffset * width * height + (y / mip) * width + (x / mip);
@@ -25,7 +40,16 @@ struct MipMap {
     }
 
     void calculate() {
-        for (hsize_t mipIndex = 0; mipIndex < bufferSize; mipIndex++) {
+        calculate(0, bufferSize);
+    }
+    
+    // Finalise a single channel, so that channels can be processed independently
+    void calculate(hsize_t totalChannelOffset) {
+        calculate(totalChannelOffset * width * height, width * height);
+    }
+    
+    void calculate(hsize_t offset, hsize_t size) {
+        for (hsize_t mipIndex = offset; mipIndex < offset + size; mipIndex++) {
             if (count[mipIndex]) {
                 vals[mipIndex] /= count[mipIndex];
             } else {
@@ -34,13 +58,17 @@ struct MipMap {
         }
     }
     
-    void write(hsize_t stokesOffset, hsize_t channelOffset);
+    // Only numChannels channels of the buffer, starting at bufferChannelOffset, are written (0 means all of them)
+    void write(hsize_t stokesOffset, hsize_t channelOffset, const Quantizer& quantizer, hsize_t numChannels = 0, hsize_t bufferChannelOffset = 0);
     void resetBuffers();
+    void resetBuffers(hsize_t bufferChannelOffset, hsize_t numChannels);
     
     std::vector<hsize_t> datasetDims;
     int mip;
+    MipMapType type;
     
-    H5::DataSet dataset;
+    std::shared_ptr<OutputDataset> dataset;
+    ChunkChecksums checksums;
     
     std::vector<hsize_t> bufferDims;
     hsize_t bufferSize;
@@ -50,6 +78,8 @@ struct MipMap {
     hsize_t depth;
     hsize_t stokes;
     
+    char* memory;
+    bool ownsBuffers;
     double* vals;
     int* count;
 };
@@ -57,13 +87,17 @@ struct MipMap {
 // A set of mipmaps
 struct MipMaps {
     MipMaps() {};
-    MipMaps(std::vector<hsize_t> standardDims, const std::vector<hsize_t>& chunkDims);
+    MipMaps(std::vector<hsize_t> standardDims, const std::vector<hsize_t>& chunkDims, MipMapType type = MipMapType::FLOAT);
     
     // We need the dataset dimensions to work out how many mipmaps we have
-    static hsize_t size(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims);
+    static hsize_t size(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims, MipMapType type = MipMapType::FLOAT);
+    // The size of the buffers only
+    static hsize_t bufferSize(const std::vector<hsize_t>& standardDims, const std::vector<hsize_t>& standardBufferDims);
     
-    void createDatasets(H5::Group group);
-    void createBuffers(const std::vector<hsize_t>& standardBufferDims);
+    void createDatasets(OutputGroup group, int compression = 0, bool checksums = false);
+    // Returns false if the file has no mipmaps
+    bool openDatasets(OutputGroup group);
+    void createBuffers(const std::vector<hsize_t>& standardBufferDims, char* memory = nullptr);
     
     void accumulate(double val, hsize_t x, hsize_t y, hsize_t totalChannelOffset) {
         for (auto& mipMap : mipMaps) {
@@ -77,14 +111,23 @@ struct MipMaps {
         }
     }
     
+    void calculate(hsize_t totalChannelOffset) {
+        for (auto& mipMap : mipMaps) {
+            mipMap.calculate(totalChannelOffset);
+        }
+    }
+    
     // TODO if we ever want a tiled mipmap calculation
     // we'll need to implement options to pass in custom buffer dims
     // and additional x and y offsets
-    void write(hsize_t stokesOffset, hsize_t channelOffset);
+    void write(hsize_t stokesOffset, hsize_t channelOffset, const Quantizer& quantizer = Quantizer(), hsize_t numChannels = 0, hsize_t bufferChannelOffset = 0);
+    void writeChecksums();
     void resetBuffers();
+    void resetBuffers(hsize_t bufferChannelOffset, hsize_t numChannels);
     
     std::vector<hsize_t> standardDims;
     std::vector<hsize_t> chunkDims;
+    MipMapType type;
     
     std::vector<MipMap> mipMaps;
 };
@@ -0,0 +1,151 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "MultiConverter.h"
+
+#include <thread>
+
+// The number of channels which the broadcast keeps, so that the outputs can drift apart a little
+#define BROADCAST_SLOTS (hsize_t)4
+
+MultiConverter::MultiConverter(std::string inputFileName, const std::vector<OutputSpec>& outputs, hsize_t memoryLimit) : outputs(outputs) {
+    broadcast.reset(new ChannelBroadcast(inputFileName, BROADCAST_SLOTS));
+    
+    // Each output is converted with the fast method, unless the slow method was chosen for it
+    for (auto& output : this->outputs) {
+        // The broadcast reads the input for all the outputs
+        if (output.options.directIO) {
+            std::cout << "Warning: the input is shared by several outputs, so it is not read with direct I/O." << std::endl;
+            output.options.directIO = false;
+        }
+        
+        if (output.options.slow) {
+            converters.emplace_back(new SlowConverter(inputFileName, output.fileName, output.options));
+        } else {
+            converters.emplace_back(new FastConverter(inputFileName, output.fileName, output.options));
+        }
+        
+        memoryUsages.push_back(converters.back()->calculateMemoryUsage().total);
+    }
+    
+    // If the outputs don't fit in the available memory together, the largest fast outputs are converted with the
+    // slow method instead, one at a time, with the memory which is left by the others. The slow method has to read
+    // rounded data from the input again, so outputs with lossy rounding stay fast.
+    hsize_t available = availableMemory();
+    if (memoryLimit) {
+        available = std::min(available, memoryLimit);
+    }
+    
+    std::vector<bool> fixed;
+    for (auto& output : this->outputs) {
+        fixed.push_back(output.options.slow || output.options.keepBits || output.options.noiseFraction > 0);
+    }
+    
+    while (calculateMemoryUsage() > available) {
+        int largest(-1);
+        for (int i = 0; i < (int)converters.size(); i++) {
+            if (!fixed[i] && (largest < 0 || memoryUsages[i] > memoryUsages[largest])) {
+                largest = i;
+            }
+        }
+        
+        if (largest < 0) {
+            break;
+        }
+        
+        fixed[largest] = true;
+        
+        hsize_t others = calculateMemoryUsage() - memoryUsages[largest];
+        OutputSpec& output = this->outputs[largest];
+        ConverterOptions slowOptions = output.options;
+        slowOptions.slow = true;
+        // The smallest possible limit still leaves the slow method its smallest buffers
+        slowOptions.memoryLimit = available > others ? available - others : 1;
+        
+        std::unique_ptr<Converter> slowConverter(new SlowConverter(inputFileName, output.fileName, slowOptions));
+        hsize_t slowUsage = slowConverter->calculateMemoryUsage().total;
+        
+        if (slowUsage < memoryUsages[largest]) {
+            std::cout << "Warning: the outputs don't fit in the " << available * 1e-9 << " GB of available memory together, so " << output.fileName << " is converted with the slow method." << std::endl;
+            output.options = slowOptions;
+            converters[largest] = std::move(slowConverter);
+            memoryUsages[largest] = slowUsage;
+        }
+    }
+    
+    for (int i = 0; i < (int)converters.size(); i++) {
+        auto& options = this->outputs[i].options;
+        hsize_t numChannels = options.channelCount ? options.channelCount : broadcast->depth - options.channelOffset;
+        converters[i]->shareInput(broadcast.get(), broadcast->addConsumer(options.channelOffset, numChannels));
+    }
+}
+
+hsize_t MultiConverter::calculateMemoryUsage() {
+    hsize_t total = ChannelBroadcast::size(BROADCAST_SLOTS, broadcast->height, broadcast->width);
+    
+    for (auto& usage : memoryUsages) {
+        total += usage;
+    }
+    
+    return total;
+}
+
+void MultiConverter::reportMemoryUsage() {
+    for (int i = 0; i < (int)converters.size(); i++) {
+        std::cout << "OUTPUT " << outputs[i].fileName << (outputs[i].options.slow ? " (slow method)" : "") << ":" << std::endl;
+        converters[i]->reportMemoryUsage();
+        std::cout << std::endl;
+    }
+    
+    std::cout << "Shared input channels:\t" << ChannelBroadcast::size(BROADCAST_SLOTS, broadcast->height, broadcast->width) * 1e-9 << " GB" << std::endl;
+    
+    hsize_t total = calculateMemoryUsage();
+    std::cout << "TOTAL FOR ALL OUTPUTS:\t" << total * 1e-9 << "GB" << std::endl;
+    
+    hsize_t available = availableMemory();
+    if (total > available) {
+        std::cout << "This exceeds the " << available * 1e-9 << " GB of available memory, so some of the buffers will be backed by scratch files." << std::endl;
+    }
+}
+
+void MultiConverter::convert() {
+    // Each output is converted on its own thread. The HDF5 library is only used by one of them at a time, but the
+    // statistics, mipmaps and rotations of the different outputs are calculated in parallel.
+    std::vector<std::thread> threads;
+    std::vector<std::string> errors(converters.size());
+    
+    for (int i = 0; i < (int)converters.size(); i++) {
+        threads.emplace_back([this, i, &errors] {
+            try {
+                converters[i]->convert();
+            } catch (const char* msg) {
+                errors[i] = msg;
+            } catch (const H5::Exception& e) {
+                errors[i] = e.getDetailMsg();
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+            
+            // The other outputs don't wait for this one any more, even if it has failed
+            broadcast->finish(i);
+        });
+    }
+    
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    bool failed(false);
+    for (int i = 0; i < (int)converters.size(); i++) {
+        if (!errors[i].empty()) {
+            std::cerr << "Error: could not convert " << outputs[i].fileName << ": " << errors[i] << "." << std::endl;
+            failed = true;
+        }
+    }
+    
+    if (failed) {
+        throw "Some of the outputs could not be converted";
+    }
+}
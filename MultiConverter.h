@@ -0,0 +1,36 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __MULTICONVERTER_H
+#define __MULTICONVERTER_H
+
+#include "Converter.h"
+
+// One of several outputs which are converted from the same input
+struct OutputSpec {
+    std::string fileName;
+    ConverterOptions options;
+};
+
+// Converts one input to several outputs, which may each have their own channel range, products and layout, with a
+// single read of the input. Each output has its own converter, which runs on its own thread, and reads the channels
+// from a shared broadcast. The memory usage is accounted across all the outputs: if they don't fit together, the
+// largest outputs are converted with the slow method instead, with the memory which is left by the others.
+class MultiConverter {
+public:
+    MultiConverter(std::string inputFileName, const std::vector<OutputSpec>& outputs, hsize_t memoryLimit);
+    
+    void convert();
+    void reportMemoryUsage();
+    hsize_t calculateMemoryUsage();
+
+protected:
+    std::vector<OutputSpec> outputs;
+    std::vector<std::unique_ptr<Converter>> converters;
+    std::vector<hsize_t> memoryUsages;
+    std::unique_ptr<ChannelBroadcast> broadcast;
+};
+
+#endif
@@ -0,0 +1,693 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Output.h"
+#include "DirectoryStore.h"
+#include "Util.h"
+#include "Throttle.h"
+#include "IoStats.h"
+#include "Hdf5Stats.h"
+
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+// The HDF5 library can't be used from multiple threads at once, even for different files, and several converters may
+// write their outputs at the same time. Every use of the library goes through this lock, which is recursive because
+// some methods call others.
+static std::recursive_mutex hdf5Mutex;
+#define HDF5_LOCK std::lock_guard<std::recursive_mutex> hdf5Lock(hdf5Mutex)
+
+// A file which is built in memory grows in steps of this size
+#define CORE_INCREMENT (size_t)(256 << 10)
+// Contiguous datasets of up to this size are compact in a file which is built in memory. The limit for a compact
+// dataset is 64 kB, including the rest of its object header.
+#define COMPACT_DATASET_SIZE (hsize_t)(16 << 10)
+
+// Data types
+
+hsize_t dataTypeSize(DataType type) {
+    switch (type) {
+        case DataType::DOUBLE:
+        case DataType::INT64:
+            return 8;
+        case DataType::FLOAT:
+        case DataType::UINT32:
+            return 4;
+        case DataType::HALF:
+        case DataType::BFLOAT16:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+H5::DataType hdf5FileType(DataType type) {
+    switch (type) {
+        case DataType::FLOAT: {
+            H5::FloatType floatType(H5::PredType::NATIVE_FLOAT);
+            floatType.setOrder(H5T_ORDER_LE);
+            return floatType;
+        }
+        case DataType::DOUBLE: {
+            H5::FloatType doubleType(H5::PredType::NATIVE_DOUBLE);
+            doubleType.setOrder(H5T_ORDER_LE);
+            return doubleType;
+        }
+        case DataType::INT64: {
+            H5::IntType intType(H5::PredType::NATIVE_INT64);
+            intType.setOrder(H5T_ORDER_LE);
+            return intType;
+        }
+        case DataType::UINT32:
+            return H5::PredType::STD_U32LE;
+        case DataType::UINT8:
+            return H5::PredType::NATIVE_UINT8;
+        default: {
+            // HDF5 has no predefined 16-bit float types, but we can derive them from the 32-bit type
+            H5::FloatType floatType(H5::PredType::IEEE_F32LE);
+            
+            if (type == DataType::HALF) {
+                floatType.setFields(15, 10, 5, 0, 10);
+                floatType.setSize(2);
+                floatType.setEbias(15);
+            } else {
+                floatType.setFields(15, 7, 8, 0, 7);
+                floatType.setSize(2);
+                floatType.setEbias(127);
+            }
+            
+            return floatType;
+        }
+    }
+}
+
+H5::DataType hdf5MemoryType(DataType type) {
+    switch (type) {
+        case DataType::FLOAT:
+            return H5::PredType::NATIVE_FLOAT;
+        case DataType::DOUBLE:
+            return H5::PredType::NATIVE_DOUBLE;
+        case DataType::INT64:
+            return H5::PredType::NATIVE_INT64;
+        case DataType::UINT32:
+            return H5::PredType::NATIVE_UINT32;
+        case DataType::UINT8:
+            return H5::PredType::NATIVE_UINT8;
+        default:
+            return hdf5FileType(type);
+    }
+}
+
+// OutputGroup
+
+std::shared_ptr<OutputDataset> OutputGroup::createDataset(const std::string& name, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) {
+    return backend->createDataset(child(name), type, dims, chunkDims, compression);
+}
+
+std::shared_ptr<OutputDataset> OutputGroup::createExtendibleDataset(const std::string& name, DataType type, hsize_t chunkSize) {
+    return backend->createExtendibleDataset(child(name), type, chunkSize);
+}
+
+OutputGroup OutputGroup::createGroup(const std::string& name) {
+    backend->createGroup(child(name));
+    return OutputGroup(backend, child(name));
+}
+
+void OutputGroup::link(const std::string& target, const std::string& name) {
+    backend->link(child(target), child(name));
+}
+
+bool OutputGroup::exists(const std::string& name) {
+    return backend->exists(child(name));
+}
+
+std::shared_ptr<OutputDataset> OutputGroup::openDataset(const std::string& name) {
+    return backend->openDataset(child(name));
+}
+
+bool OutputGroup::attributeExists(const std::string& name) {
+    return backend->attributeExists(path, name);
+}
+
+void OutputGroup::writeAttribute(const std::string& name, const std::string& value) {
+    backend->writeAttribute(path, name, value);
+}
+
+void OutputGroup::writeAttribute(const std::string& name, int64_t value) {
+    backend->writeAttribute(path, name, value);
+}
+
+void OutputGroup::writeAttribute(const std::string& name, double value) {
+    backend->writeAttribute(path, name, value);
+}
+
+void OutputGroup::writeAttribute(const std::string& name, bool value) {
+    backend->writeAttribute(path, name, value);
+}
+
+void OutputGroup::removeAttribute(const std::string& name) {
+    backend->removeAttribute(path, name);
+}
+
+// OutputBackend
+
+std::unique_ptr<OutputBackend> OutputBackend::create(OutputBackendType type, const std::string& fileName, bool inMemory) {
+    if (type == OutputBackendType::DIRECTORY) {
+        return std::unique_ptr<OutputBackend>(new DirectoryStore(fileName));
+    }
+    
+    return std::unique_ptr<OutputBackend>(new Hdf5Output(fileName, false, inMemory));
+}
+
+std::unique_ptr<OutputBackend> OutputBackend::open(const std::string& fileName) {
+    return std::unique_ptr<OutputBackend>(new Hdf5Output(fileName, true));
+}
+
+// Hdf5Output
+
+Hdf5Output::Hdf5Output(const std::string& fileName, bool update, bool inMemory) : fileName(fileName), inMemory(inMemory), stats(nullptr) {
+    HDF5_LOCK;
+    
+    // The statistics of a file in storage are collected by its file driver
+    H5::FileAccPropList accessList;
+    if (hdf5StatsEnabled() && !inMemory) {
+        setHdf5StatsDriver(accessList);
+        stats = hdf5FileStats(fileName);
+    }
+    
+    if (update) {
+        if (!std::filesystem::exists(fileName) || !H5::H5File::isHdf5(fileName)) {
+            throw "Could not open the HDF5 file to update";
+        }
+        file = H5::H5File(fileName, H5F_ACC_RDWR, H5::FileCreatPropList::DEFAULT, accessList);
+    } else if (inMemory) {
+        // The core driver keeps the whole file in memory. Its own backing store writes the file in many pieces, so
+        // the image of the file is written out in one piece when it is closed instead.
+        accessList.setCore(CORE_INCREMENT, false);
+        file = H5::H5File(fileName, H5F_ACC_TRUNC, H5::FileCreatPropList::DEFAULT, accessList);
+    } else {
+        file = H5::H5File(fileName, H5F_ACC_TRUNC, H5::FileCreatPropList::DEFAULT, accessList);
+    }
+}
+
+Hdf5Output::~Hdf5Output() {
+    // Closing the file here, under the lock, leaves nothing for the library to do when the members are destroyed
+    HDF5_LOCK;
+    
+    try {
+        file.close();
+    } catch (const H5::Exception&) {
+    }
+}
+
+H5::Group Hdf5Output::openGroup(const std::string& path) {
+    return file.openGroup(path.empty() ? "/" : path);
+}
+
+// Create any missing groups in the path, and return the final group and the dataset name
+static H5::Group createHdf5Groups(H5::Group group, const std::string& path, std::string& name) {
+    auto splitPath = split(path, '/');
+    
+    name = splitPath.back();
+    splitPath.pop_back();
+    
+    for (auto& groupname : splitPath) {
+        if (!hdf5Exists(group, groupname)) {
+            group = group.createGroup(groupname);
+        } else {
+            group = group.openGroup(groupname);
+        }
+    }
+    
+    return group;
+}
+
+std::shared_ptr<OutputDataset> Hdf5Output::createDataset(const std::string& path, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) {
+    HDF5_LOCK;
+    
+    std::string name;
+    H5::Group group = createHdf5Groups(openGroup(""), path, name);
+    
+    H5::DSetCreatPropList propList;
+    if (!chunkDims.empty()) {
+        propList.setChunk(chunkDims.size(), chunkDims.data());
+        
+        // Filters can only be applied to chunked datasets
+        if (compression) {
+            propList.setShuffle();
+            propList.setDeflate(compression);
+        }
+    } else if (inMemory && product(dims) * dataTypeSize(type) <= COMPACT_DATASET_SIZE) {
+        // The data is stored in the object header, so the dataset needs no separate allocation in the file
+        propList.setLayout(H5D_COMPACT);
+    }
+    
+    auto dataSpace = H5::DataSpace(dims.size(), dims.data());
+    auto dataset = group.createDataSet(name, hdf5FileType(type), dataSpace, propList);
+    auto outputDataset = std::make_shared<Hdf5Dataset>(dataset, type, dims, writeBehind.get(), chunkDims, compression, !inMemory);
+    if (stats) {
+        outputDataset->stats = hdf5DatasetStats(stats, path, dataset);
+    }
+    return outputDataset;
+}
+
+std::shared_ptr<OutputDataset> Hdf5Output::createExtendibleDataset(const std::string& path, DataType type, hsize_t chunkSize) {
+    HDF5_LOCK;
+    
+    std::string name;
+    H5::Group group = createHdf5Groups(openGroup(""), path, name);
+    
+    H5::DSetCreatPropList propList;
+    propList.setChunk(1, &chunkSize);
+    
+    hsize_t dims(0);
+    hsize_t maxDims(H5S_UNLIMITED);
+    auto dataSpace = H5::DataSpace(1, &dims, &maxDims);
+    auto dataset = group.createDataSet(name, hdf5FileType(type), dataSpace, propList);
+    auto outputDataset = std::make_shared<Hdf5Dataset>(dataset, type, std::vector<hsize_t>{0}, writeBehind.get(), EMPTY_DIMS, 0, !inMemory);
+    if (stats) {
+        outputDataset->stats = hdf5DatasetStats(stats, path, dataset);
+    }
+    return outputDataset;
+}
+
+void Hdf5Output::createGroup(const std::string& path) {
+    HDF5_LOCK;
+    
+    std::string name;
+    H5::Group group = createHdf5Groups(openGroup(""), path, name);
+    group.createGroup(name);
+}
+
+void Hdf5Output::link(const std::string& target, const std::string& path) {
+    HDF5_LOCK;
+    
+    openGroup("").link(H5L_TYPE_HARD, target, path);
+}
+
+bool Hdf5Output::exists(const std::string& path) {
+    HDF5_LOCK;
+    
+    // Each group in the path has to be checked separately
+    H5::Group group = openGroup("");
+    auto splitPath = split(path, '/');
+    
+    for (size_t i = 0; i < splitPath.size(); i++) {
+        if (!hdf5Exists(group, splitPath[i])) {
+            return false;
+        }
+        
+        if (i + 1 < splitPath.size()) {
+            if (group.childObjType(splitPath[i]) != H5O_TYPE_GROUP) {
+                return false;
+            }
+            group = group.openGroup(splitPath[i]);
+        }
+    }
+    
+    return true;
+}
+
+// The type of an existing dataset, which must be one of the types we write
+static DataType dataTypeOf(const H5::DataSet& dataset) {
+    H5T_class_t typeClass = dataset.getTypeClass();
+    size_t size = dataset.getDataType().getSize();
+    
+    if (typeClass == H5T_FLOAT) {
+        if (size == 8) {
+            return DataType::DOUBLE;
+        } else if (size == 4) {
+            return DataType::FLOAT;
+        } else if (size == 2) {
+            return dataset.getFloatType().getEbias() == 15 ? DataType::HALF : DataType::BFLOAT16;
+        }
+    } else if (typeClass == H5T_INTEGER) {
+        if (size == 8) {
+            return DataType::INT64;
+        } else if (size == 4) {
+            return DataType::UINT32;
+        } else if (size == 1) {
+            return DataType::UINT8;
+        }
+    }
+    
+    throw "Unexpected dataset type";
+}
+
+std::shared_ptr<OutputDataset> Hdf5Output::openDataset(const std::string& path) {
+    HDF5_LOCK;
+    
+    auto dataset = openGroup("").openDataSet(path);
+    auto dataSpace = dataset.getSpace();
+    std::vector<hsize_t> dims(dataSpace.getSimpleExtentNdims());
+    dataSpace.getSimpleExtentDims(dims.data());
+    auto outputDataset = std::make_shared<Hdf5Dataset>(dataset, dataTypeOf(dataset), dims, writeBehind.get());
+    if (stats) {
+        outputDataset->stats = hdf5DatasetStats(stats, path, dataset);
+    }
+    return outputDataset;
+}
+
+bool Hdf5Output::attributeExists(const std::string& path, const std::string& name) {
+    HDF5_LOCK;
+    
+    return openGroup(path).attrExists(name);
+}
+
+void Hdf5Output::writeAttribute(const std::string& path, const std::string& name, const std::string& value) {
+    HDF5_LOCK;
+    
+    H5::StrType strType(H5::PredType::C_S1, 256);
+    H5::DataSpace dataSpace(H5S_SCALAR);
+    auto attribute = openGroup(path).createAttribute(name, strType, dataSpace);
+    attribute.write(strType, value);
+}
+
+void Hdf5Output::writeAttribute(const std::string& path, const std::string& name, int64_t value) {
+    HDF5_LOCK;
+    
+    H5::DataType intType = hdf5FileType(DataType::INT64);
+    H5::DataSpace dataSpace(H5S_SCALAR);
+    auto attribute = openGroup(path).createAttribute(name, intType, dataSpace);
+    attribute.write(intType, &value);
+}
+
+void Hdf5Output::writeAttribute(const std::string& path, const std::string& name, double value) {
+    HDF5_LOCK;
+    
+    H5::DataType doubleType = hdf5FileType(DataType::DOUBLE);
+    H5::DataSpace dataSpace(H5S_SCALAR);
+    auto attribute = openGroup(path).createAttribute(name, doubleType, dataSpace);
+    attribute.write(doubleType, &value);
+}
+
+void Hdf5Output::writeAttribute(const std::string& path, const std::string& name, bool value) {
+    HDF5_LOCK;
+    
+    H5::IntType boolType(H5::PredType::NATIVE_HBOOL);
+    H5::DataSpace dataSpace(H5S_SCALAR);
+    auto attribute = openGroup(path).createAttribute(name, boolType, dataSpace);
+    attribute.write(boolType, &value);
+}
+
+void Hdf5Output::removeAttribute(const std::string& path, const std::string& name) {
+    HDF5_LOCK;
+    
+    openGroup(path).removeAttr(name);
+}
+
+void Hdf5Output::bypassPageCache() {
+    if (!writeBehind) {
+        writeBehind.reset(new WriteBehind());
+        writeBehind->open(fileName);
+    }
+}
+
+void Hdf5Output::close() {
+    std::unique_ptr<char[]> image;
+    ssize_t size = 0;
+    
+    {
+        HDF5_LOCK;
+        
+        bool copied = true;
+        
+        if (inMemory && file.getId() > 0) {
+            file.flush(H5F_SCOPE_GLOBAL);
+            
+            size = H5Fget_file_image(file.getId(), nullptr, 0);
+            image.reset(new char[std::max(size, (ssize_t)1)]);
+            copied = size >= 0 && H5Fget_file_image(file.getId(), image.get(), size) == size;
+        }
+        
+        if (stats && file.getId() > 0) {
+            recordMetadataCache(stats, file.getId());
+        }
+        
+        // The file is closed even if its image could not be copied, so that closing it again does nothing
+        file.close();
+        
+        if (!copied) {
+            throw "Could not get the image of the output file";
+        }
+    }
+    
+    // The throttle may sleep, so the image is written without holding the HDF5 lock
+    if (image) {
+        // One sequential write, unless it is throttled
+        std::ofstream imageFile(fileName, std::ios::binary | std::ios::trunc);
+        if (!imageFile.is_open()) {
+            throw "Could not create the output file";
+        }
+        
+        hsize_t blockSize = throttleWriteBlock() ? throttleWriteBlock() : size;
+        
+        for (hsize_t done = 0; done < (hsize_t)size; done += blockSize) {
+            hsize_t count = std::min(blockSize, size - done);
+            throttleWrite(count);
+            
+            IoCall call(IoSite::HDF5_IMAGE_WRITE, count);
+            if (!imageFile.write(image.get() + done, count)) {
+                throw "Could not write the output file";
+            }
+        }
+        
+        // The last block is only written when the file is closed, and a truncated file must not be renamed into place
+        imageFile.close();
+        if (imageFile.fail()) {
+            throw "Could not write the output file";
+        }
+    }
+    
+    if (writeBehind) {
+        writeBehind->close();
+    }
+}
+
+// Hdf5Dataset
+
+Hdf5Dataset::~Hdf5Dataset() {
+    HDF5_LOCK;
+    // Closing the dataset flushes its chunk cache
+    Hdf5StatsScope scope(stats);
+    
+    try {
+        dataset.close();
+    } catch (const H5::Exception&) {
+    }
+}
+
+std::vector<std::pair<hsize_t, hsize_t>> Hdf5Dataset::throttledPieces(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t elementSize, hsize_t blockSize, int& axis) {
+    std::vector<std::pair<hsize_t, hsize_t>> pieces;
+    
+    // The pieces are split along the outermost axis which is longer than one, so each of them is contiguous in memory
+    axis = 0;
+    while (axis < (int)count.size() && count[axis] == 1) {
+        axis++;
+    }
+    
+    if (!blockSize || axis == (int)count.size()) {
+        return pieces;
+    }
+    
+    hsize_t sliceSize = product(std::vector<hsize_t>(count.begin() + axis + 1, count.end())) * elementSize;
+    hsize_t step = std::max((hsize_t)1, blockSize / sliceSize);
+    
+    // A chunk is only written by one piece, so that HDF5 doesn't have to read it back or write it twice
+    std::vector<hsize_t> datasetChunkDims = chunkDims;
+    if (datasetChunkDims.empty()) {
+        HDF5_LOCK;
+        auto propList = dataset.getCreatePlist();
+        if (propList.getLayout() == H5D_CHUNKED) {
+            datasetChunkDims.resize(dims.size());
+            propList.getChunk(dims.size(), datasetChunkDims.data());
+        }
+    }
+    
+    if (!datasetChunkDims.empty()) {
+        hsize_t chunkDepth = datasetChunkDims[axis];
+        step = std::max(chunkDepth, step / chunkDepth * chunkDepth);
+    }
+    
+    hsize_t end = start[axis] + count[axis];
+    for (hsize_t position = start[axis]; position < end;) {
+        hsize_t next = std::min(end, (position / step + 1) * step);
+        pieces.emplace_back(position, next - position);
+        position = next;
+    }
+    
+    return pieces;
+}
+
+void Hdf5Dataset::transfer(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing) {
+    bool wholeDataset = count.empty() || start.empty();
+    std::vector<hsize_t> slabCount = wholeDataset ? dims : count;
+    std::vector<hsize_t> slabStart = wholeDataset ? std::vector<hsize_t>(dims.size(), 0) : start;
+    hsize_t elementSize = dataTypeSize(memType);
+    hsize_t size = product(slabCount) * elementSize;
+    
+    // A throttled transfer which is larger than a block is split into pieces, which are paced evenly
+    hsize_t blockSize(0);
+    if (throttled) {
+        blockSize = writing ? throttleWriteBlock() : throttleReadBlock();
+    }
+    
+    int axis;
+    std::vector<std::pair<hsize_t, hsize_t>> pieces;
+    if (blockSize && size > blockSize) {
+        pieces = throttledPieces(slabCount, slabStart, elementSize, blockSize, axis);
+    }
+    
+    if (pieces.size() < 2) {
+        if (throttled && writing) {
+            throttleWrite(size);
+        } else if (throttled) {
+            throttleRead(size);
+        }
+        
+        HDF5_LOCK;
+        Hdf5StatsScope scope(stats, writing ? Hdf5StatsScope::WRITE : Hdf5StatsScope::READ);
+        scope.addLookups(slabCount, slabStart);
+    
+        H5::DataSpace memSpace(memDims.size(), memDims.data());
+        auto fileSpace = dataset.getSpace();
+        if (!wholeDataset) {
+            fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+        }
+        
+        // The in-memory file is not storage, so its calls are not measured
+        std::unique_ptr<IoCall> call;
+        if (throttled) {
+            call.reset(new IoCall(writing ? IoSite::HDF5_WRITE : IoSite::HDF5_READ, size));
+        }
+        
+        if (writing) {
+            dataset.write(data, hdf5MemoryType(memType), memSpace, fileSpace);
+    
+            if (writeBehind) {
+                writeBehind->release();
+            }
+        } else {
+            dataset.read(data, hdf5MemoryType(memType), memSpace, fileSpace);
+        }
+        
+        return;
+    }
+    
+    hsize_t sliceSize = product(std::vector<hsize_t>(slabCount.begin() + axis + 1, slabCount.end())) * elementSize;
+    
+    for (auto& piece : pieces) {
+        std::vector<hsize_t> pieceCount = slabCount;
+        std::vector<hsize_t> pieceStart = slabStart;
+        pieceStart[axis] = piece.first;
+        pieceCount[axis] = piece.second;
+        
+        hsize_t pieceSize = piece.second * sliceSize;
+        if (writing) {
+            throttleWrite(pieceSize);
+        } else {
+            throttleRead(pieceSize);
+        }
+        
+        HDF5_LOCK;
+        Hdf5StatsScope scope(stats, writing ? Hdf5StatsScope::WRITE : Hdf5StatsScope::READ);
+        scope.addLookups(pieceCount, pieceStart);
+        
+        // The memory of the piece is contiguous, so it can be described as a flat array
+        hsize_t numElements = pieceSize / elementSize;
+        H5::DataSpace memSpace(1, &numElements);
+        auto fileSpace = dataset.getSpace();
+        fileSpace.selectHyperslab(H5S_SELECT_SET, pieceCount.data(), pieceStart.data());
+        char* pieceData = (char*)data + (piece.first - slabStart[axis]) * sliceSize;
+        IoCall call(writing ? IoSite::HDF5_WRITE : IoSite::HDF5_READ, pieceSize);
+        
+        if (writing) {
+            dataset.write(pieceData, hdf5MemoryType(memType), memSpace, fileSpace);
+            
+            if (writeBehind) {
+                writeBehind->release();
+            }
+        } else {
+            dataset.read(pieceData, hdf5MemoryType(memType), memSpace, fileSpace);
+        }
+    }
+}
+
+void Hdf5Dataset::write(const void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    transfer((void*)data, memType, memDims, count, start, true);
+}
+
+void Hdf5Dataset::read(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    transfer(data, memType, memDims, count, start, false);
+}
+
+void Hdf5Dataset::append(const uint8_t* data, hsize_t size, hsize_t offset) {
+    if (!size) {
+        return;
+    }
+    
+    if (throttled) {
+        throttleWrite(size);
+    }
+    
+    HDF5_LOCK;
+    Hdf5StatsScope scope(stats, Hdf5StatsScope::WRITE);
+    scope.addLookups({size}, {offset});
+    
+    hsize_t newSize = offset + size;
+    dataset.extend(&newSize);
+    dims = {newSize};
+    
+    H5::DataSpace memSpace(1, &size);
+    auto fileSpace = dataset.getSpace();
+    fileSpace.selectHyperslab(H5S_SELECT_SET, &size, &offset);
+    
+    std::unique_ptr<IoCall> call;
+    if (throttled) {
+        call.reset(new IoCall(IoSite::HDF5_APPEND, size));
+    }
+    dataset.write(data, H5::PredType::NATIVE_UINT8, memSpace, fileSpace);
+    
+    if (writeBehind) {
+        writeBehind->release();
+    }
+}
+
+void Hdf5Dataset::writeChunk(const std::vector<hsize_t>& offset, const std::vector<uint8_t>& chunk) {
+    writeWholeChunk(offset, chunk.data(), chunk.size());
+}
+
+bool Hdf5Dataset::encodeChunk(const float* chunk, hsize_t size, std::vector<uint8_t>& encoded) const {
+    if (!compression) {
+        return false;
+    }
+    
+    ::encodeChunk((const uint8_t*)chunk, size * sizeof(float), sizeof(float), compression, encoded);
+    return true;
+}
+
+void Hdf5Dataset::writeWholeChunk(const std::vector<hsize_t>& start, const void* data, hsize_t size) {
+    if (throttled) {
+        throttleWrite(size);
+    }
+    
+    HDF5_LOCK;
+    // A direct chunk write bypasses the chunk cache
+    Hdf5StatsScope scope(stats, Hdf5StatsScope::WRITE);
+    
+    std::unique_ptr<IoCall> call;
+    if (throttled) {
+        call.reset(new IoCall(IoSite::HDF5_CHUNK_WRITE, size));
+    }
+    
+    if (H5Dwrite_chunk(dataset.getId(), H5P_DEFAULT, 0, start.data(), size, data) < 0) {
+        throw "Could not write chunk";
+    }
+    
+    if (writeBehind) {
+        writeBehind->release();
+    }
+}
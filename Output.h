@@ -0,0 +1,281 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include "common.h"
+#include "DirectIO.h"
+#include "Hdf5Stats.h"
+
+// Element types of the output datasets, and of the memory which is written to them
+enum class DataType {
+    FLOAT,
+    DOUBLE,
+    INT64,
+    UINT32,
+    UINT8,
+    HALF,
+    BFLOAT16
+};
+
+hsize_t dataTypeSize(DataType type);
+// The little-endian type which is used in the HDF5 file
+H5::DataType hdf5FileType(DataType type);
+// The type of the data in memory. 16-bit float data has already been converted to the file type.
+H5::DataType hdf5MemoryType(DataType type);
+
+// A dataset in the output. Data is written as a contiguous block of memory in row-major order, either to the whole
+// dataset, or to the hyperslab given by count and start.
+class OutputDataset {
+public:
+    OutputDataset(DataType type, const std::vector<hsize_t>& dims) : type(type), dims(dims) {}
+    virtual ~OutputDataset() {}
+    
+    virtual void write(const void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) = 0;
+    virtual void read(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) = 0;
+    // Only for one-dimensional extendible datasets
+    virtual void append(const uint8_t* data, hsize_t size, hsize_t offset) = 0;
+    
+    // Some chunked datasets can also be written one whole chunk at a time, so that the chunks don't have to be
+    // gathered from a larger block of memory. The chunk is in row-major order, padded to the full chunk size at the
+    // edges of the dataset. It is encoded with the dataset's filters first, which can be done on any thread.
+    virtual bool takesWholeChunks() const {
+        return false;
+    }
+    
+    // Returns false if the dataset has no filters, and the chunk can be written as it is
+    virtual bool encodeChunk(const float* chunk, hsize_t size, std::vector<uint8_t>& encoded) const {
+        UNUSED(chunk);
+        UNUSED(size);
+        UNUSED(encoded);
+        throw "This dataset can't be written in whole chunks";
+    }
+    
+    // The start is the position of the chunk in the dataset, in elements
+    virtual void writeWholeChunk(const std::vector<hsize_t>& start, const void* data, hsize_t size) {
+        UNUSED(start);
+        UNUSED(data);
+        UNUSED(size);
+        throw "This dataset can't be written in whole chunks";
+    }
+    
+    void write(const float* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        write(data, DataType::FLOAT, memDims, count, start);
+    }
+    
+    void write(const double* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        write(data, DataType::DOUBLE, memDims, count, start);
+    }
+    
+    void write(const int64_t* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        write(data, DataType::INT64, memDims, count, start);
+    }
+    
+    void write(const uint32_t* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        write(data, DataType::UINT32, memDims, count, start);
+    }
+    
+    // For 16-bit float data which has already been converted to the dataset's own type
+    void write(const uint16_t* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        write(data, type, memDims, count, start);
+    }
+    
+    void read(float* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        read(data, DataType::FLOAT, memDims, count, start);
+    }
+    
+    void read(double* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        read(data, DataType::DOUBLE, memDims, count, start);
+    }
+    
+    void read(int64_t* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        read(data, DataType::INT64, memDims, count, start);
+    }
+    
+    void read(uint32_t* data, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS) {
+        read(data, DataType::UINT32, memDims, count, start);
+    }
+    
+    DataType type;
+    std::vector<hsize_t> dims;
+};
+
+class OutputBackend;
+
+// A group in the output, identified by its path from the root
+struct OutputGroup {
+    OutputGroup() : backend(nullptr) {}
+    OutputGroup(OutputBackend* backend, const std::string& path) : backend(backend), path(path) {}
+    
+    std::string child(const std::string& name) const {
+        return path.empty() ? name : path + "/" + name;
+    }
+    
+    // Any missing groups in the path are created
+    std::shared_ptr<OutputDataset> createDataset(const std::string& name, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims = EMPTY_DIMS, int compression = 0);
+    // A one-dimensional dataset which grows as data is appended to it
+    std::shared_ptr<OutputDataset> createExtendibleDataset(const std::string& name, DataType type, hsize_t chunkSize);
+    OutputGroup createGroup(const std::string& name);
+    // Make an existing object in this group available under a second name
+    void link(const std::string& target, const std::string& name);
+    
+    // Existing objects, for updating a file
+    bool exists(const std::string& name);
+    std::shared_ptr<OutputDataset> openDataset(const std::string& name);
+    
+    bool attributeExists(const std::string& name);
+    void writeAttribute(const std::string& name, const std::string& value);
+    void writeAttribute(const std::string& name, int64_t value);
+    void writeAttribute(const std::string& name, double value);
+    void writeAttribute(const std::string& name, bool value);
+    void removeAttribute(const std::string& name);
+    
+    OutputBackend* backend;
+    std::string path;
+};
+
+enum class OutputBackendType {
+    HDF5,
+    DIRECTORY
+};
+
+// Where the converter's output goes. All the paths are relative to the root of the output.
+class OutputBackend {
+public:
+    virtual ~OutputBackend() {}
+    
+    // An HDF5 output can be built in memory, and written to the file in one go when it is closed
+    static std::unique_ptr<OutputBackend> create(OutputBackendType type, const std::string& fileName, bool inMemory = false);
+    // Open an existing HDF5 file to update it in place
+    static std::unique_ptr<OutputBackend> open(const std::string& fileName);
+    
+    OutputGroup root() {
+        return OutputGroup(this, "");
+    }
+    
+    // Whether different parts of the output can be written from multiple threads at once
+    virtual bool concurrentWrites() const {
+        return false;
+    }
+    
+    // Keep the written data out of the page cache, as far as the backend can
+    virtual void bypassPageCache() {}
+    
+    virtual std::shared_ptr<OutputDataset> createDataset(const std::string& path, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) = 0;
+    virtual std::shared_ptr<OutputDataset> createExtendibleDataset(const std::string& path, DataType type, hsize_t chunkSize) = 0;
+    virtual void createGroup(const std::string& path) = 0;
+    virtual void link(const std::string& target, const std::string& path) = 0;
+    
+    // Only backends which can open existing files implement these
+    virtual bool exists(const std::string& path) {
+        UNUSED(path);
+        throw "This output backend can't open existing objects";
+    }
+    
+    virtual std::shared_ptr<OutputDataset> openDataset(const std::string& path) {
+        UNUSED(path);
+        throw "This output backend can't open existing objects";
+    }
+    
+    virtual void removeAttribute(const std::string& path, const std::string& name) {
+        UNUSED(path);
+        UNUSED(name);
+        throw "This output backend can't remove attributes";
+    }
+    
+    virtual bool attributeExists(const std::string& path, const std::string& name) = 0;
+    virtual void writeAttribute(const std::string& path, const std::string& name, const std::string& value) = 0;
+    virtual void writeAttribute(const std::string& path, const std::string& name, int64_t value) = 0;
+    virtual void writeAttribute(const std::string& path, const std::string& name, double value) = 0;
+    virtual void writeAttribute(const std::string& path, const std::string& name, bool value) = 0;
+    
+    // Finish writing. Datasets may not be used afterwards.
+    virtual void close() = 0;
+};
+
+// Writes the output directly to an HDF5 file. The HDF5 library can't be used from multiple threads at once, so all the
+// methods share a lock.
+class Hdf5Output : public OutputBackend {
+public:
+    // The file is created, unless it is opened to be updated. A file which is created in memory is only written when
+    // it is closed, in one go, and its tiny contiguous datasets are stored in their object headers.
+    Hdf5Output(const std::string& fileName, bool update = false, bool inMemory = false);
+    ~Hdf5Output() override;
+    
+    std::shared_ptr<OutputDataset> createDataset(const std::string& path, DataType type, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims, int compression) override;
+    std::shared_ptr<OutputDataset> createExtendibleDataset(const std::string& path, DataType type, hsize_t chunkSize) override;
+    void createGroup(const std::string& path) override;
+    void link(const std::string& target, const std::string& path) override;
+    
+    bool exists(const std::string& path) override;
+    std::shared_ptr<OutputDataset> openDataset(const std::string& path) override;
+    
+    bool attributeExists(const std::string& path, const std::string& name) override;
+    void writeAttribute(const std::string& path, const std::string& name, const std::string& value) override;
+    void writeAttribute(const std::string& path, const std::string& name, int64_t value) override;
+    void writeAttribute(const std::string& path, const std::string& name, double value) override;
+    void writeAttribute(const std::string& path, const std::string& name, bool value) override;
+    void removeAttribute(const std::string& path, const std::string& name) override;
+    
+    // The HDF5 library we use has no direct VFD, so the written pages are released as the file is written instead
+    void bypassPageCache() override;
+    
+    void close() override;
+
+private:
+    H5::Group openGroup(const std::string& path);
+    
+    H5::H5File file;
+    std::string fileName;
+    std::unique_ptr<WriteBehind> writeBehind;
+    bool inMemory;
+    // Null unless the HDF5 statistics are collected
+    FileStats* stats;
+};
+
+class Hdf5Dataset : public OutputDataset {
+public:
+    // The I/O of a dataset in a file which is built in memory is not throttled
+    Hdf5Dataset(H5::DataSet dataset, DataType type, const std::vector<hsize_t>& dims, WriteBehind* writeBehind = nullptr, const std::vector<hsize_t>& chunkDims = EMPTY_DIMS, int compression = 0, bool throttled = true) : OutputDataset(type, dims), dataset(dataset), writeBehind(writeBehind), chunkDims(chunkDims), compression(compression), throttled(throttled), stats(nullptr) {}
+    ~Hdf5Dataset() override;
+    
+    using OutputDataset::write;
+    using OutputDataset::read;
+    
+    void write(const void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) override;
+    void read(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) override;
+    void append(const uint8_t* data, hsize_t size, hsize_t offset) override;
+    
+    // Write a chunk which has already been passed through the dataset's filters. The offset is in elements.
+    void writeChunk(const std::vector<hsize_t>& offset, const std::vector<uint8_t>& chunk);
+    
+    // Single precision datasets which were created chunked take whole chunks
+    bool takesWholeChunks() const override {
+        return !chunkDims.empty() && type == DataType::FLOAT;
+    }
+    
+    bool encodeChunk(const float* chunk, hsize_t size, std::vector<uint8_t>& encoded) const override;
+    void writeWholeChunk(const std::vector<hsize_t>& start, const void* data, hsize_t size) override;
+    
+    H5::DataSet dataset;
+    // Releases the pages of each write from the page cache (null if the page cache is used normally)
+    WriteBehind* writeBehind;
+    
+    // The chunk dimensions and filters which the dataset was created with (empty if it was opened)
+    std::vector<hsize_t> chunkDims;
+    int compression;
+    bool throttled;
+    // Null unless the HDF5 statistics are collected
+    DatasetStats* stats;
+
+private:
+    void transfer(void* data, DataType memType, const std::vector<hsize_t>& memDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, bool writing);
+    // Split a hyperslab into pieces of about blockSize bytes along one axis, which is returned, without splitting any
+    // chunks. Each piece is a start and a count along the axis.
+    std::vector<std::pair<hsize_t, hsize_t>> throttledPieces(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t elementSize, hsize_t blockSize, int& axis);
+};
+
+#endif
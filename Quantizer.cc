@@ -0,0 +1,46 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Quantizer.h"
+
+const int Quantizer::NO_QUANTUM = std::numeric_limits<int>::min();
+
+Quantizer::Quantizer(int keepBits, double noiseFraction, hsize_t numChannels) : keepBits(keepBits), noiseFraction(noiseFraction) {
+    if (noiseFraction > 0) {
+        quantumExponents.resize(numChannels, NO_QUANTUM);
+    }
+}
+
+void Quantizer::setChannelNoise(hsize_t index, const StatsCounter& counter, hsize_t totalVals) {
+    if (noiseFraction <= 0) {
+        return;
+    }
+    
+    hsize_t numFinite = totalVals - counter.nanCount;
+    int quantumExponent = NO_QUANTUM;
+    
+    if (numFinite > 1) {
+        double mean = counter.sum / numFinite;
+        double sigma = std::sqrt(std::max(0.0, counter.sumSq / numFinite - mean * mean));
+        double quantum = noiseFraction * sigma;
+        
+        // Channels with no measurable noise are not rounded at all
+        if (std::isfinite(quantum) && quantum > 0) {
+            quantumExponent = (int)std::floor(std::log2(quantum));
+        }
+    }
+    
+    quantumExponents[index] = quantumExponent;
+}
+
+void Quantizer::writeAttributes(OutputGroup group) const {
+    if (keepBits) {
+        group.writeAttribute("QUANTIZATION", std::string("BITROUND"));
+        group.writeAttribute("QUANTIZATION_KEEP_BITS", (int64_t)keepBits);
+    } else if (noiseFraction > 0) {
+        group.writeAttribute("QUANTIZATION", std::string("NOISE"));
+        group.writeAttribute("QUANTIZATION_NOISE_FRACTION", noiseFraction);
+    }
+}
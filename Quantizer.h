@@ -0,0 +1,106 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __QUANTIZER_H
+#define __QUANTIZER_H
+
+#include "common.h"
+#include "Stats.h"
+#include "Util.h"
+#include "Output.h"
+
+// Optional lossy precision reduction, applied to the data just before it is written.
+// Low mantissa bits are rounded away (round to nearest, ties to even), which makes the data much more compressible.
+// Either a fixed number of mantissa bits is kept, or each channel is rounded to a power-of-two quantum
+// which is a fraction of the channel noise (estimated from the XY standard deviation).
+// Statistics are always calculated from the original values.
+struct Quantizer {
+    Quantizer() : keepBits(0), noiseFraction(0) {}
+    Quantizer(int keepBits, double noiseFraction, hsize_t numChannels);
+    
+    bool enabled() const {
+        return keepBits > 0 || noiseFraction > 0;
+    }
+    
+    // Derive the quantum for a channel from its XY statistics (noise mode only)
+    void setChannelNoise(hsize_t index, const StatsCounter& counter, hsize_t totalVals);
+    
+    // Mipmaps are averages of mip x mip pixels, so in noise mode their quantum is smaller by a factor of mip
+    float round(float val, hsize_t index, int mip = 1) const {
+        if (keepBits) {
+            return roundMantissa(val, keepBits);
+        }
+        
+        int quantumExponent = quantumExponents[index];
+        
+        if (quantumExponent == NO_QUANTUM) {
+            return val;
+        }
+        
+        return roundToQuantum(val, quantumExponent - (int)std::log2(mip));
+    }
+    
+    void round(float* data, hsize_t size, hsize_t index) const {
+        for (hsize_t i = 0; i < size; i++) {
+            data[i] = round(data[i], index);
+        }
+    }
+    
+    void writeAttributes(OutputGroup group) const;
+    
+    static float roundMantissa(float val, int keepBits) {
+        if (keepBits >= 23) {
+            return val;
+        }
+        
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(float));
+        
+        // Leave NaN and infinity alone
+        if ((bits & 0x7f800000) == 0x7f800000) {
+            return val;
+        }
+        
+        int drop = 23 - std::max(0, keepBits);
+        uint32_t half = (1u << (drop - 1)) - 1;
+        uint32_t lsb = (bits >> drop) & 1;
+        uint32_t rounded = (bits + half + lsb) & ~((1u << drop) - 1);
+        
+        // Don't round the largest values up to infinity
+        if ((rounded & 0x7f800000) == 0x7f800000) {
+            rounded = bits & ~((1u << drop) - 1);
+        }
+        
+        float result;
+        memcpy(&result, &rounded, sizeof(float));
+        return result;
+    }
+    
+    // Keep only the mantissa bits which are at least as significant as 2^quantumExponent.
+    // Values smaller than the quantum are rounded to a power of two.
+    static float roundToQuantum(float val, int quantumExponent) {
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(float));
+        
+        int exponent = (int)((bits >> 23) & 0xff);
+        
+        // Leave subnormals, NaN and infinity alone
+        if (exponent == 0 || exponent == 0xff) {
+            return val;
+        }
+        
+        return roundMantissa(val, std::max(0, exponent - 127 - quantumExponent));
+    }
+    
+    static const int NO_QUANTUM;
+    
+    int keepBits;
+    double noiseFraction;
+    
+    // One entry per channel (and Stokes), in noise mode
+    std::vector<int> quantumExponents;
+};
+
+#endif
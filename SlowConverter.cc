@@ -5,56 +5,190 @@
 
 #include "Converter.h"
 
-SlowConverter::SlowConverter(std::string inputFileName, std::string outputFileName, bool progress) : Converter(inputFileName, outputFileName, progress) {}
+// Without a memory limit, the rotation buffers may use as much memory as the first pass, or this much
+#define ROTATION_MEMORY (hsize_t)(1 << 30)
+// The rotation tile is halved until it reaches this size, before the channels are split into ranges
+#define MIN_ROTATION_TILE_SIZE (hsize_t)128
 
-MemoryUsage SlowConverter::calculateMemoryUsage() {
-    MemoryUsage m;
+SlowConverter::SlowConverter(std::string inputFileName, std::string outputFileName, const ConverterOptions& options) : Converter(inputFileName, outputFileName, options), rotationTileSize(TILE_SIZE), rotationDepth(depth) {
+    // A streamed input is only read once, so the later passes read the main dataset instead of the FITS data. If the
+    // main dataset has been rounded, it doesn't have the original values.
+    if (inputStream && quantizer.enabled()) {
+        throw "The slow method can't convert a streamed input with lossy rounding";
+    }
+    
+    if (swizzledChunkDims.empty() || !(writeSwizzled || writeZStats)) {
+        return;
+    }
+    
+    // Plan the rotation before the chunks of the rotated dataset are fixed. If the channels have to be split into
+    // ranges which are shallower than the chunks, the chunks are made as deep as a range, so that each chunk is still
+    // written once, and in order.
+    std::vector<hsize_t> chunkDims;
+    std::swap(chunkDims, swizzledChunkDims);
+    Arena plannedArena;
+    planArena(plannedArena);
+    std::swap(chunkDims, swizzledChunkDims);
+    
+    if (rotationDepth < swizzledChunkDims[N - 1]) {
+        swizzledChunkDims[N - 1] = rotationDepth;
+        swizzledChunkDims[N - 2] = std::min(height, std::max((hsize_t)1, (hsize_t)(1 << 18) / rotationDepth));
+    }
+}
+
+void SlowConverter::shareInput(ChannelBroadcast* broadcast, int consumer) {
+    // A shared input is also only read once, like a stream
+    if (quantizer.enabled()) {
+        throw "The slow method can't share its input with other outputs if it has lossy rounding";
+    }
+    
+    Converter::shareInput(broadcast, consumer);
+}
 
-    m.sizes["Main dataset"] = height * width * sizeof(float);
-    m.sizes["Mipmaps"] = MipMaps::size(standardDims, {1, height, width});
-    m.sizes["XY stats"] = Stats::size({depth}, numBins);
+void SlowConverter::addRotationRegions(Arena& arena, hsize_t tileSize, hsize_t rangeDepth) {
+    hsize_t slicePixels = std::min(tileSize, width) * std::min(tileSize, height);
+    
+    // The rotated slice is only needed for the rotated dataset, but the Z statistics also need the standard slice.
+    arena.add("Rotation", (writeSwizzled ? 2 : 1) * rangeDepth * slicePixels * sizeof(float), 1, 1);
     
-    if (depth > 1) {
-        m.sizes["Rotation"] = 2 * product(trimAxes({stokes, depth, TILE_SIZE, TILE_SIZE}, N)) * sizeof(float);
-        m.sizes["XYZ stats"] = Stats::size({}, numBins, depth);
-        m.sizes["Z stats"] = Stats::size({TILE_SIZE, TILE_SIZE});
+    if (writeZStats) {
+        arena.add("Z stats", Stats::size({slicePixels}), 1, 1);
+        
+        // If the channels are split into ranges, the Z statistics of each pixel are accumulated over all the ranges
+        if (rangeDepth < depth) {
+            arena.add("Z stats partials", slicePixels * sizeof(StatsCounter), 1, 1);
+        }
     }
+}
+
+void SlowConverter::planRotation(Arena& arena) {
+    hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
+    
+    Arena base;
+    base.copyPlan(arena);
+    base.plan();
+    hsize_t limit = options.memoryLimit ? options.memoryLimit : std::max(arenaMemoryUsage(base, channelsPerWrite).total, ROTATION_MEMORY);
+    
+    auto fits = [&](hsize_t tileSize, hsize_t rangeDepth) {
+        Arena trial;
+        trial.copyPlan(arena);
+        addRotationRegions(trial, tileSize, rangeDepth);
+        trial.plan();
+        return arenaMemoryUsage(trial, channelsPerWrite).total <= limit;
+    };
+    
+    // Shrink the tile first, because splitting the channels makes the writes of the rotated dataset smaller
+    rotationTileSize = TILE_SIZE;
+    rotationDepth = depth;
     
-    for (auto& kv : m.sizes) {
-        m.total += kv.second;
+    while (rotationTileSize > MIN_ROTATION_TILE_SIZE && !fits(rotationTileSize, depth)) {
+        rotationTileSize /= 2;
     }
     
-    if (depth > 1) {
-        m.total -= std::min(m.sizes["Main dataset"], m.sizes["Rotation"] + m.sizes["Z stats"]);
-        m.note = " (Main dataset and slices for rotation and Z statistics are not allocated at the same time.)";
+    if (!fits(rotationTileSize, depth)) {
+        // If the rotated dataset is chunked, each range has to hold whole chunks
+        hsize_t step = swizzledChunkDims.empty() ? 1 : swizzledChunkDims[N - 1];
+        
+        // The largest range which fits, or the smallest possible range if none does
+        hsize_t low = 1;
+        hsize_t high = (depth - 1) / step;
+        while (low < high) {
+            hsize_t mid = (low + high + 1) / 2;
+            if (fits(rotationTileSize, mid * step)) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        rotationDepth = std::max((hsize_t)1, low) * step;
     }
+    
+    addRotationRegions(arena, rotationTileSize, rotationDepth);
+}
 
+void SlowConverter::planArena(Arena& arena) {
+    // Channels are processed in batches which match the chunk depth, so that each chunk is written once
+    hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
+    
+    // Phase 0 is the main pass and the histogram pass over the channels
+    arena.add("Main dataset", channelsPerWrite * height * width * sizeof(float), 0, 0);
+    
+    if (writeMipMaps) {
+        arena.add("Mipmaps", MipMaps::bufferSize(standardDims, {channelsPerWrite, height, width}), 0, 0);
+    }
+    
+    // The FITS data is read in both phases
+    if (options.directIO) {
+        arena.add("Direct I/O", DIRECT_IO_BUFFER_SIZE, 0, 1);
+    }
+    
+    // Phase 1 is the rotation pass over the tiles. Its buffers are sized to fit in the memory budget.
+    if (writeSwizzled || writeZStats) {
+        planRotation(arena);
+    }
+    
+    arena.plan();
+    
+    // Unless its size is given explicitly, the channel cache uses whatever is left under the memory limit
+    if (writeHistograms) {
+        hsize_t budget = options.channelCacheSize;
+        if (budget == (hsize_t)-1) {
+            hsize_t total = arenaMemoryUsage(arena, channelsPerWrite).total;
+            budget = options.memoryLimit > total ? options.memoryLimit - total : 0;
+        }
+        
+        hsize_t capacity = ChannelCache::capacityFor(height * width, depth, budget);
+        if (capacity) {
+            arena.add("Channel cache", capacity * height * width * sizeof(float), 0, 0);
+            arena.plan();
+        }
+    }
+}
+
+MemoryUsage SlowConverter::calculateMemoryUsage() {
+    Arena arena;
+    planArena(arena);
+    MemoryUsage m = arenaMemoryUsage(arena, N > 2 ? tileDims[N - 3] : 1);
+    
+    if (writeSwizzled || writeZStats) {
+        hsize_t numRanges = (depth + rotationDepth - 1) / rotationDepth;
+        std::ostringstream line;
+        line << "Rotation: tiles of " << std::min(rotationTileSize, width) << " x " << std::min(rotationTileSize, height) << " pixels, " << rotationDepth << " of " << depth << " channels at a time (" << numRanges << (numRanges == 1 ? " range)" : " ranges)");
+        m.details.push_back(line.str());
+    }
+    
     return m;
 }
 
 void SlowConverter::copyAndCalculate() {
     const hsize_t channelProgressStride = std::max((hsize_t)1, (hsize_t)(depth / 100));
-    hsize_t numTiles = std::ceil(width / TILE_SIZE) * std::ceil(height / TILE_SIZE);
-    const hsize_t tileProgressStride = std::max((hsize_t)1, (hsize_t)(numTiles / 100));
     
-    // Allocate one channel at a time, and no swizzled data
+    // Allocate one batch of channels at a time, and no swizzled data.
+    // The batch matches the chunk depth, so that each chunk of the main dataset and mipmaps is written once.
     hsize_t cubeSize = height * width;
+    const hsize_t channelsPerWrite = N > 2 ? tileDims[N - 3] : 1;
     TIMER(timer.start("Allocate"););
-    standardCube = new float[cubeSize];
+    allocateArena();
+    standardCube = arena.get<float>("Main dataset");
     
     // Allocate one stokes of stats at a time
     statsXY.createBuffers({depth});
     
-    if (depth > 1) {
+    if (writeStats && depth > 1) {
         statsXYZ.createBuffers({}, depth);
     }
     
-    mipMaps.createBuffers({1, height, width});
-
-    std::vector<hsize_t> count = trimAxes({1, 1, height, width}, N);
-    std::vector<hsize_t> memDims = {height, width};
+    mipMaps.createBuffers({channelsPerWrite, height, width}, arena.get<char>("Mipmaps"));
+    
+    const ArenaRegion* channelCacheRegion = arena.find("Channel cache");
+    if (channelCacheRegion) {
+        channelCache = ChannelCache(cubeSize, std::min(depth, channelCacheRegion->size / (cubeSize * sizeof(float))));
+        channelCache.createBuffers(arena.get<float>("Channel cache"));
+    }
     
     std::string timerLabelStatsMipmaps = depth > 1 ? "XY and XYZ statistics and mipmaps" : "XY statistics and mipmaps";
+    
+    std::vector<EncodedTiles> encodedTiles;
 
     
     for (unsigned int s = 0; s < stokes; s++) {
@@ -64,22 +198,32 @@ void SlowConverter::copyAndCalculate() {
         PROGRESS("\tMain loop\t");
         
         StatsCounter counterXYZ;
+        channelCache.clear();
         
         for (hsize_t c = 0; c < depth; c++) {
             PROGRESS_DECIMATED(c, channelProgressStride, "|");
+            // position of this channel in the batch
+            hsize_t b = c % channelsPerWrite;
+            float* channelData = standardCube + b * cubeSize;
+            
             // read one channel
             DEBUG(std::cout << "+ Processing channel " << c << "... " << std::flush;);
             DEBUG(std::cout << " Reading main dataset..." << std::flush;);
             TIMER(timer.start("Read"););
-            readFitsData(inputFilePtr, c, s, cubeSize, standardCube);
+            readChannel(c, s, channelData);
             
-            // Write the standard dataset
+            if (!dataSums.empty()) {
+                dataSums[s * depth + c] = fitsDataSum(channelData, cubeSize);
+            }
             
-            DEBUG(std::cout << " Writing main dataset..." << std::flush;);
-            TIMER(timer.start("Write"););
+            if (!channelHashes.empty()) {
+                channelHashes[s * depth + c] = crc32c(channelData, cubeSize * sizeof(float));
+            }
             
-            std::vector<hsize_t> start = trimAxes({s, c, 0, 0}, N);
-            writeHdf5Data(standardDataSet, standardCube, memDims, count, start);
+            // Keep the original values of the last channels for the histogram pass
+            if (c + channelCache.capacity >= depth) {
+                channelCache.store(c, channelData);
+            }
             
             DEBUG(std::cout << " Accumulating XY stats and mipmaps..." << std::flush;);
             TIMER(timer.start(timerLabelStatsMipmaps););
@@ -102,14 +246,14 @@ void SlowConverter::copyAndCalculate() {
             for (hsize_t y = 0; y < height; y++) {
                 for (hsize_t x = 0; x < width; x++) {
                     auto pos = y * width + x; // relative to channel slice
-                    auto& val = standardCube[pos];
+                    auto& val = channelData[pos];
                                         
                     if (std::isfinite(val)) {
                         // XY statistics
                         accumulate(val);
                         
                         // Accumulate mipmaps
-                        mipMaps.accumulate(val, x, y, 0);
+                        mipMaps.accumulate(val, x, y, b);
                         
                     } else {
                         counterXY.accumulateNonFinite();
@@ -122,22 +266,59 @@ void SlowConverter::copyAndCalculate() {
             statsXY.copyStatsFromCounter(indexXY, height * width, counterXY);
             
             // Accumulate XYZ statistics
-            if (depth > 1) {
+            if (writeStats && depth > 1) {
                 DEBUG(std::cout << " Accumulating XYZ stats..." << std::flush;);
                 statsXY.accumulateStatsToCounter(counterXYZ, indexXY);
             }
             
-            // Final mipmap calculation
+            // Final mipmap calculation (this does nothing if the mipmaps are not written)
             DEBUG(std::cout << " Final mipmaps..." << std::flush;);
-            mipMaps.calculate();
+            mipMaps.calculate(b);
+            
+            if (tileCache.enabled()) {
+                DEBUG(std::cout << " Encoding display tiles..." << std::flush;);
+                TIMER(timer.start("Display tiles"););
+                tileCache.encode(channelData, mipMaps, b, encodedTiles);
+                TIMER(timer.start("Write"););
+                tileCache.write(s, c, encodedTiles);
+                TIMER(timer.start(timerLabelStatsMipmaps););
+            }
+            
+            // Write the standard dataset. This happens after the statistics and mipmaps have been calculated from
+            // the original values, because if we are rounding the output we can do it in place.
+            if (quantizer.enabled()) {
+                DEBUG(std::cout << " Rounding main dataset..." << std::flush;);
+                quantizer.setChannelNoise(s * depth + c, counterXY, height * width);
+                quantizer.round(channelData, cubeSize, s * depth + c);
+            }
+            
+            // Wait until the batch is complete
+            if (b < channelsPerWrite - 1 && c < depth - 1) {
+                DEBUG(std::cout << std::endl;);
+                continue;
+            }
+            
+            hsize_t batchStart = c - b;
+            hsize_t batchSize = b + 1;
+            
+            DEBUG(std::cout << " Writing main dataset..." << std::flush;);
+            TIMER(timer.start("Write"););
             
+            std::vector<hsize_t> memDims = {batchSize, height, width};
+            std::vector<hsize_t> count = trimAxes({1, batchSize, height, width}, N);
+            std::vector<hsize_t> start = trimAxes({s, batchStart, 0, 0}, N);
+            if (standardChecksums.enabled()) {
+                standardChecksums.calculate(standardCube, count, start);
+            }
+            standardDataSet->write(standardCube, memDims, count, start);
+            TIMER(timer.start(timerLabelStatsMipmaps););
             
             // Write the mipmaps
             DEBUG(std::cout << " Writing mipmaps..." << std::flush;);
             TIMER(timer.start("Write"););
-            mipMaps.write(s, c);
+            mipMaps.write(s, batchStart, quantizer, batchSize);
             
-            // Reset mipmaps before next channel
+            // Reset mipmaps before next batch
             DEBUG(std::cout << " Resetting mipmap objects..." << std::endl;);
             TIMER(timer.start(timerLabelStatsMipmaps););
             mipMaps.resetBuffers();
@@ -146,7 +327,7 @@ void SlowConverter::copyAndCalculate() {
         
         PROGRESS(std::endl);
         
-        if (depth > 1) {
+        if (writeStats && depth > 1) {
             // Final correction of XYZ min and max
             DEBUG(std::cout << " Final XYZ stats..." << std::flush;);
             PROGRESS("\tXYZ stats" << std::endl);
@@ -156,7 +337,8 @@ void SlowConverter::copyAndCalculate() {
         
         // XY and XYZ histograms
         // We need a second pass over all channels because we need cube min and max (and channel min and max per channel)
-        // We do the second pass backwards to take advantage of caching
+        // We do the second pass backwards, so that the channels in our channel cache (and in the OS page cache)
+        // come first
         DEBUG(std::cout << " Histograms..." << std::endl;);
         PROGRESS("\tHistograms\t");
         TIMER(timer.start("Histograms"););
@@ -166,7 +348,7 @@ void SlowConverter::copyAndCalculate() {
         double cubeRange;
         bool cubeHist(false);
         
-        if (depth > 1) {
+        if (writeHistograms && depth > 1) {
             cubeMin = statsXYZ.minVals[0];
             cubeMax = statsXYZ.maxVals[0];
             cubeRange = cubeMax - cubeMin;
@@ -178,7 +360,7 @@ void SlowConverter::copyAndCalculate() {
         
         DEBUG(std::cout << "+ Will " << (cubeHist ? "" : "not ") << "calculate cube histogram." << std::endl;);
         
-        for (hsize_t c = depth; c-- > 0; ) {
+        for (hsize_t c = depth; writeHistograms && c-- > 0; ) {
             DEBUG(std::cout << "+ Processing channel " << c << "... " << std::flush;);
             PROGRESS_DECIMATED(c, channelProgressStride, "|");
             auto indexXY = c;
@@ -219,17 +401,27 @@ void SlowConverter::copyAndCalculate() {
                 cubeHistogramFunc = doNothing;
             }
             
-            // read one channel
-            DEBUG(std::cout << " Reading main dataset..." << std::flush;);
-            TIMER(timer.start("Read"););
+            // read one channel, unless it's cached
+            const float* channelData = channelCache.load(c);
             
-            readFitsData(inputFilePtr, c, s, cubeSize, standardCube);
+            if (!channelData) {
+                DEBUG(std::cout << " Reading main dataset..." << std::flush;);
+                TIMER(timer.start("Read"););
+                
+                if (singlePass()) {
+                    auto channelDims = trimAxes({1, 1, height, width}, N);
+                    standardDataSet->read(standardCube, channelDims, channelDims, trimAxes({s, c, 0, 0}, N));
+                } else {
+                    readChannel(c, s, standardCube);
+                }
+                channelData = standardCube;
+            }
 
             DEBUG(std::cout << " Calculating histogram(s)..." << std::endl;);
             TIMER(timer.start("Histograms"););
             
             for (hsize_t p = 0; p < width * height; p++) {
-                auto& val = standardCube[p];
+                auto& val = channelData[p];
                     if (std::isfinite(val)) {
                         channelHistogramFunc(val);
                         cubeHistogramFunc(val);
@@ -243,31 +435,39 @@ void SlowConverter::copyAndCalculate() {
         TIMER(timer.start("Write"););
         PROGRESS("\tWrite stats & mipmaps" << std::endl);
                 
-        statsXY.write({1, depth}, {s, 0});
-        
-        if (depth > 1) {
-            statsXYZ.write({1}, {s});
+        if (writeStats) {
+            statsXY.write({1, depth}, {s, 0});
+            
+            if (depth > 1) {
+                statsXYZ.write({1}, {s});
+            }
         }
     
     } // end of stokes
     
-    // Free memory
-    DEBUG(std::cout << "Freeing memory from main dataset... " << std::endl;);
-    TIMER(timer.start("Free"););
-    
-    delete[] standardCube;
+    // The memory of the main dataset, mipmaps and channel cache is reused for the rotation
+    if (channelCache.enabled()) {
+        PROGRESS("Channel cache: " << channelCache.hits << " of " << channelCache.hits + channelCache.misses << " channels in the histogram pass were not read again (" << channelCache.bytesSaved() * 1e-9 << " GB saved)" << std::endl);
+        channelCache = ChannelCache();
+    }
             
     // Swizzle
-    if (depth > 1) {
+    if (writeSwizzled || writeZStats) {
         DEBUG(std::cout << "Performing tiled rotation." << std::endl;);
         PROGRESS("Tiled rotation & Z stats" << std::endl);
         TIMER(timer.start("Allocate"););
         
-        hsize_t sliceSize = product(trimAxes({stokes, depth, TILE_SIZE, TILE_SIZE}, N));
-        float* standardSlice = new float[sliceSize];
-        float* rotatedSlice = new float[sliceSize];
+        hsize_t sliceSize = rotationDepth * std::min(rotationTileSize, width) * std::min(rotationTileSize, height);
+        float* standardSlice = arena.get<float>("Rotation");
+        float* rotatedSlice = writeSwizzled ? standardSlice + sliceSize : nullptr;
+        StatsCounter* partialZStats = arena.get<StatsCounter>("Z stats partials");
         
-        statsZ.createBuffers({TILE_SIZE, TILE_SIZE});
+        if (writeZStats) {
+            statsZ.createBuffers(arena.get<char>("Z stats"), {std::min(rotationTileSize, height), std::min(rotationTileSize, width)});
+        }
+        
+        hsize_t numTiles = ((width + rotationTileSize - 1) / rotationTileSize) * ((height + rotationTileSize - 1) / rotationTileSize);
+        const hsize_t tileProgressStride = std::max((hsize_t)1, (hsize_t)(numTiles / 100));
         
         for (unsigned int s = 0; s < stokes; s++) {
             DEBUG(std::cout << "Processing Stokes " << s << "..." << std::endl;);
@@ -275,88 +475,113 @@ void SlowConverter::copyAndCalculate() {
             
             hsize_t tileCount(0);
             
-            for (hsize_t xOffset = 0; xOffset < width; xOffset += TILE_SIZE) {
-                for (hsize_t yOffset = 0; yOffset < height; yOffset += TILE_SIZE) {
+            for (hsize_t xOffset = 0; xOffset < width; xOffset += rotationTileSize) {
+                for (hsize_t yOffset = 0; yOffset < height; yOffset += rotationTileSize) {
                     tileCount++;
-                    hsize_t xSize = std::min(TILE_SIZE, width - xOffset);
-                    hsize_t ySize = std::min(TILE_SIZE, height - yOffset);
+                    hsize_t xSize = std::min(rotationTileSize, width - xOffset);
+                    hsize_t ySize = std::min(rotationTileSize, height - yOffset);
                     
                     DEBUG(std::cout << "+ Processing tile slice at " << xOffset << ", " << yOffset << "..." << std::flush;);
                     PROGRESS_DECIMATED(tileCount, tileProgressStride, "#");
                     
-                    // read tile slice
-                    DEBUG(std::cout << " Reading main dataset..." << std::flush;);
-                    TIMER(timer.start("Read"););
+                    // If the slice doesn't fit in memory, it is processed in ranges of channels
+                    for (hsize_t zOffset = 0; zOffset < depth; zOffset += rotationDepth) {
+                        hsize_t zSize = std::min(rotationDepth, depth - zOffset);
                     
-                    auto standardMemDims = trimAxes({1, depth, ySize, xSize}, N);
-                    auto standardCount = trimAxes({1, depth, ySize, xSize}, N);
-                    auto standardStart = trimAxes({s, 0, yOffset, xOffset}, N);
+                        // read tile slice
+                        DEBUG(std::cout << " Reading main dataset..." << std::flush;);
+                        TIMER(timer.start("Read"););
                     
-                    readHdf5Data(standardDataSet, standardSlice, standardMemDims, standardCount, standardStart);
+                        auto standardMemDims = trimAxes({1, zSize, ySize, xSize}, N);
+                        auto standardCount = trimAxes({1, zSize, ySize, xSize}, N);
+                        auto standardStart = trimAxes({s, zOffset, yOffset, xOffset}, N);
                     
-                    // rotate tile slice
-                    DEBUG(std::cout << " Calculating rotation..." << std::flush;);
-                    TIMER(timer.start("Rotation"););
+                        // If the main dataset has been rounded, we have to read the original values from the FITS file instead,
+                        // because the Z statistics are calculated from the original values
+                        if (quantizer.enabled()) {
+                            readSubset(s, xOffset, yOffset, zOffset, xSize, ySize, zSize, standardSlice);
+                        } else {
+                            standardDataSet->read(standardSlice, standardMemDims, standardCount, standardStart);
+                        }
                     
-                    for (hsize_t i = 0; i < depth; i++) {
-                        for (hsize_t j = 0; j < ySize; j++) {
-                            for (hsize_t k = 0; k < xSize; k++) {
-                                auto sourceIndex = k + xSize * j + (ySize * xSize) * i;
-                                auto& val = standardSlice[sourceIndex];
+                        // rotate tile slice
+                        DEBUG(std::cout << " Calculating rotation..." << std::flush;);
+                        TIMER(timer.start("Rotation"););
+                    
+                        for (hsize_t i = 0; writeSwizzled && i < zSize; i++) {
+                            for (hsize_t j = 0; j < ySize; j++) {
+                                for (hsize_t k = 0; k < xSize; k++) {
+                                    auto sourceIndex = k + xSize * j + (ySize * xSize) * i;
+                                    auto& val = standardSlice[sourceIndex];
                                 
-                                // rotation
-                                auto destIndex = i + depth * j + (ySize * depth) * k;
-                                rotatedSlice[destIndex] = val;
+                                    // rotation
+                                    auto destIndex = i + zSize * j + (ySize * zSize) * k;
+                                    rotatedSlice[destIndex] = quantizer.enabled() ? quantizer.round(val, s * depth + zOffset + i) : val;
+                                }
                             }
                         }
-                    }
                     
-                    // A separate pass over the same slice depth-last 
-                    DEBUG(std::cout << " Calculating Z statistics..." << std::flush;);
-                    TIMER(timer.start("Z statistics"););
+                        // A separate pass over the same slice depth-last 
+                        DEBUG(std::cout << " Calculating Z statistics..." << std::flush;);
+                        TIMER(timer.start("Z statistics"););
                     
-                    for (hsize_t j = 0; j < ySize; j++) {
-                        for (hsize_t k = 0; k < xSize; k++) {
-                            StatsCounter counterZ;
-                            auto indexZ = k + xSize * j;
+                        bool lastRange = zOffset + zSize == depth;
+                        
+                        for (hsize_t j = 0; writeZStats && j < ySize; j++) {
+                            for (hsize_t k = 0; k < xSize; k++) {
+                                auto indexZ = k + xSize * j;
+                                // Continue from the previous range of channels
+                                StatsCounter counterZ = zOffset ? partialZStats[indexZ] : StatsCounter();
                             
-                            for (hsize_t i = 0; i < depth; i++) {
-                                auto sourceIndex = k + xSize * j + (ySize * xSize) * i;
-                                auto& val = standardSlice[sourceIndex];
+                                for (hsize_t i = 0; i < zSize; i++) {
+                                    auto sourceIndex = k + xSize * j + (ySize * xSize) * i;
+                                    auto& val = standardSlice[sourceIndex];
                                 
-                                if (std::isfinite(val)) {
-                                    // Not lazy; too much risk of encountering an ascending / descending sequence.
-                                    counterZ.accumulateFinite(val);
+                                    if (std::isfinite(val)) {
+                                        // Not lazy; too much risk of encountering an ascending / descending sequence.
+                                        counterZ.accumulateFinite(val);
+                                    } else {
+                                        counterZ.accumulateNonFinite();
+                                    }
+                                }
+                            
+                                if (lastRange) {
+                                    statsZ.copyStatsFromCounter(indexZ, depth, counterZ);
                                 } else {
-                                    counterZ.accumulateNonFinite();
+                                    partialZStats[indexZ] = counterZ;
                                 }
                             }
-                            
-                            statsZ.copyStatsFromCounter(indexZ, depth, counterZ);
                         }
-                    }
                     
-                    // write tile slice
-                    DEBUG(std::cout << " Writing rotated dataset..." << std::endl;);
-                    TIMER(timer.start("Write"););
+                        // write tile slice
+                        DEBUG(std::cout << " Writing rotated dataset..." << std::endl;);
+                        TIMER(timer.start("Write"););
+                    
+                        auto swizzledMemDims = trimAxes({1, xSize, ySize, zSize}, N);
+                        auto swizzledCount = trimAxes({1, xSize, ySize, zSize}, N);
+                        auto swizzledStart = trimAxes({s, xOffset, yOffset, zOffset}, N);
                     
-                    auto swizzledMemDims = trimAxes({1, xSize, ySize, depth}, N);
-                    auto swizzledCount = trimAxes({1, xSize, ySize, depth}, N);
-                    auto swizzledStart = trimAxes({s, xOffset, yOffset, 0}, N);
+                        if (swizzledChecksums.enabled()) {
+                            swizzledChecksums.calculate(rotatedSlice, swizzledCount, swizzledStart);
+                        }
                     
-                    writeHdf5Data(swizzledDataSet, rotatedSlice, swizzledMemDims, swizzledCount, swizzledStart);
+                        if (writeSwizzled) {
+                            swizzledDataSet->write(rotatedSlice, swizzledMemDims, swizzledCount, swizzledStart);
+                        }
+                    }
                     
                     DEBUG(std::cout << " Writing Z statistics..." << std::endl;);
                     // write Z statistics
-                    statsZ.write({ySize, xSize}, {1, ySize, xSize}, {s, yOffset, xOffset});
+                    if (writeZStats) {
+                        statsZ.write({ySize, xSize}, {1, ySize, xSize}, {s, yOffset, xOffset});
+                    }
                 }
             }
             PROGRESS(std::endl);
         }
-        
-        TIMER(timer.start("Free"););
-        DEBUG(std::cout << "Freeing memory from main and rotated dataset slices... " << std::endl;);
-        delete[] standardSlice;
-        delete[] rotatedSlice;
     }
+    
+    TIMER(timer.start("Free"););
+    DEBUG(std::cout << "Freeing memory... " << std::endl;);
+    arena.free();
 }
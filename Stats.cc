@@ -11,15 +11,7 @@ Stats::Stats(const std::vector<hsize_t>& basicDatasetDims, hsize_t numBins) : ba
 
 Stats::~Stats() {
     if (buffersAllocated) {
-        delete[] minVals;
-        delete[] maxVals;
-        delete[] sums;
-        delete[] sumsSq;
-        delete[] nanCounts;
-        if (histogramBuffersAllocated) {
-            delete[] histograms;
-            delete[] partialHistograms;
-        }
+        delete[] memory;
     }
 }
 
@@ -28,38 +20,54 @@ hsize_t Stats::size(std::vector<hsize_t> dims, hsize_t numBins, hsize_t partialH
     return (2 * sizeof(float) + 2 * sizeof(double) + sizeof(int64_t)) * statsSize + sizeof(int64_t) * (statsSize * numBins + statsSize * numBins * partialHistMultiplier);
 }
 
-void Stats::createDatasets(H5::Group group, std::string name) {
-    H5::FloatType floatType(H5::PredType::NATIVE_FLOAT);
-    floatType.setOrder(H5T_ORDER_LE);
-    
-    H5::IntType intType(H5::PredType::NATIVE_INT64);
-    intType.setOrder(H5T_ORDER_LE);
-    
-    createHdf5Dataset(minDset, group, "Statistics/" + name + "/MIN", floatType, basicDatasetDims);
-    createHdf5Dataset(maxDset, group, "Statistics/" + name + "/MAX", floatType, basicDatasetDims);
-    createHdf5Dataset(sumDset, group, "Statistics/" + name + "/SUM", floatType, basicDatasetDims);
-    createHdf5Dataset(ssqDset, group, "Statistics/" + name + "/SUM_SQ", floatType, basicDatasetDims);
-    createHdf5Dataset(nanDset, group, "Statistics/" + name + "/NAN_COUNT", intType, basicDatasetDims);
+void Stats::createDatasets(OutputGroup group, std::string name) {
+    minDset = group.createDataset("Statistics/" + name + "/MIN", DataType::FLOAT, basicDatasetDims);
+    maxDset = group.createDataset("Statistics/" + name + "/MAX", DataType::FLOAT, basicDatasetDims);
+    sumDset = group.createDataset("Statistics/" + name + "/SUM", DataType::FLOAT, basicDatasetDims);
+    ssqDset = group.createDataset("Statistics/" + name + "/SUM_SQ", DataType::FLOAT, basicDatasetDims);
+    nanDset = group.createDataset("Statistics/" + name + "/NAN_COUNT", DataType::INT64, basicDatasetDims);
     
     if (numBins) {
-        createHdf5Dataset(histDset, group, "Statistics/" + name + "/HISTOGRAM", intType, extend(basicDatasetDims, {numBins}));
+        histDset = group.createDataset("Statistics/" + name + "/HISTOGRAM", DataType::INT64, extend(basicDatasetDims, {numBins}));
+    }
+}
+
+void Stats::openDatasets(OutputGroup group, std::string name) {
+    minDset = group.openDataset("Statistics/" + name + "/MIN");
+    maxDset = group.openDataset("Statistics/" + name + "/MAX");
+    sumDset = group.openDataset("Statistics/" + name + "/SUM");
+    ssqDset = group.openDataset("Statistics/" + name + "/SUM_SQ");
+    nanDset = group.openDataset("Statistics/" + name + "/NAN_COUNT");
+    basicDatasetDims = minDset->dims;
+    
+    if (group.exists("Statistics/" + name + "/HISTOGRAM")) {
+        histDset = group.openDataset("Statistics/" + name + "/HISTOGRAM");
+        numBins = histDset->dims.back();
+    } else {
+        numBins = 0;
     }
 }
 
 void Stats::createBuffers(std::vector<hsize_t> dims, hsize_t partialHistMultiplier) {
+    createBuffers(new char[size(dims, numBins, partialHistMultiplier)], dims, partialHistMultiplier);
+    buffersAllocated = true;
+}
+
+void Stats::createBuffers(char* memory, std::vector<hsize_t> dims, hsize_t partialHistMultiplier) {
     fullBasicBufferDims = dims;
     auto statsSize = product(dims);
+    this->memory = memory;
         
-    minVals = new float[statsSize];
-    maxVals = new float[statsSize];
-    sums = new double[statsSize];
-    sumsSq = new double[statsSize];
-    nanCounts = new int64_t[statsSize];
-    buffersAllocated = true;
+    // The widest types come first, so that all the buffers are aligned
+    sums = (double*)memory;
+    sumsSq = sums + statsSize;
+    nanCounts = (int64_t*)(sumsSq + statsSize);
+    minVals = (float*)(nanCounts + statsSize);
+    maxVals = minVals + statsSize;
     
     if (numBins) {
-        histograms = new int64_t[statsSize * numBins];
-        partialHistograms = new int64_t[statsSize * numBins * partialHistMultiplier];
+        histograms = (int64_t*)(maxVals + statsSize);
+        partialHistograms = histograms + statsSize * numBins;
         this->partialHistMultiplier = partialHistMultiplier;
         histogramBuffersAllocated = true;
     }
@@ -73,6 +81,23 @@ void Stats::clearHistogramBuffers() {
     }
 }
 
+void Stats::read(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+    auto basicN = basicDatasetDims.size();
+    auto basicCount = trimAxes(count, basicN);
+    auto basicStart = trimAxes(start, basicN);
+    
+    minDset->read(minVals, fullBasicBufferDims, basicCount, basicStart);
+    maxDset->read(maxVals, fullBasicBufferDims, basicCount, basicStart);
+    sumDset->read(sums, fullBasicBufferDims, basicCount, basicStart);
+    ssqDset->read(sumsSq, fullBasicBufferDims, basicCount, basicStart);
+    nanDset->read(nanCounts, fullBasicBufferDims, basicCount, basicStart);
+    
+    if (numBins) {
+        auto histN = basicN + 1;
+        histDset->read(histograms, extend(fullBasicBufferDims, {numBins}), trimAxes(extend(count, {numBins}), histN), trimAxes(extend(start, {0}), histN));
+    }
+}
+
 void Stats::write() {
     writeBasic(fullBasicBufferDims);
     
@@ -85,24 +110,24 @@ void Stats::write(const std::vector<hsize_t>& count, const std::vector<hsize_t>&
     write(fullBasicBufferDims, count, start);
 }
 
-void Stats::write(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
+void Stats::write(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t bufferOffset) {
     auto basicN = basicDatasetDims.size();
-    writeBasic(basicBufferDims, trimAxes(count, basicN), trimAxes(start, basicN));
+    writeBasic(basicBufferDims, trimAxes(count, basicN), trimAxes(start, basicN), bufferOffset);
     
     if (numBins) {
         auto histN = basicN + 1;
-        writeHistogram(basicBufferDims, trimAxes(extend(count, {numBins}), histN), trimAxes(extend(start, {0}), histN));
+        writeHistogram(basicBufferDims, trimAxes(extend(count, {numBins}), histN), trimAxes(extend(start, {0}), histN), bufferOffset);
     }
 }
     
-void Stats::writeBasic(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    writeHdf5Data(minDset, minVals, basicBufferDims, count, start);
-    writeHdf5Data(maxDset, maxVals, basicBufferDims, count, start);
-    writeHdf5Data(sumDset, sums, basicBufferDims, count, start);
-    writeHdf5Data(ssqDset, sumsSq, basicBufferDims, count, start);
-    writeHdf5Data(nanDset, nanCounts, basicBufferDims, count, start);
+void Stats::writeBasic(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t bufferOffset) {
+    minDset->write(minVals + bufferOffset, basicBufferDims, count, start);
+    maxDset->write(maxVals + bufferOffset, basicBufferDims, count, start);
+    sumDset->write(sums + bufferOffset, basicBufferDims, count, start);
+    ssqDset->write(sumsSq + bufferOffset, basicBufferDims, count, start);
+    nanDset->write(nanCounts + bufferOffset, basicBufferDims, count, start);
 }
 
-void Stats::writeHistogram(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    writeHdf5Data(histDset, histograms, extend(basicBufferDims, {numBins}), count, start);
+void Stats::writeHistogram(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t bufferOffset) {
+    histDset->write(histograms + bufferOffset * numBins, extend(basicBufferDims, {numBins}), count, start);
 }
@@ -8,6 +8,7 @@
 
 #include "common.h"
 #include "Util.h"
+#include "Output.h"
 
 struct StatsCounter {
     StatsCounter() : minVal(std::numeric_limits<float>::max()), maxVal(-std::numeric_limits<float>::max()), sum(0), sumSq(0), nanCount(0) {
@@ -56,8 +57,12 @@ struct Stats {
     static hsize_t size(std::vector<hsize_t> dims, hsize_t numBins = 0, hsize_t partialHistMultiplier = 0);
     
     // Setup
-    void createDatasets(H5::Group group, std::string name);
+    void createDatasets(OutputGroup group, std::string name);
+    // Open the datasets of an existing file. The number of bins is taken from the histogram dataset, if there is one.
+    void openDatasets(OutputGroup group, std::string name);
     void createBuffers(std::vector<hsize_t> dims, hsize_t partialHistMultiplier = 0);
+    // Use memory which is owned by someone else (this must be at least size(dims, numBins, partialHistMultiplier))
+    void createBuffers(char* memory, std::vector<hsize_t> dims, hsize_t partialHistMultiplier = 0);
     
     // Basic stats
     
@@ -108,25 +113,29 @@ struct Stats {
         }
     }
     
+    // Reading the stats of an existing file into the buffers
+    void read(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
+    
     // Writing
     void write();
     void write(const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
-    void write(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start);
-    void writeBasic(const std::vector<hsize_t>& basicBufferDims = EMPTY_DIMS, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
-    void writeHistogram(const std::vector<hsize_t>& basicBufferDims = EMPTY_DIMS, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
+    // The buffer offset is the index of the first buffer entry to write, so that part of the buffers can be written
+    void write(const std::vector<hsize_t>& basicBufferDims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start, hsize_t bufferOffset = 0);
+    void writeBasic(const std::vector<hsize_t>& basicBufferDims = EMPTY_DIMS, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS, hsize_t bufferOffset = 0);
+    void writeHistogram(const std::vector<hsize_t>& basicBufferDims = EMPTY_DIMS, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS, hsize_t bufferOffset = 0);
     
     // Dataset dimensions
     std::vector<hsize_t> basicDatasetDims;
     hsize_t numBins;
     
     // Datasets
-    H5::DataSet minDset;
-    H5::DataSet maxDset;
-    H5::DataSet sumDset;
-    H5::DataSet ssqDset;
-    H5::DataSet nanDset;
+    std::shared_ptr<OutputDataset> minDset;
+    std::shared_ptr<OutputDataset> maxDset;
+    std::shared_ptr<OutputDataset> sumDset;
+    std::shared_ptr<OutputDataset> ssqDset;
+    std::shared_ptr<OutputDataset> nanDset;
     
-    H5::DataSet histDset;
+    std::shared_ptr<OutputDataset> histDset;
     
     // Buffer dimensions
     
@@ -134,6 +143,7 @@ struct Stats {
     hsize_t partialHistMultiplier;
 
     // Buffers
+    char* memory;
     float* minVals;
     float* maxVals;
     double* sums;
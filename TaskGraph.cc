@@ -0,0 +1,177 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "TaskGraph.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+TaskGraph::TaskGraph(int maxThreads) : maxThreads(maxThreads), remaining(0), ready(0), failed(false) {}
+
+int TaskGraph::numThreads() {
+#ifdef _OPENMP
+    // Respect OMP_NUM_THREADS
+    return std::max(1, omp_get_max_threads());
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+Task* TaskGraph::add(std::function<void()> work, const std::vector<Task*>& dependencies) {
+    tasks.emplace_back(work);
+    Task* task = &tasks.back();
+    
+    for (auto& dependency : dependencies) {
+        addDependency(task, dependency);
+    }
+    
+    return task;
+}
+
+void TaskGraph::addDependency(Task* task, Task* dependency) {
+    if (dependency) {
+        dependency->successors.push_back(task);
+        task->pending++;
+    }
+}
+
+void TaskGraph::push(int worker, Task* task) {
+    {
+        // The count is raised before the task can be taken, so that it never drops below zero
+        std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+        ready++;
+        workers[worker]->queue.push_back(task);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+    }
+    idle.notify_one();
+}
+
+Task* TaskGraph::pop(int worker) {
+    std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+    auto& queue = workers[worker]->queue;
+    
+    if (queue.empty()) {
+        return nullptr;
+    }
+    
+    Task* task = queue.back();
+    queue.pop_back();
+    ready--;
+    return task;
+}
+
+Task* TaskGraph::steal(int thief) {
+    int numWorkers = workers.size();
+    
+    for (int i = 1; i < numWorkers; i++) {
+        auto& victim = workers[(thief + i) % numWorkers];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        
+        if (!victim->queue.empty()) {
+            Task* task = victim->queue.front();
+            victim->queue.pop_front();
+            ready--;
+            return task;
+        }
+    }
+    
+    return nullptr;
+}
+
+void TaskGraph::finish(int worker, Task* task) {
+    for (auto& successor : task->successors) {
+        if (--successor->pending == 0) {
+            push(worker, successor);
+        }
+    }
+    
+    if (--remaining == 0) {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+        }
+        idle.notify_all();
+    }
+}
+
+void TaskGraph::work(int worker) {
+    while (remaining > 0) {
+        Task* task = pop(worker);
+        
+        if (!task) {
+            task = steal(worker);
+        }
+        
+        if (!task) {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idle.wait(lock, [&] { return remaining == 0 || ready > 0; });
+            continue;
+        }
+        
+        // After a failure we still walk the rest of the graph so that the workers terminate, but we do no more work
+        if (!failed) {
+            try {
+                task->work();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+        
+        finish(worker, task);
+    }
+}
+
+void TaskGraph::run() {
+    int numWorkers = std::min((size_t)(maxThreads ? maxThreads : numThreads()), std::max((size_t)1, tasks.size()));
+    
+    workers.clear();
+    for (int i = 0; i < numWorkers; i++) {
+        workers.emplace_back(new Worker());
+    }
+    
+    remaining = tasks.size();
+    ready = 0;
+    failed = false;
+    error = nullptr;
+    
+    // Distribute the initially ready tasks
+    int next(0);
+    for (auto& task : tasks) {
+        if (task.pending == 0) {
+            push(next, &task);
+            next = (next + 1) % numWorkers;
+        }
+    }
+    
+    if (remaining > 0 && ready == 0) {
+        throw "Task graph has no ready tasks (dependency cycle)";
+    }
+    
+    // The calling thread is the first worker
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numWorkers; i++) {
+        threads.emplace_back(&TaskGraph::work, this, i);
+    }
+    
+    work(0);
+    
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    tasks.clear();
+    workers.clear();
+    
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
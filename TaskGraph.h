@@ -0,0 +1,72 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __TASKGRAPH_H
+#define __TASKGRAPH_H
+
+#include "common.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+
+// A single unit of work in a task graph
+struct Task {
+    Task(std::function<void()> work) : work(work), pending(0) {}
+    
+    std::function<void()> work;
+    std::vector<Task*> successors;
+    std::atomic<int> pending;
+};
+
+// A dependency graph of tasks, executed by a pool of work-stealing threads.
+// A task becomes ready as soon as all the tasks it depends on have finished. Each worker has its own queue:
+// tasks which are made ready by a worker are pushed to the back of its queue and executed next (so that
+// dependent work on the same data stays on the same core), and idle workers steal from the front of
+// other workers' queues.
+// If a task throws, the remaining tasks are skipped and the exception is rethrown by run().
+class TaskGraph {
+public:
+    // At most maxThreads workers are used (0 for numThreads())
+    TaskGraph(int maxThreads = 0);
+    
+    // Dependencies which are null are ignored, so that optional tasks can be passed in directly
+    Task* add(std::function<void()> work, const std::vector<Task*>& dependencies = {});
+    void addDependency(Task* task, Task* dependency);
+    
+    // Execute all tasks and wait for them to finish. The graph is empty afterwards.
+    void run();
+    
+    static int numThreads();
+
+private:
+    struct Worker {
+        std::deque<Task*> queue;
+        std::mutex mutex;
+    };
+    
+    void push(int worker, Task* task);
+    Task* pop(int worker);
+    Task* steal(int thief);
+    void work(int worker);
+    void finish(int worker, Task* task);
+    
+    std::deque<Task> tasks;
+    std::vector<std::unique_ptr<Worker>> workers;
+    int maxThreads;
+    
+    std::atomic<size_t> remaining;
+    std::atomic<size_t> ready;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+};
+
+#endif
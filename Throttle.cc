@@ -0,0 +1,137 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Throttle.h"
+
+#include <thread>
+
+// The bucket holds this many seconds' worth of tokens, which is the longest burst at full speed
+#define THROTTLE_INTERVAL 0.05
+// Large reads and writes are split into blocks which take about one interval at the limit, within these bounds
+#define MIN_THROTTLE_BLOCK (hsize_t)(64 << 10)
+#define MAX_THROTTLE_BLOCK (hsize_t)(4 << 20)
+
+// TokenBucket
+
+void TokenBucket::setRate(double rate) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    this->rate = rate;
+    // An operation of one unit can always start straight away
+    capacity = std::max(1.0, rate * THROTTLE_INTERVAL);
+    tokens = capacity;
+    lastRefill = std::chrono::steady_clock::now();
+}
+
+double TokenBucket::take(double amount) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto now = std::chrono::steady_clock::now();
+    tokens = std::min(capacity, tokens + std::chrono::duration<double>(now - lastRefill).count() * rate);
+    lastRefill = now;
+    
+    // The caller waits for the debt of the operations before it, and its own tokens are reserved now, so that
+    // concurrent callers are served in order
+    double wait = tokens < 0 ? -tokens / rate : 0;
+    tokens -= amount;
+    return wait;
+}
+
+// The throttle of the process
+
+static IoLimits limits;
+static TokenBucket readBucket;
+static TokenBucket writeBucket;
+static TokenBucket operationBucket;
+
+static std::mutex counterMutex;
+static ThrottleCounter readCounter;
+static ThrottleCounter writeCounter;
+
+void setIoLimits(const IoLimits& newLimits) {
+    limits = newLimits;
+    readBucket.setRate(limits.readBandwidth);
+    writeBucket.setRate(limits.writeBandwidth);
+    operationBucket.setRate(limits.iops);
+}
+
+const IoLimits& ioLimits() {
+    return limits;
+}
+
+static void throttle(TokenBucket& bucket, ThrottleCounter& counter, hsize_t bytes) {
+    if (!bucket.enabled() && !operationBucket.enabled()) {
+        return;
+    }
+    
+    double wait(0);
+    if (bucket.enabled()) {
+        wait = bucket.take(bytes);
+    }
+    if (operationBucket.enabled()) {
+        wait = std::max(wait, operationBucket.take(1));
+    }
+    
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+    
+    std::lock_guard<std::mutex> lock(counterMutex);
+    counter.seconds += wait;
+    counter.bytes += bytes;
+    counter.operations++;
+}
+
+void throttleRead(hsize_t bytes) {
+    throttle(readBucket, readCounter, bytes);
+}
+
+void throttleWrite(hsize_t bytes) {
+    throttle(writeBucket, writeCounter, bytes);
+}
+
+static hsize_t throttleBlock(hsize_t bandwidth) {
+    if (!bandwidth) {
+        return 0;
+    }
+    
+    hsize_t block = bandwidth * THROTTLE_INTERVAL;
+    // With an IOPS limit too, smaller blocks would use up the operations before the bandwidth
+    if (limits.iops) {
+        block = std::max(block, bandwidth / limits.iops);
+    }
+    
+    return std::max(MIN_THROTTLE_BLOCK, std::min(MAX_THROTTLE_BLOCK, block));
+}
+
+hsize_t throttleReadBlock() {
+    return throttleBlock(limits.readBandwidth);
+}
+
+hsize_t throttleWriteBlock() {
+    return throttleBlock(limits.writeBandwidth);
+}
+
+ThrottleCounter readThrottleCounter() {
+    std::lock_guard<std::mutex> lock(counterMutex);
+    return readCounter;
+}
+
+ThrottleCounter writeThrottleCounter() {
+    std::lock_guard<std::mutex> lock(counterMutex);
+    return writeCounter;
+}
+
+void printThrottleTimes() {
+    if (!limits.enabled()) {
+        return;
+    }
+    
+    auto read = readThrottleCounter();
+    auto write = writeThrottleCounter();
+    
+    std::cout << "Read throttling: " << read.seconds << " seconds (" << read.bytes * 1e-6 << " MB in " << read.operations << " operations)" << std::endl;
+    std::cout << "Write throttling: " << write.seconds << " seconds (" << write.bytes * 1e-6 << " MB in " << write.operations << " operations)" << std::endl;
+}
@@ -0,0 +1,79 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __THROTTLE_H
+#define __THROTTLE_H
+
+#include "common.h"
+
+#include <mutex>
+
+// Limits on the I/O of the whole process, in bytes and operations per second (0 means no limit)
+struct IoLimits {
+    IoLimits() : readBandwidth(0), writeBandwidth(0), iops(0) {}
+    
+    bool enabled() const {
+        return readBandwidth || writeBandwidth || iops;
+    }
+    
+    hsize_t readBandwidth;
+    hsize_t writeBandwidth;
+    hsize_t iops;
+};
+
+// A token bucket which refills at a fixed rate, and holds at most a short interval's worth of tokens, so that the
+// operations which take from it are spread out evenly instead of starting in bursts. An operation may take more
+// tokens than the bucket holds; the debt is paid by the operations which come after it.
+class TokenBucket {
+public:
+    TokenBucket() : rate(0), capacity(0), tokens(0) {}
+    
+    void setRate(double rate);
+    
+    bool enabled() const {
+        return rate > 0;
+    }
+    
+    // Take the tokens, and return how long the caller has to wait before it may use them, in seconds
+    double take(double amount);
+
+private:
+    double rate;
+    double capacity;
+    double tokens;
+    std::chrono::time_point<std::chrono::steady_clock> lastRefill;
+    std::mutex mutex;
+};
+
+// Time spent waiting for the throttle, and the I/O which passed through it
+struct ThrottleCounter {
+    ThrottleCounter() : seconds(0), bytes(0), operations(0) {}
+    
+    double seconds;
+    hsize_t bytes;
+    hsize_t operations;
+};
+
+// Set the limits before any I/O starts
+void setIoLimits(const IoLimits& limits);
+const IoLimits& ioLimits();
+
+// Wait until a read or write of this many bytes may start. All the reads of the input and all the reads and writes
+// of the output go through these, on any thread. They must not be called while holding the HDF5 or FITS lock, so that
+// other threads can still use the libraries while one waits.
+void throttleRead(hsize_t bytes);
+void throttleWrite(hsize_t bytes);
+
+// The size in which a large read or write should be split, so that it is paced evenly (0 if it doesn't need to be)
+hsize_t throttleReadBlock();
+hsize_t throttleWriteBlock();
+
+ThrottleCounter readThrottleCounter();
+ThrottleCounter writeThrottleCounter();
+
+// Print the time spent waiting for the throttle, if the I/O is throttled
+void printThrottleTimes();
+
+#endif
@@ -0,0 +1,142 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "TileCache.h"
+#include "Quantizer.h"
+
+#include <zlib.h>
+
+// Copy a tile out of a channel and round it
+template <typename T>
+static void extractTile(const T* channel, hsize_t width, hsize_t xOffset, hsize_t yOffset, hsize_t xSize, hsize_t ySize, int keepBits, std::vector<float>& tile) {
+    tile.resize(xSize * ySize);
+    
+    for (hsize_t y = 0; y < ySize; y++) {
+        const T* row = channel + (yOffset + y) * width + xOffset;
+        for (hsize_t x = 0; x < xSize; x++) {
+            tile[y * xSize + x] = Quantizer::roundMantissa(row[x], keepBits);
+        }
+    }
+}
+
+// TileLayer
+
+TileLayer::TileLayer(const std::vector<hsize_t>& datasetDims, int mip) : datasetDims(datasetDims), mip(mip), size(0) {
+    auto N = datasetDims.size();
+    width = datasetDims[N - 1];
+    height = datasetDims[N - 2];
+    tilesX = std::ceil((float)width / DISPLAY_TILE_SIZE);
+    tilesY = std::ceil((float)height / DISPLAY_TILE_SIZE);
+}
+
+// TileCache
+
+TileCache::TileCache(const std::vector<hsize_t>& standardDims, const MipMaps& mipMaps, int keepBits) : keepBits(keepBits) {
+    layers.push_back(TileLayer(standardDims, 1));
+    
+    for (auto& mipMap : mipMaps.mipMaps) {
+        layers.push_back(TileLayer(mipMap.datasetDims, mipMap.mip));
+    }
+}
+
+void TileCache::createDatasets(OutputGroup group) {
+    auto cacheGroup = group.createGroup("TileCache");
+    cacheGroup.writeAttribute("TILE_SIZE", (int64_t)DISPLAY_TILE_SIZE);
+    cacheGroup.writeAttribute("CODEC", std::string("BITROUND+SHUFFLE+DEFLATE"));
+    cacheGroup.writeAttribute("CODEC_KEEP_BITS", (int64_t)keepBits);
+    
+    for (auto& layer : layers) {
+        std::ostringstream layerName;
+        layerName << "DATA_XY_" << layer.mip;
+        
+        int N = layer.datasetDims.size();
+        auto indexDims = extend(trimAxes(layer.datasetDims, N), {2});
+        indexDims[N - 2] = layer.tilesY;
+        indexDims[N - 1] = layer.tilesX;
+        
+        layer.tilesDset = cacheGroup.createExtendibleDataset(layerName.str() + "/TILES", DataType::UINT8, 1 << 20);
+        layer.indexDset = cacheGroup.createDataset(layerName.str() + "/INDEX", DataType::INT64, indexDims);
+    }
+}
+
+void TileCache::encodeTile(std::vector<float>& tile, EncodedTiles& encoded) {
+    hsize_t numVals = tile.size();
+    
+    // Shuffle the bytes into planes, so that the zeroed low bits end up next to each other
+    std::vector<uint8_t> shuffled(numVals * sizeof(float));
+    const uint8_t* bytes = (const uint8_t*)tile.data();
+    
+    for (hsize_t i = 0; i < numVals; i++) {
+        for (hsize_t b = 0; b < sizeof(float); b++) {
+            shuffled[b * numVals + i] = bytes[i * sizeof(float) + b];
+        }
+    }
+    
+    uLongf compressedSize = compressBound(shuffled.size());
+    hsize_t offset = encoded.data.size();
+    encoded.data.resize(offset + compressedSize);
+    
+    if (compress2(encoded.data.data() + offset, &compressedSize, shuffled.data(), shuffled.size(), 1) != Z_OK) {
+        throw "Could not compress display tile";
+    }
+    
+    encoded.data.resize(offset + compressedSize);
+    encoded.index.push_back(offset);
+    encoded.index.push_back(compressedSize);
+}
+
+void TileCache::encode(const float* channel, const MipMaps& mipMaps, hsize_t bufferChannel, std::vector<EncodedTiles>& encoded) const {
+    encoded.resize(layers.size());
+    std::vector<float> tile;
+    
+    for (size_t l = 0; l < layers.size(); l++) {
+        auto& layer = layers[l];
+        encoded[l] = EncodedTiles();
+        
+        for (hsize_t tileY = 0; tileY < layer.tilesY; tileY++) {
+            for (hsize_t tileX = 0; tileX < layer.tilesX; tileX++) {
+                hsize_t xOffset = tileX * DISPLAY_TILE_SIZE;
+                hsize_t yOffset = tileY * DISPLAY_TILE_SIZE;
+                hsize_t xSize = std::min(DISPLAY_TILE_SIZE, layer.width - xOffset);
+                hsize_t ySize = std::min(DISPLAY_TILE_SIZE, layer.height - yOffset);
+                
+                if (l == 0) {
+                    extractTile(channel, layer.width, xOffset, yOffset, xSize, ySize, keepBits, tile);
+                } else {
+                    auto& mipMap = mipMaps.mipMaps[l - 1];
+                    const double* mipChannel = mipMap.vals + bufferChannel * mipMap.width * mipMap.height;
+                    extractTile(mipChannel, mipMap.width, xOffset, yOffset, xSize, ySize, keepBits, tile);
+                }
+                
+                encodeTile(tile, encoded[l]);
+            }
+        }
+    }
+}
+
+void TileCache::write(hsize_t stokes, hsize_t channel, std::vector<EncodedTiles>& encoded) {
+    for (size_t l = 0; l < layers.size(); l++) {
+        auto& layer = layers[l];
+        auto& tiles = encoded[l];
+        
+        layer.tilesDset->append(tiles.data.data(), tiles.data.size(), layer.size);
+        
+        // Make the offsets absolute
+        for (size_t i = 0; i < tiles.index.size(); i += 2) {
+            tiles.index[i] += layer.size;
+        }
+        
+        layer.size += tiles.data.size();
+        
+        int N = layer.datasetDims.size();
+        std::vector<hsize_t> memDims = {layer.tilesY, layer.tilesX, 2};
+        auto count = trimAxes({1, 1, layer.tilesY, layer.tilesX, 2}, N + 1);
+        auto start = trimAxes({stokes, channel, 0, 0, 0}, N + 1);
+        layer.indexDset->write(tiles.index.data(), memDims, count, start);
+        
+        // Free the memory as soon as it has been written
+        tiles = EncodedTiles();
+    }
+}
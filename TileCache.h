@@ -0,0 +1,70 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __TILECACHE_H
+#define __TILECACHE_H
+
+#include "common.h"
+#include "Util.h"
+#include "MipMap.h"
+
+// The encoded display tiles of one channel of one layer
+struct EncodedTiles {
+    std::vector<uint8_t> data;
+    // Offset (relative to the start of the data) and size of each tile, in row-major tile order
+    std::vector<int64_t> index;
+};
+
+// A single layer of the tile cache (the base layer or a mipmap)
+struct TileLayer {
+    TileLayer() {}
+    TileLayer(const std::vector<hsize_t>& datasetDims, int mip);
+    
+    std::vector<hsize_t> datasetDims;
+    int mip;
+    
+    hsize_t width;
+    hsize_t height;
+    hsize_t tilesX;
+    hsize_t tilesY;
+    
+    std::shared_ptr<OutputDataset> tilesDset;
+    std::shared_ptr<OutputDataset> indexDset;
+    
+    // Current end of the tiles dataset
+    hsize_t size;
+};
+
+// Optional precomputed display tiles, so that a server can stream them without any computation.
+// Each DISPLAY_TILE_SIZE x DISPLAY_TILE_SIZE tile of each channel of the base layer and of each mipmap is
+// encoded separately with a lossy float codec: the values are rounded to a configurable number of mantissa bits,
+// the bytes are shuffled into planes and the result is compressed with deflate.
+// For each layer the encoded tiles are appended to a byte dataset, and an index dataset holds the offset and size of
+// each tile in that dataset.
+struct TileCache {
+    TileCache() : keepBits(0) {}
+    TileCache(const std::vector<hsize_t>& standardDims, const MipMaps& mipMaps, int keepBits);
+    
+    bool enabled() const {
+        return keepBits > 0;
+    }
+    
+    void createDatasets(OutputGroup group);
+    
+    // Encode all layers of one channel. The mipmaps must already have been calculated for this channel.
+    // This can be called from multiple threads at once.
+    void encode(const float* channel, const MipMaps& mipMaps, hsize_t bufferChannel, std::vector<EncodedTiles>& encoded) const;
+    
+    // Append the encoded tiles of one channel to the datasets, and write their index
+    void write(hsize_t stokes, hsize_t channel, std::vector<EncodedTiles>& encoded);
+    
+    // The tile must already have been rounded
+    static void encodeTile(std::vector<float>& tile, EncodedTiles& encoded);
+    
+    int keepBits;
+    std::vector<TileLayer> layers;
+};
+
+#endif
@@ -0,0 +1,429 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "Updater.h"
+
+// The Z statistics need all the channels of a pixel, so they are recalculated from blocks of rows of the main dataset.
+// The blocks are limited to this size, but they always hold at least one row.
+static const hsize_t Z_BLOCK_SIZE = (hsize_t)1 << 28;
+
+Updater::Updater(std::string inputFileName, std::string fileName, const ConverterOptions& options) : timer(), options(options), progress(options.progress), numChangedChannels(0), oldCubeMin(0), oldCubeMax(0), oldCubeHist(false) {
+    TIMER(timer.start("Setup"););
+    
+    openFitsFile(&inputFilePtr, inputFileName);
+    
+    long dims[4];
+    
+    getFitsDims(inputFilePtr, N, dims);
+    
+    stokes = N == 4 ? dims[3] : 1;
+    depth = N >= 3 ? dims[2] : 1;
+    height = dims[1];
+    width = dims[0];
+    
+    standardDims = trimAxes({stokes, depth, height, width}, N);
+    
+    output = OutputBackend::open(fileName);
+    outputGroup = OutputGroup(output.get(), "0");
+    
+    if (!outputGroup.exists("DATA")) {
+        throw "The file to update has no main dataset";
+    }
+    
+    standardDataSet = outputGroup.openDataset("DATA");
+    
+    if (standardDataSet->dims != standardDims) {
+        throw "The dimensions of the FITS file do not match the file to update";
+    }
+    
+    // The old values of the changed channels and the Z profiles are read back from the main dataset, so it must not
+    // be rounded. The display tiles are appended to a single dataset, and a chunk checksum of the rotated dataset
+    // covers all the channels, so neither can be rewritten for a single channel.
+    if (outputGroup.attributeExists("QUANTIZATION")) {
+        throw "Files with lossy rounding can't be updated";
+    }
+    
+    if (outputGroup.exists("TileCache")) {
+        throw "Files with display tiles can't be updated";
+    }
+    
+    if (outputGroup.exists("Checksums")) {
+        throw "Files with chunk checksums can't be updated";
+    }
+    
+    // PRODUCTS
+    hasStats = outputGroup.exists("Statistics/XY");
+    hasXYZStats = hasStats && depth > 1 && outputGroup.exists("Statistics/XYZ");
+    hasZStats = depth > 1 && outputGroup.exists("Statistics/Z");
+    
+    std::string swizzledName = N == 3 ? "ZYX" : "ZYXW";
+    hasSwizzled = depth > 1 && outputGroup.exists("SwizzledData/" + swizzledName);
+    
+    // One Stokes of XY stats at a time
+    if (hasStats) {
+        statsXY.openDatasets(outputGroup, "XY");
+        statsXY.createBuffers({depth});
+    }
+    
+    // The two partial histograms hold the old and the new values of the changed channels
+    if (hasXYZStats) {
+        statsXYZ.openDatasets(outputGroup, "XYZ");
+        statsXYZ.createBuffers({}, 2);
+    }
+    
+    if (hasZStats) {
+        zRowsPerBlock = std::max((hsize_t)1, std::min(height, Z_BLOCK_SIZE / (depth * width * sizeof(float))));
+        statsZ.openDatasets(outputGroup, "Z");
+        statsZ.createBuffers({zRowsPerBlock, width});
+    }
+    
+    if (hasSwizzled) {
+        swizzledDataSet = outputGroup.openDataset("SwizzledData/" + swizzledName);
+        rotatedChannel.resize(height * width);
+    }
+    
+    // The mipmaps of one channel at a time
+    mipMaps = MipMaps(standardDims, EMPTY_DIMS);
+    hasMipMaps = mipMaps.openDatasets(outputGroup);
+    
+    if (hasMipMaps) {
+        mipMaps.createBuffers({1, height, width});
+    }
+    
+    // CHANGED CHANNELS
+    if (outputGroup.exists("ChannelHashes")) {
+        channelHashDataSet = outputGroup.openDataset("ChannelHashes");
+        channelHashes.resize(stokes * depth);
+        channelHashDataSet->read(channelHashes.data(), {stokes * depth});
+    } else if (options.updateChannels.empty()) {
+        throw "The file to update has no channel hashes, so the changed channels must be given";
+    }
+    
+    for (auto& c : options.updateChannels) {
+        if (c >= depth) {
+            throw "A changed channel is outside the cube";
+        }
+    }
+    
+    oldChannel.resize(height * width);
+    changedPixels.resize(height * width);
+}
+
+Updater::~Updater() {
+    if (output) {
+        output->close();
+    }
+    closeFitsFile(inputFilePtr);
+}
+
+void Updater::update() {
+    hsize_t channelSize = height * width;
+    std::vector<float> channel(channelSize);
+    
+    // Without a list of changed channels, every channel is read and compared with its stored hash
+    std::vector<hsize_t> candidates = options.updateChannels;
+    bool compareHashes = candidates.empty();
+    
+    if (compareHashes) {
+        candidates.resize(depth);
+        std::iota(candidates.begin(), candidates.end(), 0);
+    }
+    
+    const hsize_t channelProgressStride = std::max((hsize_t)1, (hsize_t)(candidates.size() / 100));
+    hsize_t totalChangedChannels(0);
+    
+    for (unsigned int s = 0; s < stokes; s++) {
+        DEBUG(std::cout << "Updating Stokes " << s << "..." << std::endl;);
+        PROGRESS("Stokes " << s << ":" << std::endl);
+        PROGRESS("\tChannels\t");
+        
+        TIMER(timer.start("Read statistics"););
+        
+        if (hasStats) {
+            statsXY.read({1, depth}, {s, 0});
+        }
+        
+        if (hasXYZStats) {
+            statsXYZ.clearHistogramBuffers();
+            statsXYZ.read({1}, {s});
+            
+            oldCubeMin = statsXYZ.minVals[0];
+            oldCubeMax = statsXYZ.maxVals[0];
+            oldCubeHist = std::isfinite(oldCubeMin) && std::isfinite(oldCubeMax) && oldCubeMax - oldCubeMin > 0;
+        }
+        
+        std::fill(changedPixels.begin(), changedPixels.end(), false);
+        numChangedChannels = 0;
+        
+        for (hsize_t i = 0; i < candidates.size(); i++) {
+            PROGRESS_DECIMATED(i, channelProgressStride, "|");
+            hsize_t c = candidates[i];
+            
+            TIMER(timer.start("Read"););
+            readFitsData(inputFilePtr, c, s, channelSize, channel.data());
+            
+            if (!channelHashes.empty()) {
+                uint32_t hash = crc32c(channel.data(), channelSize * sizeof(float));
+                
+                if (compareHashes && hash == channelHashes[s * depth + c]) {
+                    continue;
+                }
+                
+                channelHashes[s * depth + c] = hash;
+            }
+            
+            updateChannel(s, c, channel.data());
+        }
+        
+        PROGRESS(std::endl);
+        
+        if (numChangedChannels) {
+            updateCubeStats(s);
+        }
+        
+        totalChangedChannels += numChangedChannels;
+    }
+    
+    if (totalChangedChannels) {
+        TIMER(timer.start("Write"););
+        
+        if (channelHashDataSet) {
+            channelHashDataSet->write(channelHashes.data(), {stokes * depth});
+        }
+        
+        // The result of the DATASUM check only applies to the FITS file which was originally converted
+        for (auto& name : {"FITS_DATASUM_CHECK", "FITS_DATASUM_COMPUTED", "FITS_CHECKSUM_CHECK"}) {
+            if (outputGroup.attributeExists(name)) {
+                outputGroup.removeAttribute(name);
+            }
+        }
+    }
+    
+    PROGRESS("Updated " << totalChangedChannels << " channels" << std::endl);
+    
+    TIMER(timer.print(product(standardDims)););
+}
+
+void Updater::updateChannel(unsigned int s, hsize_t c, const float* channel) {
+    hsize_t channelSize = height * width;
+    std::vector<hsize_t> count = trimAxes({1, 1, height, width}, N);
+    std::vector<hsize_t> start = trimAxes({s, c, 0, 0}, N);
+    
+    TIMER(timer.start("Read"););
+    standardDataSet->read(oldChannel.data(), {height, width}, count, start);
+    
+    // A channel which was given as changed may not have changed after all
+    TIMER(timer.start("Compare"););
+    bool changed(false);
+    
+    for (hsize_t i = 0; i < channelSize; i++) {
+        if (memcmp(&oldChannel[i], &channel[i], sizeof(float))) {
+            changedPixels[i] = true;
+            changed = true;
+        }
+    }
+    
+    if (!changed) {
+        return;
+    }
+    
+    DEBUG(std::cout << "+ Updating channel " << c << "..." << std::endl;);
+    numChangedChannels++;
+    
+    TIMER(timer.start("Write"););
+    standardDataSet->write(channel, {height, width}, count, start);
+    
+    if (hasStats) {
+        TIMER(timer.start("XY statistics"););
+        
+        StatsCounter counterXY;
+        std::function<void(float)> accumulate;
+        
+        auto lazy_accumulate = [&] (float val) {
+            counterXY.accumulateFiniteLazy(val);
+        };
+        
+        auto first_accumulate = [&] (float val) {
+            counterXY.accumulateFiniteLazyFirst(val);
+            accumulate = lazy_accumulate;
+        };
+        
+        accumulate = first_accumulate;
+        
+        for (hsize_t i = 0; i < channelSize; i++) {
+            auto& val = channel[i];
+            
+            if (std::isfinite(val)) {
+                accumulate(val);
+            } else {
+                counterXY.accumulateNonFinite();
+            }
+        }
+        
+        statsXY.copyStatsFromCounter(c, channelSize, counterXY);
+        
+        if (statsXY.numBins) {
+            memset(statsXY.histograms + c * statsXY.numBins, 0, sizeof(int64_t) * statsXY.numBins);
+            
+            double chanMin = statsXY.minVals[c];
+            double chanMax = statsXY.maxVals[c];
+            double chanRange = chanMax - chanMin;
+            
+            if (std::isfinite(chanMin) && std::isfinite(chanMax) && chanRange > 0) {
+                for (hsize_t i = 0; i < channelSize; i++) {
+                    auto& val = channel[i];
+                    
+                    if (std::isfinite(val)) {
+                        statsXY.accumulateHistogram(val, chanMin, chanRange, c);
+                    }
+                }
+            }
+        }
+        
+        // Count the old and the new values of the channel in the old XYZ histogram bins, in case the bins don't change
+        if (hasXYZStats && statsXYZ.numBins && oldCubeHist) {
+            double oldCubeRange = oldCubeMax - oldCubeMin;
+            
+            for (hsize_t i = 0; i < channelSize; i++) {
+                if (std::isfinite(oldChannel[i])) {
+                    statsXYZ.accumulatePartialHistogram(oldChannel[i], oldCubeMin, oldCubeRange, 0);
+                }
+                
+                if (std::isfinite(channel[i])) {
+                    statsXYZ.accumulatePartialHistogram(channel[i], oldCubeMin, oldCubeRange, 1);
+                }
+            }
+        }
+    }
+    
+    if (hasMipMaps) {
+        TIMER(timer.start("Mipmaps"););
+        
+        for (hsize_t y = 0; y < height; y++) {
+            for (hsize_t x = 0; x < width; x++) {
+                auto& val = channel[y * width + x];
+                
+                if (std::isfinite(val)) {
+                    mipMaps.accumulate(val, x, y, 0);
+                }
+            }
+        }
+        
+        mipMaps.calculate(0);
+        
+        TIMER(timer.start("Write"););
+        mipMaps.write(s, c);
+        mipMaps.resetBuffers();
+    }
+    
+    if (hasSwizzled) {
+        TIMER(timer.start("Rotation"););
+        
+        for (hsize_t y = 0; y < height; y++) {
+            for (hsize_t x = 0; x < width; x++) {
+                rotatedChannel[y + height * x] = channel[x + width * y];
+            }
+        }
+        
+        TIMER(timer.start("Write"););
+        swizzledDataSet->write(rotatedChannel.data(), {width, height, 1}, trimAxes({1, width, height, 1}, N), trimAxes({s, 0, 0, c}, N));
+    }
+}
+
+void Updater::updateCubeStats(unsigned int s) {
+    if (hasStats) {
+        TIMER(timer.start("Write"););
+        statsXY.write({1, depth}, {s, 0});
+    }
+    
+    if (hasXYZStats) {
+        TIMER(timer.start("XYZ statistics"););
+        
+        // Recalculate the XYZ stats from the XY stats of all the channels
+        StatsCounter counterXYZ;
+        
+        for (hsize_t i = 0; i < depth; i++) {
+            statsXY.accumulateStatsToCounter(counterXYZ, i);
+        }
+        
+        statsXYZ.copyStatsFromCounter(0, depth * height * width, counterXYZ);
+        
+        if (statsXYZ.numBins) {
+            hsize_t numBins = statsXYZ.numBins;
+            double cubeMin = statsXYZ.minVals[0];
+            double cubeMax = statsXYZ.maxVals[0];
+            double cubeRange = cubeMax - cubeMin;
+            bool cubeHist = std::isfinite(cubeMin) && std::isfinite(cubeMax) && cubeRange > 0;
+            
+            if (cubeHist && oldCubeHist && cubeMin == oldCubeMin && cubeMax == oldCubeMax) {
+                // The bins have not changed, so we only have to replace the old values of the changed channels with
+                // the new ones
+                for (hsize_t i = 0; i < numBins; i++) {
+                    statsXYZ.histograms[i] += statsXYZ.partialHistograms[numBins + i] - statsXYZ.partialHistograms[i];
+                }
+            } else {
+                // Otherwise all the channels have to be counted again, from the main dataset
+                DEBUG(std::cout << "+ The cube min or max has changed; recalculating the XYZ histogram..." << std::endl;);
+                memset(statsXYZ.histograms, 0, sizeof(int64_t) * numBins);
+                
+                for (hsize_t c = 0; cubeHist && c < depth; c++) {
+                    TIMER(timer.start("Read"););
+                    standardDataSet->read(oldChannel.data(), {height, width}, trimAxes({1, 1, height, width}, N), trimAxes({s, c, 0, 0}, N));
+                    
+                    TIMER(timer.start("XYZ statistics"););
+                    for (auto& val : oldChannel) {
+                        if (std::isfinite(val)) {
+                            statsXYZ.accumulateHistogram(val, cubeMin, cubeRange, 0);
+                        }
+                    }
+                }
+            }
+        }
+        
+        TIMER(timer.start("Write"););
+        statsXYZ.write({1}, {s});
+    }
+    
+    if (hasZStats) {
+        std::vector<float> block(depth * zRowsPerBlock * width);
+        
+        for (hsize_t rowStart = 0; rowStart < height; rowStart += zRowsPerBlock) {
+            hsize_t rowEnd = std::min(height, rowStart + zRowsPerBlock);
+            hsize_t numRows = rowEnd - rowStart;
+            
+            // Only the blocks with changed pixels
+            auto blockPixels = changedPixels.begin() + rowStart * width;
+            if (std::find(blockPixels, blockPixels + numRows * width, true) == blockPixels + numRows * width) {
+                continue;
+            }
+            
+            TIMER(timer.start("Read"););
+            standardDataSet->read(block.data(), {depth, numRows, width}, trimAxes({1, depth, numRows, width}, N), trimAxes({s, 0, rowStart, 0}, N));
+            
+            TIMER(timer.start("Z statistics"););
+            
+            for (hsize_t j = 0; j < numRows; j++) {
+                for (hsize_t k = 0; k < width; k++) {
+                    StatsCounter counterZ;
+                    
+                    for (hsize_t i = 0; i < depth; i++) {
+                        auto& val = block[k + width * j + numRows * width * i];
+                        
+                        if (std::isfinite(val)) {
+                            counterZ.accumulateFinite(val);
+                        } else {
+                            counterZ.accumulateNonFinite();
+                        }
+                    }
+                    
+                    statsZ.copyStatsFromCounter(k + width * j, depth, counterZ);
+                }
+            }
+            
+            TIMER(timer.start("Write"););
+            statsZ.write({numRows, width}, {1, numRows, width}, {s, rowStart, 0});
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#ifndef __UPDATER_H
+#define __UPDATER_H
+
+#include "Converter.h"
+
+// Updates an existing output file in place from a FITS file in which only some channels have changed. The changed
+// channels are either given, or found by comparing the channel hashes which were stored at conversion time with the
+// channels of the FITS file.
+// Only the changed channels of the main dataset, the rotated dataset, the XY statistics and the mipmaps are
+// rewritten. The XYZ statistics are recalculated from the stored XY statistics, and the XYZ histogram is adjusted by
+// the difference between the old and the new channels unless the cube min or max has changed. The Z statistics are
+// only recalculated for the blocks of rows which contain a changed pixel.
+class Updater {
+public:
+    Updater(std::string inputFileName, std::string fileName, const ConverterOptions& options);
+    ~Updater();
+    
+    void update();
+
+protected:
+    // Rewrite a single changed channel
+    void updateChannel(unsigned int s, hsize_t c, const float* channel);
+    // Recalculate the stats which depend on all the channels of a Stokes
+    void updateCubeStats(unsigned int s);
+    
+    Timer timer;
+    ConverterOptions options;
+    bool progress;
+    
+    fitsfile* inputFilePtr;
+    
+    std::unique_ptr<OutputBackend> output;
+    OutputGroup outputGroup;
+    std::shared_ptr<OutputDataset> standardDataSet;
+    std::shared_ptr<OutputDataset> swizzledDataSet;
+    std::shared_ptr<OutputDataset> channelHashDataSet;
+    
+    // The products which the file has
+    bool hasStats;
+    bool hasXYZStats;
+    bool hasZStats;
+    bool hasSwizzled;
+    bool hasMipMaps;
+    
+    Stats statsXY;
+    Stats statsXYZ;
+    Stats statsZ;
+    MipMaps mipMaps;
+    std::vector<uint32_t> channelHashes;
+    
+    // The old values of a changed channel, and the new values rotated for the rotated dataset
+    std::vector<float> oldChannel;
+    std::vector<float> rotatedChannel;
+    
+    // The pixels which have changed in any channel of the current Stokes
+    std::vector<bool> changedPixels;
+    hsize_t numChangedChannels;
+    
+    // The XYZ histogram bins of the current Stokes before the update
+    double oldCubeMin;
+    double oldCubeMax;
+    bool oldCubeHist;
+    
+    // The Z statistics are recalculated in blocks of this many rows
+    hsize_t zRowsPerBlock;
+    
+    int N;
+    hsize_t stokes, depth, height, width;
+    std::vector<hsize_t> standardDims;
+};
+
+#endif
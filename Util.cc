@@ -4,6 +4,16 @@
 */
 
 #include "Util.h"
+#include "Throttle.h"
+#include "IoStats.h"
+
+#include <fstream>
+#include <mutex>
+
+// Several converters may share the input file, and CFITSIO shares the state of a file which is opened more than once,
+// so the FITS helpers are only used by one thread at a time
+static std::mutex fitsMutex;
+#define FITS_LOCK std::lock_guard<std::mutex> fitsLock(fitsMutex)
 
 std::vector<std::string> split(const std::string &str, char separator) {
     std::vector<std::string> result;
@@ -24,13 +34,6 @@ std::vector<hsize_t> trimAxes(const std::vector<hsize_t>& dims, int N) {
     return trimmed;
 }
 
-std::vector<hsize_t> extend(const std::vector<hsize_t>& left, const std::vector<hsize_t>& right) {
-    std::vector<hsize_t> result;
-    result.insert(result.end(), left.begin(), left.end());
-    result.insert(result.end(), right.begin(), right.end());
-    return result;
-}
-
 std::vector<hsize_t> mipDims(const std::vector<hsize_t>& dims, int mip) {
     int N = dims.size();
     auto mipDims = dims;
@@ -46,11 +49,12 @@ hsize_t product(const std::vector<hsize_t>& dims) {
     return std::accumulate(begin(dims), end(dims), (hsize_t)1, std::multiplies<hsize_t>());
 }
 
-bool useChunks(const std::vector<hsize_t>& dims) {    
+// Datasets which are smaller than a chunk in X or Y are not chunked
+bool useChunks(const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims) {
     int N = dims.size();
     
     for (auto i = std::max(0, N - 2); i < N; i++) {
-        if (dims[i] < TILE_SIZE) {
+        if (dims[i] < chunkDims[i]) {
             return false;
         }
     }
@@ -58,7 +62,23 @@ bool useChunks(const std::vector<hsize_t>& dims) {
     return true;
 }
 
+static void checkFitsImageType(fitsfile* filePtr) {
+    int status(0);
+    int bitpix;
+    fits_get_img_type(filePtr, &bitpix, &status);
+    
+    if (status != 0) {
+        throw "Could not read image type";
+    }
+    
+    if (bitpix != -32) {
+        throw "Currently only supports FP32 files";
+    }
+}
+
 void openFitsFile(fitsfile** filePtrPtr, const std::string& fileName) {
+    FITS_LOCK;
+    
     int status(0);
     
     fits_open_file(filePtrPtr, fileName.c_str(), READONLY, &status);
@@ -67,19 +87,26 @@ void openFitsFile(fitsfile** filePtrPtr, const std::string& fileName) {
         throw "Could not open FITS file";
     }
     
-    int bitpix;
-    fits_get_img_type(*filePtrPtr, &bitpix, &status);
+    checkFitsImageType(*filePtrPtr);
+}
+
+void openFitsMemFile(fitsfile** filePtrPtr, const std::string& name, void** memory, size_t* size) {
+    FITS_LOCK;
+    
+    int status(0);
+    
+    fits_open_memfile(filePtrPtr, name.c_str(), READONLY, memory, size, 0, NULL, &status);
     
     if (status != 0) {
-        throw "Could not read image type";
+        throw "Could not open FITS header";
     }
 
-    if (bitpix != -32) {
-        throw "Currently only supports FP32 files";
-    }
+    checkFitsImageType(*filePtrPtr);
 }
 
 void closeFitsFile(fitsfile* filePtr) {
+    FITS_LOCK;
+    
     int status(0);
     
     fits_close_file(filePtr, &status);
@@ -90,6 +117,8 @@ void closeFitsFile(fitsfile* filePtr) {
 }
 
 void getFitsDims(fitsfile* filePtr, int& N, long* dims) {
+    FITS_LOCK;
+    
     int status(0);
     
     fits_get_img_dim(filePtr, &N, &status);
@@ -110,6 +139,8 @@ void getFitsDims(fitsfile* filePtr, int& N, long* dims) {
 }
 
 void readFitsHeader(fitsfile* filePtr, int& numAttributes) {
+    FITS_LOCK;
+    
     int status(0);
     
     fits_get_hdrspace(filePtr, &numAttributes, NULL, &status);
@@ -120,6 +151,8 @@ void readFitsHeader(fitsfile* filePtr, int& numAttributes) {
 }
 
 void readFitsAttribute(fitsfile* filePtr, int i, std::string& name, std::string& value) {
+    FITS_LOCK;
+    
     int status(0);
     char keyTmp[255];
     char valueTmp[255];
@@ -135,6 +168,8 @@ void readFitsAttribute(fitsfile* filePtr, int i, std::string& name, std::string&
 }
 
 void readFitsStringAttribute(fitsfile* filePtr, const std::string& name, std::string& value) {
+    FITS_LOCK;
+    
     int status(0);
     int strLen;
     char strValueTmp[255];
@@ -149,106 +184,289 @@ void readFitsStringAttribute(fitsfile* filePtr, const std::string& name, std::st
 }
 
 void readFitsData(fitsfile* filePtr, hsize_t channel, unsigned int stokes, hsize_t size, float* destination) {
-    long fpixel[] = {1, 1, (long)channel + 1, stokes + 1};
-    int status(0);
+    // A throttled read is split into blocks, which are paced evenly
+    hsize_t blockSize = throttleReadBlock() / sizeof(float);
+    hsize_t width(0);
     
-    fits_read_pix(filePtr, TFLOAT, fpixel, size, NULL, destination, NULL, &status);
+    if (blockSize && blockSize < size) {
+        FITS_LOCK;
     
-    if (status != 0) {
-        throw "Could not read image data";
+        long dims[4];
+        int status(0);
+        fits_get_img_size(filePtr, 4, dims, &status);
+        
+        if (status != 0) {
+            throw "Could not read image size";
+        }
+        
+        width = dims[0];
+    } else {
+        blockSize = size;
+    }
+    
+    for (hsize_t done = 0; done < size; done += blockSize) {
+        hsize_t count = std::min(blockSize, size - done);
+        throttleRead(count * sizeof(float));
+        
+        FITS_LOCK;
+        
+        long fpixel[] = {width ? (long)(done % width) + 1 : 1, width ? (long)(done / width) + 1 : 1, (long)channel + 1, stokes + 1};
+        int status(0);
+    
+        IoCall call(IoSite::FITS_READ, count * sizeof(float));
+        fits_read_pix(filePtr, TFLOAT, fpixel, count, NULL, destination + done, NULL, &status);
+    
+        if (status != 0) {
+            throw "Could not read image data";
+        }
     }
 }
 
-// Only available in C++ API from 1.10.1
-bool hdf5Exists(H5::H5Location& location, const std::string& name) {
-    return H5Lexists(location.getId(), name.c_str(), H5P_DEFAULT) > 0;
-}
-
-void createHdf5Dataset(H5::DataSet& dataset, H5::Group group, std::string path, H5::DataType dataType, std::vector<hsize_t> dims, const std::vector<hsize_t>& chunkDims) {
-    auto splitPath = split(path, '/');
+void readFitsSubset(fitsfile* filePtr, unsigned int stokes, hsize_t xOffset, hsize_t yOffset, hsize_t zOffset, hsize_t xSize, hsize_t ySize, hsize_t zSize, float* destination) {
+    // A throttled read is split into blocks of whole channels of the subset
+    hsize_t channelSize = xSize * ySize;
+    hsize_t blockDepth = zSize;
+    if (throttleReadBlock()) {
+        blockDepth = std::max((hsize_t)1, throttleReadBlock() / (channelSize * sizeof(float)));
+    }
     
-    auto name = splitPath.back();
-    splitPath.pop_back();
+    for (hsize_t z = 0; z < zSize; z += blockDepth) {
+        hsize_t depth = std::min(blockDepth, zSize - z);
+        throttleRead(depth * channelSize * sizeof(float));
+        
+        FITS_LOCK;
+    
+        long fpixel[] = {(long)xOffset + 1, (long)yOffset + 1, (long)(zOffset + z) + 1, stokes + 1};
+        long lpixel[] = {(long)(xOffset + xSize), (long)(yOffset + ySize), (long)(zOffset + z + depth), stokes + 1};
+        long inc[] = {1, 1, 1, 1};
+        int status(0);
+    
+        IoCall call(IoSite::FITS_SUBSET_READ, depth * channelSize * sizeof(float));
+        fits_read_subset(filePtr, TFLOAT, fpixel, lpixel, inc, NULL, destination + z * channelSize, NULL, &status);
     
-    for (auto& groupname : splitPath) {
-        if (!hdf5Exists(group, groupname)) {
-            group = group.createGroup(groupname);
-        } else {
-            group = group.openGroup(groupname);
+        if (status != 0) {
+            throw "Could not read image data subset";
         }
     }
+}
+
+uint32_t addFitsDataSums(uint32_t a, uint32_t b) {
+    uint64_t sum = (uint64_t)a + b;
+    return (sum & 0xFFFFFFFF) + (sum >> 32);
+}
+
+uint32_t fitsDataSum(const float* data, hsize_t size, uint32_t sum) {
+    // Accumulate in 64 bits and fold the carries back in at the end of each block. The blocks are small enough that
+    // the accumulator can't overflow.
+    const hsize_t blockSize = (hsize_t)1 << 30;
     
-    H5::DSetCreatPropList propList;
-    if (!chunkDims.empty()) {
-        propList.setChunk(chunkDims.size(), chunkDims.data());
+    for (hsize_t start = 0; start < size; start += blockSize) {
+        hsize_t end = std::min(size, start + blockSize);
+        uint64_t blockSum = 0;
+        
+        for (hsize_t i = start; i < end; i++) {
+            uint32_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            blockSum += word;
+        }
+        
+        while (blockSum >> 32) {
+            blockSum = (blockSum & 0xFFFFFFFF) + (blockSum >> 32);
+        }
+        
+        sum = addFitsDataSums(sum, blockSum);
     }
     
-    auto dataSpace = H5::DataSpace(dims.size(), dims.data());
-    dataset = group.createDataSet(name, dataType, dataSpace, propList);
+    return sum;
 }
 
-void writeHdf5Attribute(H5::Group group, std::string name, std::string value) {
-    H5::StrType strType(H5::PredType::C_S1, 256);
-    H5::DataSpace dataSpace(H5S_SCALAR);
-    auto attribute = group.createAttribute(name, strType, dataSpace);
-    attribute.write(strType, value);
+bool readFitsDataSum(fitsfile* filePtr, uint32_t& dataSum) {
+    FITS_LOCK;
+    
+    int status(0);
+    char valueTmp[255];
+    
+    fits_read_key(filePtr, TSTRING, "DATASUM", valueTmp, NULL, &status);
+    
+    if (status == KEY_NO_EXIST) {
+        return false;
+    }
+    
+    if (status != 0) {
+        throw "Could not read DATASUM";
+    }
+    
+    // The value is an unsigned decimal integer in a string
+    char* end;
+    unsigned long long value = std::strtoull(valueTmp, &end, 10);
+    
+    if (end == valueTmp || value > 0xFFFFFFFF) {
+        throw "Could not parse DATASUM";
+    }
+    
+    dataSum = value;
+    return true;
 }
 
-void writeHdf5Attribute(H5::Group group, std::string name, int64_t value) {
-    H5::IntType intType(H5::PredType::NATIVE_INT64);
-    intType.setOrder(H5T_ORDER_LE);
-    H5::DataSpace dataSpace(H5S_SCALAR);
-    auto attribute = group.createAttribute(name, intType, dataSpace);
-    attribute.write(intType, &value);
+uint32_t fitsHeaderSum(const char* header, hsize_t size) {
+    uint64_t sum(0);
+    
+    for (hsize_t i = 0; i + 4 <= size; i += 4) {
+        auto bytes = (const uint8_t*)header + i;
+        sum += ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+    
+    while (sum >> 32) {
+        sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    }
+    
+    return sum;
 }
 
-void writeHdf5Attribute(H5::Group group, std::string name, double value) {
-    H5::FloatType doubleType(H5::PredType::NATIVE_DOUBLE);
-    doubleType.setOrder(H5T_ORDER_LE);
-    H5::DataSpace dataSpace(H5S_SCALAR);
-    auto attribute = group.createAttribute(name, doubleType, dataSpace);
-    attribute.write(doubleType, &value);
+bool readFitsHeaderSum(fitsfile* filePtr, uint32_t& headerSum) {
+    char fileName[FLEN_FILENAME];
+    LONGLONG headerStart, dataStart, dataEnd;
+    
+    {
+        FITS_LOCK;
+        int status(0);
+        fits_file_name(filePtr, fileName, &status);
+        fits_get_hduaddrll(filePtr, &headerStart, &dataStart, &dataEnd, &status);
+        
+        if (status != 0) {
+            return false;
+        }
+    }
+    
+    std::ifstream file(fileName, std::ios::binary);
+    std::vector<char> header(dataStart - headerStart);
+    
+    if (header.empty() || !file.seekg(headerStart) || !file.read(header.data(), header.size())) {
+        return false;
+    }
+    
+    std::string card(header.data(), std::min(header.size(), (size_t)20));
+    if (card.compare(0, 9, "SIMPLE  =") != 0 && card.compare(0, 20, "XTENSION= 'IMAGE   '") != 0) {
+        return false;
+    }
+    
+    headerSum = fitsHeaderSum(header.data(), header.size());
+    return true;
 }
 
-void writeHdf5Attribute(H5::Group group, std::string name, bool value) {
-    H5::IntType boolType(H5::PredType::NATIVE_HBOOL);
-    H5::DataSpace dataSpace(H5S_SCALAR);
-    auto attribute = group.createAttribute(name, boolType, dataSpace);
-    attribute.write(boolType, &value);
+bool fitsHasChecksum(fitsfile* filePtr) {
+    FITS_LOCK;
+    
+    int status(0);
+    char valueTmp[255];
+    
+    fits_read_key(filePtr, TSTRING, "CHECKSUM", valueTmp, NULL, &status);
+    
+    if (status == KEY_NO_EXIST) {
+        return false;
+    }
+    
+    if (status != 0) {
+        throw "Could not read CHECKSUM";
+    }
+    
+    return true;
 }
 
-void writeHdf5Data(H5::DataSet& dataset, float* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    H5::DataSpace memSpace(dims.size(), dims.data());
-    auto fileSpace = dataset.getSpace();
-    if (!count.empty() && !start.empty()) {
-        fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+bool fitsDataIsScaled(fitsfile* filePtr) {
+    FITS_LOCK;
+    
+    int status(0);
+    double bscale(1);
+    double bzero(0);
+    
+    fits_read_key(filePtr, TDOUBLE, "BSCALE", &bscale, NULL, &status);
+    
+    if (status == KEY_NO_EXIST) {
+        status = 0;
     }
-    dataset.write(data, H5::PredType::NATIVE_FLOAT, memSpace, fileSpace);
+    
+    fits_read_key(filePtr, TDOUBLE, "BZERO", &bzero, NULL, &status);
+    
+    if (status == KEY_NO_EXIST) {
+        status = 0;
+    }
+    
+    if (status != 0) {
+        throw "Could not read scaling keywords";
+    }
+    
+    return bscale != 1 || bzero != 0;
 }
 
-void writeHdf5Data(H5::DataSet& dataset, double* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    H5::DataSpace memSpace(dims.size(), dims.data());
-    auto fileSpace = dataset.getSpace();
-    if (!count.empty() && !start.empty()) {
-        fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+// Read the first number from a file (-1 if there is none, e.g. for a cgroup limit of "max")
+static hsize_t readNumber(const std::string& fileName) {
+    std::ifstream file(fileName);
+    unsigned long long value;
+    
+    if (file >> value) {
+        return value;
     }
-    dataset.write(data, H5::PredType::NATIVE_DOUBLE, memSpace, fileSpace);
+    
+    return -1;
 }
 
-void writeHdf5Data(H5::DataSet& dataset, int64_t* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    H5::DataSpace memSpace(dims.size(), dims.data());
-    auto fileSpace = dataset.getSpace();
-    if (!count.empty() && !start.empty()) {
-        fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+// Read a value from a file of keys and values, like a cgroup's memory.stat (0 if there is none)
+static hsize_t readKey(const std::string& fileName, const std::string& key) {
+    std::ifstream file(fileName);
+    std::string name;
+    unsigned long long value;
+    
+    while (file >> name >> value) {
+        if (name == key) {
+            return value;
+        }
     }
-    dataset.write(data, H5::PredType::NATIVE_INT64, memSpace, fileSpace);
+    
+    return 0;
 }
 
-void readHdf5Data(H5::DataSet& dataset, float* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count, const std::vector<hsize_t>& start) {
-    H5::DataSpace memSpace(dims.size(), dims.data());
-    auto fileSpace = dataset.getSpace();
-    if (!count.empty() && !start.empty()) {
-        fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+hsize_t availableMemory() {
+    hsize_t available(-1);
+    
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        unsigned long long kilobytes;
+        if (sscanf(line.c_str(), "MemAvailable: %llu kB", &kilobytes) == 1) {
+            available = kilobytes * 1024;
+        }
+    }
+    
+    // The limit of the cgroup applies even if the machine has more memory. This checks the root of the hierarchy
+    // which is mounted in the container, with either version of cgroups. The usage includes the page cache, which
+    // can be reclaimed.
+    struct CgroupFiles {
+        std::string limit;
+        std::string usage;
+        std::string cacheKey;
+    };
+    
+    const std::vector<CgroupFiles> cgroups = {
+        {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory.current", "file"},
+        {"/sys/fs/cgroup/memory/memory.limit_in_bytes", "/sys/fs/cgroup/memory/memory.usage_in_bytes", "total_cache"}
+    };
+    
+    for (auto& cgroup : cgroups) {
+        hsize_t limit = readNumber(cgroup.limit);
+        hsize_t usage = readNumber(cgroup.usage);
+        
+        if (limit != (hsize_t)-1 && usage != (hsize_t)-1) {
+            std::string statFile = cgroup.usage.substr(0, cgroup.usage.rfind('/')) + "/memory.stat";
+            usage -= std::min(usage, readKey(statFile, cgroup.cacheKey));
+            available = std::min(available, limit > usage ? limit - usage : 0);
+        }
     }
-    dataset.read(data, H5::PredType::NATIVE_FLOAT, memSpace, fileSpace);
+    
+    return available;
+}
+
+// Only available in C++ API from 1.10.1
+bool hdf5Exists(H5::H5Location& location, const std::string& name) {
+    return H5Lexists(location.getId(), name.c_str(), H5P_DEFAULT) > 0;
 }
@@ -10,10 +10,17 @@
 
 std::vector<std::string> split(const std::string &str, char separator);
 std::vector<hsize_t> trimAxes(const std::vector<hsize_t>& dims, int N);
-std::vector<hsize_t> extend(const std::vector<hsize_t>& left, const std::vector<hsize_t>& right);
 std::vector<hsize_t> mipDims(const std::vector<hsize_t>& dims, int mip);
 hsize_t product(const std::vector<hsize_t>& dims);
 
+template <typename T>
+std::vector<T> extend(const std::vector<T>& left, const std::vector<T>& right) {
+    std::vector<T> result;
+    result.insert(result.end(), left.begin(), left.end());
+    result.insert(result.end(), right.begin(), right.end());
+    return result;
+}
+
 template <typename T>
 std::ostream& operator<< (std::ostream& out, const std::vector<T>& v) {
   if ( !v.empty() ) {
@@ -24,28 +31,43 @@ std::ostream& operator<< (std::ostream& out, const std::vector<T>& v) {
   return out;
 }
 
-bool useChunks(const std::vector<hsize_t>& dims);
+bool useChunks(const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunkDims);
 
 void openFitsFile(fitsfile** filePtrPtr, const std::string& fileName);
+// Open a FITS file which is held in memory. The memory and its size have to outlive the file.
+void openFitsMemFile(fitsfile** filePtrPtr, const std::string& name, void** memory, size_t* size);
 void closeFitsFile(fitsfile* filePtr);
 void getFitsDims(fitsfile* filePtr, int& N, long* dims);
 void readFitsHeader(fitsfile* filePtr, int& numAttributes);
 void readFitsAttribute(fitsfile* filePtr, int i, std::string& name, std::string& value);
 void readFitsStringAttribute(fitsfile* filePtr, const std::string& name, std::string& value);
 void readFitsData(fitsfile* filePtr, hsize_t channel, unsigned int stokes, hsize_t size, float* destination);
+void readFitsSubset(fitsfile* filePtr, unsigned int stokes, hsize_t xOffset, hsize_t yOffset, hsize_t zOffset, hsize_t xSize, hsize_t ySize, hsize_t zSize, float* destination);
 
-// Only available in C++ API from 1.10.1
-bool hdf5Exists(H5::H5Location& location, const std::string& name);
-void createHdf5Dataset(H5::DataSet& dataset, H5::Group group, std::string path, H5::DataType dataType, std::vector<hsize_t> dims, const std::vector<hsize_t>& chunkDims = EMPTY_DIMS);
-void writeHdf5Attribute(H5::Group group, std::string name, std::string value);
-void writeHdf5Attribute(H5::Group group, std::string name, int64_t value);
-void writeHdf5Attribute(H5::Group group, std::string name, double value);
-void writeHdf5Attribute(H5::Group group, std::string name, bool value);
+// The FITS DATASUM is the 32-bit ones' complement sum of the data unit, read as big-endian words. Each single
+// precision pixel is one word, and the padding is zero, so the sum can be calculated from the pixels after CFITSIO
+// has converted them, as long as it hasn't scaled them. Ones' complement sums can be added in any order, so each
+// channel can be summed separately as it is read. A sum can be continued over more data by passing in the previous
+// result.
+uint32_t fitsDataSum(const float* data, hsize_t size, uint32_t sum = 0);
+uint32_t addFitsDataSums(uint32_t a, uint32_t b);
+// Returns false if the header has no DATASUM
+bool readFitsDataSum(fitsfile* filePtr, uint32_t& dataSum);
+// The CHECKSUM keyword makes the ones' complement sum of the whole HDU, header and data, all ones. The header is
+// summed from its raw blocks.
+uint32_t fitsHeaderSum(const char* header, hsize_t size);
+// Read the raw header blocks of the current HDU from the file, where CFITSIO says they are. Returns false if they
+// are not the header which CFITSIO reads, as in a compressed file.
+bool readFitsHeaderSum(fitsfile* filePtr, uint32_t& headerSum);
+bool fitsHasChecksum(fitsfile* filePtr);
+// Whether CFITSIO applies BSCALE and BZERO to the pixels it reads
+bool fitsDataIsScaled(fitsfile* filePtr);
 
-void writeHdf5Data(H5::DataSet& dataset, float* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
-void writeHdf5Data(H5::DataSet& dataset, double* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
-void writeHdf5Data(H5::DataSet& dataset, int64_t* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
+// The memory which can be allocated without swapping, from the kernel's estimate and the limit of the memory cgroup
+// (-1 if it can't be determined)
+hsize_t availableMemory();
 
-void readHdf5Data(H5::DataSet& dataset, float* data, const std::vector<hsize_t>& dims, const std::vector<hsize_t>& count = EMPTY_DIMS, const std::vector<hsize_t>& start = EMPTY_DIMS);
+// Only available in C++ API from 1.10.1
+bool hdf5Exists(H5::H5Location& location, const std::string& name);
 
 #endif
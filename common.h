@@ -28,6 +28,7 @@
 
 #define TILE_SIZE (hsize_t)512
 #define MIN_MIPMAP_SIZE (hsize_t)128
+#define DISPLAY_TILE_SIZE (hsize_t)256
 
 #ifdef _VERBOSE_
     #define DEBUG(x) do {x} while (0)
@@ -8,36 +8,259 @@
 #include <fstream>
 #include <sstream>
 #include "Converter.h"
+#include "Updater.h"
+#include "MultiConverter.h"
+#include "Throttle.h"
+#include "IoStats.h"
+#include "Hdf5Stats.h"
 
-bool getOptions(int argc, char** argv, std::string& inputFileName, std::string& outputFileName, bool& slow, bool& progress, bool& onlyReportMemory) {
+// Parse a comma-separated list of output product names
+bool parseProducts(const std::string& list, unsigned int& products) {
+    products = 0;
+    
+    for (auto& name : split(list, ',')) {
+        if (name == "all") {
+            products |= ALL_PRODUCTS;
+        } else if (name == "data") {
+            // The main dataset is always written
+        } else if (name == "stats") {
+            products |= PRODUCT_STATS;
+        } else if (name == "histograms") {
+            products |= PRODUCT_HISTOGRAMS;
+        } else if (name == "zstats") {
+            products |= PRODUCT_Z_STATS;
+        } else if (name == "swizzled") {
+            products |= PRODUCT_SWIZZLED;
+        } else if (name == "mipmaps") {
+            products |= PRODUCT_MIPMAPS;
+        } else {
+            std::cerr << "Unknown output product '" << name << "'." << std::endl;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Parse a comma-separated list of channels and ranges of channels
+bool parseChannels(const std::string& list, std::vector<hsize_t>& channels) {
+    channels.clear();
+    
+    for (auto& item : split(list, ',')) {
+        auto range = split(item, '-');
+        char* end;
+        
+        if (item.empty() || item.back() == '-' || range.size() > 2 || range[0].empty()) {
+            std::cerr << "Invalid channel range '" << item << "'." << std::endl;
+            return false;
+        }
+        
+        hsize_t first = std::strtoull(range[0].c_str(), &end, 10);
+        hsize_t last = *end ? 0 : std::strtoull(range.back().c_str(), &end, 10);
+        
+        if (*end || last < first) {
+            std::cerr << "Invalid channel range '" << item << "'." << std::endl;
+            return false;
+        }
+        
+        for (hsize_t c = first; c <= last; c++) {
+            channels.push_back(c);
+        }
+    }
+    
+    std::sort(channels.begin(), channels.end());
+    channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+    
+    return true;
+}
+
+// Parse a comma-separated list of chunk dimensions
+bool parseChunkDims(const std::string& list, std::vector<hsize_t>& chunkDims) {
+    chunkDims.clear();
+    
+    for (auto& dim : split(list, ',')) {
+        long size = std::atol(dim.c_str());
+        chunkDims.push_back(size > 0 ? size : 0);
+    }
+    
+    if (chunkDims.size() < 2 || chunkDims.size() > 4 || std::count(chunkDims.begin(), chunkDims.end(), 0)) {
+        std::cerr << "The chunk dimensions must be a list of two to four positive integers." << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+bool parseBackend(const std::string& name, OutputBackendType& backend) {
+    if (name == "hdf5") {
+        backend = OutputBackendType::HDF5;
+    } else if (name == "directory") {
+        backend = OutputBackendType::DIRECTORY;
+    } else {
+        std::cerr << "Unknown output backend '" << name << "'." << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+// Parse an output specification of the form path[:key=value...], starting from the options of the main output
+bool parseOutputSpec(const std::string& spec, const ConverterOptions& defaults, OutputSpec& output) {
+    auto fields = split(spec, ':');
+    
+    if (fields.empty() || fields[0].empty()) {
+        std::cerr << "Missing filename in output specification '" << spec << "'." << std::endl;
+        return false;
+    }
+    
+    output.fileName = fields[0];
+    output.options = defaults;
+    
+    for (size_t i = 1; i < fields.size(); i++) {
+        auto separator = fields[i].find('=');
+        std::string key = fields[i].substr(0, separator);
+        std::string value = separator == std::string::npos ? "" : fields[i].substr(separator + 1);
+        
+        if (key == "channels") {
+            std::vector<hsize_t> channels;
+            if (!parseChannels(value, channels) || channels.empty() || channels.back() - channels.front() + 1 != channels.size()) {
+                std::cerr << "The channels of an output must be a single range (e.g. 10-20)." << std::endl;
+                return false;
+            }
+            output.options.channelOffset = channels.front();
+            output.options.channelCount = channels.size();
+        } else if (key == "products") {
+            if (!parseProducts(value, output.options.products)) {
+                return false;
+            }
+        } else if (key == "chunks") {
+            if (!parseChunkDims(value, output.options.chunkDims)) {
+                return false;
+            }
+        } else if (key == "compression") {
+            output.options.compression = std::atoi(value.c_str());
+            if (output.options.compression < 1 || output.options.compression > 9) {
+                std::cerr << "The compression level must be between 1 and 9." << std::endl;
+                return false;
+            }
+        } else if (key == "backend") {
+            if (!parseBackend(value, output.options.backend)) {
+                return false;
+            }
+        } else if (key == "slow" && value.empty()) {
+            output.options.slow = true;
+        } else {
+            std::cerr << "Unknown field '" << fields[i] << "' in output specification '" << spec << "'." << std::endl;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// A limit which is given for this run can only lower a limit from the configuration file
+hsize_t lowerLimit(hsize_t configured, hsize_t requested) {
+    if (!configured || !requested) {
+        return std::max(configured, requested);
+    }
+    return std::min(configured, requested);
+}
+
+// The latency of the reads and writes, and the time spent waiting for the I/O throttle, are reported in the profile
+// and in the progress output
+void reportIo(bool progress) {
+#ifdef _TIMER_
+    progress = true;
+#endif
+    if (progress) {
+        printIoLatencies();
+        printThrottleTimes();
+    }
+}
+
+bool getOptions(int argc, char** argv, std::string& inputFileName, std::string& outputFileName, ConverterOptions& options, std::vector<OutputSpec>& outputs, IoLimits& ioLimits, bool& onlyReportMemory, bool& onlyVerify) {
     extern int optind;
     extern char *optarg;
     
     int opt;
     bool err(false);
+    // Additional outputs, which are parsed once the options of the main output are known
+    std::vector<std::string> outputSpecs;
     
     std::ostringstream usage;
     usage << "IDIA FITS to HDF5 converter version " << HDF5_CONVERTER_VERSION 
     << " using IDIA schema version " << SCHEMA_VERSION << std::endl
-    << "Usage: fits2idia [-o output_filename] [-s] [-p] [-m] input_filename" << std::endl << std::endl
+    << "Usage: fits2idia [-o output_filename] [-s] [-p] [-m] [-b bits | -n fraction] [-z level] [-t type] [-T bits] [-c chunk_dims] [--products list] [--channel-cache MB] [--backend type] [--keep-store] [--checksums] [--datasum mode] [--channel-hashes] [--direct-io] [--tile-major] [--compress-cube] [--scratch-dir dir] [--small-file-size MB] [--read-limit MB/s] [--write-limit MB/s] [--iops-limit N] [--hdf5-stats] [--output spec ...] input_filename" << std::endl
+    << "       fits2idia --verify [-p] hdf5_filename" << std::endl
+    << "       fits2idia --update [--channels list] [-p] [-o output_filename] input_filename" << std::endl << std::endl
     << "Options:" << std::endl 
-    << "-o\tOutput filename" << std::endl 
+    << "-o\tOutput filename (required if the input filename is -, which streams the FITS file from standard input and reads it only once; the image has to be in the primary HDU)" << std::endl 
     << "-s\tUse slower but less memory-intensive method (enable if memory allocation fails)" << std::endl 
     << "-p\tPrint progress output (by default the program is silent)" << std::endl
     << "-m\tReport predicted memory usage and exit without performing the conversion" << std::endl
+    << "-b\tLossy: round the output data to this number of mantissa bits (1-22)" << std::endl
+    << "-n\tLossy: round the output data of each channel to this fraction of the channel noise (e.g. 0.1)" << std::endl
+    << "-t\tStorage type of the mipmaps: float (default), half or bfloat16" << std::endl
+    << "-T\tPrecompute compressed display tiles, rounded to this number of mantissa bits (1-23)" << std::endl
+    << "-c\tChunk dimensions of the main dataset and mipmaps, as a comma-separated list ending with the X axis (e.g. 8,256,256; default 1,512,512)" << std::endl
+    << "-z\tCompress chunked datasets with shuffle and deflate at this level (1-9; 1 is used by default if -b or -n is set)" << std::endl
+    << "--products\tComma-separated list of the output products to write: any of data, stats, histograms (implies stats), zstats, swizzled and mipmaps, or all (default). The main dataset is always written, and work for products which are not selected is skipped." << std::endl
+    << "--channel-cache\tMemory in MB for the slow method to keep channels between passes (by default whatever is left under the configured memory limit)" << std::endl
+    << "--backend\tOutput backend: hdf5 (default) writes the HDF5 file directly; directory writes the chunks to a directory store (output_filename.tmp.zarr) from many threads at once, and packs it into the HDF5 file at the end. An existing path of that name is only replaced if it is a store which was left behind by an earlier conversion." << std::endl
+    << "--keep-store\tDo not delete the directory store (output_filename.tmp.zarr) after packing it. The next conversion to the same output replaces it." << std::endl
+    << "--checksums\tStore a CRC32C checksum of each chunk of the main dataset, the rotated dataset and the mipmaps (these datasets are always chunked if this is set)" << std::endl
+    << "--datasum\tCheck the data against the DATASUM keyword of the FITS file while it is read, and the whole HDU against the CHECKSUM keyword: record writes the results to the FITS_DATASUM_CHECK and FITS_CHECKSUM_CHECK attributes; fail also aborts the conversion if the data does not match, the DATASUM is missing, or the CHECKSUM does not match" << std::endl
+    << "--channel-hashes\tStore a CRC32C hash of each input channel, so that an update can find the changed channels" << std::endl
+    << "--direct-io\tRead the FITS data with direct I/O, and keep the output file out of the page cache, so that the conversion doesn't evict other cached data. The input must be an uncompressed file with unscaled 32-bit float data; otherwise it is read normally." << std::endl
+    << "--tile-major\tWrite the main dataset in whole chunks, which are laid out, rounded, checksummed and compressed in parallel, instead of letting HDF5 gather and compress each chunk on one thread. Only applies to the fast method with the HDF5 backend, if the main dataset is chunked." << std::endl
+    << "--compress-cube\tHold the channels in memory losslessly compressed instead of as a raw cube, so that the fast method fits in less memory. This costs the time to compress each channel once, and to decompress it for the histograms, the Z stats and the rotated dataset. The memory report estimates the compressed size from a few sample channels." << std::endl
+    << "--scratch-dir\tWhere to put the scratch file which backs the conversion buffers if they don't fit in the available memory (default: the directory of the output file). If the fast method doesn't fit, but the slow method does, the slow method is used instead." << std::endl
+    << "--small-file-size\tImages with up to this many MB of data are converted on a single thread, and the output is built in memory and written in one go, which saves the thread start-up and the many small writes of a tiny conversion (default 0.25; 0 disables this). Only applies to the HDF5 backend without direct I/O." << std::endl
+    << "--read-limit\tLimit the bandwidth of all the reads of the input and the output files to this many MB per second. The reads are paced evenly. This can only lower a limit in the configuration file." << std::endl
+    << "--write-limit\tLimit the bandwidth of all the writes of the output files to this many MB per second. The writes are paced evenly. This can only lower a limit in the configuration file." << std::endl
+    << "--iops-limit\tLimit the reads and writes together to this many operations per second. This can only lower a limit in the configuration file." << std::endl
+    << "--hdf5-stats\tReport what the HDF5 library did for each output file: estimates of the hits and misses of the chunk cache, the chunk reads and writes and the time spent in the compression filters of each dataset, and the hit rate and size of the metadata cache. The counting slows the HDF5 I/O down a little, and small images are no longer built in memory." << std::endl
+    << "--output\tAn additional output, which is converted from the same read of the input, as path[:channels=first-last][:products=list][:chunks=dims][:compression=level][:backend=type][:slow]. The fields override the other options for this output. Can be given more than once; the -o output is only written as well if -o is given. The outputs are converted in parallel, and the slow method is used for the largest of them if they don't fit in memory together." << std::endl
+    << "--update\tUpdate an existing output file in place from a FITS file in which only some channels have changed. Only the changed channels and the statistics which depend on them are rewritten. Files with lossy rounding, display tiles or chunk checksums can't be updated." << std::endl
+    << "--channels\tThe changed channels for --update, as a comma-separated list of channels and ranges (e.g. 3,10-12; by default the channels whose hashes have changed)" << std::endl
+    << "--verify\tVerify the chunk checksums of an existing output file instead of converting a file" << std::endl
     << "-q\tSuppress all non-error output. Deprecated; this is now the default." << std::endl;
     
-    while ((opt = getopt(argc, argv, ":o:spqm")) != -1) {
+    static struct option longOptions[] = {
+        {"products", required_argument, nullptr, 'P'},
+        {"channel-cache", required_argument, nullptr, 'C'},
+        {"backend", required_argument, nullptr, 'B'},
+        {"keep-store", no_argument, nullptr, 'K'},
+        {"checksums", no_argument, nullptr, 'S'},
+        {"datasum", required_argument, nullptr, 'D'},
+        {"channel-hashes", no_argument, nullptr, 'H'},
+        {"direct-io", no_argument, nullptr, 'I'},
+        {"tile-major", no_argument, nullptr, 'J'},
+        {"compress-cube", no_argument, nullptr, 'Z'},
+        {"scratch-dir", required_argument, nullptr, 'R'},
+        {"small-file-size", required_argument, nullptr, 'F'},
+        {"read-limit", required_argument, nullptr, 'G'},
+        {"write-limit", required_argument, nullptr, 'W'},
+        {"iops-limit", required_argument, nullptr, 'Q'},
+        {"hdf5-stats", no_argument, nullptr, 'X'},
+        {"output", required_argument, nullptr, 'O'},
+        {"update", no_argument, nullptr, 'U'},
+        {"channels", required_argument, nullptr, 'L'},
+        {"verify", no_argument, nullptr, 'V'},
+        {nullptr, 0, nullptr, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, ":o:spqmb:n:z:t:T:c:", longOptions, nullptr)) != -1) {
         switch (opt) {
             case 'o':
                 outputFileName.assign(optarg);
                 break;
             case 's':
                 // use slower but less memory-intensive method
-                slow = true;
+                options.slow = true;
                 break;
             case 'p':
-                progress = true;
+                options.progress = true;
                 break;
             case 'q':
                 std::cerr << "The -q flag is deprecated. The converter is quiet by default." << std::endl;
@@ -46,6 +269,124 @@ bool getOptions(int argc, char** argv, std::string& inputFileName, std::string&
                 // only print memory usage and exit
                 onlyReportMemory = true;
                 break;
+            case 'b':
+                options.keepBits = std::atoi(optarg);
+                if (options.keepBits < 1 || options.keepBits > 22) {
+                    err = true;
+                    std::cerr << "The number of mantissa bits must be between 1 and 22." << std::endl;
+                }
+                break;
+            case 'n':
+                options.noiseFraction = std::atof(optarg);
+                if (!(options.noiseFraction > 0)) {
+                    err = true;
+                    std::cerr << "The noise fraction must be a positive number." << std::endl;
+                }
+                break;
+            case 'z':
+                options.compression = std::atoi(optarg);
+                if (options.compression < 1 || options.compression > 9) {
+                    err = true;
+                    std::cerr << "The compression level must be between 1 and 9." << std::endl;
+                }
+                break;
+            case 't':
+                if (std::string(optarg) == "float") {
+                    options.mipMapType = MipMapType::FLOAT;
+                } else if (std::string(optarg) == "half") {
+                    options.mipMapType = MipMapType::HALF;
+                } else if (std::string(optarg) == "bfloat16") {
+                    options.mipMapType = MipMapType::BFLOAT16;
+                } else {
+                    err = true;
+                    std::cerr << "Unknown mipmap type '" << optarg << "'." << std::endl;
+                }
+                break;
+            case 'T':
+                options.tileKeepBits = std::atoi(optarg);
+                if (options.tileKeepBits < 1 || options.tileKeepBits > 23) {
+                    err = true;
+                    std::cerr << "The number of display tile mantissa bits must be between 1 and 23." << std::endl;
+                }
+                break;
+            case 'c':
+                if (!parseChunkDims(optarg, options.chunkDims)) {
+                    err = true;
+                }
+                break;
+            case 'C':
+                options.channelCacheSize = std::max(0.0, std::atof(optarg)) * 1e6;
+                break;
+            case 'P':
+                if (!parseProducts(optarg, options.products)) {
+                    err = true;
+                }
+                break;
+            case 'B':
+                if (!parseBackend(optarg, options.backend)) {
+                    err = true;
+                }
+                break;
+            case 'K':
+                options.keepStore = true;
+                break;
+            case 'S':
+                options.checksums = true;
+                break;
+            case 'D':
+                if (std::string(optarg) == "record") {
+                    options.dataSumCheck = DataSumCheck::RECORD;
+                } else if (std::string(optarg) == "fail") {
+                    options.dataSumCheck = DataSumCheck::FAIL;
+                } else {
+                    err = true;
+                    std::cerr << "Unknown DATASUM check mode '" << optarg << "'." << std::endl;
+                }
+                break;
+            case 'H':
+                options.channelHashes = true;
+                break;
+            case 'I':
+                options.directIO = true;
+                break;
+            case 'J':
+                options.tileMajor = true;
+                break;
+            case 'Z':
+                options.compressCube = true;
+                break;
+            case 'R':
+                options.scratchDirectory.assign(optarg);
+                break;
+            case 'F':
+                options.smallFileSize = std::max(0.0, std::atof(optarg)) * 1e6;
+                break;
+            case 'G':
+                ioLimits.readBandwidth = std::max(0.0, std::atof(optarg)) * 1e6;
+                break;
+            case 'W':
+                ioLimits.writeBandwidth = std::max(0.0, std::atof(optarg)) * 1e6;
+                break;
+            case 'Q':
+                ioLimits.iops = std::max(0.0, std::atof(optarg));
+                break;
+            case 'X':
+                options.hdf5Stats = true;
+                break;
+            case 'O':
+                outputSpecs.push_back(optarg);
+                break;
+            case 'U':
+                options.update = true;
+                break;
+            case 'L':
+                if (!parseChannels(optarg, options.updateChannels)) {
+                    err = true;
+                }
+                break;
+            case 'V':
+                onlyVerify = true;
+                break;
             case ':':
                 err = true;
                 std::cerr << "Missing argument for option " << opt << "." << std::endl;
@@ -57,6 +398,16 @@ bool getOptions(int argc, char** argv, std::string& inputFileName, std::string&
         }
     }
     
+    if (options.keepBits && options.noiseFraction > 0) {
+        err = true;
+        std::cerr << "The -b and -n options are mutually exclusive." << std::endl;
+    }
+    
+    // Rounding is only worthwhile if the data is compressed
+    if ((options.keepBits || options.noiseFraction > 0) && !options.compression) {
+        options.compression = 1;
+    }
+    
     if (optind >= argc) {
         err = true;
         std::cerr << "Missing input filename parameter." << std::endl;
@@ -70,11 +421,35 @@ bool getOptions(int argc, char** argv, std::string& inputFileName, std::string&
         std::cerr << "Unexpected additional parameters." << std::endl;
     }
         
+    if (!outputSpecs.empty() && (options.update || onlyVerify)) {
+        err = true;
+        std::cerr << "Additional outputs can only be written by a conversion." << std::endl;
+    }
+    
+    // The main output is only one of several if it is given explicitly
+    if (!outputSpecs.empty() && !outputFileName.empty()) {
+        outputs.push_back({outputFileName, options});
+    }
+    
+    for (auto& spec : outputSpecs) {
+        OutputSpec output;
+        if (parseOutputSpec(spec, options, output)) {
+            outputs.push_back(output);
+        } else {
+            err = true;
+        }
+    }
+    
     if (err) {
         std::cerr << std::endl << usage.str() << std::endl;
         return false;
     }
     
+    if (outputFileName.empty() && outputs.empty() && inputFileName == "-" && !onlyReportMemory) {
+        std::cerr << "An output filename is required when the input is read from standard input." << std::endl;
+        return false;
+    }
+    
     if (outputFileName.empty()) {
         auto fitsIndex = inputFileName.find_last_of(".fits");
         if (fitsIndex != std::string::npos) {
@@ -91,15 +466,37 @@ bool getOptions(int argc, char** argv, std::string& inputFileName, std::string&
 int main(int argc, char** argv) {
     std::string inputFileName;
     std::string outputFileName;
-    bool slow(false);
-    bool progress(false);
+    ConverterOptions options;
+    std::vector<OutputSpec> outputs;
     bool onlyReportMemory(false);
+    bool onlyVerify(false);
+    IoLimits requestedIoLimits;
     
-    if (!getOptions(argc, argv, inputFileName, outputFileName, slow, progress, onlyReportMemory)) {
+    if (!getOptions(argc, argv, inputFileName, outputFileName, options, outputs, requestedIoLimits, onlyReportMemory, onlyVerify)) {
         return 1;
     }
     
-    hsize_t memoryLimit(0);
+    if (onlyVerify) {
+        try {
+            hsize_t numMismatches = verifyChecksums(inputFileName, options.progress);
+            if (numMismatches) {
+                std::cerr << "Error: " << numMismatches << " chunks do not match their checksums." << std::endl;
+                return 1;
+            }
+            reportIo(options.progress);
+        } catch (const char* msg) {
+            std::cerr << "Error: " << msg << ". Aborting." << std::endl;
+            return 1;
+        } catch (const H5::Exception& e) {
+            std::cerr << "Error: " << e.getDetailMsg() << ". Aborting." << std::endl;
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    hsize_t& memoryLimit = options.memoryLimit;
+    IoLimits configuredIoLimits;
     
     std::ifstream rcFile("/etc/fits2idiarc");
     if (rcFile.fail()){
@@ -114,14 +511,85 @@ int main(int argc, char** argv) {
             if (std::regex_match(line, match, std::regex(" *memory_limit *= *(\\d+) *"))) {
                 std::stringstream sstream(match[1]);
                 sstream >> memoryLimit;
+            } else if (std::regex_match(line, match, std::regex(" *read_bandwidth_limit *= *(\\d+) *"))) {
+                std::stringstream sstream(match[1]);
+                sstream >> configuredIoLimits.readBandwidth;
+            } else if (std::regex_match(line, match, std::regex(" *write_bandwidth_limit *= *(\\d+) *"))) {
+                std::stringstream sstream(match[1]);
+                sstream >> configuredIoLimits.writeBandwidth;
+            } else if (std::regex_match(line, match, std::regex(" *iops_limit *= *(\\d+) *"))) {
+                std::stringstream sstream(match[1]);
+                sstream >> configuredIoLimits.iops;
             }
         }
     }
     
+    IoLimits limits;
+    limits.readBandwidth = lowerLimit(configuredIoLimits.readBandwidth, requestedIoLimits.readBandwidth);
+    limits.writeBandwidth = lowerLimit(configuredIoLimits.writeBandwidth, requestedIoLimits.writeBandwidth);
+    limits.iops = lowerLimit(configuredIoLimits.iops, requestedIoLimits.iops);
+    setIoLimits(limits);
+    
+    if (options.hdf5Stats) {
+        try {
+            enableHdf5Stats();
+        } catch (const char* msg) {
+            std::cerr << "Error: " << msg << ". Aborting." << std::endl;
+            return 1;
+        }
+    }
+    
+    if (options.update) {
+        try {
+            Updater updater(inputFileName, outputFileName, options);
+            updater.update();
+            reportIo(options.progress);
+        } catch (const char* msg) {
+            std::cerr << "Error: " << msg << ". Aborting." << std::endl;
+            return 1;
+        }
+        
+        printHdf5Stats();
+        return 0;
+    }
+    
+    // Several outputs are converted from a single read of the input
+    if (!outputs.empty()) {
+        try {
+            for (auto& output : outputs) {
+                output.options.memoryLimit = memoryLimit;
+            }
+            
+            MultiConverter converter(inputFileName, outputs, memoryLimit);
+            
+            if (onlyReportMemory) {
+                converter.reportMemoryUsage();
+                return 0;
+            }
+            
+            if (memoryLimit > 0) {
+                hsize_t predictedTotal = converter.calculateMemoryUsage();
+                if (predictedTotal > memoryLimit) {
+                    std::cerr << "Error: approximate memory requirement of " << predictedTotal * 1e-9 << "GB for all the outputs exceeds configured memory limit of " << memoryLimit * 1e-9 << "GB. Aborting." << std::endl;
+                    return 1;
+                }
+            }
+            
+            converter.convert();
+            reportIo(options.progress);
+        } catch (const char* msg) {
+            std::cerr << "Error: " << msg << ". Aborting." << std::endl;
+            return 1;
+        }
+        
+        printHdf5Stats();
+        return 0;
+    }
+    
     std::unique_ptr<Converter> converter;
         
     try {
-        converter = Converter::getConverter(inputFileName, outputFileName, slow, progress);
+        converter = Converter::getConverter(inputFileName, outputFileName, options);
         
         if (onlyReportMemory) {
             converter->reportMemoryUsage();
@@ -136,13 +604,18 @@ int main(int argc, char** argv) {
             }
         }
     
-        DEBUG(std::cout << "Converting FITS file " << inputFileName << " to HDF5 file " << outputFileName << (slow ? " using slower, memory-efficient method" : "") << std::endl;);
+        DEBUG(std::cout << "Converting FITS file " << inputFileName << " to HDF5 file " << outputFileName << (options.slow ? " using slower, memory-efficient method" : "") << std::endl;);
 
         converter->convert();
+        reportIo(options.progress);
     } catch (const char* msg) {
         std::cerr << "Error: " << msg << ". Aborting." << std::endl;
         return 1;
     }
 
+    // The output file is only closed with the converter
+    converter.reset();
+    printHdf5Stats();
+
     return 0;
 }
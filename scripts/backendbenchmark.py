@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+
+import os
+import subprocess
+import argparse
+from timeit import default_timer as timer
+
+BACKENDS = ["hdf5", "directory"]
+
+def make_image(outfile, *dims):
+    cmd = ["make_image.py", "-o", outfile, "--"]
+    cmd.extend(str(d) for d in dims)
+
+    print(*cmd)
+
+    result = subprocess.run(cmd)
+    assert result.returncode == 0, "Image generation failed."
+
+def convert(infile, outfile, executable, backend, threads, extra_args):
+    cmd = [executable, "--backend", backend, *extra_args, "-o", outfile, infile]
+    env = dict(os.environ, OMP_NUM_THREADS=str(threads))
+
+    print("OMP_NUM_THREADS=%d" % threads, *cmd)
+
+    start = timer()
+    result = subprocess.run(cmd, env=env)
+    end = timer()
+    assert result.returncode == 0, "Conversion failed."
+
+    return end - start
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark of the output backends. Each image is converted with each backend, compression level and number of threads. The time of the directory backend includes packing the directory store into the HDF5 file.")
+    parser.add_argument('-d', '--dims', type=int, nargs=3, help="The image dimensions (X Y Z) (default: 2048 2048 256).", default=[2048, 2048, 256])
+    parser.add_argument('-z', '--compression', type=int, nargs='+', help="The compression levels to compare; 0 is no compression (default: 0 1 5).", default=[0, 1, 5])
+    parser.add_argument('-t', '--threads', type=int, nargs='+', help="The numbers of threads to compare (default: 1 4 16).", default=[1, 4, 16])
+    parser.add_argument('-s', '--slow', action='store_true', help="Use the slow converter.")
+    parser.add_argument("executable", help="The path to the converter executable.")
+    args = parser.parse_args()
+
+    make_image("test.fits", *args.dims)
+
+    results = []
+
+    for level in args.compression:
+        extra_args = ["-s"] if args.slow else []
+        if level:
+            extra_args.extend(["-z", str(level)])
+
+        for threads in args.threads:
+            times = [convert("test.fits", "BACKEND.hdf5", args.executable, backend, threads, extra_args) for backend in BACKENDS]
+            results.append((level, threads, *times))
+
+            subprocess.run(["rm", "BACKEND.hdf5"])
+
+    subprocess.run(["rm", "test.fits"])
+
+    print("Compression", "Threads", *BACKENDS, "speedup", sep='\t')
+    print()
+
+    for level, threads, *times in results:
+        print(level, threads, *("%.4g" % t for t in times), "%.2f" % (times[0] / times[1]), sep='\t')
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+import os
+import subprocess
+import argparse
+from collections import defaultdict
+from timeit import default_timer as timer
+
+import h5py
+import numpy as np
+
+# Chunk shapes of the main dataset and mipmaps to compare, as passed to the converter's -c option.
+# The first entry is the default.
+CHUNK_SHAPES = [
+    (1, 512, 512),
+    (1, 256, 256),
+    (4, 256, 256),
+    (8, 256, 256),
+    (16, 128, 128),
+    (32, 64, 64),
+]
+
+def make_image(outfile, *dims):
+    cmd = ["make_image.py", "-o", outfile, "--"]
+    cmd.extend(str(d) for d in dims)
+
+    print(*cmd)
+
+    result = subprocess.run(cmd)
+    assert result.returncode == 0, "Image generation failed."
+
+def convert(infile, outfile, executable, chunks, extra_args):
+    cmd = [executable, "-c", ",".join(str(c) for c in chunks), *extra_args, "-o", outfile, infile]
+
+    print(*cmd)
+
+    start = timer()
+    result = subprocess.run(cmd)
+    end = timer()
+    assert result.returncode == 0, "Conversion failed."
+
+    return end - start
+
+def drop_caches():
+    os.system("sudo sh -c 'sync && echo 3 > /proc/sys/vm/drop_caches'")
+
+# Read patterns of the viewer. Each function reads from an open file and returns nothing.
+
+def tile(f, rng):
+    # A single 256x256 tile of one channel at full resolution
+    data = f["0/DATA"]
+    depth, height, width = data.shape
+    z = rng.integers(depth)
+    y = rng.integers(max(1, height - 256))
+    x = rng.integers(max(1, width - 256))
+    data[z, y:y + 256, x:x + 256]
+
+def animation(f, rng):
+    # Ten consecutive channels at reduced resolution, from the largest mipmap which fits in 1024x1024
+    mipmaps = f["0/MipMaps/DATA"]
+    names = sorted(mipmaps, key=lambda n: int(n.split("_")[-1]))
+    name = next((n for n in names if max(mipmaps[n].shape[-2:]) <= 1024), names[-1])
+    data = mipmaps[name]
+    start = rng.integers(max(1, data.shape[0] - 10))
+    for z in range(start, min(start + 10, data.shape[0])):
+        data[z]
+
+def cutout(f, rng):
+    # A 64x64 spatial region over the whole spectral range
+    data = f["0/DATA"]
+    depth, height, width = data.shape
+    y = rng.integers(max(1, height - 64))
+    x = rng.integers(max(1, width - 64))
+    data[:, y:y + 64, x:x + 64]
+
+def profile(f, rng):
+    # A single Z profile, read from the main dataset (the rotated dataset is not affected by the chunk shape)
+    data = f["0/DATA"]
+    depth, height, width = data.shape
+    data[:, rng.integers(height), rng.integers(width)]
+
+READ_PATTERNS = {
+    "tile": tile,
+    "animation": animation,
+    "cutout": cutout,
+    "profile": profile,
+}
+
+def time_reads(hdf5name, pattern, repeat, seed):
+    rng = np.random.default_rng(seed)
+
+    drop_caches()
+
+    with h5py.File(hdf5name, "r") as f:
+        start = timer()
+        for i in range(repeat):
+            READ_PATTERNS[pattern](f, rng)
+        end = timer()
+
+    return (end - start) / repeat
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark of the chunk shape of the main dataset and mipmaps. Each image is converted with each chunk shape, and typical viewer read patterns are timed on the output files.")
+    parser.add_argument('-d', '--dims', type=int, nargs=3, help="The image dimensions (X Y Z) (default: 2048 2048 256).", default=[2048, 2048, 256])
+    parser.add_argument('-r', '--repeat', type=int, help="The number of reads of each pattern (default: 20).", default=20)
+    parser.add_argument('-z', '--compression', type=int, help="Also pass this compression level to the converter.")
+    parser.add_argument("executable", help="The path to the converter executable.")
+    args = parser.parse_args()
+
+    extra_args = []
+    if args.compression:
+        extra_args.extend(["-z", str(args.compression)])
+
+    make_image("test.fits", *args.dims)
+
+    times = defaultdict(dict)
+
+    for chunks in CHUNK_SHAPES:
+        times[chunks]["convert"] = convert("test.fits", "CHUNKS.hdf5", args.executable, chunks, extra_args)
+        times[chunks]["size (MB)"] = os.path.getsize("CHUNKS.hdf5") / 1e6
+
+        for pattern in READ_PATTERNS:
+            # The same seed for each chunk shape, so that the same regions are read
+            times[chunks][pattern] = time_reads("CHUNKS.hdf5", pattern, args.repeat, 0)
+
+        subprocess.run(["rm", "CHUNKS.hdf5"])
+
+    subprocess.run(["rm", "test.fits"])
+
+    columns = ["convert", "size (MB)", *READ_PATTERNS]
+
+    print("Chunk shape (Z,Y,X)", *columns, sep='\t')
+    print()
+
+    for chunks in CHUNK_SHAPES:
+        print(",".join(str(c) for c in chunks), *("%.4g" % times[chunks][c] for c in columns), sep='\t')
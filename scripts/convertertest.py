@@ -8,6 +8,8 @@ import warnings
 import random
 import re
 import argparse
+import functools
+import zlib
 from collections import defaultdict
 from timeit import default_timer as timer
 
@@ -184,10 +186,11 @@ def make_image(outfile, *dims, **params):
     result = subprocess.run(cmd)
     assert result.returncode == 0, "Image generation failed."
     
-def convert(infile, outfile, executable, slow=False):
+def convert(infile, outfile, executable, slow=False, options=()):
     cmd = [executable]
     if slow:
         cmd.append("-s")
+    cmd.extend(options)
     cmd.extend(["-o", outfile, infile])
     
     print(*cmd)
@@ -235,6 +238,450 @@ def test_new_old_converter(infile, slow, old_converter, new_converter):
     
     compare_hdf5_hdf5("OLD.hdf5", "NEW.hdf5", "Old and new versions differ.", True)
 
+# FEATURE TESTS
+# These check the optional features against plain conversions of small generated images, so they don't need make_image.py or h5diff.
+
+def make_cube(shape, nan_fraction=0.05, seed=1):
+    rng = np.random.default_rng(seed)
+    # Each channel gets its own offset and noise level
+    channels = shape[0] if len(shape) > 2 else 1
+    scale = np.linspace(0.5, 5, channels).reshape((-1,) + (1,) * (len(shape) - 1))
+    data = (rng.normal(0, 1, shape) * scale + scale).astype(np.float32)
+    data[rng.random(shape) < nan_fraction] = np.nan
+    return data
+
+def write_fits(filename, data, checksum=False, **keywords):
+    hdu = fits.PrimaryHDU(data.astype(np.float32))
+    for key, value in keywords.items():
+        hdu.header[key] = value
+    hdu.writeto(filename, overwrite=True, checksum=checksum)
+
+def modify_file(filename, offset, change):
+    with open(filename, "r+b") as f:
+        f.seek(offset)
+        data = f.read(len(change))
+        f.seek(offset)
+        f.write(bytes(a ^ b for a, b in zip(data, change)))
+
+def run_converter(executable, *args):
+    cmd = [executable, *args]
+    print(*cmd)
+    return subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+
+def attribute(obj, name):
+    value = obj.attrs[name]
+    return value.decode() if isinstance(value, bytes) else value
+
+def read_datasets(filename, group="0"):
+    datasets = {}
+    with h5py.File(filename, "r") as hdf5file:
+        hdf5file[group].visititems(lambda name, obj: datasets.__setitem__(name, obj[()]) if isinstance(obj, h5py.Dataset) else None)
+    return datasets
+
+def compare_datasets(file1, file2, fail_msg, group="0", rtol={}):
+    datasets1 = read_datasets(file1, group)
+    datasets2 = read_datasets(file2, group)
+    assert sorted(datasets1) == sorted(datasets2), "%s Datasets differ: %r and %r" % (fail_msg, sorted(datasets1), sorted(datasets2))
+    for name in datasets1:
+        # Some datasets may only match to within a tolerance
+        if name in rtol:
+            assert_allclose(datasets1[name], datasets2[name], rtol=rtol[name], equal_nan=True, err_msg="%s %s differs." % (fail_msg, name))
+        else:
+            assert_equal(datasets1[name], datasets2[name], err_msg="%s %s differs." % (fail_msg, name))
+
+def remove(*filenames):
+    subprocess.run(["rm", "-rf", *filenames])
+
+def test_rounding(executable):
+    data = make_cube((12, 40, 30))
+    write_fits("ROUND.fits", data)
+    finite = np.isfinite(data)
+    original = data[finite].astype(np.float64)
+    # The converter's noise estimate for each channel
+    sigma = np.broadcast_to(np.nanstd(data.astype(np.float64), axis=(1, 2)).reshape(-1, 1, 1), data.shape)[finite]
+    
+    for slow in (False, True):
+        convert("ROUND.fits", "PLAIN.hdf5", executable, slow)
+        statistics = read_datasets("PLAIN.hdf5", "0/Statistics")
+        
+        for bits in (3, 10):
+            convert("ROUND.fits", "ROUNDED.hdf5", executable, slow, ["-b", str(bits)])
+            with h5py.File("ROUNDED.hdf5", "r") as hdf5file:
+                assert attribute(hdf5file["0"], "QUANTIZATION") == "BITROUND", "QUANTIZATION attribute is incorrect."
+                assert attribute(hdf5file["0"], "QUANTIZATION_KEEP_BITS") == bits, "QUANTIZATION_KEEP_BITS attribute is incorrect."
+                rounded = hdf5file["0/DATA"][()]
+            
+            assert_equal(np.isnan(rounded), ~finite, err_msg="Rounding changed the NaNs.")
+            error = np.abs(rounded[finite] - original) / np.abs(original)
+            assert error.max() <= 2.0**-(bits + 1), "Rounding to %d bits has a relative error of %g." % (bits, error.max())
+            
+            for name, values in read_datasets("ROUNDED.hdf5", "0/Statistics").items():
+                assert_equal(values, statistics[name], err_msg="Rounding to %d bits changed the %s statistics." % (bits, name))
+        
+        for fraction in (0.1, 0.5):
+            convert("ROUND.fits", "ROUNDED.hdf5", executable, slow, ["-n", str(fraction)])
+            with h5py.File("ROUNDED.hdf5", "r") as hdf5file:
+                assert attribute(hdf5file["0"], "QUANTIZATION") == "NOISE", "QUANTIZATION attribute is incorrect."
+                assert attribute(hdf5file["0"], "QUANTIZATION_NOISE_FRACTION") == fraction, "QUANTIZATION_NOISE_FRACTION attribute is incorrect."
+                rounded = hdf5file["0/DATA"][()]
+            
+            # The quantum is the largest power of two up to the fraction of the noise
+            error = np.abs(rounded[finite] - original)
+            assert (error <= 0.5 * fraction * sigma * (1 + 1e-6)).all(), "Rounding to %g of the noise has an error of up to %g of the noise." % (fraction, (error / sigma).max())
+            
+            for name, values in read_datasets("ROUNDED.hdf5", "0/Statistics").items():
+                assert_equal(values, statistics[name], err_msg="Rounding to %g of the noise changed the %s statistics." % (fraction, name))
+    
+    remove("ROUND.fits", "PLAIN.hdf5", "ROUNDED.hdf5")
+
+CRC32C_TABLE = [functools.reduce(lambda crc, _: (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0), range(8), i) for i in range(256)]
+
+def crc32c(data, crc=0):
+    crc ^= 0xffffffff
+    for byte in data:
+        crc = (crc >> 8) ^ CRC32C_TABLE[(crc ^ byte) & 0xff]
+    return crc ^ 0xffffffff
+
+def corrupt_chunk(filename, dataset, index):
+    with h5py.File(filename, "r") as hdf5file:
+        info = hdf5file[dataset].id.get_chunk_info(index)
+    modify_file(filename, info.byte_offset + info.size // 2, b"\xff")
+
+def test_checksums(executable):
+    assert crc32c(b"123456789") == 0xE3069283, "The reference CRC32C is incorrect."
+    
+    write_fits("CHECKSUMS.fits", make_cube((12, 40, 30)))
+    
+    for slow, options in ((False, []), (True, []), (False, ["-z", "1"])):
+        convert("CHECKSUMS.fits", "CHECKSUMS.hdf5", executable, slow, ["--checksums", "-c", "4,16,16"] + options)
+        
+        # The checksum of a chunk is the CRC32C of its little-endian values
+        with h5py.File("CHECKSUMS.hdf5", "r") as hdf5file:
+            chunk = hdf5file["0/DATA"][4:8, 16:32, 0:16].astype("<f4")
+            expected = hdf5file["0/Checksums/DATA"][1, 1, 0]
+        assert crc32c(chunk.tobytes()) == expected, "The checksum of a chunk is not its CRC32C."
+        
+        result = run_converter(executable, "--verify", "CHECKSUMS.hdf5")
+        assert result.returncode == 0, "The checksums of an intact file do not verify:\n%s" % result.stderr.decode()
+        
+        corrupt_chunk("CHECKSUMS.hdf5", "0/DATA", 5)
+        result = run_converter(executable, "--verify", "CHECKSUMS.hdf5")
+        assert result.returncode == 1 and re.search(b"(Checksum mismatch|Unreadable chunk) in DATA at chunk 0 2 1", result.stderr), "The corrupted chunk was not reported:\n%s" % result.stderr.decode()
+    
+    # Files which can't be verified are reported, not crashed on
+    for filename in ("CHECKSUMS.fits", "MISSING.hdf5"):
+        result = run_converter(executable, "--verify", filename)
+        assert result.returncode == 1 and b"Error:" in result.stderr, "Verifying %s did not fail with an error." % filename
+    
+    remove("CHECKSUMS.fits", "CHECKSUMS.hdf5")
+
+def check_fits_sums(filename, datasum, checksum):
+    with h5py.File(filename, "r") as hdf5file:
+        assert attribute(hdf5file["0"], "FITS_DATASUM_CHECK") == datasum, "FITS_DATASUM_CHECK is %s instead of %s." % (attribute(hdf5file["0"], "FITS_DATASUM_CHECK"), datasum)
+        assert attribute(hdf5file["0"], "FITS_CHECKSUM_CHECK") == checksum, "FITS_CHECKSUM_CHECK is %s instead of %s." % (attribute(hdf5file["0"], "FITS_CHECKSUM_CHECK"), checksum)
+        return int(attribute(hdf5file["0"], "FITS_DATASUM_COMPUTED"))
+
+def test_datasum(executable):
+    data = make_cube((6, 30, 20))
+    write_fits("DATASUM.fits", data, checksum=True, OBJECT="ALPHA")
+    header = fits.getheader("DATASUM.fits")
+    data_offset = len(header.tostring())
+    
+    for slow in (False, True):
+        for mode in ("record", "fail"):
+            convert("DATASUM.fits", "DATASUM.hdf5", executable, slow, ["--datasum", mode])
+            computed = check_fits_sums("DATASUM.hdf5", "MATCH", "MATCH")
+            assert computed == int(header["DATASUM"]), "FITS_DATASUM_COMPUTED is incorrect."
+    
+    # A stream is checked from the header blocks which it keeps
+    with open("DATASUM.fits", "rb") as f:
+        result = subprocess.run([executable, "--datasum", "fail", "-o", "DATASUM.hdf5", "-"], stdin=f)
+    assert result.returncode == 0, "Streamed conversion failed."
+    check_fits_sums("DATASUM.hdf5", "MATCH", "MATCH")
+    
+    # A changed header keyword only breaks the CHECKSUM
+    modify_file("DATASUM.fits", bytes(header.tostring(), "ascii").index(b"'ALPHA"), bytes(a ^ b for a, b in zip(b"'ALPHA", b"'BRAVO")))
+    for slow in (False, True):
+        convert("DATASUM.fits", "DATASUM.hdf5", executable, slow, ["--datasum", "record"])
+        check_fits_sums("DATASUM.hdf5", "MATCH", "MISMATCH")
+        result = run_converter(executable, *(["-s"] if slow else []), "--datasum", "fail", "-o", "DATASUM.hdf5", "DATASUM.fits")
+        assert result.returncode == 1, "A CHECKSUM mismatch did not abort the conversion."
+    
+    # A changed pixel breaks both
+    write_fits("DATASUM.fits", data, checksum=True)
+    modify_file("DATASUM.fits", data_offset + 4 * int(np.flatnonzero(np.isfinite(data))[0]), b"\x80")
+    for slow in (False, True):
+        remove("DATASUM.hdf5")
+        convert("DATASUM.fits", "DATASUM.hdf5", executable, slow, ["--datasum", "record"])
+        check_fits_sums("DATASUM.hdf5", "MISMATCH", "MISMATCH")
+        result = run_converter(executable, *(["-s"] if slow else []), "--datasum", "fail", "-o", "DATASUM.hdf5", "DATASUM.fits")
+        assert result.returncode == 1 and b"does not match the FITS DATASUM" in result.stderr, "A DATASUM mismatch did not abort the conversion."
+    
+    # Without the keywords
+    write_fits("DATASUM.fits", data)
+    convert("DATASUM.fits", "DATASUM.hdf5", executable, False, ["--datasum", "record"])
+    check_fits_sums("DATASUM.hdf5", "MISSING", "MISSING")
+    remove("DATASUM.hdf5")
+    for slow in (False, True):
+        result = run_converter(executable, *(["-s"] if slow else []), "--datasum", "fail", "-o", "DATASUM.hdf5", "DATASUM.fits")
+        assert result.returncode == 1 and b"can't be verified" in result.stderr, "A missing DATASUM did not abort the conversion."
+        assert not os.path.exists("DATASUM.hdf5"), "An aborted conversion left an output file."
+    
+    remove("DATASUM.fits", "DATASUM.hdf5", "DATASUM.hdf5.tmp")
+
+def test_update(executable):
+    data = make_cube((16, 40, 30))
+    write_fits("UPDATE.fits", data)
+    
+    # The XYZ sums are recalculated from the XY sums, so they can differ in the last bit
+    tolerance = {"Statistics/XYZ/SUM": 1e-6, "Statistics/XYZ/SUM_SQ": 1e-6, "Statistics/XYZ/MEAN": 1e-6}
+    
+    def check_update(changed, options, channels, fail_msg):
+        for slow in (False, True):
+            convert("UPDATE.fits", "UPDATED.hdf5", executable, slow, options)
+            write_fits("CHANGED.fits", changed)
+            result = run_converter(executable, "--update", *channels, "-o", "UPDATED.hdf5", "CHANGED.fits")
+            assert result.returncode == 0, "Update failed:\n%s" % result.stderr.decode()
+            convert("CHANGED.fits", "FULL.hdf5", executable, slow, options)
+            compare_datasets("UPDATED.hdf5", "FULL.hdf5", fail_msg, rtol=tolerance)
+    
+    # The changed channels are found from their hashes
+    changed = data.copy()
+    changed[3] += 0.25
+    changed[10, 5:9, 2:20] = np.nan
+    check_update(changed, ["--channel-hashes"], [], "Update with channel hashes differs from a full conversion.")
+    
+    # The changed channels are given explicitly
+    check_update(changed, [], ["--channels", "3,10"], "Update of a list of channels differs from a full conversion.")
+    
+    # A new cube maximum and minimum move the bins of the XYZ histogram, so it is counted again
+    changed = data.copy()
+    changed[7, 20, 15] = 100
+    changed[8, 1, 1] = -100
+    check_update(changed, ["--channel-hashes"], [], "Update which changes the cube range differs from a full conversion.")
+    with h5py.File("FULL.hdf5", "r") as full, h5py.File("UPDATED.hdf5", "r") as updated:
+        assert_equal(updated["0/Statistics/XYZ/HISTOGRAM"][()], full["0/Statistics/XYZ/HISTOGRAM"][()], err_msg="The XYZ histogram was not counted again.")
+    
+    # Files whose stored values can't be updated from the FITS file are refused
+    for options in (["-b", "8"], ["-T", "10"], ["--checksums"]):
+        convert("UPDATE.fits", "UPDATED.hdf5", executable, False, ["--channel-hashes"] + options)
+        result = run_converter(executable, "--update", "--channels", "3", "-o", "UPDATED.hdf5", "CHANGED.fits")
+        assert result.returncode == 1 and b"Error:" in result.stderr, "Update of a file converted with %s was not refused." % " ".join(options)
+    
+    remove("UPDATE.fits", "CHANGED.fits", "UPDATED.hdf5", "FULL.hdf5")
+
+def test_stream(executable):
+    for shape in ((12, 40, 30), (2, 6, 30, 20)):
+        write_fits("STREAM.fits", make_cube(shape))
+        
+        # These images are small enough to be converted in memory, unless that is disabled
+        for slow, options in itertools.product((False, True), ([], ["--small-file-size", "0"])):
+            convert("STREAM.fits", "FILE.hdf5", executable, slow, options)
+            
+            cmd = [executable] + (["-s"] if slow else []) + options + ["-o", "STREAMED.hdf5", "-"]
+            print(*cmd, "< STREAM.fits")
+            with open("STREAM.fits", "rb") as f:
+                result = subprocess.run(cmd, stdin=f)
+            assert result.returncode == 0, "Streamed conversion failed."
+            
+            compare_datasets("STREAMED.hdf5", "FILE.hdf5", "Streamed conversion differs from a conversion of the file.")
+    
+    remove("STREAM.fits", "FILE.hdf5", "STREAMED.hdf5")
+
+def test_multi_output(executable):
+    for shape in ((12, 40, 30), (2, 8, 30, 20)):
+        write_fits("MULTI.fits", make_cube(shape))
+        
+        for slow in (False, True):
+            common = ["-s"] if slow else []
+            subset = "SUBSET.hdf5:channels=2-5:products=data,stats"
+            
+            result = run_converter(executable, *common, "--output", "MULTI.hdf5", "--output", subset, "MULTI.fits")
+            assert result.returncode == 0, "Conversion to several outputs failed:\n%s" % result.stderr.decode()
+            for name in ("MULTI.hdf5", "SUBSET.hdf5"):
+                os.rename(name, "TOGETHER_" + name)
+            
+            # Each output is converted again on its own
+            for spec in ("MULTI.hdf5", subset):
+                result = run_converter(executable, *common, "--output", spec, "MULTI.fits")
+                assert result.returncode == 0, "Conversion to %s failed:\n%s" % (spec, result.stderr.decode())
+            
+            compare_datasets("TOGETHER_MULTI.hdf5", "MULTI.hdf5", "Full output of a multi-output conversion differs from a separate conversion.")
+            compare_datasets("TOGETHER_SUBSET.hdf5", "SUBSET.hdf5", "Subset output of a multi-output conversion differs from a separate conversion.")
+            
+            # The subset holds channels 2 to 5 of each Stokes of the full output
+            with h5py.File("MULTI.hdf5", "r") as full, h5py.File("SUBSET.hdf5", "r") as part:
+                assert_equal(part["0/DATA"][()], full["0/DATA"][()][..., 2:6, :, :], err_msg="The subset output holds the wrong channels.")
+                assert "MipMaps" not in part["0"] and "SwizzledData" not in part["0"], "The subset output has products which were not requested."
+    
+    remove("MULTI.fits", "MULTI.hdf5", "SUBSET.hdf5", "TOGETHER_MULTI.hdf5", "TOGETHER_SUBSET.hdf5")
+
+def test_backend(executable):
+    for shape in ((12, 40, 30), (2, 6, 30, 20)):
+        write_fits("BACKEND.fits", make_cube(shape))
+        
+        for slow, options in itertools.product((False, True), ([], ["-z", "1"], ["--checksums"], ["-c", "3,16,7"], ["-z", "1", "--checksums", "-c", "3,16,7"])):
+            convert("BACKEND.fits", "HDF5.hdf5", executable, slow, options)
+            convert("BACKEND.fits", "PACKED.hdf5", executable, slow, options + ["--backend", "directory"])
+            compare_datasets("PACKED.hdf5", "HDF5.hdf5", "Packed directory store differs from the output of the HDF5 backend.")
+            assert not os.path.exists("PACKED.hdf5.tmp.zarr"), "The directory store was not removed."
+    
+    # The store is only kept if it is asked for, and it is replaced by the next conversion
+    convert("BACKEND.fits", "PACKED.hdf5", executable, False, ["--backend", "directory", "--keep-store"])
+    assert os.path.exists("PACKED.hdf5.tmp.zarr/0/DATA/.zarray"), "The directory store was not kept."
+    convert("BACKEND.fits", "PACKED.hdf5", executable, False, ["--backend", "directory"])
+    assert not os.path.exists("PACKED.hdf5.tmp.zarr"), "A kept directory store was not replaced."
+    
+    # A directory which the converter didn't write is left alone
+    os.makedirs("PACKED.hdf5.tmp.zarr")
+    open("PACKED.hdf5.tmp.zarr/KEEP", "w").close()
+    result = run_converter(executable, "--backend", "directory", "-o", "PACKED.hdf5", "BACKEND.fits")
+    assert result.returncode == 1 and b"Error:" in result.stderr, "The converter replaced a directory which it didn't write."
+    assert os.path.exists("PACKED.hdf5.tmp.zarr/KEEP"), "The converter removed a directory which it didn't write."
+    
+    remove("BACKEND.fits", "HDF5.hdf5", "PACKED.hdf5", "PACKED.hdf5.tmp.zarr")
+
+def test_tile_major(executable):
+    # The chunk shapes don't all divide the image, so some chunks are padded at its edges
+    for shape in ((10, 250, 90), (2, 5, 250, 90)):
+        write_fits("TILES.fits", make_cube(shape))
+        
+        for chunks, options in itertools.product(("4,64,64", "3,100,37"), ([], ["-z", "1"], ["-b", "8"], ["--checksums"], ["-z", "1", "-b", "8", "--checksums"])):
+            for small in ([], ["--small-file-size", "0"]):
+                args = ["-c", chunks] + small + options
+                convert("TILES.fits", "NORMAL.hdf5", executable, False, args)
+                convert("TILES.fits", "TILE_MAJOR.hdf5", executable, False, args + ["--tile-major"])
+                compare_datasets("TILE_MAJOR.hdf5", "NORMAL.hdf5", "Tile-major output differs from normal output.")
+    
+    remove("TILES.fits", "NORMAL.hdf5", "TILE_MAJOR.hdf5")
+
+def test_compress_cube(executable):
+    rng = np.random.default_rng(2)
+    
+    for shape in ((12, 60, 50), (2, 6, 60, 50)):
+        data = make_cube(shape)
+        # Large blanked regions compress well, and values with random exponents don't compress at all, so the cube
+        # is held in both compressed and raw blocks
+        data[..., :2, :, :] = np.nan
+        data[..., 20:, :30] = np.nan
+        noisy = data[..., -2:, :, :]
+        noisy[...] = rng.choice((-1, 1), noisy.shape) * np.exp(rng.uniform(-60, 60, noisy.shape))
+        write_fits("CUBE.fits", data)
+        
+        for options in ([], ["-z", "1"], ["-c", "4,32,32", "--tile-major"], ["-c", "4,32,32", "--tile-major", "-z", "1", "-b", "8"]):
+            convert("CUBE.fits", "RAW.hdf5", executable, False, options)
+            convert("CUBE.fits", "COMPRESSED.hdf5", executable, False, options + ["--compress-cube"])
+            compare_datasets("COMPRESSED.hdf5", "RAW.hdf5", "Output with a compressed cube differs from normal output.")
+    
+    remove("CUBE.fits", "RAW.hdf5", "COMPRESSED.hdf5")
+
+def read_bits(dataset):
+    # Read the stored 16-bit values as they are, without converting them to a native float type
+    assert dataset.id.get_type().get_size() == 2, "%s is not a 16-bit dataset." % dataset.name
+    bits = np.empty(dataset.shape, np.uint16)
+    dataset.id.read(h5py.h5s.ALL, h5py.h5s.ALL, bits, mtype=dataset.id.get_type())
+    return bits
+
+def bfloat16_bits(values):
+    # Round to nearest, ties to even, keeping NaNs quiet
+    bits = values.astype(np.float32).view(np.uint32).astype(np.uint64)
+    rounded = ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16).astype(np.uint16)
+    return np.where(np.isnan(values), ((bits >> 16) | 0x40).astype(np.uint16), rounded)
+
+def test_mipmap_types(executable):
+    # Blocks of special values which are aligned to the largest mipmap, so that they survive the averaging
+    special = (np.inf, -np.inf, np.nan, 3e-6, -2e-7, 1e5, 65519, 65504, 1e-39, -3e-40, 3.4e38, -3.4e38)
+    
+    # The mipmap widths are not multiples of 8, so that the vectorised loops also have a tail
+    for shape in ((3, 300, 270), (2, 2, 300, 270)):
+        data = make_cube(shape)
+        for i, value in enumerate(special):
+            data[..., 16 * (i // 8):16 * (i // 8 + 1), 16 * (i % 8):16 * (i % 8 + 1)] = value
+        write_fits("MIPMAP.fits", data)
+        
+        convert("MIPMAP.fits", "FLOAT.hdf5", executable)
+        convert("MIPMAP.fits", "HALF.hdf5", executable, False, ["-t", "half"])
+        convert("MIPMAP.fits", "BFLOAT16.hdf5", executable, False, ["-t", "bfloat16"])
+        
+        with h5py.File("FLOAT.hdf5", "r") as floats, h5py.File("HALF.hdf5", "r") as half, h5py.File("BFLOAT16.hdf5", "r") as bfloat16:
+            names = list(floats["0/MipMaps/DATA"])
+            assert names, "No mipmaps were written."
+            
+            for name in names:
+                reference = floats["0/MipMaps/DATA"][name][()]
+                nans = np.isnan(reference)
+                
+                halfBits = read_bits(half["0/MipMaps/DATA"][name])
+                with np.errstate(over="ignore"):
+                    expected = reference.astype(np.float16).view(np.uint16)
+                assert_equal(np.isnan(halfBits.view(np.float16)), nans, err_msg="Half mipmap %s has different NaNs." % name)
+                assert_equal(halfBits[~nans], expected[~nans], err_msg="Half mipmap %s differs from float16." % name)
+                
+                assert_equal(read_bits(bfloat16["0/MipMaps/DATA"][name]), bfloat16_bits(reference), err_msg="Bfloat16 mipmap %s is not rounded to nearest even." % name)
+    
+    remove("MIPMAP.fits", "FLOAT.hdf5", "HALF.hdf5", "BFLOAT16.hdf5")
+
+def round_mantissa(values, keep_bits):
+    # The converter's rounding, which leaves NaN and infinity alone and doesn't round the largest values up to infinity
+    if keep_bits >= 23:
+        return values
+    bits = values.astype(np.float32).view(np.uint32).astype(np.uint64)
+    drop = 23 - max(0, keep_bits)
+    mask = (1 << drop) - 1
+    rounded = (bits + ((1 << (drop - 1)) - 1) + ((bits >> drop) & 1)) & ~np.uint64(mask)
+    rounded = np.where((rounded & 0x7f800000) == 0x7f800000, bits & ~np.uint64(mask), rounded)
+    rounded = np.where((bits & 0x7f800000) == 0x7f800000, bits, rounded)
+    return rounded.astype(np.uint32).view(np.float32)
+
+def decode_tile(tiles, offset, size, shape):
+    # Inflate the tile, and gather its byte planes back into floats
+    planes = np.frombuffer(zlib.decompress(tiles[offset:offset + size].tobytes()), np.uint8)
+    return planes.reshape(4, -1).T.copy().view("<f4").reshape(shape)
+
+def test_tile_cache(executable):
+    # The images don't divide into tiles, so each layer has edge tiles
+    for shape, keep_bits in (((2, 600, 530), 10), ((2, 2, 300, 270), 3)):
+        write_fits("TILECACHE.fits", make_cube(shape))
+        convert("TILECACHE.fits", "TILECACHE.hdf5", executable, False, ["-T", str(keep_bits)])
+        
+        with h5py.File("TILECACHE.hdf5", "r") as hdf5file:
+            cache = hdf5file["0/TileCache"]
+            tile_size = attribute(cache, "TILE_SIZE")
+            assert attribute(cache, "CODEC_KEEP_BITS") == keep_bits, "The tile cache has the wrong number of kept bits."
+            
+            layers = {"DATA_XY_1": hdf5file["0/DATA"]}
+            layers.update(hdf5file["0/MipMaps/DATA"].items())
+            assert sorted(cache) == sorted(layers), "The tile cache layers %r don't match the mipmaps." % sorted(cache)
+            
+            for name, dataset in layers.items():
+                data = dataset[()].reshape((-1,) + dataset.shape[-2:])
+                tiles = cache[name]["TILES"][()]
+                index = cache[name]["INDEX"][()].reshape((data.shape[0],) + cache[name]["INDEX"].shape[-3:])
+                height, width = data.shape[-2:]
+                assert index.shape[1:3] == (-(-height // tile_size), -(-width // tile_size)), "The tile index of %s has the wrong shape." % name
+                
+                for channel, tile_y, tile_x in itertools.product(range(data.shape[0]), range(index.shape[1]), range(index.shape[2])):
+                    y, x = tile_y * tile_size, tile_x * tile_size
+                    expected = round_mantissa(data[channel, y:y + tile_size, x:x + tile_size], keep_bits)
+                    offset, size = index[channel, tile_y, tile_x]
+                    assert_equal(decode_tile(tiles, offset, size, expected.shape), expected, err_msg="Tile %d %d of channel %d of %s differs from the rounded data." % (tile_y, tile_x, channel, name))
+    
+    remove("TILECACHE.fits", "TILECACHE.hdf5")
+
+FEATURE_TESTS = {
+    "ROUNDING": test_rounding,
+    "CHECKSUMS": test_checksums,
+    "DATASUM": test_datasum,
+    "UPDATE": test_update,
+    "STREAM": test_stream,
+    "MULTI": test_multi_output,
+    "BACKEND": test_backend,
+    "TILE_MAJOR": test_tile_major,
+    "COMPRESS_CUBE": test_compress_cube,
+    "MIPMAP_TYPES": test_mipmap_types,
+    "TILE_CACHE": test_tile_cache,
+}
+
 def small_nans_image_set():
     image_set = []
     
@@ -390,13 +837,19 @@ if __name__ == "__main__":
     parser.add_argument('-t', '--time', action='store_true', help='Time the converter(s) instead of checking the output.')
     parser.add_argument('-s', '--slow', action='store_true', help='Use the slow converter versions when comparing converters or timing converter(s).')
     parser.add_argument('-i', '--image-set', nargs="+", help="The image set(s) to use. Any combination of %s. By default a small dummy set is used." % ", ".join(repr(o) for o in IMAGE_SETS) , default=["DUMMY"])
+    parser.add_argument('-f', '--feature', action="append", dest="features", help="Test this optional feature instead of converting image sets. One of %s, or ALL. Can be given more than once." % ", ".join(repr(o) for o in FEATURE_TESTS))
     parser.add_argument('-r', '--repeat', type=int, help="The number of times to repeat timed conversions (default: 3).", default=3)
     parser.add_argument("executable", help="The path to the executable to test.")
     args = parser.parse_args()
     
     image_sets = (IMAGE_SETS[i] for i in args.image_set)
     
-    if args.time:
+    if args.features:
+        for feature in (FEATURE_TESTS if "ALL" in args.features else args.features):
+            print("Testing %s" % feature)
+            FEATURE_TESTS[feature](args.executable)
+        print("All feature tests passed.")
+    elif args.time:
         test_speed(args, *image_sets)
     else:
         for image_set in image_sets:
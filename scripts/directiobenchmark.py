@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+import os
+import subprocess
+import argparse
+from timeit import default_timer as timer
+
+MODES = ["buffered", "direct"]
+
+def make_image(outfile, *dims):
+    cmd = ["make_image.py", "-o", outfile, "--"]
+    cmd.extend(str(d) for d in dims)
+
+    print(*cmd)
+
+    result = subprocess.run(cmd)
+    assert result.returncode == 0, "Image generation failed."
+
+def drop_from_cache(filename):
+    fd = os.open(filename, os.O_RDONLY)
+    os.fdatasync(fd)
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    os.close(fd)
+
+def cached_bytes(filename):
+    # The resident pages of a single file, as reported by fincore from util-linux
+    result = subprocess.run(["fincore", "--bytes", "--noheadings", "--output", "RES", filename], capture_output=True, text=True)
+    assert result.returncode == 0, "Could not get the page cache residency."
+    return int(result.stdout.split()[0])
+
+def page_cache_size():
+    with open("/proc/meminfo") as f:
+        for line in f:
+            if line.startswith("Cached:"):
+                return int(line.split()[1]) * 1024
+
+def convert(infile, outfile, executable, mode, extra_args):
+    cmd = [executable, *extra_args, "-o", outfile, infile]
+    if mode == "direct":
+        cmd.insert(1, "--direct-io")
+
+    print(*cmd)
+
+    drop_from_cache(infile)
+    cache_before = page_cache_size()
+
+    start = timer()
+    result = subprocess.run(cmd)
+    end = timer()
+    assert result.returncode == 0, "Conversion failed."
+
+    return end - start, cached_bytes(infile), cached_bytes(outfile), page_cache_size() - cache_before
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark of direct I/O. Each image is converted with and without --direct-io, starting with the input file out of the page cache. The time, the parts of the input and output files which are left in the page cache, and the growth of the page cache are compared. The output file has to be on a filesystem which supports direct I/O, which excludes tmpfs.")
+    parser.add_argument('-d', '--dims', type=int, nargs='+', action='append', help="The image dimensions (X Y Z [S]); can be given more than once (default: 4096 4096 64).")
+    parser.add_argument('-s', '--slow', action='store_true', help="Use the slow converter.")
+    parser.add_argument('-r', '--repeat', type=int, help="Number of conversions of each image with each mode; the fastest time is reported (default: 1).", default=1)
+    parser.add_argument("executable", help="The path to the converter executable.")
+    args = parser.parse_args()
+
+    extra_args = ["-s"] if args.slow else []
+    results = []
+
+    for dims in args.dims or [[4096, 4096, 64]]:
+        make_image("test.fits", *dims)
+        size = os.path.getsize("test.fits")
+
+        for mode in MODES:
+            runs = []
+            for i in range(args.repeat):
+                runs.append(convert("test.fits", "DIRECTIO.hdf5", args.executable, mode, extra_args))
+                subprocess.run(["rm", "DIRECTIO.hdf5"])
+
+            elapsed = min(r[0] for r in runs)
+            results.append((" ".join(str(d) for d in dims), mode, elapsed, size / elapsed, *runs[-1][1:]))
+
+        subprocess.run(["rm", "test.fits"])
+
+    print("Dimensions", "Mode", "Time (s)", "Input MB/s", "Input cached (MB)", "Output cached (MB)", "Cache growth (MB)", sep='\t')
+    print()
+
+    for dims, mode, elapsed, throughput, input_cached, output_cached, growth in results:
+        print(dims, mode, "%.4g" % elapsed, "%.1f" % (throughput * 1e-6), "%.1f" % (input_cached * 1e-6), "%.1f" % (output_cached * 1e-6), "%.1f" % (growth * 1e-6), sep='\t')
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+
+import os
+import subprocess
+import argparse
+import statistics
+from timeit import default_timer as timer
+
+# The small file path is disabled with a size of 0
+MODES = {"default": [], "small-file": ["--small-file-size", "1"], "normal": ["--small-file-size", "0"]}
+
+def make_image(outfile, *dims):
+    cmd = ["make_image.py", "-o", outfile, "--"]
+    cmd.extend(str(d) for d in dims)
+    
+    print(*cmd)
+    
+    result = subprocess.run(cmd)
+    assert result.returncode == 0, "Image generation failed."
+
+def convert(infile, outfile, executable, mode_args, extra_args):
+    cmd = [executable, *mode_args, *extra_args, "-o", outfile, infile]
+    
+    start = timer()
+    result = subprocess.run(cmd)
+    end = timer()
+    assert result.returncode == 0, "Conversion failed."
+    
+    return end - start
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark of the conversion latency of tiny images. Each image is converted many times with the small file path forced on, with it disabled, and with the default threshold, and the median and the 90th percentile of the time per file are compared.")
+    parser.add_argument('-d', '--dims', type=int, nargs='+', action='append', help="The image dimensions (X Y [Z] [S]); can be given more than once (default: 200 200, and 200 200 16).")
+    parser.add_argument('-n', '--number', type=int, help="Number of conversions of each image with each mode (default: 50).", default=50)
+    parser.add_argument('-s', '--slow', action='store_true', help="Use the slow converter.")
+    parser.add_argument("executable", help="The path to the converter executable.")
+    args = parser.parse_args()
+    
+    extra_args = ["-s"] if args.slow else []
+    results = []
+    
+    for dims in args.dims or [[200, 200], [200, 200, 16]]:
+        make_image("test.fits", *dims)
+        
+        for mode, mode_args in MODES.items():
+            times = []
+            for i in range(args.number):
+                times.append(convert("test.fits", "SMALLFILE.hdf5", args.executable, mode_args, extra_args))
+            size = os.path.getsize("SMALLFILE.hdf5")
+            subprocess.run(["rm", "SMALLFILE.hdf5"])
+            
+            times.sort()
+            results.append((" ".join(str(d) for d in dims), mode, statistics.median(times), times[int(0.9 * (len(times) - 1))], size))
+        
+        subprocess.run(["rm", "test.fits"])
+    
+    print("Dimensions", "Mode", "Median (ms)", "P90 (ms)", "Output size (kB)", sep='\t')
+    print()
+    
+    for dims, mode, median, p90, size in results:
+        print(dims, mode, "%.2f" % (median * 1e3), "%.2f" % (p90 * 1e3), "%.1f" % (size * 1e-3), sep='\t')
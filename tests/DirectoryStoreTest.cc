@@ -0,0 +1,79 @@
+/* This file is part of the FITS to IDIA file format converter: https://github.com/idia-astro/fits2idia
+   Copyright 2019, 2020, 2021 the Inter-University Institute for Data Intensive Astronomy (IDIA)
+   SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+// Concurrent writes to the directory store, which the converter only makes in chunk-aligned blocks, so that the
+// conversion tests can't show whether partial chunk writes are locked correctly
+
+#include "DirectoryStore.h"
+#include "Util.h"
+
+#include <filesystem>
+#include <thread>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Two threads write their own parts of chunk (1, 0) of a 16x16 dataset with 8x8 chunks, many times over. The second
+// thread's region also covers chunk (1, 1), so the two regions span different ranges of chunks. Each write reads,
+// modifies and rewrites the shared chunk, so a write which isn't locked against the other one loses its values.
+bool testOverlappingPartialWrites(const std::string& directory) {
+    DirectoryStore store(directory);
+    auto dataset = store.createDataset("DATA", DataType::FLOAT, {16, 16}, {8, 8}, 1);
+    
+    const std::vector<hsize_t> countA = {2, 4}, startA = {8, 0};
+    const std::vector<hsize_t> countB = {2, 12}, startB = {8, 4};
+    
+    for (int iteration = 1; iteration <= 500; iteration++) {
+        std::vector<float> dataA(product(countA), iteration);
+        std::vector<float> dataB(product(countB), -iteration);
+        
+        // A chunk which is rewritten while it is read may not even decode
+        const char* errorA(nullptr);
+        const char* errorB(nullptr);
+        std::thread threadA([&]{ try { dataset->write(dataA.data(), countA, countA, startA); } catch (const char* msg) { errorA = msg; } });
+        std::thread threadB([&]{ try { dataset->write(dataB.data(), countB, countB, startB); } catch (const char* msg) { errorB = msg; } });
+        threadA.join();
+        threadB.join();
+        
+        if (errorA || errorB) {
+            std::cerr << "Write " << iteration << " failed: " << (errorA ? errorA : errorB) << "." << std::endl;
+            return false;
+        }
+        
+        std::vector<float> result(2 * 16);
+        dataset->read(result.data(), {2, 16}, {2, 16}, {8, 0});
+        
+        for (hsize_t i = 0; i < result.size(); i++) {
+            float expected = i % 16 < 4 ? iteration : -iteration;
+            if (result[i] != expected) {
+                std::cerr << "Write " << iteration << " to row " << 8 + i / 16 << " column " << i % 16 << " was lost: found " << result[i] << " instead of " << expected << "." << std::endl;
+                return false;
+            }
+        }
+    }
+    
+    store.close();
+    return true;
+}
+
+int main() {
+    std::string directory = (fs::temp_directory_path() / ("fits2idia_directorystoretest_" + std::to_string(getpid()))).string();
+    bool passed(false);
+    
+    try {
+        passed = testOverlappingPartialWrites(directory);
+    } catch (const char* msg) {
+        std::cerr << "Error: " << msg << "." << std::endl;
+    }
+    
+    fs::remove_all(directory);
+    
+    if (!passed) {
+        return 1;
+    }
+    
+    std::cout << "Directory store tests passed." << std::endl;
+    return 0;
+}